@@ -49,6 +49,10 @@ WITH_BRIDGE:=yes
 # suggested by the MQTT spec), but it can be disabled if required.
 WITH_PERSISTENCE:=yes
 
+# Comment out to remove support for compressing the persistent database with
+# zlib (the persistence_compression option).
+WITH_ZLIB:=yes
+
 # Comment out to remove memory tracking support from the broker. If disabled,
 # mosquitto won't track heap memory usage nor export '$SYS/broker/heap/current
 # size', but will use slightly less memory and CPU time.
@@ -172,6 +176,8 @@ endif
 ifeq ($(WITH_THREADING),yes)
 	LIB_LIBS:=$(LIB_LIBS) -lpthread
 	LIB_CFLAGS:=$(LIB_CFLAGS) -DWITH_THREADING
+	BROKER_LIBS:=$(BROKER_LIBS) -lpthread
+	BROKER_CFLAGS:=$(BROKER_CFLAGS) -DWITH_THREADING
 endif
 
 ifeq ($(WITH_STRICT_PROTOCOL),yes)
@@ -187,6 +193,11 @@ ifeq ($(WITH_PERSISTENCE),yes)
 	BROKER_CFLAGS:=$(BROKER_CFLAGS) -DWITH_PERSISTENCE
 endif
 
+ifeq ($(WITH_ZLIB),yes)
+	BROKER_LIBS:=$(BROKER_LIBS) -lz
+	BROKER_CFLAGS:=$(BROKER_CFLAGS) -DWITH_ZLIB
+endif
+
 ifeq ($(WITH_MEMORY_TRACKING),yes)
 	ifneq ($(UNAME),SunOS)
 		BROKER_CFLAGS:=$(BROKER_CFLAGS) -DWITH_MEMORY_TRACKING
@@ -48,6 +48,38 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifdef REAL_WITH_MEMORY_TRACKING
 static unsigned long memcount = 0;
 static unsigned long max_memcount = 0;
+
+/* The broker also allocates and frees memory on its worker threads, so with
+ * threading the counters are only updated atomically. */
+static void _memcount_add(size_t size)
+{
+#ifdef WITH_THREADING
+	unsigned long count, max, old;
+
+	count = __sync_add_and_fetch(&memcount, size);
+	max = __sync_add_and_fetch(&max_memcount, 0);
+	while(count > max){
+		old = __sync_val_compare_and_swap(&max_memcount, max, count);
+		if(old == max) break;
+		/* Raised by another thread in the meantime. */
+		max = old;
+	}
+#else
+	memcount += size;
+	if(memcount > max_memcount){
+		max_memcount = memcount;
+	}
+#endif
+}
+
+static void _memcount_sub(size_t size)
+{
+#ifdef WITH_THREADING
+	__sync_sub_and_fetch(&memcount, size);
+#else
+	memcount -= size;
+#endif
+}
 #endif
 
 void *_mosquitto_calloc(size_t nmemb, size_t size)
@@ -55,10 +87,7 @@ void *_mosquitto_calloc(size_t nmemb, size_t size)
 	void *mem = calloc(nmemb, size);
 
 #ifdef REAL_WITH_MEMORY_TRACKING
-	memcount += malloc_usable_size(mem);
-	if(memcount > max_memcount){
-		max_memcount = memcount;
-	}
+	_memcount_add(malloc_usable_size(mem));
 #endif
 
 	return mem;
@@ -67,7 +96,7 @@ void *_mosquitto_calloc(size_t nmemb, size_t size)
 void _mosquitto_free(void *mem)
 {
 #ifdef REAL_WITH_MEMORY_TRACKING
-	memcount -= malloc_usable_size(mem);
+	_memcount_sub(malloc_usable_size(mem));
 #endif
 	free(mem);
 }
@@ -77,10 +106,7 @@ void *_mosquitto_malloc(size_t size)
 	void *mem = malloc(size);
 
 #ifdef REAL_WITH_MEMORY_TRACKING
-	memcount += malloc_usable_size(mem);
-	if(memcount > max_memcount){
-		max_memcount = memcount;
-	}
+	_memcount_add(malloc_usable_size(mem));
 #endif
 
 	return mem;
@@ -89,12 +115,20 @@ void *_mosquitto_malloc(size_t size)
 #ifdef REAL_WITH_MEMORY_TRACKING
 unsigned long _mosquitto_memory_used(void)
 {
+#ifdef WITH_THREADING
+	return __sync_add_and_fetch(&memcount, 0);
+#else
 	return memcount;
+#endif
 }
 
 unsigned long _mosquitto_max_memory_used(void)
 {
+#ifdef WITH_THREADING
+	return __sync_add_and_fetch(&max_memcount, 0);
+#else
 	return max_memcount;
+#endif
 }
 #endif
 
@@ -103,16 +137,13 @@ void *_mosquitto_realloc(void *ptr, size_t size)
 	void *mem;
 #ifdef REAL_WITH_MEMORY_TRACKING
 	if(ptr){
-		memcount -= malloc_usable_size(ptr);
+		_memcount_sub(malloc_usable_size(ptr));
 	}
 #endif
 	mem = realloc(ptr, size);
 
 #ifdef REAL_WITH_MEMORY_TRACKING
-	memcount += malloc_usable_size(mem);
-	if(memcount > max_memcount){
-		max_memcount = memcount;
-	}
+	_memcount_add(malloc_usable_size(mem));
 #endif
 
 	return mem;
@@ -123,10 +154,7 @@ char *_mosquitto_strdup(const char *s)
 	char *str = strdup(s);
 
 #ifdef REAL_WITH_MEMORY_TRACKING
-	memcount += malloc_usable_size(str);
-	if(memcount > max_memcount){
-		max_memcount = memcount;
-	}
+	_memcount_add(malloc_usable_size(str));
 #endif
 
 	return str;
@@ -96,7 +96,8 @@ enum mosquitto_client_state {
 	mosq_cs_disconnecting = 2,
 	mosq_cs_connect_async = 3,
 	mosq_cs_connect_pending = 4,
-	mosq_cs_connect_srv = 5
+	mosq_cs_connect_srv = 5,
+	mosq_cs_auth_pending = 6
 };
 
 enum _mosquitto_protocol {
@@ -199,12 +200,35 @@ struct mosquitto {
 	int msg_count;
 	int msg_count12;
 	struct _mosquitto_acl_user *acl_list;
+	struct _mosquitto_acl_node *acl_patterns;
+	struct _mosquitto_acl_cache *acl_cache;
+	int acl_cache_count;
+	unsigned int acl_cache_generation;
+	unsigned int acl_generation;
+	/* db->acl_generation when acl_list was set. */
+	unsigned int acl_list_generation;
 	struct _mqtt3_listener *listener;
 	time_t disconnect_t;
 	int pollfd_index;
 	int db_index;
 	struct _mosquitto_packet *out_packet_last;
 	bool is_dropping;
+	struct _mosquitto_spill *spill;
+	struct _mosquitto_lazy *lazy;
+	struct _mosquitto_conflate *conflate_index;
+	/* Position in the message expiry index, or -1. */
+	int expiry_pos;
+	bool is_persisted;
+	unsigned long msg_bytes;
+	unsigned long max_queued_bytes;
+	unsigned long pub_bytes;
+	bool is_throttled;
+	int acks_held;
+	struct _mosquitto_auth_request *auth_request;
+#  ifdef WITH_TLS
+	/* Counted in listener->handshake_count until the handshake is done. */
+	bool tls_handshaking;
+#  endif
 #else
 	void *userdata;
 	bool in_callback;
@@ -643,6 +643,19 @@ ssize_t _mosquitto_net_read(struct mosquitto *mosq, void *buf, size_t count)
 #endif
 }
 
+#ifdef WITH_TLS
+/* Returns true once the kernel encrypts data sent on this connection. The
+ * socket can then be written to directly, without copying through openssl. */
+static int _mosquitto_ktls_send(struct mosquitto *mosq)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	return BIO_get_ktls_send(SSL_get_wbio(mosq->ssl));
+#else
+	return 0;
+#endif
+}
+#endif
+
 ssize_t _mosquitto_net_write(struct mosquitto *mosq, void *buf, size_t count)
 {
 #ifdef WITH_TLS
@@ -655,7 +668,7 @@ ssize_t _mosquitto_net_write(struct mosquitto *mosq, void *buf, size_t count)
 
 	errno = 0;
 #ifdef WITH_TLS
-	if(mosq->ssl){
+	if(mosq->ssl && !_mosquitto_ktls_send(mosq)){
 		ret = SSL_write(mosq->ssl, buf, count);
 		if(ret < 0){
 			err = SSL_get_error(mosq->ssl, ret);
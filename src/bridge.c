@@ -168,11 +168,22 @@ int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context)
 	context->ping_t = 0;
 	context->bridge->lazy_reconnect = false;
 	mqtt3_bridge_packet_cleanup(context);
+#ifdef WITH_PERSISTENCE
+	if(context->lazy){
+		mqtt3_db_lazy_load(db, context);
+	}
+#endif
 	mqtt3_db_message_reconnect_reset(context);
 
 	if(context->clean_session){
 		mqtt3_db_messages_delete(context);
+#ifdef WITH_PERSISTENCE
+		mqtt3_spill_close(db, context, true);
+#endif
 	}
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_client(context);
+#endif
 
 	/* Delete all local subscriptions even for clean_session==false. We don't
 	 * remove any messages and the next loop carries out the resubscription
@@ -183,7 +194,7 @@ int mqtt3_bridge_connect(struct mosquitto_db *db, struct mosquitto *context)
 	for(i=0; i<context->bridge->topic_count; i++){
 		if(context->bridge->topics[i].direction == bd_out || context->bridge->topics[i].direction == bd_both){
 			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Bridge %s doing local SUBSCRIBE on topic %s", context->id, context->bridge->topics[i].local_topic);
-			if(mqtt3_sub_add(db, context, context->bridge->topics[i].local_topic, context->bridge->topics[i].qos, &db->subs)) return 1;
+			if(mqtt3_sub_add(db, context, context->bridge->topics[i].local_topic, context->bridge->topics[i].qos, mosq_sa_check, &db->subs)) return 1;
 		}
 	}
 
@@ -115,6 +115,8 @@ static void _config_init_reload(struct mqtt3_config *config)
 	/* Set defaults */
 	if(config->acl_file) _mosquitto_free(config->acl_file);
 	config->acl_file = NULL;
+	config->acl_cache_size = 0;
+	config->acl_cache_ttl = 0;
 	config->allow_anonymous = true;
 	config->allow_duplicate_messages = false;
 	config->allow_zero_length_clientid = true;
@@ -151,6 +153,7 @@ static void _config_init_reload(struct mqtt3_config *config)
 	}
 #endif
 	config->log_timestamp = true;
+	config->password_cache_ttl = 0;
 	if(config->password_file) _mosquitto_free(config->password_file);
 	config->password_file = NULL;
 	config->persistence = false;
@@ -158,10 +161,23 @@ static void _config_init_reload(struct mqtt3_config *config)
 	config->persistence_location = NULL;
 	if(config->persistence_file) _mosquitto_free(config->persistence_file);
 	config->persistence_file = NULL;
+	config->persistence_background = true;
+	config->persistence_compression = false;
+	config->persistence_fsync = pf_file;
+	config->persistence_lazy_load = false;
+	config->persistence_wal = false;
+	config->persistence_wal_commit_count = 1000;
+	config->persistence_wal_commit_interval = 10;
+	config->persistence_wal_max_size = 67108864;
+	config->persistence_wal_sync_interval = 1;
 	config->persistent_client_expiration = 0;
 	if(config->psk_file) _mosquitto_free(config->psk_file);
+#ifdef WITH_TLS
+	if(config->tls_ticket_key_file) _mosquitto_free(config->tls_ticket_key_file);
+#endif
 	config->psk_file = NULL;
 	config->queue_qos0_messages = false;
+	config->queue_spill_threshold = 0;
 	config->retry_interval = 20;
 	config->store_clean_interval = 10;
 	config->sys_interval = 10;
@@ -175,6 +191,40 @@ static void _config_init_reload(struct mqtt3_config *config)
 		config->auth_options = NULL;
 		config->auth_option_count = 0;
 	}
+	if(config->queue_bytes_users){
+		for(i=0; i<config->queue_bytes_user_count; i++){
+			_mosquitto_free(config->queue_bytes_users[i].pattern);
+		}
+		_mosquitto_free(config->queue_bytes_users);
+		config->queue_bytes_users = NULL;
+		config->queue_bytes_user_count = 0;
+	}
+	if(config->message_expiries){
+		for(i=0; i<config->message_expiry_count; i++){
+			_mosquitto_free(config->message_expiries[i].topic);
+		}
+		_mosquitto_free(config->message_expiries);
+		config->message_expiries = NULL;
+		config->message_expiry_count = 0;
+	}
+	if(config->queue_conflate_topics){
+		for(i=0; i<config->queue_conflate_topic_count; i++){
+			_mosquitto_free(config->queue_conflate_topics[i]);
+		}
+		_mosquitto_free(config->queue_conflate_topics);
+		config->queue_conflate_topics = NULL;
+		config->queue_conflate_topic_count = 0;
+	}
+	if(config->persistence_durable_topics){
+		for(i=0; i<config->persistence_durable_topic_count; i++){
+			_mosquitto_free(config->persistence_durable_topics[i]);
+		}
+		_mosquitto_free(config->persistence_durable_topics);
+		config->persistence_durable_topics = NULL;
+		config->persistence_durable_topic_count = 0;
+	}
+	config->memory_limit = 0;
+	config->memory_limit_policy = mp_drop_newest;
 }
 
 void mqtt3_config_init(struct mqtt3_config *config)
@@ -186,6 +236,8 @@ void mqtt3_config_init(struct mqtt3_config *config)
 	config->default_listener.host = NULL;
 	config->default_listener.port = 0;
 	config->default_listener.max_connections = -1;
+	config->default_listener.max_queued_bytes = 0;
+	config->default_listener.queue_conflate_all = false;
 	config->default_listener.mount_point = NULL;
 	config->default_listener.socks = NULL;
 	config->default_listener.sock_count = 0;
@@ -201,6 +253,9 @@ void mqtt3_config_init(struct mqtt3_config *config)
 	config->default_listener.require_certificate = false;
 	config->default_listener.crlfile = NULL;
 	config->default_listener.use_identity_as_username = false;
+	config->default_listener.tls_ktls = false;
+	config->default_listener.max_handshakes = 0;
+	config->default_listener.handshake_count = 0;
 #endif
 	config->listeners = NULL;
 	config->listener_count = 0;
@@ -211,6 +266,13 @@ void mqtt3_config_init(struct mqtt3_config *config)
 	config->bridge_count = 0;
 #endif
 	config->auth_plugin = NULL;
+	config->auth_workers = 0;
+#ifdef WITH_TLS
+	config->tls_session_cache_size = 0;
+	config->tls_session_timeout = 300;
+	config->tls_ticket_key_file = NULL;
+	config->tls_handshake_workers = 0;
+#endif
 	config->verbose = false;
 	config->message_size_limit = 0;
 }
@@ -231,6 +293,33 @@ void mqtt3_config_cleanup(struct mqtt3_config *config)
 	if(config->persistence_file) _mosquitto_free(config->persistence_file);
 	if(config->persistence_filepath) _mosquitto_free(config->persistence_filepath);
 	if(config->psk_file) _mosquitto_free(config->psk_file);
+#ifdef WITH_TLS
+	if(config->tls_ticket_key_file) _mosquitto_free(config->tls_ticket_key_file);
+#endif
+	if(config->queue_bytes_users){
+		for(i=0; i<config->queue_bytes_user_count; i++){
+			_mosquitto_free(config->queue_bytes_users[i].pattern);
+		}
+		_mosquitto_free(config->queue_bytes_users);
+	}
+	if(config->message_expiries){
+		for(i=0; i<config->message_expiry_count; i++){
+			_mosquitto_free(config->message_expiries[i].topic);
+		}
+		_mosquitto_free(config->message_expiries);
+	}
+	if(config->queue_conflate_topics){
+		for(i=0; i<config->queue_conflate_topic_count; i++){
+			_mosquitto_free(config->queue_conflate_topics[i]);
+		}
+		_mosquitto_free(config->queue_conflate_topics);
+	}
+	if(config->persistence_durable_topics){
+		for(i=0; i<config->persistence_durable_topic_count; i++){
+			_mosquitto_free(config->persistence_durable_topics[i]);
+		}
+		_mosquitto_free(config->persistence_durable_topics);
+	}
 	if(config->listeners){
 		for(i=0; i<config->listener_count; i++){
 			if(config->listeners[i].host) _mosquitto_free(config->listeners[i].host);
@@ -382,10 +471,13 @@ int mqtt3_config_parse_args(struct mqtt3_config *config, int argc, char *argv[])
 			|| config->default_listener.require_certificate
 			|| config->default_listener.crlfile
 			|| config->default_listener.use_identity_as_username
+			|| config->default_listener.tls_ktls
+			|| config->default_listener.max_handshakes
 #endif
 			|| config->default_listener.host
 			|| config->default_listener.port
 			|| config->default_listener.max_connections != -1
+			|| config->default_listener.max_queued_bytes
 			|| config->default_listener.mount_point){
 
 		config->listener_count++;
@@ -410,6 +502,8 @@ int mqtt3_config_parse_args(struct mqtt3_config *config, int argc, char *argv[])
 			config->listeners[config->listener_count-1].mount_point = NULL;
 		}
 		config->listeners[config->listener_count-1].max_connections = config->default_listener.max_connections;
+		config->listeners[config->listener_count-1].max_queued_bytes = config->default_listener.max_queued_bytes;
+		config->listeners[config->listener_count-1].queue_conflate_all = config->default_listener.queue_conflate_all;
 		config->listeners[config->listener_count-1].client_count = 0;
 		config->listeners[config->listener_count-1].socks = NULL;
 		config->listeners[config->listener_count-1].sock_count = 0;
@@ -426,6 +520,9 @@ int mqtt3_config_parse_args(struct mqtt3_config *config, int argc, char *argv[])
 		config->listeners[config->listener_count-1].ssl_ctx = NULL;
 		config->listeners[config->listener_count-1].crlfile = config->default_listener.crlfile;
 		config->listeners[config->listener_count-1].use_identity_as_username = config->default_listener.use_identity_as_username;
+		config->listeners[config->listener_count-1].tls_ktls = config->default_listener.tls_ktls;
+		config->listeners[config->listener_count-1].max_handshakes = config->default_listener.max_handshakes;
+		config->listeners[config->listener_count-1].handshake_count = 0;
 #endif
 	}
 
@@ -580,6 +677,12 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 						}
 					}
 					if(_conf_parse_string(&token, "acl_file", &config->acl_file, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "acl_cache_size")){
+					if(_conf_parse_int(&token, "acl_cache_size", &config->acl_cache_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->acl_cache_size < 0) config->acl_cache_size = 0;
+				}else if(!strcmp(token, "acl_cache_ttl")){
+					if(_conf_parse_int(&token, "acl_cache_ttl", &config->acl_cache_ttl, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->acl_cache_ttl < 0) config->acl_cache_ttl = 0;
 				}else if(!strcmp(token, "address") || !strcmp(token, "addresses")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; // FIXME
@@ -662,6 +765,10 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 				}else if(!strcmp(token, "auth_plugin")){
 					if(reload) continue; // Auth plugin not currently valid for reloading.
 					if(_conf_parse_string(&token, "auth_plugin", &config->auth_plugin, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "auth_workers")){
+					if(reload) continue; // Workers are only started once.
+					if(_conf_parse_int(&token, "auth_workers", &config->auth_workers, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->auth_workers < 0) config->auth_workers = 0;
 				}else if(!strcmp(token, "auto_id_prefix")){
 					if(_conf_parse_string(&token, "auto_id_prefix", &config->auto_id_prefix, saveptr)) return MOSQ_ERR_INVAL;
 					if(config->auto_id_prefix){
@@ -1249,6 +1356,14 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_connections value in configuration.");
 					}
+				}else if(!strcmp(token, "max_handshakes")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_int(&token, "max_handshakes", &cur_listener->max_handshakes, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_listener->max_handshakes < 0) cur_listener->max_handshakes = 0;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
 				}else if(!strcmp(token, "max_inflight_messages")){
 					token = strtok_r(NULL, " ", &saveptr);
 					if(token){
@@ -1257,6 +1372,39 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_inflight_messages value in configuration.");
 					}
+				}else if(!strcmp(token, "max_queued_bytes")){
+					if(reload) continue; // Listeners not valid for reloading.
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						cur_listener->max_queued_bytes = strtoul(token, NULL, 10);
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_queued_bytes value in configuration.");
+					}
+				}else if(!strcmp(token, "max_queued_bytes_user")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						config->queue_bytes_user_count++;
+						config->queue_bytes_users = _mosquitto_realloc(config->queue_bytes_users, config->queue_bytes_user_count*sizeof(struct _mqtt3_queue_bytes_user));
+						if(!config->queue_bytes_users){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+							return MOSQ_ERR_NOMEM;
+						}
+						config->queue_bytes_users[config->queue_bytes_user_count-1].pattern = _mosquitto_strdup(token);
+						if(!config->queue_bytes_users[config->queue_bytes_user_count-1].pattern){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+							return MOSQ_ERR_NOMEM;
+						}
+						token = strtok_r(NULL, " ", &saveptr);
+						if(token){
+							config->queue_bytes_users[config->queue_bytes_user_count-1].max_queued_bytes = strtoul(token, NULL, 10);
+						}else{
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid max_queued_bytes_user value in configuration.");
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_queued_bytes_user value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "max_queued_messages")){
 					token = strtok_r(NULL, " ", &saveptr);
 					if(token){
@@ -1265,6 +1413,64 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}else{
 						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_queued_messages value in configuration.");
 					}
+				}else if(!strcmp(token, "memory_limit")){
+#ifdef REAL_WITH_MEMORY_TRACKING
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						config->memory_limit = strtoul(token, NULL, 10);
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty memory_limit value in configuration.");
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Memory tracking support not available.");
+#endif
+				}else if(!strcmp(token, "memory_limit_policy")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(!strcmp(token, "drop_newest")){
+							config->memory_limit_policy = mp_drop_newest;
+						}else if(!strcmp(token, "drop_oldest_qos0")){
+							config->memory_limit_policy = mp_drop_oldest_qos0;
+						}else if(!strcmp(token, "reject_heaviest_producer")){
+							config->memory_limit_policy = mp_reject_heaviest_producer;
+						}else if(!strcmp(token, "disconnect_largest_consumer")){
+							config->memory_limit_policy = mp_disconnect_largest_consumer;
+						}else{
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid memory_limit_policy value (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty memory_limit_policy value in configuration.");
+					}
+				}else if(!strcmp(token, "message_expiry")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(_mosquitto_topic_wildcard_pos_check(token)){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid message_expiry topic (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+						config->message_expiry_count++;
+						config->message_expiries = _mosquitto_realloc(config->message_expiries, config->message_expiry_count*sizeof(struct _mqtt3_message_expiry));
+						if(!config->message_expiries){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+							return MOSQ_ERR_NOMEM;
+						}
+						config->message_expiries[config->message_expiry_count-1].topic = _mosquitto_strdup(token);
+						if(!config->message_expiries[config->message_expiry_count-1].topic){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+							return MOSQ_ERR_NOMEM;
+						}
+						token = strtok_r(NULL, " ", &saveptr);
+						if(token && atoi(token) > 0){
+							config->message_expiries[config->message_expiry_count-1].expiry = atoi(token);
+						}else{
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid message_expiry value in configuration.");
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty message_expiry value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "message_size_limit")){
 					if(_conf_parse_int(&token, "message_size_limit", &config->message_size_limit, saveptr)) return MOSQ_ERR_INVAL;
 					if(config->message_size_limit < 0 || config->message_size_limit > MQTT_MAX_PAYLOAD){
@@ -1331,6 +1537,9 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
+				}else if(!strcmp(token, "password_cache_ttl")){
+					if(_conf_parse_int(&token, "password_cache_ttl", &config->password_cache_ttl, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->password_cache_ttl < 0) config->password_cache_ttl = 0;
 				}else if(!strcmp(token, "password_file")){
 					if(reload){
 						if(config->password_file){
@@ -1341,10 +1550,85 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					if(_conf_parse_string(&token, "password_file", &config->password_file, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistence") || !strcmp(token, "retained_persistence")){
 					if(_conf_parse_bool(&token, token, &config->persistence, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_background")){
+					if(_conf_parse_bool(&token, "persistence_background", &config->persistence_background, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_compression")){
+#ifdef WITH_ZLIB
+					if(_conf_parse_bool(&token, "persistence_compression", &config->persistence_compression, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Compression support not available.");
+#endif
+				}else if(!strcmp(token, "persistence_durable_topic")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(_mosquitto_topic_wildcard_pos_check(token)){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid persistence_durable_topic topic (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+						config->persistence_durable_topic_count++;
+						config->persistence_durable_topics = _mosquitto_realloc(config->persistence_durable_topics, config->persistence_durable_topic_count*sizeof(char *));
+						if(!config->persistence_durable_topics){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+							return MOSQ_ERR_NOMEM;
+						}
+						config->persistence_durable_topics[config->persistence_durable_topic_count-1] = _mosquitto_strdup(token);
+						if(!config->persistence_durable_topics[config->persistence_durable_topic_count-1]){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+							return MOSQ_ERR_NOMEM;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty persistence_durable_topic value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "persistence_file")){
 					if(_conf_parse_string(&token, "persistence_file", &config->persistence_file, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_fsync")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(!strcmp(token, "none")){
+							config->persistence_fsync = pf_none;
+						}else if(!strcmp(token, "file")){
+							config->persistence_fsync = pf_file;
+						}else if(!strcmp(token, "directory")){
+							config->persistence_fsync = pf_directory;
+						}else{
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid persistence_fsync value (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty persistence_fsync value in configuration.");
+					}
+				}else if(!strcmp(token, "persistence_lazy_load")){
+					if(_conf_parse_bool(&token, "persistence_lazy_load", &config->persistence_lazy_load, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "persistence_location")){
 					if(_conf_parse_string(&token, "persistence_location", &config->persistence_location, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_wal")){
+					if(_conf_parse_bool(&token, "persistence_wal", &config->persistence_wal, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "persistence_wal_commit_count")){
+					if(_conf_parse_int(&token, "persistence_wal_commit_count", &config->persistence_wal_commit_count, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->persistence_wal_commit_count < 1){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid persistence_wal_commit_count value (%d).", config->persistence_wal_commit_count);
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "persistence_wal_commit_interval")){
+					if(_conf_parse_int(&token, "persistence_wal_commit_interval", &config->persistence_wal_commit_interval, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->persistence_wal_commit_interval < 0){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid persistence_wal_commit_interval value (%d).", config->persistence_wal_commit_interval);
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "persistence_wal_max_size")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						config->persistence_wal_max_size = strtoul(token, NULL, 10);
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty persistence_wal_max_size value in configuration.");
+					}
+				}else if(!strcmp(token, "persistence_wal_sync_interval")){
+					if(_conf_parse_int(&token, "persistence_wal_sync_interval", &config->persistence_wal_sync_interval, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->persistence_wal_sync_interval < 0){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid persistence_wal_sync_interval value (%d).", config->persistence_wal_sync_interval);
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "persistent_client_expiration")){
 					token = strtok_r(NULL, " ", &saveptr);
 					if(token){
@@ -1407,8 +1691,40 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS/TLS-PSK support not available.");
 #endif
+				}else if(!strcmp(token, "queue_conflate")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(_mosquitto_topic_wildcard_pos_check(token)){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid queue_conflate topic (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+						config->queue_conflate_topic_count++;
+						config->queue_conflate_topics = _mosquitto_realloc(config->queue_conflate_topics, config->queue_conflate_topic_count*sizeof(char *));
+						if(!config->queue_conflate_topics){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+							return MOSQ_ERR_NOMEM;
+						}
+						config->queue_conflate_topics[config->queue_conflate_topic_count-1] = _mosquitto_strdup(token);
+						if(!config->queue_conflate_topics[config->queue_conflate_topic_count-1]){
+							_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+							return MOSQ_ERR_NOMEM;
+						}
+					}else{
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Empty queue_conflate value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "queue_conflate_all")){
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_bool(&token, "queue_conflate_all", &cur_listener->queue_conflate_all, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "queue_qos0_messages")){
 					if(_conf_parse_bool(&token, token, &config->queue_qos0_messages, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "queue_spill_threshold")){
+#ifdef WITH_PERSISTENCE
+					if(_conf_parse_int(&token, "queue_spill_threshold", &config->queue_spill_threshold, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->queue_spill_threshold < 0) config->queue_spill_threshold = 0;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Persistence support not available.");
+#endif
 				}else if(!strcmp(token, "require_certificate")){
 #ifdef WITH_TLS
 					if(reload) continue; // Listeners not valid for reloading.
@@ -1503,6 +1819,47 @@ int _config_read_file(struct mqtt3_config *config, bool reload, const char *file
 					}
 #else
 					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "tls_handshake_workers")){
+#ifdef WITH_TLS
+					if(reload) continue; // Workers are only started once.
+					if(_conf_parse_int(&token, "tls_handshake_workers", &config->tls_handshake_workers, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->tls_handshake_workers < 0) config->tls_handshake_workers = 0;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_ktls")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_bool(&token, "tls_ktls", &cur_listener->tls_ktls, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_cache_size")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_int(&token, "tls_session_cache_size", &config->tls_session_cache_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->tls_session_cache_size < 0) config->tls_session_cache_size = 0;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_timeout")){
+#ifdef WITH_TLS
+					if(reload) continue; // Listeners not valid for reloading.
+					if(_conf_parse_int(&token, "tls_session_timeout", &config->tls_session_timeout, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->tls_session_timeout < 1){
+						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid tls_session_timeout value (%d).", config->tls_session_timeout);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_ticket_key_file")){
+#ifdef WITH_TLS
+					if(reload) continue; // The keys are re-read on reload, but not the path.
+					if(_conf_parse_string(&token, "tls_ticket_key_file", &config->tls_ticket_key_file, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
 #endif
 				}else if(!strcmp(token, "tls_version")){
 #if defined(WITH_TLS)
@@ -63,6 +63,7 @@ struct mosquitto *mqtt3_context_init(int sock)
 	 * done by looking at context->bridge for bridges that we create ourself,
 	 * but incoming bridges need some other way of being recorded. */
 	context->is_bridge = false;
+	context->is_persisted = false;
 
 	context->in_packet.payload = NULL;
 	_mosquitto_packet_cleanup(&context->in_packet);
@@ -85,13 +86,49 @@ struct mosquitto *mqtt3_context_init(int sock)
 	context->last_msg = NULL;
 	context->msg_count = 0;
 	context->msg_count12 = 0;
+	context->spill = NULL;
+	context->lazy = NULL;
+	context->expiry_pos = -1;
+	context->conflate_index = NULL;
+	context->msg_bytes = 0;
+	context->max_queued_bytes = 0;
+	context->pub_bytes = 0;
+	context->is_throttled = false;
+	context->acks_held = 0;
+	context->auth_request = NULL;
 #ifdef WITH_TLS
 	context->ssl = NULL;
+	context->tls_handshaking = false;
 #endif
 
 	return context;
 }
 
+/* Add a new context to db->contexts, reusing a free slot if there is one. */
+int mqtt3_context_add(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct mosquitto **tmp_contexts;
+	int i;
+
+	for(i=0; i<db->context_count; i++){
+		if(db->contexts[i] == NULL){
+			db->contexts[i] = context;
+			break;
+		}
+	}
+	if(i==db->context_count){
+		tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*(db->context_count+1));
+		if(!tmp_contexts){
+			return MOSQ_ERR_NOMEM;
+		}
+		db->context_count++;
+		db->contexts = tmp_contexts;
+		db->contexts[i] = context;
+	}
+	context->db_index = i;
+	return MOSQ_ERR_SUCCESS;
+}
+
 /*
  * This will result in any outgoing packets going unsent. If we're disconnected
  * forcefully then it is usually an error condition and shouldn't be a problem,
@@ -106,6 +143,10 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 
 	if(!context) return;
 
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_acks_drop(context);
+#endif
+	mosquitto_auth_request_cancel(context);
 	if(context->username){
 		_mosquitto_free(context->username);
 		context->username = NULL;
@@ -114,6 +155,8 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 		_mosquitto_free(context->password);
 		context->password = NULL;
 	}
+	mosquitto_acl_context_cleanup_default(context);
+	mosquitto_acl_cache_cleanup(context);
 #ifdef WITH_BRIDGE
 	if(context->bridge){
 		if(context->bridge->username){
@@ -125,6 +168,7 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 	}
 #endif
 #ifdef WITH_TLS
+	mqtt3_tls_handshake_end(context);
 	if(context->ssl){
 		SSL_free(context->ssl);
 		context->ssl = NULL;
@@ -139,9 +183,23 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 		context->listener = NULL;
 	}
 	if(context->clean_session && db){
+#ifdef WITH_PERSISTENCE
+		mqtt3_wal_client_delete(context);
+#endif
 		mqtt3_subs_clean_session(db, context, &db->subs);
 		mqtt3_db_messages_delete(context);
 	}
+#ifdef WITH_PERSISTENCE
+	if(context->spill && db){
+		/* Spilled messages are kept on disk for persistent clients, so they
+		 * survive a restart. */
+		if(context->clean_session){
+			mqtt3_spill_close(db, context, true);
+		}else if(do_free){
+			mqtt3_spill_close(db, context, false);
+		}
+	}
+#endif
 	if(context->address){
 		_mosquitto_free(context->address);
 		context->address = NULL;
@@ -181,20 +239,34 @@ void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, b
 		msg = context->msgs;
 		while(msg){
 			next = msg->next;
+			if(msg->conflate){
+				mqtt3_db_conflate_remove(context, msg);
+			}
 			msg->store->ref_count--;
 			_mosquitto_free(msg);
 			msg = next;
 		}
 		context->msgs = NULL;
 		context->last_msg = NULL;
+		context->msg_bytes = 0;
+#ifdef WITH_PERSISTENCE
+		if(context->lazy){
+			mqtt3_db_lazy_discard(context);
+		}
+#endif
 	}
 	if(do_free){
+		mqtt3_db_expiry_context_remove(context);
 		_mosquitto_free(context);
 	}
 }
 
 void mqtt3_context_disconnect(struct mosquitto_db *db, struct mosquitto *ctxt)
 {
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_acks_drop(ctxt);
+#endif
+	mosquitto_auth_request_cancel(ctxt);
 	if(ctxt->state != mosq_cs_disconnecting && ctxt->will){
 		/* Unexpected disconnect, queue the client will. */
 		mqtt3_db_messages_easy_queue(db, ctxt, ctxt->will->topic, ctxt->will->qos, ctxt->will->payloadlen, ctxt->will->payload, ctxt->will->retain);
@@ -205,12 +277,18 @@ void mqtt3_context_disconnect(struct mosquitto_db *db, struct mosquitto *ctxt)
 		_mosquitto_free(ctxt->will);
 		ctxt->will = NULL;
 	}
+#ifdef WITH_TLS
+	mqtt3_tls_handshake_end(ctxt);
+#endif
 	if(ctxt->listener){
 		ctxt->listener->client_count--;
 		assert(ctxt->listener->client_count >= 0);
 		ctxt->listener = NULL;
 	}
 	ctxt->disconnect_t = mosquitto_time();
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_client(ctxt);
+#endif
 	_mosquitto_socket_close(ctxt);
 }
 
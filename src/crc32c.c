@@ -0,0 +1,173 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crc32c.h"
+
+/* Use the SSE4.2 crc32 instruction when the CPU has it. The compiler needs
+ * to support enabling it for a single function. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+		&& (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#  define CRC32C_SSE42
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#  include <arm_acle.h>
+#  define CRC32C_ARM
+#endif
+
+#define CRC32C_POLY 0x82F63B78
+
+#ifndef CRC32C_ARM
+/* Slicing-by-8 tables, filled on first use. */
+static uint32_t crc32c_table[8][256];
+static int crc32c_table_ready = 0;
+
+#ifdef CRC32C_SSE42
+/* -1 until checked, then 0 or 1. */
+static int crc32c_have_sse42 = -1;
+#endif
+
+static void _crc32c_table_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for(i=0; i<256; i++){
+		crc = i;
+		for(j=0; j<8; j++){
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32c_table[0][i] = crc;
+	}
+	for(i=0; i<256; i++){
+		crc = crc32c_table[0][i];
+		for(j=1; j<8; j++){
+			crc = crc32c_table[0][crc & 0xFF] ^ (crc >> 8);
+			crc32c_table[j][i] = crc;
+		}
+	}
+	crc32c_table_ready = 1;
+}
+
+static uint32_t _crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint32_t lo, hi;
+
+	if(!crc32c_table_ready){
+		_crc32c_table_init();
+	}
+	while(len >= 8){
+		/* Assembled byte by byte, so independent of host byte order. */
+		lo = crc ^ ((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+		hi = (uint32_t)p[4] | ((uint32_t)p[5] << 8) | ((uint32_t)p[6] << 16) | ((uint32_t)p[7] << 24);
+		crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF]
+			^ crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24]
+			^ crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF]
+			^ crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while(len--){
+		crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+#endif
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t _crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint32_t v32;
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+	uint64_t v;
+
+	while(len >= 8){
+		__builtin_memcpy(&v, p, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, v);
+		p += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)crc64;
+#endif
+
+	while(len >= 4){
+		__builtin_memcpy(&v32, p, 4);
+		crc = __builtin_ia32_crc32si(crc, v32);
+		p += 4;
+		len -= 4;
+	}
+	while(len--){
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	}
+	return crc;
+}
+#endif
+
+#ifdef CRC32C_ARM
+static uint32_t _crc32c_arm(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t v;
+
+	while(len >= 8){
+		__builtin_memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+		p += 8;
+		len -= 8;
+	}
+	while(len--){
+		crc = __crc32cb(crc, *p++);
+	}
+	return crc;
+}
+#endif
+
+uint32_t _mosquitto_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	crc = ~crc;
+#if defined(CRC32C_ARM)
+	crc = _crc32c_arm(crc, buf, len);
+#else
+#  ifdef CRC32C_SSE42
+	if(crc32c_have_sse42 == -1){
+		__builtin_cpu_init();
+		crc32c_have_sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+	}
+	if(crc32c_have_sse42){
+		return ~_crc32c_sse42(crc, buf, len);
+	}
+#  endif
+	crc = _crc32c_sw(crc, buf, len);
+#endif
+	return ~crc;
+}
@@ -41,8 +41,34 @@ static int max_inflight = 20;
 static int max_queued = 100;
 #ifdef WITH_SYS_TREE
 extern unsigned long g_msgs_dropped;
+extern unsigned long g_msgs_expired;
+extern unsigned long g_msgs_conflated;
+extern unsigned long g_evicted_queue_bytes;
+extern unsigned long g_evicted_oldest_qos0;
+extern unsigned long g_evicted_newest;
+extern unsigned long g_evicted_clients_disconnected;
 #endif
 
+/* Min-heap of items ordered by the time they next need looking at, so that
+ * message expiry only visits what is due. Each item keeps its position in
+ * the heap, or -1 when it is not in it. */
+struct _db_expiry_entry{
+	time_t time;
+	void *item;
+	int *pos;
+};
+
+struct _db_expiry_heap{
+	struct _db_expiry_entry *entries;
+	int count;
+	int size;
+};
+
+/* Clients with outgoing messages that may expire. */
+static struct _db_expiry_heap expiry_contexts = {NULL, 0, 0};
+/* Retained messages that may expire. */
+static struct _db_expiry_heap expiry_retained = {NULL, 0, 0};
+
 int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db)
 {
 	int rc = 0;
@@ -58,6 +84,7 @@ int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db)
 	db->contexts[0] = NULL;
 	// Initialize the hashtable
 	db->clientid_index_hash = NULL;
+	db->source_ids = NULL;
 
 	db->subs.next = NULL;
 	db->subs.subs = NULL;
@@ -135,6 +162,15 @@ int mqtt3_db_close(struct mosquitto_db *db)
 	subhier_clean(db->subs.children);
 	mqtt3_db_store_clean(db);
 
+	if(expiry_contexts.entries) _mosquitto_free(expiry_contexts.entries);
+	expiry_contexts.entries = NULL;
+	expiry_contexts.count = 0;
+	expiry_contexts.size = 0;
+	if(expiry_retained.entries) _mosquitto_free(expiry_retained.entries);
+	expiry_retained.entries = NULL;
+	expiry_retained.count = 0;
+	expiry_retained.size = 0;
+
 	return MOSQ_ERR_SUCCESS;
 }
 
@@ -169,6 +205,12 @@ static void _message_remove(struct mosquitto *context, struct mosquitto_client_m
 		return;
 	}
 
+	if((*msg)->conflate){
+		mqtt3_db_conflate_remove(context, *msg);
+	}
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_client_msg_delete(context, *msg);
+#endif
 	/* FIXME - it would be nice to be able to remove the stored message here if ref_count==0 */
 	(*msg)->store->ref_count--;
 	if(last){
@@ -186,6 +228,7 @@ static void _message_remove(struct mosquitto *context, struct mosquitto_client_m
 	if((*msg)->qos > 0){
 		context->msg_count12--;
 	}
+	context->msg_bytes -= (*msg)->store->msg.payloadlen;
 	_mosquitto_free(*msg);
 	if(last){
 		*msg = last->next;
@@ -194,6 +237,238 @@ static void _message_remove(struct mosquitto *context, struct mosquitto_client_m
 	}
 }
 
+/* Outgoing messages that have not been sent to the client yet may be
+ * discarded once their expiry time has passed. Anything already sent is left
+ * to complete the normal flow. */
+static bool _db_message_expirable(struct mosquitto_client_msg *msg)
+{
+	if(msg->direction != mosq_md_out || msg->dup || !msg->store->expiry_time){
+		return false;
+	}
+	switch(msg->state){
+		case mosq_ms_queued:
+		case mosq_ms_publish_qos0:
+		case mosq_ms_publish_qos1:
+		case mosq_ms_publish_qos2:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool _db_message_expired(struct mosquitto_client_msg *msg, time_t now)
+{
+	return _db_message_expirable(msg) && msg->store->expiry_time <= now;
+}
+
+/* Move queued outgoing messages into the inflight window after messages in
+ * front of them were removed without being acknowledged. */
+static void _db_messages_promote(struct mosquitto *context)
+{
+	struct mosquitto_client_msg *tail;
+	int msg_index = 0;
+
+	tail = context->msgs;
+	while(tail && (max_inflight == 0 || msg_index < max_inflight)){
+		msg_index++;
+		if(tail->state == mosq_ms_queued && tail->direction == mosq_md_out){
+			tail->timestamp = mosquitto_time();
+			switch(tail->qos){
+				case 0:
+					tail->state = mosq_ms_publish_qos0;
+					break;
+				case 1:
+					tail->state = mosq_ms_publish_qos1;
+					break;
+				case 2:
+					tail->state = mosq_ms_publish_qos2;
+					break;
+			}
+		}
+		tail = tail->next;
+	}
+}
+
+static int _db_context_expire(struct mosquitto *context, time_t now)
+{
+	struct mosquitto_client_msg *tail, *last = NULL;
+	int expired = 0;
+
+	tail = context->msgs;
+	while(tail){
+		if(_db_message_expired(tail, now)){
+			_message_remove(context, &tail, last);
+			expired++;
+		}else{
+			last = tail;
+			tail = tail->next;
+		}
+	}
+	if(expired){
+#ifdef WITH_SYS_TREE
+		g_msgs_expired += expired;
+#endif
+		_db_messages_promote(context);
+	}
+	return expired;
+}
+
+static void _db_expiry_swap(struct _db_expiry_heap *heap, int a, int b)
+{
+	struct _db_expiry_entry tmp;
+
+	tmp = heap->entries[a];
+	heap->entries[a] = heap->entries[b];
+	heap->entries[b] = tmp;
+	*heap->entries[a].pos = a;
+	*heap->entries[b].pos = b;
+}
+
+static void _db_expiry_up(struct _db_expiry_heap *heap, int i)
+{
+	int parent;
+
+	while(i > 0){
+		parent = (i-1)/2;
+		if(heap->entries[parent].time <= heap->entries[i].time) break;
+		_db_expiry_swap(heap, i, parent);
+		i = parent;
+	}
+}
+
+static void _db_expiry_down(struct _db_expiry_heap *heap, int i)
+{
+	int child;
+
+	while(1){
+		child = 2*i+1;
+		if(child >= heap->count) break;
+		if(child+1 < heap->count && heap->entries[child+1].time < heap->entries[child].time){
+			child++;
+		}
+		if(heap->entries[i].time <= heap->entries[child].time) break;
+		_db_expiry_swap(heap, i, child);
+		i = child;
+	}
+}
+
+/* Add item to the heap, or move it earlier if it is already there. */
+static int _db_expiry_add(struct _db_expiry_heap *heap, void *item, int *pos, time_t time)
+{
+	struct _db_expiry_entry *entries;
+
+	if(*pos >= 0){
+		if(time < heap->entries[*pos].time){
+			heap->entries[*pos].time = time;
+			_db_expiry_up(heap, *pos);
+		}
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(heap->count == heap->size){
+		entries = _mosquitto_realloc(heap->entries, sizeof(struct _db_expiry_entry)*(heap->size+64));
+		if(!entries){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return MOSQ_ERR_NOMEM;
+		}
+		heap->entries = entries;
+		heap->size += 64;
+	}
+	heap->entries[heap->count].time = time;
+	heap->entries[heap->count].item = item;
+	heap->entries[heap->count].pos = pos;
+	*pos = heap->count;
+	heap->count++;
+	_db_expiry_up(heap, *pos);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _db_expiry_remove(struct _db_expiry_heap *heap, int *pos)
+{
+	int i = *pos;
+
+	if(i < 0) return;
+
+	*pos = -1;
+	heap->count--;
+	if(i == heap->count) return;
+
+	heap->entries[i] = heap->entries[heap->count];
+	*heap->entries[i].pos = i;
+	_db_expiry_up(heap, i);
+	_db_expiry_down(heap, *heap->entries[i].pos);
+}
+
+/* Remove and return the earliest item if it is due by now. */
+static void *_db_expiry_due(struct _db_expiry_heap *heap, time_t now)
+{
+	void *item;
+
+	if(!heap->count || heap->entries[0].time > now) return NULL;
+
+	item = heap->entries[0].item;
+	_db_expiry_remove(heap, heap->entries[0].pos);
+	return item;
+}
+
+/* Schedule context to be checked when stored, just queued for it, expires. */
+void mqtt3_db_expiry_context_add(struct mosquitto *context, struct mosquitto_msg_store *stored)
+{
+	if(!stored->expiry_time) return;
+
+	_db_expiry_add(&expiry_contexts, context, &context->expiry_pos, stored->expiry_time);
+}
+
+void mqtt3_db_expiry_context_remove(struct mosquitto *context)
+{
+	_db_expiry_remove(&expiry_contexts, &context->expiry_pos);
+}
+
+void mqtt3_db_expiry_retain_add(struct mosquitto_msg_store *stored)
+{
+	if(!stored->expiry_time) return;
+
+	_db_expiry_add(&expiry_retained, stored, &stored->expiry_pos, stored->expiry_time);
+}
+
+struct mosquitto_msg_store *mqtt3_db_expiry_retain_due(time_t now)
+{
+	return _db_expiry_due(&expiry_retained, now);
+}
+
+/* Schedule context again for the earliest of its remaining messages that can
+ * still expire. */
+static void _db_context_expiry_reschedule(struct mosquitto *context)
+{
+	struct mosquitto_client_msg *tail;
+	time_t next = 0;
+
+	for(tail=context->msgs; tail; tail=tail->next){
+		if(_db_message_expirable(tail) && (!next || tail->store->expiry_time < next)){
+			next = tail->store->expiry_time;
+		}
+	}
+	if(next){
+		_db_expiry_add(&expiry_contexts, context, &context->expiry_pos, next);
+	}
+}
+
+void mqtt3_db_message_expire(struct mosquitto_db *db)
+{
+	struct mosquitto *context;
+	time_t now;
+
+	assert(db);
+
+	if(!db->config->message_expiry_count) return;
+
+	now = mosquitto_time();
+	while((context = _db_expiry_due(&expiry_contexts, now))){
+		_db_context_expire(context, now);
+		_db_context_expiry_reschedule(context);
+	}
+	mqtt3_subs_retain_expire(db, now);
+}
+
 int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir)
 {
 	struct mosquitto_client_msg *tail, *last = NULL;
@@ -241,17 +516,234 @@ int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosqui
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Remove the oldest QoS 0 message that has not yet been sent to this
+ * client. Returns 1 if there was no such message. */
+static int _db_drop_oldest_qos0(struct mosquitto *context)
+{
+	struct mosquitto_client_msg *tail, *last = NULL;
+
+	tail = context->msgs;
+	while(tail){
+		if(tail->direction == mosq_md_out && tail->qos == 0
+				&& (tail->state == mosq_ms_queued || tail->state == mosq_ms_publish_qos0)){
+
+			_message_remove(context, &tail, last);
+#ifdef WITH_SYS_TREE
+			g_msgs_dropped++;
+			g_evicted_oldest_qos0++;
+#endif
+			return 0;
+		}
+		last = tail;
+		tail = tail->next;
+	}
+	return 1;
+}
+
+static int _db_dest_id_add(struct mosquitto_db *db, struct mosquitto *context, enum mosquitto_msg_direction dir, bool retain, struct mosquitto_msg_store *stored)
+{
+	char **dest_ids;
+
+	if(db->config->allow_duplicate_messages == false && dir == mosq_md_out && retain == false){
+		/* Record which client ids this message has been sent to so we can avoid duplicates.
+		 * Outgoing messages only.
+		 * If retain==true then this is a stale retained message and so should be
+		 * sent regardless. FIXME - this does mean retained messages will received
+		 * multiple times for overlapping subscriptions, although this is only the
+		 * case for SUBSCRIPTION with multiple subs in so is a minor concern.
+		 */
+		dest_ids = _mosquitto_realloc(stored->dest_ids, sizeof(char *)*(stored->dest_id_count+1));
+		if(dest_ids){
+			stored->dest_ids = dest_ids;
+			stored->dest_id_count++;
+			stored->dest_ids[stored->dest_id_count-1] = _mosquitto_strdup(context->id);
+			if(!stored->dest_ids[stored->dest_id_count-1]){
+				return MOSQ_ERR_NOMEM;
+			}
+		}else{
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Whether queueing stored for context would take its queue over
+ * max_queued_bytes, once freed bytes have been removed from it. A message is
+ * always accepted into an empty queue, so that a single message larger than
+ * the limit can still be delivered. */
+static bool _db_queued_bytes_exceeded(struct mosquitto *context, unsigned long freed, struct mosquitto_msg_store *stored)
+{
+	unsigned long msg_bytes = context->msg_bytes - freed;
+
+	if(!context->max_queued_bytes || !msg_bytes
+			|| msg_bytes + stored->msg.payloadlen <= context->max_queued_bytes){
+
+		return false;
+	}
+	if(context->is_dropping == false){
+		context->is_dropping = true;
+		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE,
+				"Outgoing messages are being dropped for client %s.",
+				context->id);
+	}
+#ifdef WITH_SYS_TREE
+	g_msgs_dropped++;
+	g_evicted_queue_bytes++;
+#endif
+	return true;
+}
+
+void mqtt3_db_conflate_remove(struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+	HASH_DELETE(hh, context->conflate_index, msg->conflate);
+	_mosquitto_free(msg->conflate);
+	msg->conflate = NULL;
+}
+
+static int _db_conflate_add(struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+	struct _mosquitto_conflate *entry;
+	const char *topic = msg->store->msg.topic;
+
+	if(!topic) return MOSQ_ERR_SUCCESS;
+
+	/* Only the newest message for a topic is indexed. */
+	HASH_FIND(hh, context->conflate_index, topic, strlen(topic), entry);
+	if(entry){
+		mqtt3_db_conflate_remove(context, entry->msg);
+	}
+
+	entry = _mosquitto_malloc(sizeof(struct _mosquitto_conflate));
+	if(!entry) return MOSQ_ERR_NOMEM;
+	entry->msg = msg;
+	msg->conflate = entry;
+	HASH_ADD_KEYPTR(hh, context->conflate_index, topic, strlen(topic), entry);
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Whether msg has not been sent yet, so could still be replaced. */
+static bool _db_conflate_replaceable(struct mosquitto_client_msg *msg)
+{
+	if(msg->dup) return false;
+
+	switch(msg->state){
+		case mosq_ms_queued:
+		case mosq_ms_publish_qos0:
+		case mosq_ms_publish_qos1:
+		case mosq_ms_publish_qos2:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/* Rebuild the conflation index for the queue of a client restored from the
+ * persistent database, so later messages can replace those in the queue. */
+int mqtt3_db_conflate_rebuild(struct mosquitto *context)
+{
+	struct mosquitto_client_msg *tail;
+
+	for(tail=context->msgs; tail; tail=tail->next){
+		if(tail->conflate){
+			mqtt3_db_conflate_remove(context, tail);
+		}
+		if(tail->direction == mosq_md_out && _db_conflate_replaceable(tail)
+				&& (tail->store->conflate || (context->listener && context->listener->queue_conflate_all))){
+
+			/* Later messages on a topic replace earlier ones in the index. */
+			if(_db_conflate_add(context, tail)) return MOSQ_ERR_NOMEM;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* If a message for the same topic is still waiting to be sent to this client,
+ * replace it with the new one in place rather than queueing another.
+ * Returns MOSQ_ERR_SUCCESS if a message was replaced, 2 if the new message
+ * was dropped because it would take the queue over max_queued_bytes, or 1 if
+ * there was no message to replace. */
+static int _db_conflate_replace(struct mosquitto *context, uint16_t mid, int qos, bool retain, struct mosquitto_msg_store *stored)
+{
+	struct _mosquitto_conflate *entry;
+	struct mosquitto_client_msg *msg;
+	const char *topic = stored->msg.topic;
+
+	if(!topic || !context->conflate_index) return 1;
+
+	HASH_FIND(hh, context->conflate_index, topic, strlen(topic), entry);
+	if(!entry) return 1;
+
+	msg = entry->msg;
+	if(!_db_conflate_replaceable(msg)){
+		/* Already sent, so it can no longer be replaced. */
+		mqtt3_db_conflate_remove(context, msg);
+		return 1;
+	}
+	if(_db_queued_bytes_exceeded(context, msg->store->msg.payloadlen, stored)){
+		return 2;
+	}
+
+	/* The index key points into the stored message, so must be re-added. */
+	HASH_DELETE(hh, context->conflate_index, entry);
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_client_msg_delete(context, msg);
+#endif
+
+	msg->store->ref_count--;
+	context->msg_bytes -= msg->store->msg.payloadlen;
+	if(msg->qos > 0){
+		context->msg_count12--;
+	}
+	msg->store = stored;
+	msg->store->ref_count++;
+	context->msg_bytes += stored->msg.payloadlen;
+	if(qos > 0){
+		context->msg_count12++;
+	}
+	msg->mid = mid;
+	msg->qos = qos;
+	msg->retain = retain;
+	if(msg->state != mosq_ms_queued){
+		switch(qos){
+			case 0:
+				msg->state = mosq_ms_publish_qos0;
+				break;
+			case 1:
+				msg->state = mosq_ms_publish_qos1;
+				break;
+			case 2:
+				msg->state = mosq_ms_publish_qos2;
+				break;
+		}
+	}
+	HASH_ADD_KEYPTR(hh, context->conflate_index, topic, strlen(topic), entry);
+	mqtt3_db_expiry_context_add(context, stored);
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_client_msg_add(context, msg);
+#endif
+#ifdef WITH_SYS_TREE
+	g_msgs_conflated++;
+#endif
+	return MOSQ_ERR_SUCCESS;
+}
+
 int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored)
 {
 	struct mosquitto_client_msg *msg;
 	enum mosquitto_msg_state state = mosq_ms_invalid;
 	int rc = 0;
 	int i;
-	char **dest_ids;
+	bool conflate;
 
 	assert(stored);
 	if(!context) return MOSQ_ERR_INVAL;
 
+#ifdef WITH_PERSISTENCE
+	if(context->lazy){
+		/* Queued messages must stay in order. */
+		mqtt3_db_lazy_load(db, context);
+	}
+#endif
 	/* Check whether we've already sent this message to this client
 	 * for outgoing messages only.
 	 * If retain==true then this is a stale retained message and so should be
@@ -282,6 +774,72 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 		}
 	}
 
+	conflate = dir == mosq_md_out
+			&& (stored->conflate || (context->listener && context->listener->queue_conflate_all));
+#ifdef WITH_PERSISTENCE
+	/* Spilled messages are older than anything that would be conflated in
+	 * memory, so conflation is suspended until the spill has drained. */
+	if(context->spill) conflate = false;
+#endif
+	if(conflate){
+		rc = _db_conflate_replace(context, mid, qos, retain, stored);
+		if(rc == MOSQ_ERR_SUCCESS){
+			return _db_dest_id_add(db, context, dir, retain, stored)?MOSQ_ERR_NOMEM:MOSQ_ERR_SUCCESS;
+		}else if(rc == 2){
+			return 2;
+		}
+		rc = 0;
+	}
+
+#ifdef WITH_PERSISTENCE
+	/* Persistent clients with a deep queue have further messages spilled to
+	 * disk. Once anything has been spilled, everything after it must be too,
+	 * until the spill has been drained, to keep messages in order. */
+	if(dir == mosq_md_out && qos > 0 && context->clean_session == false
+			&& db->config->persistence && db->config->queue_spill_threshold > 0){
+
+		if((context->spill && !context->spill->draining)
+				|| (!context->spill && context->msg_count12 >= db->config->queue_spill_threshold)){
+
+			if(!mqtt3_spill_message(db, context, qos, retain, stored)){
+				return _db_dest_id_add(db, context, dir, retain, stored)?MOSQ_ERR_NOMEM:2;
+			}
+			if(context->spill){
+				/* The message couldn't be spilled, but queueing it in memory
+				 * would put it ahead of older messages still on disk. */
+#ifdef WITH_SYS_TREE
+				g_msgs_dropped++;
+#endif
+				return 2;
+			}
+		}
+	}
+#endif
+
+	if(dir == mosq_md_out){
+		if(_db_queued_bytes_exceeded(context, 0, stored)){
+			return 2;
+		}
+		if(mqtt3_db_memory_limit_exceeded(db)){
+			if(db->config->memory_limit_policy == mp_drop_newest){
+#ifdef WITH_SYS_TREE
+				g_msgs_dropped++;
+				g_evicted_newest++;
+#endif
+				return 2;
+			}else if(db->config->memory_limit_policy == mp_drop_oldest_qos0){
+				if(_db_drop_oldest_qos0(context) && qos == 0){
+					/* Nothing older to drop, so drop this one. */
+#ifdef WITH_SYS_TREE
+					g_msgs_dropped++;
+					g_evicted_oldest_qos0++;
+#endif
+					return 2;
+				}
+			}
+		}
+	}
+
 	if(context->sock != INVALID_SOCKET){
 		if(qos == 0 || max_inflight == 0 || context->msg_count12 < max_inflight){
 			if(dir == mosq_md_out){
@@ -355,6 +913,7 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 	msg->dup = false;
 	msg->qos = qos;
 	msg->retain = retain;
+	msg->conflate = NULL;
 	if(context->last_msg){
 		context->last_msg->next = msg;
 		context->last_msg = msg;
@@ -366,26 +925,19 @@ int mqtt3_db_message_insert(struct mosquitto_db *db, struct mosquitto *context,
 	if(qos > 0){
 		context->msg_count12++;
 	}
+	context->msg_bytes += stored->msg.payloadlen;
+	if(dir == mosq_md_out){
+		mqtt3_db_expiry_context_add(context, stored);
+	}
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_client_msg_add(context, msg);
+#endif
 
-	if(db->config->allow_duplicate_messages == false && dir == mosq_md_out && retain == false){
-		/* Record which client ids this message has been sent to so we can avoid duplicates.
-		 * Outgoing messages only.
-		 * If retain==true then this is a stale retained message and so should be
-		 * sent regardless. FIXME - this does mean retained messages will received
-		 * multiple times for overlapping subscriptions, although this is only the
-		 * case for SUBSCRIPTION with multiple subs in so is a minor concern.
-		 */
-		dest_ids = _mosquitto_realloc(stored->dest_ids, sizeof(char *)*(stored->dest_id_count+1));
-		if(dest_ids){
-			stored->dest_ids = dest_ids;
-			stored->dest_id_count++;
-			stored->dest_ids[stored->dest_id_count-1] = _mosquitto_strdup(context->id);
-			if(!stored->dest_ids[stored->dest_id_count-1]){
-				return MOSQ_ERR_NOMEM;
-			}
-		}else{
-			return MOSQ_ERR_NOMEM;
-		}
+	if(conflate && _db_conflate_add(context, msg)){
+		return MOSQ_ERR_NOMEM;
+	}
+	if(_db_dest_id_add(db, context, dir, retain, stored)){
+		return MOSQ_ERR_NOMEM;
 	}
 #ifdef WITH_BRIDGE
 	if(context->bridge && context->bridge->start_type == bst_lazy
@@ -408,6 +960,9 @@ int mqtt3_db_message_update(struct mosquitto *context, uint16_t mid, enum mosqui
 		if(tail->mid == mid && tail->direction == dir){
 			tail->state = state;
 			tail->timestamp = mosquitto_time();
+#ifdef WITH_PERSISTENCE
+			mqtt3_wal_client_msg_update(context, tail);
+#endif
 			return MOSQ_ERR_SUCCESS;
 		}
 		tail = tail->next;
@@ -421,9 +976,18 @@ int mqtt3_db_messages_delete(struct mosquitto *context)
 
 	if(!context) return MOSQ_ERR_INVAL;
 
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_client_msgs_delete(context);
+	if(context->lazy){
+		mqtt3_db_lazy_discard(context);
+	}
+#endif
 	tail = context->msgs;
 	while(tail){
 		/* FIXME - it would be nice to be able to remove the stored message here if rec_count==0 */
+		if(tail->conflate){
+			mqtt3_db_conflate_remove(context, tail);
+		}
 		tail->store->ref_count--;
 		next = tail->next;
 		_mosquitto_free(tail);
@@ -433,6 +997,7 @@ int mqtt3_db_messages_delete(struct mosquitto *context)
 	context->last_msg = NULL;
 	context->msg_count = 0;
 	context->msg_count12 = 0;
+	context->msg_bytes = 0;
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -456,65 +1021,150 @@ int mqtt3_db_messages_easy_queue(struct mosquitto_db *db, struct mosquitto *cont
 	return mqtt3_db_messages_queue(db, source_id, topic, qos, retain, stored);
 }
 
+/* Source ids are interned so that every message from the same publisher
+ * shares a single copy of its id, rather than one strdup per message. */
+static struct _mosquitto_source_id *_db_source_id_get(struct mosquitto_db *db, const char *source)
+{
+	struct _mosquitto_source_id *ref;
+	size_t len;
+
+	HASH_FIND_STR(db->source_ids, source, ref);
+	if(!ref){
+		len = strlen(source);
+		ref = _mosquitto_malloc(sizeof(struct _mosquitto_source_id) + len + 1);
+		if(!ref) return NULL;
+		ref->id = (char *)ref + sizeof(struct _mosquitto_source_id);
+		memcpy(ref->id, source, len+1);
+		ref->ref_count = 0;
+		HASH_ADD_KEYPTR(hh, db->source_ids, ref->id, len, ref);
+	}
+	ref->ref_count++;
+	return ref;
+}
+
+static void _db_source_id_release(struct mosquitto_db *db, struct _mosquitto_source_id *ref)
+{
+	if(!ref) return;
+
+	ref->ref_count--;
+	if(ref->ref_count == 0){
+		HASH_DELETE(hh, db->source_ids, ref);
+		_mosquitto_free(ref);
+	}
+}
+
+/* Topics beginning with $ are only matched by patterns that also begin
+ * with $. */
+static bool _db_topic_matches(const char *pattern, const char *topic)
+{
+	bool result;
+
+	if(topic[0] == '$' && pattern[0] != '$') return false;
+	if(mosquitto_topic_matches_sub(pattern, topic, &result)) return false;
+	return result;
+}
+
+/* Return the time at which a message on this topic expires, from the first
+ * matching message_expiry option, or 0 if it never expires. */
+static time_t _db_message_expiry_time(struct mosquitto_db *db, const char *topic)
+{
+	int i;
+
+	if(!topic) return 0;
+
+	for(i=0; i<db->config->message_expiry_count; i++){
+		if(_db_topic_matches(db->config->message_expiries[i].topic, topic)){
+			return mosquitto_time() + db->config->message_expiries[i].expiry;
+		}
+	}
+	return 0;
+}
+
+/* Whether acknowledgements of incoming messages on this topic wait for the
+ * write-ahead log to be synced. */
+bool mqtt3_db_message_durable(struct mosquitto_db *db, const char *topic)
+{
+	int i;
+
+	if(!topic || !db->config->persistence || !db->config->persistence_wal) return false;
+
+	for(i=0; i<db->config->persistence_durable_topic_count; i++){
+		if(_db_topic_matches(db->config->persistence_durable_topics[i], topic)){
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool _db_message_conflate(struct mosquitto_db *db, const char *topic)
+{
+	int i;
+
+	if(!topic) return false;
+
+	for(i=0; i<db->config->queue_conflate_topic_count; i++){
+		if(_db_topic_matches(db->config->queue_conflate_topics[i], topic)){
+			return true;
+		}
+	}
+	return false;
+}
+
 int mqtt3_db_message_store(struct mosquitto_db *db, const char *source, uint16_t source_mid, const char *topic, int qos, uint32_t payloadlen, const void *payload, int retain, struct mosquitto_msg_store **stored, dbid_t store_id)
 {
 	struct mosquitto_msg_store *temp;
+	size_t topiclen = 0;
+	char *block;
 
 	assert(db);
 	assert(stored);
 
-	temp = _mosquitto_malloc(sizeof(struct mosquitto_msg_store));
-	if(!temp) return MOSQ_ERR_NOMEM;
-
-	temp->next = db->msg_store;
-	temp->ref_count = 0;
-	if(source){
-		temp->source_id = _mosquitto_strdup(source);
-	}else{
-		temp->source_id = _mosquitto_strdup("");
+	if(topic){
+		topiclen = strlen(topic) + 1;
 	}
-	if(!temp->source_id){
+	/* Topic and payload live inline after the struct. The payload gets an
+	 * extra terminating zero byte to match what clients see. */
+	temp = _mosquitto_malloc(sizeof(struct mosquitto_msg_store) + topiclen + (payloadlen?payloadlen+1:0));
+	if(!temp){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+
+	temp->source = _db_source_id_get(db, source?source:"");
+	if(!temp->source){
 		_mosquitto_free(temp);
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return MOSQ_ERR_NOMEM;
 	}
+	temp->source_id = temp->source->id;
+	temp->next = db->msg_store;
+	temp->ref_count = 0;
 	temp->source_mid = source_mid;
+	temp->expiry_time = _db_message_expiry_time(db, topic);
+	temp->expiry_pos = -1;
+	temp->conflate = _db_message_conflate(db, topic);
+	temp->persisted = false;
 	temp->msg.mid = 0;
 	temp->msg.qos = qos;
 	temp->msg.retain = retain;
+
+	block = (char *)temp + sizeof(struct mosquitto_msg_store);
 	if(topic){
-		temp->msg.topic = _mosquitto_strdup(topic);
-		if(!temp->msg.topic){
-			_mosquitto_free(temp->source_id);
-			_mosquitto_free(temp);
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-			return MOSQ_ERR_NOMEM;
-		}
+		temp->msg.topic = block;
+		memcpy(temp->msg.topic, topic, topiclen);
+		block += topiclen;
 	}else{
 		temp->msg.topic = NULL;
 	}
 	temp->msg.payloadlen = payloadlen;
 	if(payloadlen){
-		temp->msg.payload = _mosquitto_malloc(sizeof(char)*payloadlen);
-		if(!temp->msg.payload){
-			if(temp->source_id) _mosquitto_free(temp->source_id);
-			if(temp->msg.topic) _mosquitto_free(temp->msg.topic);
-			if(temp->msg.payload) _mosquitto_free(temp->msg.payload);
-			_mosquitto_free(temp);
-			return MOSQ_ERR_NOMEM;
-		}
+		temp->msg.payload = block;
 		memcpy(temp->msg.payload, payload, sizeof(char)*payloadlen);
+		block[payloadlen] = 0;
 	}else{
 		temp->msg.payload = NULL;
 	}
 
-	if(!temp->source_id || (payloadlen && !temp->msg.payload)){
-		if(temp->source_id) _mosquitto_free(temp->source_id);
-		if(temp->msg.topic) _mosquitto_free(temp->msg.topic);
-		if(temp->msg.payload) _mosquitto_free(temp->msg.payload);
-		_mosquitto_free(temp);
-		return 1;
-	}
 	temp->dest_ids = NULL;
 	temp->dest_id_count = 0;
 	db->msg_store_count++;
@@ -560,6 +1210,7 @@ int mqtt3_db_message_reconnect_reset(struct mosquitto *context)
 	msg = context->msgs;
 	context->msg_count = 0;
 	context->msg_count12 = 0;
+	context->msg_bytes = 0;
 	while(msg){
 		context->last_msg = msg;
 
@@ -567,6 +1218,7 @@ int mqtt3_db_message_reconnect_reset(struct mosquitto *context)
 		if(msg->qos > 0){
 			context->msg_count12++;
 		}
+		context->msg_bytes += msg->store->msg.payloadlen;
 
 		if(msg->direction == mosq_md_out){
 			if(msg->state != mosq_ms_queued){
@@ -755,14 +1407,24 @@ int mqtt3_db_message_write(struct mosquitto *context)
 	uint32_t payloadlen;
 	const void *payload;
 	int msg_count = 0;
+	time_t now;
 
 	if(!context || context->sock == -1
 			|| (context->state == mosq_cs_connected && !context->id)){
 		return MOSQ_ERR_INVAL;
 	}
 
+	now = mosquitto_time();
 	tail = context->msgs;
 	while(tail){
+		if(_db_message_expired(tail, now)){
+			_message_remove(context, &tail, last);
+#ifdef WITH_SYS_TREE
+			g_msgs_expired++;
+#endif
+			_db_messages_promote(context);
+			continue;
+		}
 		if(tail->direction == mosq_md_in){
 			msg_count++;
 		}
@@ -875,15 +1537,14 @@ void mqtt3_db_store_clean(struct mosquitto_db *db)
 	tail = db->msg_store;
 	while(tail){
 		if(tail->ref_count == 0){
-			if(tail->source_id) _mosquitto_free(tail->source_id);
+			_db_expiry_remove(&expiry_retained, &tail->expiry_pos);
+			_db_source_id_release(db, tail->source);
 			if(tail->dest_ids){
 				for(i=0; i<tail->dest_id_count; i++){
 					if(tail->dest_ids[i]) _mosquitto_free(tail->dest_ids[i]);
 				}
 				_mosquitto_free(tail->dest_ids);
 			}
-			if(tail->msg.topic) _mosquitto_free(tail->msg.topic);
-			if(tail->msg.payload) _mosquitto_free(tail->msg.payload);
 			if(last){
 				last->next = tail->next;
 				_mosquitto_free(tail);
@@ -907,6 +1568,110 @@ void mqtt3_db_limits_set(int inflight, int queued)
 	max_queued = queued;
 }
 
+/* Simple glob match, where '*' matches any sequence of characters. */
+static bool _db_pattern_match(const char *pattern, const char *str)
+{
+	while(*pattern){
+		if(*pattern == '*'){
+			while(*pattern == '*') pattern++;
+			if(!*pattern) return true;
+			while(*str){
+				if(_db_pattern_match(pattern, str)) return true;
+				str++;
+			}
+			return false;
+		}
+		if(*pattern != *str) return false;
+		pattern++;
+		str++;
+	}
+	return *str == '\0';
+}
+
+/* Work out the queue byte limit for a client, from the first
+ * max_queued_bytes_user pattern that matches its username, or failing that
+ * from the listener it connected to. */
+void mqtt3_db_limits_context_set(struct mosquitto_db *db, struct mosquitto *context)
+{
+	int i;
+
+	assert(db);
+	assert(context);
+
+	if(context->username){
+		for(i=0; i<db->config->queue_bytes_user_count; i++){
+			if(_db_pattern_match(db->config->queue_bytes_users[i].pattern, context->username)){
+				context->max_queued_bytes = db->config->queue_bytes_users[i].max_queued_bytes;
+				return;
+			}
+		}
+	}
+	if(context->listener){
+		context->max_queued_bytes = context->listener->max_queued_bytes;
+	}else{
+		context->max_queued_bytes = 0;
+	}
+}
+
+bool mqtt3_db_memory_limit_exceeded(struct mosquitto_db *db)
+{
+#ifdef REAL_WITH_MEMORY_TRACKING
+	if(db->config->memory_limit && _mosquitto_memory_used() > db->config->memory_limit){
+		return true;
+	}
+#endif
+	return false;
+}
+
+/* Called periodically from the main loop to apply the memory_limit policies
+ * that act on clients rather than on individual messages. */
+void mqtt3_db_memory_limit_check(struct mosquitto_db *db)
+{
+	struct mosquitto *context;
+	struct mosquitto *heaviest = NULL;
+	int i;
+	bool exceeded;
+
+	assert(db);
+
+	exceeded = mqtt3_db_memory_limit_exceeded(db);
+	for(i=0; i<db->context_count; i++){
+		context = db->contexts[i];
+		if(!context) continue;
+
+		context->is_throttled = false;
+		if(!exceeded || context->sock == INVALID_SOCKET) continue;
+
+		if(db->config->memory_limit_policy == mp_reject_heaviest_producer){
+			if(context->pub_bytes && (!heaviest || context->pub_bytes > heaviest->pub_bytes)){
+				heaviest = context;
+			}
+		}else if(db->config->memory_limit_policy == mp_disconnect_largest_consumer){
+			if(context->msg_bytes && (!heaviest || context->msg_bytes > heaviest->msg_bytes)){
+				heaviest = context;
+			}
+		}
+	}
+	for(i=0; i<db->context_count; i++){
+		if(db->contexts[i]){
+			db->contexts[i]->pub_bytes = 0;
+		}
+	}
+	if(!heaviest) return;
+
+	if(db->config->memory_limit_policy == mp_reject_heaviest_producer){
+		/* Publishes from this client are rejected until the next check. */
+		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Memory limit exceeded, rejecting publishes from client %s.", heaviest->id);
+		heaviest->is_throttled = true;
+	}else{
+		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Memory limit exceeded, disconnecting client %s.", heaviest->id);
+#ifdef WITH_SYS_TREE
+		g_evicted_clients_disconnected++;
+#endif
+		mqtt3_context_disconnect(db, heaviest);
+	}
+}
+
 void mqtt3_db_vacuum(void)
 {
 	/* FIXME - reimplement? */
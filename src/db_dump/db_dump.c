@@ -36,7 +36,11 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
+#ifdef WITH_ZLIB
+#  include <zlib.h>
+#endif
 
+#include <crc32c.h>
 #include <mosquitto_broker.h>
 #include <memory_mosq.h>
 #include <persist.h>
@@ -307,95 +311,889 @@ error:
 	return 1;
 }
 
+static int _db_client_subs_chunk_restore(struct mosquitto_db *db, FILE *db_fd)
+{
+	uint32_t i32temp, count, i;
+	uint16_t i16temp, slen, shared, prev_len = 0;
+	uint8_t i8temp, qos;
+	char *client_id = NULL;
+	char topic[UINT16_MAX+1];
+	int j;
+
+	read_e(db_fd, &i16temp, sizeof(uint16_t));
+	slen = ntohs(i16temp);
+	client_id = calloc(slen+1, sizeof(char));
+	if(!client_id){
+		fclose(db_fd);
+		fprintf(stderr, "Error: Out of memory.");
+		return 1;
+	}
+	read_e(db_fd, client_id, slen);
+	printf("\tClient ID: %s\n", client_id);
+	read_e(db_fd, &i32temp, sizeof(uint32_t));
+	count = ntohl(i32temp);
+	printf("\tCount: %u\n", count);
+	for(i=0; i<count; i++){
+		/* Difference from the tree node number of the previous topic. */
+		for(j=0; j<5; j++){
+			read_e(db_fd, &i8temp, sizeof(uint8_t));
+			if(!(i8temp & 128)) break;
+		}
+		read_e(db_fd, &i16temp, sizeof(uint16_t));
+		shared = ntohs(i16temp);
+		read_e(db_fd, &i16temp, sizeof(uint16_t));
+		slen = ntohs(i16temp);
+		if(shared > prev_len || (uint32_t)shared + slen > UINT16_MAX){
+			errno = EINVAL;
+			goto error;
+		}
+		read_e(db_fd, &topic[shared], slen);
+		prev_len = shared + slen;
+		topic[prev_len] = '\0';
+		read_e(db_fd, &qos, sizeof(uint8_t));
+		printf("\tTopic: %s\n", topic);
+		printf("\tQoS: %d\n", qos);
+	}
+	free(client_id);
+	return 0;
+error:
+	fprintf(stderr, "Error: %s.", strerror(errno));
+	if(client_id) free(client_id);
+	fclose(db_fd);
+	return 1;
+}
+
+/* Print one chunk whose body is available from db_fd. db_fd is closed on
+ * error. */
+/* Called for each chunk with a stream holding just its body. A handler closes
+ * db_fd if it fails. */
+typedef int (*chunk_handler)(struct mosquitto_db *db, FILE *db_fd, uint16_t chunk, uint32_t length);
+
+#ifdef WITH_ZLIB
+static int _db_block_read(struct mosquitto_db *db, FILE *db_fd, uint32_t length, chunk_handler handler);
+#endif
+
+/* Read chunks from fd until the end of the stream and pass each to handler.
+ * Each chunk body is read into memory first so that its CRC can be checked
+ * before parsing. The chunks inside a DB_CHUNK_BLOCK are passed to handler
+ * after the block itself. */
+static int _db_chunks_read(struct mosquitto_db *db, FILE *fd, bool crc, chunk_handler handler)
+{
+	uint32_t i32temp, length, body_crc, stored_crc;
+	uint16_t i16temp, chunk;
+	uint8_t *body = NULL;
+	FILE *body_fd;
+	size_t rlen;
+
+	while(rlen = fread(&i16temp, sizeof(uint16_t), 1, fd), rlen == 1){
+		chunk = ntohs(i16temp);
+		read_e(fd, &i32temp, sizeof(uint32_t));
+		length = ntohl(i32temp);
+
+		body = malloc(length+1);
+		if(!body){
+			fprintf(stderr, "Error: Out of memory.");
+			return 1;
+		}
+		read_e(fd, body, length);
+		if(crc){
+			read_e(fd, &stored_crc, sizeof(uint32_t));
+			i16temp = htons(chunk);
+			body_crc = _mosquitto_crc32c(0, &i16temp, sizeof(uint16_t));
+			i32temp = htonl(length);
+			body_crc = _mosquitto_crc32c(body_crc, &i32temp, sizeof(uint32_t));
+			body_crc = _mosquitto_crc32c(body_crc, body, length);
+			if(body_crc != ntohl(stored_crc)){
+				fprintf(stderr, "Error: CRC mismatch in chunk \"%d\".", chunk);
+				free(body);
+				return 1;
+			}
+		}
+
+		body_fd = fmemopen(body, length+1, "rb");
+		if(!body_fd) goto error;
+		if(handler(db, body_fd, chunk, length)){
+			free(body);
+			return 1;
+		}
+		if(chunk == DB_CHUNK_BLOCK){
+			rewind(body_fd);
+#ifdef WITH_ZLIB
+			if(_db_block_read(db, body_fd, length, handler)){
+				free(body);
+				return 1;
+			}
+#else
+			fprintf(stderr, "Error: Compressed database support not available.");
+			fclose(body_fd);
+			free(body);
+			return 1;
+#endif
+		}
+		fclose(body_fd);
+		free(body);
+		body = NULL;
+	}
+	if(ferror(fd)) goto error;
+	return 0;
+error:
+	fprintf(stderr, "Error: %s.", strerror(errno));
+	if(body) free(body);
+	return 1;
+}
+
+#ifdef WITH_ZLIB
+static int _db_block_read(struct mosquitto_db *db, FILE *db_fd, uint32_t length, chunk_handler handler)
+{
+	uint32_t i32temp, raw_len;
+	uint8_t *zdata, *raw;
+	uLongf dest_len;
+	FILE *raw_fd;
+	int rc;
+
+	read_e(db_fd, &i32temp, sizeof(uint32_t));
+	raw_len = ntohl(i32temp);
+	if(length < sizeof(uint32_t)){
+		fprintf(stderr, "Error: Corrupt persistent database.");
+		fclose(db_fd);
+		return 1;
+	}
+	length -= sizeof(uint32_t);
+
+	zdata = malloc(length);
+	raw = malloc(raw_len+1);
+	if(!zdata || !raw){
+		fprintf(stderr, "Error: Out of memory.");
+		free(zdata);
+		free(raw);
+		fclose(db_fd);
+		return 1;
+	}
+	if(fread(zdata, 1, length, db_fd) != length){
+		fprintf(stderr, "Error: %s.", strerror(errno));
+		free(zdata);
+		free(raw);
+		fclose(db_fd);
+		return 1;
+	}
+	dest_len = raw_len;
+	if(uncompress(raw, &dest_len, zdata, length) != Z_OK || dest_len != raw_len){
+		fprintf(stderr, "Error: Corrupt compressed block.");
+		free(zdata);
+		free(raw);
+		fclose(db_fd);
+		return 1;
+	}
+	free(zdata);
+
+	raw_fd = fmemopen(raw, raw_len, "rb");
+	if(!raw_fd){
+		fprintf(stderr, "Error: %s.", strerror(errno));
+		free(raw);
+		fclose(db_fd);
+		return 1;
+	}
+	rc = _db_chunks_read(db, raw_fd, true, handler);
+	fclose(raw_fd);
+	free(raw);
+	if(rc) fclose(db_fd);
+	return rc;
+error:
+	fprintf(stderr, "Error: %s.", strerror(errno));
+	fclose(db_fd);
+	return 1;
+}
+#endif
+
+static int _db_chunk_dump(struct mosquitto_db *db, FILE *db_fd, uint16_t chunk, uint32_t length)
+{
+	dbid_t i64temp;
+	uint32_t i32temp;
+	uint8_t i8temp;
+
+	switch(chunk){
+		case DB_CHUNK_CFG:
+			printf("DB_CHUNK_CFG:\n");
+			printf("\tLength: %d\n", length);
+			read_e(db_fd, &i8temp, sizeof(uint8_t)); // shutdown
+			printf("\tShutdown: %d\n", i8temp);
+			read_e(db_fd, &i8temp, sizeof(uint8_t)); // sizeof(dbid_t)
+			printf("\tDB ID size: %d\n", i8temp);
+			if(i8temp != sizeof(dbid_t)){
+				fprintf(stderr, "Error: Incompatible database configuration (dbid size is %d bytes, expected %ld)",
+						i8temp, sizeof(dbid_t));
+				fclose(db_fd);
+				return 1;
+			}
+			read_e(db_fd, &i64temp, sizeof(dbid_t));
+			printf("\tLast DB ID: %ld\n", (long)i64temp);
+			break;
+
+		case DB_CHUNK_WAL_GEN:
+			printf("DB_CHUNK_WAL_GEN:\n");
+			printf("\tLength: %d\n", length);
+			read_e(db_fd, &i32temp, sizeof(uint32_t));
+			printf("\tWrite-ahead log generation: %d\n", ntohl(i32temp));
+			break;
+
+		case DB_CHUNK_MSG_STORE:
+			printf("DB_CHUNK_MSG_STORE:\n");
+			printf("\tLength: %d\n", length);
+			return _db_msg_store_chunk_restore(db, db_fd);
+
+		case DB_CHUNK_CLIENT_MSG:
+			printf("DB_CHUNK_CLIENT_MSG:\n");
+			printf("\tLength: %d\n", length);
+			return _db_client_msg_chunk_restore(db, db_fd);
+
+		case DB_CHUNK_RETAIN:
+			printf("DB_CHUNK_RETAIN:\n");
+			printf("\tLength: %d\n", length);
+			return _db_retain_chunk_restore(db, db_fd);
+
+		case DB_CHUNK_SUB:
+			printf("DB_CHUNK_SUB:\n");
+			printf("\tLength: %d\n", length);
+			return _db_sub_chunk_restore(db, db_fd);
+
+		case DB_CHUNK_CLIENT_SUBS:
+			printf("DB_CHUNK_CLIENT_SUBS:\n");
+			printf("\tLength: %d\n", length);
+			return _db_client_subs_chunk_restore(db, db_fd);
+
+		case DB_CHUNK_CLIENT:
+			printf("DB_CHUNK_CLIENT:\n");
+			printf("\tLength: %d\n", length);
+			return _db_client_chunk_restore(db, db_fd);
+
+		case DB_CHUNK_BLOCK:
+			printf("DB_CHUNK_BLOCK:\n");
+			printf("\tLength: %d\n", length);
+			break;
+
+		default:
+			fprintf(stderr, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
+			break;
+	}
+	return 0;
+error:
+	fprintf(stderr, "Error: %s.", strerror(errno));
+	fclose(db_fd);
+	return 1;
+}
+
+/* ================================================================
+ * --stats
+ *
+ * Memory use doesn't depend on the number of clients, topics or queued
+ * messages, only on the number of stored messages, which are tracked in a
+ * compact table so that orphaned entries and the size of queued and retained
+ * messages can be found. Each client's queued messages follow its client
+ * chunk, so they are totalled one client at a time.
+ * ================================================================ */
+
+#define STATS_CHUNK_TYPES (DB_CHUNK_CLIENT_SUBS+1)
+/* Sizes below 16 have a bucket each, larger sizes have eight buckets per
+ * power of two, so percentiles are accurate to within 12.5%. */
+#define STATS_BUCKETS (16+28*8)
+
+struct stats_store{
+	dbid_t id;
+	uint32_t payloadlen;
+	uint16_t ref_count;
+	bool retained;
+};
+
+struct stats_top{
+	char *name;
+	uint64_t count;
+	uint64_t bytes;
+};
+
+struct stats_top_list{
+	struct stats_top *items;
+	int count;
+	bool by_bytes;
+};
+
+static int stats_top_n = 10;
+
+static uint64_t stats_chunk_count[STATS_CHUNK_TYPES+1];
+static uint64_t stats_chunk_bytes[STATS_CHUNK_TYPES+1];
+
+static struct stats_store *stats_stores = NULL;
+static uint64_t stats_store_size = 0;
+static uint64_t stats_store_count = 0;
+
+static uint64_t stats_payload_buckets[STATS_BUCKETS];
+static uint64_t stats_payload_bytes = 0;
+static uint32_t stats_payload_max = 0;
+
+static char *stats_client_id = NULL;
+static uint64_t stats_client_msgs = 0;
+static uint64_t stats_client_bytes = 0;
+static uint64_t stats_clients_queued = 0;
+static uint64_t stats_client_msgs_unknown = 0;
+static struct stats_top_list stats_top_msgs = {NULL, 0, false};
+static struct stats_top_list stats_top_bytes = {NULL, 0, true};
+
+static uint64_t stats_subscriptions = 0;
+
+static uint64_t stats_retained = 0;
+static uint64_t stats_retained_bytes = 0;
+static struct stats_top_list stats_top_topics = {NULL, 0, true};
+
+static int _stats_bucket(uint32_t size)
+{
+	int e = 0;
+
+	if(size < 16) return size;
+	while((size >> e) > 1) e++;
+	return 16 + (e-4)*8 + ((size >> (e-3)) & 7);
+}
+
+/* The largest size that falls in a bucket. */
+static uint64_t _stats_bucket_max(int bucket)
+{
+	int e;
+
+	if(bucket < 16) return bucket;
+	e = (bucket-16)/8 + 4;
+	return ((uint64_t)(8 + (bucket-16)%8 + 1) << (e-3)) - 1;
+}
+
+static uint64_t _stats_percentile(uint64_t count, int percent)
+{
+	uint64_t seen = 0;
+	uint64_t rank;
+	int i;
+
+	if(!count) return 0;
+	rank = (count*percent + 99)/100;
+	for(i=0; i<STATS_BUCKETS; i++){
+		seen += stats_payload_buckets[i];
+		if(seen >= rank){
+			return _stats_bucket_max(i);
+		}
+	}
+	return stats_payload_max;
+}
+
+static uint64_t _stats_store_hash(dbid_t id)
+{
+	uint64_t h = (uint64_t)id;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* Find the entry for id, or the empty slot where it belongs. */
+static struct stats_store *_stats_store_slot(dbid_t id)
+{
+	uint64_t i;
+
+	i = _stats_store_hash(id) & (stats_store_size-1);
+	while(stats_stores[i].id && stats_stores[i].id != id){
+		i = (i+1) & (stats_store_size-1);
+	}
+	return &stats_stores[i];
+}
+
+static struct stats_store *_stats_store_find(dbid_t id)
+{
+	struct stats_store *store;
+
+	if(!stats_store_size || !id) return NULL;
+	store = _stats_store_slot(id);
+	return store->id ? store : NULL;
+}
+
+static int _stats_store_add(dbid_t id, uint32_t payloadlen)
+{
+	struct stats_store *old_stores, *store;
+	uint64_t old_size, i;
+
+	if(!id) return 0;
+	if((stats_store_count+1)*2 > stats_store_size){
+		old_stores = stats_stores;
+		old_size = stats_store_size;
+		stats_store_size = old_size ? old_size*2 : 1024;
+		stats_stores = calloc(stats_store_size, sizeof(struct stats_store));
+		if(!stats_stores){
+			fprintf(stderr, "Error: Out of memory.");
+			return 1;
+		}
+		for(i=0; i<old_size; i++){
+			if(old_stores[i].id){
+				*_stats_store_slot(old_stores[i].id) = old_stores[i];
+			}
+		}
+		free(old_stores);
+	}
+	store = _stats_store_slot(id);
+	if(!store->id){
+		store->id = id;
+		stats_store_count++;
+	}
+	store->payloadlen = payloadlen;
+	return 0;
+}
+
+/* Offer an entry to a top-N list, kept as a min-heap on the ranking value so
+ * the smallest is replaced first. name is copied if it is kept. */
+static int _stats_top_offer(struct stats_top_list *list, const char *name, uint64_t count, uint64_t bytes)
+{
+	struct stats_top item, tmp;
+	uint64_t value;
+	int i, child;
+
+	value = list->by_bytes ? bytes : count;
+	if(list->count == stats_top_n){
+		if(!stats_top_n || value <= (list->by_bytes ? list->items[0].bytes : list->items[0].count)){
+			return 0;
+		}
+		free(list->items[0].name);
+		list->count--;
+		list->items[0] = list->items[list->count];
+		/* Sift down. */
+		i = 0;
+		while((child = 2*i+1) < list->count){
+			if(child+1 < list->count
+					&& (list->by_bytes ? list->items[child+1].bytes < list->items[child].bytes
+						: list->items[child+1].count < list->items[child].count)){
+				child++;
+			}
+			if(list->by_bytes ? list->items[i].bytes <= list->items[child].bytes
+					: list->items[i].count <= list->items[child].count){
+				break;
+			}
+			tmp = list->items[i];
+			list->items[i] = list->items[child];
+			list->items[child] = tmp;
+			i = child;
+		}
+	}
+	if(!list->items){
+		list->items = calloc(stats_top_n, sizeof(struct stats_top));
+		if(!list->items){
+			fprintf(stderr, "Error: Out of memory.");
+			return 1;
+		}
+	}
+	item.name = strdup(name);
+	if(!item.name){
+		fprintf(stderr, "Error: Out of memory.");
+		return 1;
+	}
+	item.count = count;
+	item.bytes = bytes;
+	/* Sift up. */
+	i = list->count++;
+	list->items[i] = item;
+	while(i > 0){
+		child = i;
+		i = (i-1)/2;
+		if(list->by_bytes ? list->items[i].bytes <= list->items[child].bytes
+				: list->items[i].count <= list->items[child].count){
+			break;
+		}
+		tmp = list->items[i];
+		list->items[i] = list->items[child];
+		list->items[child] = tmp;
+	}
+	return 0;
+}
+
+/* Finish the totals for the client whose messages have just been read. */
+static int _stats_client_end(void)
+{
+	int rc = 0;
+
+	if(!stats_client_id) return 0;
+	stats_clients_queued++;
+	if(_stats_top_offer(&stats_top_msgs, stats_client_id, stats_client_msgs, stats_client_bytes)
+			|| _stats_top_offer(&stats_top_bytes, stats_client_id, stats_client_msgs, stats_client_bytes)){
+		rc = 1;
+	}
+	free(stats_client_id);
+	stats_client_id = NULL;
+	stats_client_msgs = 0;
+	stats_client_bytes = 0;
+	return rc;
+}
+
+/* Read a length prefixed string. With str NULL it is skipped. */
+static int _stats_string_read(FILE *db_fd, char **str)
+{
+	uint16_t i16temp, slen;
+
+	read_e(db_fd, &i16temp, sizeof(uint16_t));
+	slen = ntohs(i16temp);
+	if(!str){
+		return fseek(db_fd, slen, SEEK_CUR);
+	}
+	*str = calloc(slen+1, sizeof(char));
+	if(!*str){
+		fprintf(stderr, "Error: Out of memory.");
+		return 1;
+	}
+	read_e(db_fd, *str, slen);
+	return 0;
+error:
+	fprintf(stderr, "Error: Corrupt persistent database.");
+	if(str && *str){
+		free(*str);
+		*str = NULL;
+	}
+	return 1;
+}
+
+/* Read the parts of a message store chunk needed for statistics. topic may be
+ * NULL if it isn't wanted. */
+static int _stats_msg_store_read(FILE *db_fd, dbid_t *store_id, char **topic, uint32_t *payloadlen)
+{
+	uint32_t i32temp;
+	uint16_t i16temp;
+	uint8_t i8temp;
+
+	read_e(db_fd, store_id, sizeof(dbid_t));
+	if(_stats_string_read(db_fd, NULL)) return 1; /* source id */
+	read_e(db_fd, &i16temp, sizeof(uint16_t)); /* source mid */
+	read_e(db_fd, &i16temp, sizeof(uint16_t)); /* mid */
+	if(_stats_string_read(db_fd, topic)) return 1;
+	read_e(db_fd, &i8temp, sizeof(uint8_t)); /* qos */
+	read_e(db_fd, &i8temp, sizeof(uint8_t)); /* retain */
+	read_e(db_fd, &i32temp, sizeof(uint32_t));
+	*payloadlen = ntohl(i32temp);
+	return 0;
+error:
+	fprintf(stderr, "Error: Corrupt persistent database.");
+	if(topic && *topic){
+		free(*topic);
+		*topic = NULL;
+	}
+	return 1;
+}
+
+static int _stats_chunk(struct mosquitto_db *db, FILE *db_fd, uint16_t chunk, uint32_t length)
+{
+	struct stats_store *store;
+	dbid_t store_id;
+	uint32_t payloadlen;
+	uint32_t count;
+	char *client_id = NULL;
+
+	stats_chunk_count[chunk < STATS_CHUNK_TYPES ? chunk : STATS_CHUNK_TYPES]++;
+	stats_chunk_bytes[chunk < STATS_CHUNK_TYPES ? chunk : STATS_CHUNK_TYPES] += length;
+
+	switch(chunk){
+		case DB_CHUNK_MSG_STORE:
+			if(_stats_msg_store_read(db_fd, &store_id, NULL, &payloadlen)) goto error;
+			if(_stats_store_add(store_id, payloadlen)) goto error;
+			stats_payload_buckets[_stats_bucket(payloadlen)]++;
+			stats_payload_bytes += payloadlen;
+			if(payloadlen > stats_payload_max) stats_payload_max = payloadlen;
+			break;
+
+		case DB_CHUNK_CLIENT_MSG:
+			if(_stats_string_read(db_fd, &client_id)) goto error;
+			read_e(db_fd, &store_id, sizeof(dbid_t));
+			if(!stats_client_id || strcmp(stats_client_id, client_id)){
+				if(_stats_client_end()) goto error;
+				stats_client_id = client_id;
+				client_id = NULL;
+			}else{
+				free(client_id);
+				client_id = NULL;
+			}
+			stats_client_msgs++;
+			store = _stats_store_find(store_id);
+			if(store){
+				if(store->ref_count < UINT16_MAX) store->ref_count++;
+				stats_client_bytes += store->payloadlen;
+			}else{
+				stats_client_msgs_unknown++;
+			}
+			break;
+
+		case DB_CHUNK_SUB:
+			stats_subscriptions++;
+			break;
+
+		case DB_CHUNK_CLIENT_SUBS:
+			if(_stats_string_read(db_fd, NULL)) goto error;
+			read_e(db_fd, &count, sizeof(uint32_t));
+			stats_subscriptions += ntohl(count);
+			break;
+
+		case DB_CHUNK_RETAIN:
+			read_e(db_fd, &store_id, sizeof(dbid_t));
+			stats_retained++;
+			store = _stats_store_find(store_id);
+			if(store){
+				if(store->ref_count < UINT16_MAX) store->ref_count++;
+				store->retained = true;
+				stats_retained_bytes += store->payloadlen;
+			}
+			break;
+
+		default:
+			break;
+	}
+	return 0;
+error:
+	if(client_id) free(client_id);
+	fclose(db_fd);
+	return 1;
+}
+
+/* Second pass, only made if there are retained messages, to find their
+ * topics. */
+static int _stats_retained_chunk(struct mosquitto_db *db, FILE *db_fd, uint16_t chunk, uint32_t length)
+{
+	struct stats_store *store;
+	dbid_t store_id;
+	uint32_t payloadlen;
+	char *topic = NULL;
+	int rc;
+
+	if(chunk != DB_CHUNK_MSG_STORE) return 0;
+
+	if(_stats_msg_store_read(db_fd, &store_id, &topic, &payloadlen)){
+		fclose(db_fd);
+		return 1;
+	}
+	store = _stats_store_find(store_id);
+	rc = 0;
+	if(store && store->retained){
+		rc = _stats_top_offer(&stats_top_topics, topic, 1, payloadlen);
+	}
+	free(topic);
+	if(rc) fclose(db_fd);
+	return rc;
+}
+
+static void _json_string_print(const char *str)
+{
+	const unsigned char *c;
+
+	putchar('"');
+	for(c=(const unsigned char *)str; *c; c++){
+		if(*c == '"' || *c == '\\'){
+			printf("\\%c", *c);
+		}else if(*c < 0x20){
+			printf("\\u%04x", *c);
+		}else{
+			putchar(*c);
+		}
+	}
+	putchar('"');
+}
+
+static int _stats_top_cmp(const void *a, const void *b, bool by_bytes)
+{
+	const struct stats_top *ta = a, *tb = b;
+	uint64_t va, vb;
+
+	va = by_bytes ? ta->bytes : ta->count;
+	vb = by_bytes ? tb->bytes : tb->count;
+	if(va != vb) return va < vb ? 1 : -1;
+	return strcmp(ta->name, tb->name);
+}
+
+static int _stats_top_cmp_count(const void *a, const void *b)
+{
+	return _stats_top_cmp(a, b, false);
+}
+
+static int _stats_top_cmp_bytes(const void *a, const void *b)
+{
+	return _stats_top_cmp(a, b, true);
+}
+
+/* Print a top-N list, largest first, and free it. */
+static void _stats_top_print(struct stats_top_list *list, const char *name_key, const char *count_key, const char *bytes_key)
+{
+	int i;
+
+	qsort(list->items, list->count, sizeof(struct stats_top),
+			list->by_bytes ? _stats_top_cmp_bytes : _stats_top_cmp_count);
+	printf("[");
+	for(i=0; i<list->count; i++){
+		printf("%s\n\t\t\t{", i?",":"");
+		_json_string_print(name_key);
+		printf(": ");
+		_json_string_print(list->items[i].name);
+		if(count_key){
+			printf(", \"%s\": %llu", count_key, (unsigned long long)list->items[i].count);
+		}
+		printf(", \"%s\": %llu}", bytes_key, (unsigned long long)list->items[i].bytes);
+		free(list->items[i].name);
+	}
+	printf("%s]", list->count?"\n\t\t":"");
+	free(list->items);
+	list->items = NULL;
+	list->count = 0;
+}
+
+static void _stats_print(const char *filename, long file_size)
+{
+	const char *names[STATS_CHUNK_TYPES+1] = {
+		NULL, "cfg", "msg_store", "client_msg", "retain", "sub", "client",
+		"wal_gen", NULL, NULL, NULL, NULL, NULL, NULL, NULL, "block", "client_subs",
+		"unknown"
+	};
+	uint64_t orphaned = 0, orphaned_bytes = 0;
+	uint64_t i;
+	bool first;
+	int t;
+
+	for(i=0; i<stats_store_size; i++){
+		if(stats_stores[i].id && stats_stores[i].ref_count == 0){
+			orphaned++;
+			orphaned_bytes += stats_stores[i].payloadlen;
+		}
+	}
+
+	printf("{\n");
+	printf("\t\"file\": ");
+	_json_string_print(filename);
+	printf(",\n\t\"file_size\": %ld,\n", file_size);
+	printf("\t\"version\": %u,\n", db_version);
+
+	printf("\t\"chunks\": {");
+	first = true;
+	for(t=0; t<=STATS_CHUNK_TYPES; t++){
+		if(!names[t]) continue;
+		printf("%s\n\t\t\"%s\": {\"count\": %llu, \"bytes\": %llu}", first?"":",", names[t],
+				(unsigned long long)stats_chunk_count[t], (unsigned long long)stats_chunk_bytes[t]);
+		first = false;
+	}
+	printf("\n\t},\n");
+
+	printf("\t\"payloads\": {\"count\": %llu, \"total_bytes\": %llu, \"max\": %u, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu},\n",
+			(unsigned long long)stats_store_count, (unsigned long long)stats_payload_bytes, stats_payload_max,
+			(unsigned long long)_stats_percentile(stats_store_count, 50),
+			(unsigned long long)_stats_percentile(stats_store_count, 90),
+			(unsigned long long)_stats_percentile(stats_store_count, 99));
+
+	printf("\t\"orphaned_stores\": {\"count\": %llu, \"bytes\": %llu},\n",
+			(unsigned long long)orphaned, (unsigned long long)orphaned_bytes);
+
+	printf("\t\"clients\": {\n");
+	printf("\t\t\"count\": %llu,\n", (unsigned long long)stats_chunk_count[DB_CHUNK_CLIENT]);
+	printf("\t\t\"with_queued_messages\": %llu,\n", (unsigned long long)stats_clients_queued);
+	printf("\t\t\"queued_messages_missing_store\": %llu,\n", (unsigned long long)stats_client_msgs_unknown);
+	printf("\t\t\"top_by_messages\": ");
+	_stats_top_print(&stats_top_msgs, "id", "messages", "bytes");
+	printf(",\n\t\t\"top_by_bytes\": ");
+	_stats_top_print(&stats_top_bytes, "id", "messages", "bytes");
+	printf("\n\t},\n");
+
+	printf("\t\"subscriptions\": {\"count\": %llu},\n", (unsigned long long)stats_subscriptions);
+
+	printf("\t\"retained\": {\n");
+	printf("\t\t\"count\": %llu,\n", (unsigned long long)stats_retained);
+	printf("\t\t\"bytes\": %llu,\n", (unsigned long long)stats_retained_bytes);
+	printf("\t\t\"top_topics_by_bytes\": ");
+	_stats_top_print(&stats_top_topics, "topic", NULL, "bytes");
+	printf("\n\t}\n");
+	printf("}\n");
+}
+
+static int _stats_run(struct mosquitto_db *db, FILE *fd, const char *filename, long data_start)
+{
+	long file_size;
+
+	if(fseek(fd, 0, SEEK_END)) goto error;
+	file_size = ftell(fd);
+	if(fseek(fd, data_start, SEEK_SET)) goto error;
+
+	if(_db_chunks_read(db, fd, db_version >= 4, _stats_chunk)) return 1;
+	if(_stats_client_end()) return 1;
+	if(stats_retained){
+		if(fseek(fd, data_start, SEEK_SET)) goto error;
+		if(_db_chunks_read(db, fd, db_version >= 4, _stats_retained_chunk)) return 1;
+	}
+	_stats_print(filename, file_size);
+	free(stats_stores);
+	return 0;
+error:
+	fprintf(stderr, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: db_dump [--stats [--top <n>]] <mosquitto db filename>\n");
+	fprintf(stderr, " --stats : print a summary of the database as JSON instead of every chunk.\n");
+	fprintf(stderr, " --top : the number of clients and topics listed in the summary. Defaults to 10.\n");
+}
+
 int main(int argc, char *argv[])
 {
 	FILE *fd;
 	char header[15];
 	int rc = 0;
-	uint32_t crc;
-	dbid_t i64temp;
-	uint32_t i32temp, length;
-	uint16_t i16temp, chunk;
-	uint8_t i8temp;
-	ssize_t rlen;
+	uint32_t crc, i32temp;
 	struct mosquitto_db db;
+	bool stats = false;
+	char *filename = NULL;
+	int i;
 
-	if(argc != 2){
-		fprintf(stderr, "Usage: db_dump <mosquitto db filename>\n");
+	for(i=1; i<argc; i++){
+		if(!strcmp(argv[i], "--stats")){
+			stats = true;
+		}else if(!strcmp(argv[i], "--top")){
+			if(i == argc-1){
+				print_usage();
+				return 1;
+			}
+			stats_top_n = atoi(argv[i+1]);
+			if(stats_top_n < 0){
+				print_usage();
+				return 1;
+			}
+			i++;
+		}else if(!filename){
+			filename = argv[i];
+		}else{
+			print_usage();
+			return 1;
+		}
+	}
+	if(!filename){
+		print_usage();
 		return 1;
 	}
 	memset(&db, 0, sizeof(struct mosquitto_db));
-	fd = fopen(argv[1], "rb");
+	fd = fopen(filename, "rb");
 	if(!fd) return 0;
 	read_e(fd, &header, 15);
 	if(!memcmp(header, magic, 15)){
-		printf("Mosquitto DB dump\n");
-		// Restore DB as normal
 		read_e(fd, &crc, sizeof(uint32_t));
-		printf("CRC: %d\n", crc);
+		crc = ntohl(crc);
 		read_e(fd, &i32temp, sizeof(uint32_t));
 		db_version = ntohl(i32temp);
-		printf("DB version: %d\n", db_version);
-
-		while(rlen = fread(&i16temp, sizeof(uint16_t), 1, fd), rlen == 1){
-			chunk = ntohs(i16temp);
-			read_e(fd, &i32temp, sizeof(uint32_t));
-			length = ntohl(i32temp);
-			switch(chunk){
-				case DB_CHUNK_CFG:
-					printf("DB_CHUNK_CFG:\n");
-					printf("\tLength: %d\n", length);
-					read_e(fd, &i8temp, sizeof(uint8_t)); // shutdown
-					printf("\tShutdown: %d\n", i8temp);
-					read_e(fd, &i8temp, sizeof(uint8_t)); // sizeof(dbid_t)
-					printf("\tDB ID size: %d\n", i8temp);
-					if(i8temp != sizeof(dbid_t)){
-						fprintf(stderr, "Error: Incompatible database configuration (dbid size is %d bytes, expected %ld)",
-								i8temp, sizeof(dbid_t));
-						fclose(fd);
-						return 1;
-					}
-					read_e(fd, &i64temp, sizeof(dbid_t));
-					printf("\tLast DB ID: %ld\n", (long)i64temp);
-					break;
-
-				case DB_CHUNK_MSG_STORE:
-					printf("DB_CHUNK_MSG_STORE:\n");
-					printf("\tLength: %d\n", length);
-					if(_db_msg_store_chunk_restore(&db, fd)) return 1;
-					break;
-
-				case DB_CHUNK_CLIENT_MSG:
-					printf("DB_CHUNK_CLIENT_MSG:\n");
-					printf("\tLength: %d\n", length);
-					if(_db_client_msg_chunk_restore(&db, fd)) return 1;
-					break;
-
-				case DB_CHUNK_RETAIN:
-					printf("DB_CHUNK_RETAIN:\n");
-					printf("\tLength: %d\n", length);
-					if(_db_retain_chunk_restore(&db, fd)) return 1;
-					break;
-
-				case DB_CHUNK_SUB:
-					printf("DB_CHUNK_SUB:\n");
-					printf("\tLength: %d\n", length);
-					if(_db_sub_chunk_restore(&db, fd)) return 1;
-					break;
-
-				case DB_CHUNK_CLIENT:
-					printf("DB_CHUNK_CLIENT:\n");
-					printf("\tLength: %d\n", length);
-					if(_db_client_chunk_restore(&db, fd)) return 1;
-					break;
-
-				default:
-					fprintf(stderr, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
-					fseek(fd, length, SEEK_CUR);
-					break;
-			}
+		if(!stats){
+			printf("Mosquitto DB dump\n");
+			printf("CRC: %u\n", crc);
+			printf("DB version: %d\n", db_version);
+		}
+		if(db_version >= 4
+				&& crc != _mosquitto_crc32c(_mosquitto_crc32c(0, magic, 15), &i32temp, sizeof(uint32_t))){
+			fprintf(stderr, "Error: Header CRC mismatch.");
+			fclose(fd);
+			return 1;
+		}
+
+		if(stats){
+			rc = _stats_run(&db, fd, filename, 15+2*sizeof(uint32_t));
+		}else{
+			rc = _db_chunks_read(&db, fd, db_version >= 4, _db_chunk_dump);
 		}
-		if(rlen < 0) goto error;
 	}else{
 		fprintf(stderr, "Error: Unrecognised file format.");
 		rc = 1;
@@ -409,4 +1207,3 @@ error:
 	if(fd >= 0) fclose(fd);
 	return 1;
 }
-
@@ -32,6 +32,9 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifndef WIN32
 #include <syslog.h>
 #endif
+#ifdef WITH_THREADING
+#include <pthread.h>
+#endif
 
 #ifndef CMAKE
 #include <config.h>
@@ -60,6 +63,10 @@ HANDLE syslog_h;
  */
 static int log_destinations = MQTT3_LOG_STDERR;
 static int log_priorities = MOSQ_LOG_ERR | MOSQ_LOG_WARNING | MOSQ_LOG_NOTICE | MOSQ_LOG_INFO;
+#ifdef WITH_THREADING
+/* Only the main thread may publish log messages to topics. */
+static pthread_t log_main_thread;
+#endif
 
 int mqtt3_log_init(int priorities, int destinations)
 {
@@ -67,6 +74,9 @@ int mqtt3_log_init(int priorities, int destinations)
 
 	log_priorities = priorities;
 	log_destinations = destinations;
+#ifdef WITH_THREADING
+	log_main_thread = pthread_self();
+#endif
 
 	if(log_destinations & MQTT3_LOG_SYSLOG){
 #ifndef WIN32
@@ -212,7 +222,12 @@ int _mosquitto_log_printf(struct mosquitto *mosq, int priority, const char *fmt,
 			ReportEvent(syslog_h, syslog_priority, 0, 0, NULL, 1, 0, &sp, NULL);
 #endif
 		}
+#ifdef WITH_THREADING
+		if(log_destinations & MQTT3_LOG_TOPIC && priority != MOSQ_LOG_DEBUG
+				&& pthread_equal(pthread_self(), log_main_thread)){
+#else
 		if(log_destinations & MQTT3_LOG_TOPIC && priority != MOSQ_LOG_DEBUG){
+#endif
 			if(int_db.config && int_db.config->log_timestamp){
 				len += 30;
 				st = _mosquitto_malloc(len*sizeof(char));
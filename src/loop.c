@@ -68,9 +68,12 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 	time_t start_time = mosquitto_time();
 	time_t last_backup = mosquitto_time();
 	time_t last_store_clean = mosquitto_time();
+	time_t last_memory_check = mosquitto_time();
+	time_t last_expiry_check = mosquitto_time();
 	time_t now;
 	int time_count;
 	int fdcount;
+	int poll_timeout;
 #ifndef WIN32
 	sigset_t sigblock, origsig;
 #endif
@@ -78,6 +81,10 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 	struct pollfd *pollfds = NULL;
 	int pollfd_count = 0;
 	int pollfd_index;
+	int auth_pollfd_index;
+#ifdef WITH_TLS
+	int handshake_pollfd_index;
+#endif
 #ifdef WITH_BRIDGE
 	int bridge_sock;
 	int rc;
@@ -95,8 +102,10 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 		}
 #endif
 
-		if(listensock_count + db->context_count > pollfd_count || !pollfds){
-			pollfd_count = listensock_count + db->context_count;
+		/* The listening sockets, the auth and handshake wake up pipes and the
+		 * clients. */
+		if(listensock_count + 2 + db->context_count > pollfd_count || !pollfds){
+			pollfd_count = listensock_count + 2 + db->context_count;
 			pollfds = _mosquitto_realloc(pollfds, sizeof(struct pollfd)*pollfd_count);
 			if(!pollfds){
 				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
@@ -114,6 +123,27 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 			pollfd_index++;
 		}
 
+		/* Woken when asynchronous authentication checks complete. */
+		auth_pollfd_index = -1;
+		if(mosquitto_auth_async_sock() != -1){
+			auth_pollfd_index = pollfd_index;
+			pollfds[pollfd_index].fd = mosquitto_auth_async_sock();
+			pollfds[pollfd_index].events = POLLIN;
+			pollfds[pollfd_index].revents = 0;
+			pollfd_index++;
+		}
+#ifdef WITH_TLS
+		/* Woken when TLS handshakes run on the workers finish. */
+		handshake_pollfd_index = -1;
+		if(mqtt3_tls_handshake_sock() != -1){
+			handshake_pollfd_index = pollfd_index;
+			pollfds[pollfd_index].fd = mqtt3_tls_handshake_sock();
+			pollfds[pollfd_index].events = POLLIN;
+			pollfds[pollfd_index].revents = 0;
+			pollfd_index++;
+		}
+#endif
+
 		time_count = 0;
 		for(i=0; i<db->context_count; i++){
 			if(db->contexts[i]){
@@ -148,9 +178,20 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 							|| db->contexts[i]->bridge
 							|| now - db->contexts[i]->last_msg_in < (time_t)(db->contexts[i]->keepalive)*3/2){
 
+#ifdef WITH_PERSISTENCE
+						if(db->contexts[i]->spill){
+							mqtt3_spill_drain(db, db->contexts[i]);
+						}
+#endif
 						if(mqtt3_db_message_write(db->contexts[i]) == MOSQ_ERR_SUCCESS){
 							pollfds[pollfd_index].fd = db->contexts[i]->sock;
-							pollfds[pollfd_index].events = POLLIN;
+							if(db->contexts[i]->auth_request){
+								/* Don't read anything more until the held
+								 * packet has been checked. */
+								pollfds[pollfd_index].events = 0;
+							}else{
+								pollfds[pollfd_index].events = POLLIN;
+							}
 							pollfds[pollfd_index].revents = 0;
 							if(db->contexts[i]->current_out_packet){
 								pollfds[pollfd_index].events |= POLLOUT;
@@ -243,12 +284,19 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 
 		mqtt3_db_message_timeout_check(db, db->config->retry_interval);
 
+		poll_timeout = 100;
+#ifdef WITH_PERSISTENCE
+		/* Wake up in time to send acknowledgements held for the write-ahead
+		 * log. */
+		i = mqtt3_wal_ack_wait(db);
+		if(i >= 0 && i < poll_timeout) poll_timeout = i;
+#endif
 #ifndef WIN32
 		sigprocmask(SIG_SETMASK, &sigblock, &origsig);
-		fdcount = poll(pollfds, pollfd_index, 100);
+		fdcount = poll(pollfds, pollfd_index, poll_timeout);
 		sigprocmask(SIG_SETMASK, &origsig, NULL);
 #else
-		fdcount = WSAPoll(pollfds, pollfd_index, 100);
+		fdcount = WSAPoll(pollfds, pollfd_index, poll_timeout);
 #endif
 		if(fdcount == -1){
 			loop_handle_errors(db, pollfds);
@@ -261,6 +309,14 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 					}
 				}
 			}
+			if(auth_pollfd_index != -1 && pollfds[auth_pollfd_index].revents & POLLIN){
+				mosquitto_auth_async_process(db);
+			}
+#ifdef WITH_TLS
+			if(handshake_pollfd_index != -1 && pollfds[handshake_pollfd_index].revents & POLLIN){
+				mqtt3_tls_handshake_process(db);
+			}
+#endif
 		}
 #ifdef WITH_PERSISTENCE
 		if(db->config->persistence && db->config->autosave_interval){
@@ -277,25 +333,46 @@ int mosquitto_main_loop(struct mosquitto_db *db, int *listensock, int listensock
 			}
 		}
 #endif
+		if(db->config->message_expiry_count && last_expiry_check != mosquitto_time()){
+			mqtt3_db_message_expire(db);
+			last_expiry_check = mosquitto_time();
+		}
 		if(!db->config->store_clean_interval || last_store_clean + db->config->store_clean_interval < mosquitto_time()){
 			mqtt3_db_store_clean(db);
 			last_store_clean = mosquitto_time();
 		}
+		if(db->config->memory_limit && last_memory_check != mosquitto_time()){
+			mqtt3_db_memory_limit_check(db);
+			last_memory_check = mosquitto_time();
+		}
 #ifdef WITH_PERSISTENCE
 		if(flag_db_backup){
 			mqtt3_db_backup(db, false, false);
 			flag_db_backup = false;
 		}
+		mqtt3_db_backup_check(db);
+		mqtt3_wal_sync(db);
 #endif
 		if(flag_reload){
 			_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Reloading config.");
 			mqtt3_config_read(db->config, true);
-			mosquitto_security_cleanup(db, true);
-			mosquitto_security_init(db, true);
-			mosquitto_security_apply(db);
+			/* Before the security files are read on another thread, which
+			 * may log while this changes the settings. */
 			mqtt3_log_init(db->config->log_type, db->config->log_dest);
+			mosquitto_security_reload(db);
+#ifdef WITH_TLS
+			mqtt3_tls_session_reload();
+#endif
+			for(i=0; i<db->context_count; i++){
+				if(db->contexts[i]){
+					mqtt3_db_limits_context_set(db, db->contexts[i]);
+				}
+			}
 			flag_reload = false;
 		}
+		if(mosquitto_security_reload_finish(db)){
+			mqtt3_subs_acl_classify(db, &db->subs);
+		}
 		if(flag_tree_print){
 			mqtt3_sub_tree_print(&db->subs, 0);
 			flag_tree_print = false;
@@ -329,6 +406,12 @@ static void loop_handle_errors(struct mosquitto_db *db, struct pollfd *pollfds)
 		if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET){
 			if(pollfds[db->contexts[i]->pollfd_index].revents & (POLLERR | POLLNVAL)){
 				do_disconnect(db, i);
+			}else if(db->contexts[i]->auth_request
+					&& pollfds[db->contexts[i]->pollfd_index].revents & POLLHUP){
+
+				/* Not reading, so the hang up would otherwise be reported
+				 * on every poll until the check completes. */
+				do_disconnect(db, i);
 			}
 		}
 	}
@@ -364,6 +447,13 @@ static void loop_handle_reads_writes(struct mosquitto_db *db, struct pollfd *pol
 				if(_mosquitto_packet_read(db, db->contexts[i])){
 					do_disconnect(db, i);
 				}
+#ifdef WITH_TLS
+				if(db->contexts[i] && db->contexts[i]->tls_handshaking
+						&& db->contexts[i]->ssl && SSL_is_init_finished(db->contexts[i]->ssl)){
+
+					mqtt3_tls_handshake_end(db->contexts[i]);
+				}
+#endif
 			}
 		}
 		if(db->contexts[i] && db->contexts[i]->sock != INVALID_SOCKET){
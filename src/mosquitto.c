@@ -254,6 +254,12 @@ int main(int argc, char *argv[])
 	if(rc) return rc;
 	rc = mosquitto_security_init(&int_db, false);
 	if(rc) return rc;
+#ifdef WITH_TLS
+	rc = mqtt3_tls_session_init(&config);
+	if(rc) return rc;
+	rc = mqtt3_tls_handshake_init(&int_db);
+	if(rc) return rc;
+#endif
 
 #ifdef WITH_SYS_TREE
 	if(config.sys_interval > 0){
@@ -329,6 +335,10 @@ int main(int argc, char *argv[])
 
 	run = 1;
 	rc = mosquitto_main_loop(&int_db, listensock, listensock_count, listener_max);
+#ifdef WITH_TLS
+	/* Close the connections still owned by the handshake workers. */
+	mqtt3_tls_handshake_cleanup();
+#endif
 
 	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "mosquitto version %s terminating", VERSION);
 	mqtt3_log_close();
@@ -369,6 +379,9 @@ int main(int argc, char *argv[])
 
 	_mosquitto_net_cleanup();
 	mqtt3_config_cleanup(int_db.config);
+#ifdef WITH_TLS
+	mqtt3_tls_session_cleanup();
+#endif
 
 	return rc;
 }
@@ -54,11 +54,36 @@ POSSIBILITY OF SUCH DAMAGE.
 
 typedef uint64_t dbid_t;
 
+enum mqtt3_memory_policy{
+	mp_drop_newest = 0,
+	mp_drop_oldest_qos0 = 1,
+	mp_reject_heaviest_producer = 2,
+	mp_disconnect_largest_consumer = 3
+};
+
+enum mqtt3_persistence_fsync{
+	pf_none = 0,
+	pf_file = 1,
+	pf_directory = 2
+};
+
+struct _mqtt3_queue_bytes_user{
+	char *pattern;
+	unsigned long max_queued_bytes;
+};
+
+struct _mqtt3_message_expiry{
+	char *topic;
+	time_t expiry;
+};
+
 struct _mqtt3_listener {
 	int fd;
 	char *host;
 	uint16_t port;
 	int max_connections;
+	unsigned long max_queued_bytes;
+	bool queue_conflate_all;
 	char *mount_point;
 	int *socks;
 	int sock_count;
@@ -75,12 +100,17 @@ struct _mqtt3_listener {
 	char *crlfile;
 	bool use_identity_as_username;
 	char *tls_version;
+	bool tls_ktls;
+	int max_handshakes;
+	int handshake_count;
 #endif
 };
 
 struct mqtt3_config {
 	char *config_file;
 	char *acl_file;
+	int acl_cache_size;
+	int acl_cache_ttl;
 	bool allow_anonymous;
 	bool allow_duplicate_messages;
 	bool allow_zero_length_clientid;
@@ -99,6 +129,12 @@ struct mqtt3_config {
 	bool log_timestamp;
 	char *log_file;
 	FILE *log_fptr;
+	struct _mqtt3_queue_bytes_user *queue_bytes_users;
+	int queue_bytes_user_count;
+	unsigned long memory_limit;
+	enum mqtt3_memory_policy memory_limit_policy;
+	struct _mqtt3_message_expiry *message_expiries;
+	int message_expiry_count;
 	int message_size_limit;
 	char *password_file;
 	bool persistence;
@@ -106,9 +142,23 @@ struct mqtt3_config {
 	char *persistence_file;
 	char *persistence_filepath;
 	time_t persistent_client_expiration;
+	bool persistence_background;
+	bool persistence_compression;
+	enum mqtt3_persistence_fsync persistence_fsync;
+	bool persistence_lazy_load;
+	char **persistence_durable_topics;
+	int persistence_durable_topic_count;
+	bool persistence_wal;
+	int persistence_wal_commit_count;
+	int persistence_wal_commit_interval;
+	unsigned long persistence_wal_max_size;
+	int persistence_wal_sync_interval;
 	char *pid_file;
 	char *psk_file;
+	char **queue_conflate_topics;
+	int queue_conflate_topic_count;
 	bool queue_qos0_messages;
+	int queue_spill_threshold;
 	int retry_interval;
 	int store_clean_interval;
 	int sys_interval;
@@ -122,6 +172,22 @@ struct mqtt3_config {
 	char *auth_plugin;
 	struct mosquitto_auth_opt *auth_options;
 	int auth_option_count;
+	int auth_workers;
+	int password_cache_ttl;
+#ifdef WITH_TLS
+	int tls_session_cache_size;
+	int tls_session_timeout;
+	char *tls_ticket_key_file;
+	int tls_handshake_workers;
+#endif
+};
+
+/* How the READ access of a subscription was classified when it was made.
+ * Messages for mosq_sa_check subscriptions are checked one by one. */
+enum mosquitto_sub_acl {
+	mosq_sa_check = 0,
+	mosq_sa_allow = 1,
+	mosq_sa_deny = 2
 };
 
 struct _mosquitto_subleaf {
@@ -129,6 +195,20 @@ struct _mosquitto_subleaf {
 	struct _mosquitto_subleaf *next;
 	struct mosquitto *context;
 	int qos;
+	enum mosquitto_sub_acl acl;
+	/* The context's acl_generation when acl was set. */
+	unsigned int acl_generation;
+	/* Used by mosquitto_acl_check_batch(). */
+	int acl_result;
+};
+
+/* A subscription read from the persistent database, waiting to be added to
+ * the tree by mqtt3_sub_add_batch(). */
+struct _mosquitto_sub_restore {
+	struct mosquitto *context;
+	char *topic;
+	int qos;
+	int order;
 };
 
 struct _mosquitto_subhier {
@@ -139,14 +219,29 @@ struct _mosquitto_subhier {
 	struct mosquitto_msg_store *retained;
 };
 
+struct _mosquitto_source_id{
+	/* this is the key, stored inline after the struct */
+	char *id;
+	int ref_count;
+	UT_hash_handle hh;
+};
+
+/* Message store entries are allocated as a single block, with the topic and
+ * payload stored inline after the struct. msg.topic and msg.payload point
+ * into that block and must not be freed separately. */
 struct mosquitto_msg_store{
 	struct mosquitto_msg_store *next;
 	dbid_t db_id;
 	int ref_count;
 	char *source_id;
+	struct _mosquitto_source_id *source;
 	char **dest_ids;
 	int dest_id_count;
 	uint16_t source_mid;
+	time_t expiry_time;
+	int expiry_pos;
+	bool conflate;
+	bool persisted;
 	struct mosquitto_message msg;
 };
 
@@ -160,6 +255,53 @@ struct mosquitto_client_msg{
 	enum mosquitto_msg_direction direction;
 	enum mosquitto_msg_state state;
 	bool dup;
+	struct _mosquitto_conflate *conflate;
+};
+
+/* Per client index of conflatable outgoing messages that have not been sent
+ * yet, keyed on the topic of the stored message. */
+struct _mosquitto_conflate{
+	struct mosquitto_client_msg *msg;
+	UT_hash_handle hh;
+};
+
+/* Offline queue overflow for a persistent client. Messages beyond
+ * queue_spill_threshold are appended to a file in persistence_location and
+ * read back in order as the client drains its in-memory queue. Only the file
+ * offsets are kept in memory, and only a limited number of the files are
+ * open at once. */
+struct _mosquitto_spill{
+	FILE *fptr;
+	char *path;
+	uint32_t read_pos;
+	uint32_t write_pos;
+	/* read_pos as last written to the file. */
+	uint32_t header_pos;
+	int count;
+	bool draining;
+	/* The last drain failed to read the file, and is being retried. */
+	bool read_error;
+	/* Written to since the file was last synced. */
+	bool dirty;
+	struct _mosquitto_spill *dirty_next;
+	/* Open files, most recently used first. */
+	struct _mosquitto_spill *open_prev;
+	struct _mosquitto_spill *open_next;
+};
+
+/* Queued messages for a client restored with persistence_lazy_load that are
+ * still only in the database file, as the positions of their chunks. offset
+ * is that of the chunk in the file, or of the block containing it, in which
+ * case inner is its position in the uncompressed block. */
+struct _mosquitto_lazy_msg{
+	long offset;
+	uint32_t inner;
+};
+
+struct _mosquitto_lazy{
+	struct _mosquitto_lazy_msg *msgs;
+	int count;
+	int size;
 };
 
 struct _mosquitto_unpwd{
@@ -169,6 +311,10 @@ struct _mosquitto_unpwd{
 	unsigned int password_len;
 	unsigned char *salt;
 	unsigned int salt_len;
+	/* A keyed hash of the password last verified for this user, and when it
+	 * was verified, or 0. Used for password_cache_ttl. */
+	unsigned char cache_hash[32];
+	time_t cache_time;
 #endif
 	UT_hash_handle hh;
 };
@@ -179,10 +325,33 @@ struct _mosquitto_acl{
 	int access;
 };
 
+/* One topic level of a compiled ACL. Literal levels are hashed in the parent's
+ * children, "+" and "#" levels have their own pointers. access holds the
+ * union of the access of the ACLs that end at this level. */
+struct _mosquitto_acl_node{
+	UT_hash_handle hh;
+	struct _mosquitto_acl_node *children;
+	struct _mosquitto_acl_node *plus;
+	struct _mosquitto_acl_node *hash;
+	char *topic;
+	int access;
+};
+
+/* A cached ACL result for one topic of one client. allowed and denied hold the
+ * access types that have been checked. */
+struct _mosquitto_acl_cache{
+	UT_hash_handle hh;
+	char *topic;
+	time_t added;
+	int allowed;
+	int denied;
+};
+
 struct _mosquitto_acl_user{
 	struct _mosquitto_acl_user *next;
+	UT_hash_handle hh;
 	char *username;
-	struct _mosquitto_acl *acl;
+	struct _mosquitto_acl_node *acl;
 };
 
 struct _mosquitto_auth_plugin{
@@ -196,6 +365,46 @@ struct _mosquitto_auth_plugin{
 	int (*acl_check)(void *user_data, const char *clientid, const char *username, const char *topic, int access);
 	int (*unpwd_check)(void *user_data, const char *username, const char *password);
 	int (*psk_key_get)(void *user_data, const char *hint, const char *identity, char *key, int max_key_len);
+	int (*unpwd_check_async)(void *user_data, const char *username, const char *password, void (*complete)(void *request, int result), void *request);
+	int (*acl_check_async)(void *user_data, const char *clientid, const char *username, const char *topic, int access, void (*complete)(void *request, int result), void *request);
+	int (*acl_check_batch)(void *user_data, const char *topic, int access, const struct mosquitto_acl_client *clients, int *results, int count);
+};
+
+enum mosquitto_auth_request_type {
+	mosq_ar_unpwd = 1,
+	mosq_ar_acl = 2
+};
+
+/* A username/password or topic check that completes after the call that
+ * starts it has returned, either in an asynchronous plugin or on a worker
+ * thread. The fields up to result are used by the check. The rest hold the
+ * packet that is waiting for the result, and are only used on the main
+ * thread. */
+struct _mosquitto_auth_request{
+	struct _mosquitto_auth_request *next;
+	enum mosquitto_auth_request_type type;
+	char *clientid;
+	char *username;
+	char *password;
+	char *topic;
+	int access;
+	int result;
+	/* Set to NULL if the client goes away before the check completes. */
+	struct mosquitto *context;
+	unsigned int acl_generation;
+	/* CONNECT */
+	struct mosquitto_message *will;
+	uint8_t clean_session;
+	uint8_t protocol_version;
+	/* PUBLISH. packet is the received packet, with the payload at
+	 * payload_pos. */
+	uint8_t *packet;
+	uint32_t payload_pos;
+	uint32_t payloadlen;
+	uint16_t mid;
+	uint8_t dup;
+	uint8_t qos;
+	uint8_t retain;
 };
 
 struct _clientid_index_hash{
@@ -211,13 +420,20 @@ struct mosquitto_db{
 	struct _mosquitto_subhier subs;
 	struct _mosquitto_unpwd *unpwd;
 	struct _mosquitto_acl_user *acl_list;
+	/* The users in acl_list by username, and the user for anonymous clients. */
+	struct _mosquitto_acl_user *acl_users;
+	struct _mosquitto_acl_user *acl_anonymous;
 	struct _mosquitto_acl *acl_patterns;
+	/* Incremented when security is reloaded, to invalidate ACL caches. */
+	unsigned int acl_generation;
 	struct _mosquitto_unpwd *psk_id;
 	struct mosquitto **contexts;
 	struct _clientid_index_hash *clientid_index_hash;
 	int context_count;
 	struct mosquitto_msg_store *msg_store;
 	int msg_store_count;
+	struct _mosquitto_source_id *source_ids;
+	int msg_spilled_count;
 	struct mqtt3_config *config;
 	int persistence_changes;
 	struct _mosquitto_auth_plugin auth_plugin;
@@ -328,14 +544,34 @@ int mqtt3_socket_accept(struct mosquitto_db *db, int listensock);
 int mqtt3_socket_listen(struct _mqtt3_listener *listener);
 int _mosquitto_socket_get_address(int sock, char *buf, int len);
 
+/* ============================================================
+ * TLS session and handshake functions
+ * ============================================================ */
+#ifdef WITH_TLS
+int mqtt3_tls_session_init(struct mqtt3_config *config);
+void mqtt3_tls_session_ctx_init(SSL_CTX *ctx);
+void mqtt3_tls_session_reload(void);
+void mqtt3_tls_handshake_counts(unsigned long *full, unsigned long *resumed);
+void mqtt3_tls_session_cleanup(void);
+int mqtt3_tls_handshake_init(struct mosquitto_db *db);
+void mqtt3_tls_handshake_cleanup(void);
+bool mqtt3_tls_handshake_available(struct mosquitto *context);
+int mqtt3_tls_handshake_submit(struct mosquitto *context);
+int mqtt3_tls_handshake_sock(void);
+void mqtt3_tls_handshake_process(struct mosquitto_db *db);
+void mqtt3_tls_handshake_end(struct mosquitto *context);
+#endif
+
 /* ============================================================
  * Read handling functions
  * ============================================================ */
 int mqtt3_packet_handle(struct mosquitto_db *db, struct mosquitto *context);
 int mqtt3_handle_connack(struct mosquitto_db *db, struct mosquitto *context);
 int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context);
+int mqtt3_handle_connect_auth(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_auth_request *request);
 int mqtt3_handle_disconnect(struct mosquitto_db *db, struct mosquitto *context);
 int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context);
+int mqtt3_handle_publish_auth(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_auth_request *request);
 int mqtt3_handle_subscribe(struct mosquitto_db *db, struct mosquitto *context);
 int mqtt3_handle_unsubscribe(struct mosquitto_db *db, struct mosquitto *context);
 
@@ -346,10 +582,17 @@ int mqtt3_db_open(struct mqtt3_config *config, struct mosquitto_db *db);
 int mqtt3_db_close(struct mosquitto_db *db);
 #ifdef WITH_PERSISTENCE
 int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown);
+void mqtt3_db_backup_check(struct mosquitto_db *db);
 int mqtt3_db_restore(struct mosquitto_db *db);
+int mqtt3_db_lazy_load(struct mosquitto_db *db, struct mosquitto *context);
+void mqtt3_db_lazy_discard(struct mosquitto *context);
 #endif
 int mqtt3_db_client_count(struct mosquitto_db *db, unsigned int *count, unsigned int *inactive_count);
 void mqtt3_db_limits_set(int inflight, int queued);
+void mqtt3_db_limits_context_set(struct mosquitto_db *db, struct mosquitto *context);
+bool mqtt3_db_memory_limit_exceeded(struct mosquitto_db *db);
+bool mqtt3_db_message_durable(struct mosquitto_db *db, const char *topic);
+void mqtt3_db_memory_limit_check(struct mosquitto_db *db);
 /* Return the number of in-flight messages in count. */
 int mqtt3_db_message_count(int *count);
 int mqtt3_db_message_delete(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir);
@@ -365,24 +608,71 @@ int mqtt3_db_message_store_find(struct mosquitto *context, uint16_t mid, struct
 /* Check all messages waiting on a client reply and resend if timeout has been exceeded. */
 int mqtt3_db_message_timeout_check(struct mosquitto_db *db, unsigned int timeout);
 int mqtt3_db_message_reconnect_reset(struct mosquitto *context);
+/* Remove queued and retained messages whose expiry time has passed. */
+void mqtt3_db_message_expire(struct mosquitto_db *db);
+void mqtt3_db_expiry_context_add(struct mosquitto *context, struct mosquitto_msg_store *stored);
+void mqtt3_db_expiry_context_remove(struct mosquitto *context);
+void mqtt3_db_expiry_retain_add(struct mosquitto_msg_store *stored);
+struct mosquitto_msg_store *mqtt3_db_expiry_retain_due(time_t now);
+void mqtt3_db_conflate_remove(struct mosquitto *context, struct mosquitto_client_msg *msg);
+int mqtt3_db_conflate_rebuild(struct mosquitto *context);
 int mqtt3_retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos);
 void mqtt3_db_store_clean(struct mosquitto_db *db);
 void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_time);
 void mqtt3_db_vacuum(void);
 
+/* ============================================================
+ * Write-ahead log functions
+ * ============================================================ */
+#ifdef WITH_PERSISTENCE
+void mqtt3_wal_client(struct mosquitto *context);
+void mqtt3_wal_client_delete(struct mosquitto *context);
+void mqtt3_wal_client_msg_add(struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void mqtt3_wal_client_msg_update(struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void mqtt3_wal_client_msg_delete(struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void mqtt3_wal_client_msgs_delete(struct mosquitto *context);
+void mqtt3_wal_sub_add(struct mosquitto *context, const char *sub, int qos);
+void mqtt3_wal_sub_delete(struct mosquitto *context, const char *sub);
+void mqtt3_wal_subs_delete(struct mosquitto *context);
+void mqtt3_wal_retain(const char *topic, struct mosquitto_msg_store *stored);
+int mqtt3_wal_sync(struct mosquitto_db *db);
+int mqtt3_wal_ack(struct mosquitto_db *db, struct mosquitto *context, uint8_t command, uint16_t mid, bool durable);
+void mqtt3_wal_acks_drop(struct mosquitto *context);
+int mqtt3_wal_ack_wait(struct mosquitto_db *db);
+#endif
+
+/* ============================================================
+ * Offline queue spill functions
+ * ============================================================ */
+#ifdef WITH_PERSISTENCE
+int mqtt3_spill_message(struct mosquitto_db *db, struct mosquitto *context, int qos, bool retain, struct mosquitto_msg_store *stored);
+int mqtt3_spill_drain(struct mosquitto_db *db, struct mosquitto *context);
+int mqtt3_spill_restore(struct mosquitto_db *db, struct mosquitto *context);
+int mqtt3_spill_sync(struct mosquitto_db *db, bool headers);
+int mqtt3_spill_flush(struct mosquitto_db *db, bool headers);
+bool mqtt3_spill_dirty(void);
+void mqtt3_spill_close(struct mosquitto_db *db, struct mosquitto *context, bool remove_file);
+#endif
+
 /* ============================================================
  * Subscription functions
  * ============================================================ */
-int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root);
+int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, enum mosquitto_sub_acl acl, struct _mosquitto_subhier *root);
+int mqtt3_sub_add_batch(struct mosquitto_db *db, struct _mosquitto_sub_restore *subs, int count, struct _mosquitto_subhier *root, bool sorted);
+void mqtt3_sub_add_batch_end(void);
 int mqtt3_sub_remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct _mosquitto_subhier *root);
 int mqtt3_sub_search(struct mosquitto_db *db, struct _mosquitto_subhier *root, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored);
 void mqtt3_sub_tree_print(struct _mosquitto_subhier *root, int level);
 int mqtt3_subs_clean_session(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *root);
+int mqtt3_subs_retain_expire(struct mosquitto_db *db, time_t now);
+int mqtt3_subs_acl_classify(struct mosquitto_db *db, struct _mosquitto_subhier *root);
+int mqtt3_retain_set(struct mosquitto_db *db, const char *topic, struct mosquitto_msg_store *stored);
 
 /* ============================================================
  * Context functions
  * ============================================================ */
 struct mosquitto *mqtt3_context_init(int sock);
+int mqtt3_context_add(struct mosquitto_db *db, struct mosquitto *context);
 void mqtt3_context_cleanup(struct mosquitto_db *db, struct mosquitto *context, bool do_free);
 void mqtt3_context_disconnect(struct mosquitto_db *db, struct mosquitto *context);
 
@@ -409,17 +699,45 @@ int mosquitto_security_module_init(struct mosquitto_db *db);
 int mosquitto_security_module_cleanup(struct mosquitto_db *db);
 
 int mosquitto_security_init(struct mosquitto_db *db, bool reload);
-int mosquitto_security_apply(struct mosquitto_db *db);
+int mosquitto_security_reload(struct mosquitto_db *db);
+bool mosquitto_security_reload_finish(struct mosquitto_db *db);
 int mosquitto_security_cleanup(struct mosquitto_db *db, bool reload);
 int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access);
+void mosquitto_acl_cache_cleanup(struct mosquitto *context);
+int mosquitto_acl_cache_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access);
+void mosquitto_acl_cache_store(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access, int result);
+bool mosquitto_acl_batch_available(struct mosquitto_db *db);
+void mosquitto_acl_check_batch(struct mosquitto_db *db, struct _mosquitto_subleaf *leaves, const char *topic, int access);
+enum mosquitto_sub_acl mosquitto_acl_sub_classify(struct mosquitto_db *db, struct mosquitto *context, const char *sub);
 int mosquitto_unpwd_check(struct mosquitto_db *db, const char *username, const char *password);
+int mosquitto_unpwd_cache_check(struct mosquitto_db *db, const char *username, const char *password);
+void mosquitto_unpwd_cache_store(struct mosquitto_db *db, const char *username, const char *password);
 int mosquitto_psk_key_get(struct mosquitto_db *db, const char *hint, const char *identity, char *key, int max_key_len);
 
+int mosquitto_auth_async_init(struct mosquitto_db *db);
+void mosquitto_auth_async_cleanup(struct mosquitto_db *db);
+bool mosquitto_auth_async_available(struct mosquitto_db *db, enum mosquitto_auth_request_type type);
+int mosquitto_auth_async_sock(void);
+void mosquitto_auth_async_process(struct mosquitto_db *db);
+void mosquitto_auth_async_pause(void);
+void mosquitto_auth_async_resume(void);
+struct _mosquitto_auth_request *mosquitto_auth_request_new(struct mosquitto *context, enum mosquitto_auth_request_type type);
+int mosquitto_auth_request_submit(struct mosquitto_db *db, struct _mosquitto_auth_request *request);
+void mosquitto_auth_request_cancel(struct mosquitto *context);
+void mosquitto_auth_request_free(struct _mosquitto_auth_request *request);
+
 int mosquitto_security_init_default(struct mosquitto_db *db, bool reload);
-int mosquitto_security_apply_default(struct mosquitto_db *db);
+int mosquitto_security_reload_start_default(struct mosquitto_db *db);
+bool mosquitto_security_reload_finish_default(struct mosquitto_db *db);
 int mosquitto_security_cleanup_default(struct mosquitto_db *db, bool reload);
 int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access);
+struct _mosquitto_acl_user *mosquitto_acl_user_find_default(struct mosquitto_db *db, const char *username);
+int mosquitto_acl_context_init_default(struct mosquitto_db *db, struct mosquitto *context);
+void mosquitto_acl_context_cleanup_default(struct mosquitto *context);
+enum mosquitto_sub_acl mosquitto_acl_sub_classify_default(struct mosquitto_db *db, struct mosquitto *context, const char *sub);
 int mosquitto_unpwd_check_default(struct mosquitto_db *db, const char *username, const char *password);
+int mosquitto_unpwd_cache_check_default(struct mosquitto_db *db, const char *username, const char *password);
+void mosquitto_unpwd_cache_store_default(struct mosquitto_db *db, const char *username, const char *password);
 int mosquitto_psk_key_get_default(struct mosquitto_db *db, const char *hint, const char *identity, char *key, int max_key_len);
 
 /* ============================================================
@@ -30,7 +30,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifndef MOSQUITTO_PLUGIN_H
 #define MOSQUITTO_PLUGIN_H
 
-#define MOSQ_AUTH_PLUGIN_VERSION 2
+#define MOSQ_AUTH_PLUGIN_VERSION 3
 
 #define MOSQ_ACL_NONE 0x00
 #define MOSQ_ACL_READ 0x01
@@ -41,6 +41,12 @@ struct mosquitto_auth_opt {
 	char *value;
 };
 
+/* One of the clients passed to <mosquitto_auth_acl_check_batch>. */
+struct mosquitto_acl_client {
+	const char *clientid;
+	const char *username;
+};
+
 /*
  * To create an authentication plugin you must include this file then implement
  * the functions listed below. The resulting code should then be compiled as a
@@ -55,6 +61,10 @@ struct mosquitto_auth_opt {
  * The broker will call this function immediately after loading the plugin to
  * check it is a supported plugin version. Your code must simply return
  * MOSQ_AUTH_PLUGIN_VERSION.
+ *
+ * Version 2 plugins are still supported. Version 3 adds the optional
+ * <mosquitto_auth_unpwd_check_async>, <mosquitto_auth_acl_check_async> and
+ * <mosquitto_auth_acl_check_batch> functions.
  */
 int mosquitto_auth_plugin_version(void);
 
@@ -154,6 +164,9 @@ int mosquitto_auth_security_cleanup(void *user_data, struct mosquitto_auth_opt *
  * of MOSQ_ACL_READ (for subscriptions) or MOSQ_ACL_WRITE (for publish). Return
  * MOSQ_ERR_SUCCESS if access was granted, MOSQ_ERR_ACL_DENIED if access was
  * not granted, or MOSQ_ERR_UNKNOWN for an application specific error.
+ *
+ * If the auth_workers option is set, this function is called from several
+ * threads at once and must be thread safe.
  */
 int mosquitto_auth_acl_check(void *user_data, const char *clientid, const char *username, const char *topic, int access);
 
@@ -164,9 +177,85 @@ int mosquitto_auth_acl_check(void *user_data, const char *clientid, const char *
  * MOSQ_ERR_SUCCESS if the user is authenticated, MOSQ_ERR_AUTH if
  * authentication failed, or MOSQ_ERR_UNKNOWN for an application specific
  * error.
+ *
+ * If the auth_workers option is set, this function is called from several
+ * threads at once and must be thread safe.
  */
 int mosquitto_auth_unpwd_check(void *user_data, const char *username, const char *password);
 
+/*
+ * Function: mosquitto_auth_unpwd_check_async
+ *
+ * Optional, version 3 only. If this function is present, the broker calls it
+ * instead of <mosquitto_auth_unpwd_check> when a client connects with a
+ * username. The CONNECT is held while the broker carries on serving other
+ * clients, and is resumed when the plugin calls complete(request, result).
+ *
+ * complete() may be called from any thread, including from within this
+ * function, and must be called exactly once for each accepted request. result
+ * takes the same values as the return value of <mosquitto_auth_unpwd_check>.
+ * Any outstanding requests must be completed before
+ * <mosquitto_auth_plugin_cleanup> returns.
+ *
+ * Parameters:
+ *	user_data : the pointer provided in <mosquitto_auth_plugin_init>.
+ *	username :  the username, valid until complete() is called.
+ *	password :  the password or NULL, valid until complete() is called.
+ *	complete :  the function to call with the result.
+ *	request :   the value to pass to complete().
+ *
+ * Return value:
+ *	Return MOSQ_ERR_SUCCESS if the request was accepted.
+ *	Return any other value to refuse the connection without calling
+ *	complete().
+ */
+int mosquitto_auth_unpwd_check_async(void *user_data, const char *username, const char *password, void (*complete)(void *request, int result), void *request);
+
+/*
+ * Function: mosquitto_auth_acl_check_async
+ *
+ * Optional, version 3 only. The asynchronous version of
+ * <mosquitto_auth_acl_check>, used to check MOSQ_ACL_WRITE access for
+ * incoming PUBLISH messages. Nothing more is read from the client until
+ * complete() has been called, so messages from one client stay in order.
+ * Subscriptions, wills and outgoing messages are still checked with
+ * <mosquitto_auth_acl_check>.
+ *
+ * The rules for complete() are the same as for
+ * <mosquitto_auth_unpwd_check_async>. result takes the same values as the
+ * return value of <mosquitto_auth_acl_check>.
+ *
+ * Return value:
+ *	Return MOSQ_ERR_SUCCESS if the request was accepted.
+ *	Return any other value to treat the check as failed without calling
+ *	complete().
+ */
+int mosquitto_auth_acl_check_async(void *user_data, const char *clientid, const char *username, const char *topic, int access, void (*complete)(void *request, int result), void *request);
+
+/*
+ * Function: mosquitto_auth_acl_check_batch
+ *
+ * Optional, version 3 only. Called by the broker when a message is delivered
+ * to the subscribers of a topic, to check MOSQ_ACL_READ access for all of
+ * them at once rather than calling <mosquitto_auth_acl_check> for each one.
+ *
+ * Parameters:
+ *	user_data : the pointer provided in <mosquitto_auth_plugin_init>.
+ *	topic :     the topic of the message.
+ *	access :    the access being checked, MOSQ_ACL_READ.
+ *	clients :   the clients to check.
+ *	results :   an array that the result for each client should be copied
+ *	            into, using the same values as the return value of
+ *	            <mosquitto_auth_acl_check>.
+ *	count :     the number of elements in clients and results.
+ *
+ * Return value:
+ *	Return MOSQ_ERR_SUCCESS once every element of results has been set.
+ *	Return any other value to have the broker call
+ *	<mosquitto_auth_acl_check> for each client instead.
+ */
+int mosquitto_auth_acl_check_batch(void *user_data, const char *topic, int access, const struct mosquitto_acl_client *clients, int *results, int count);
+
 /*
  * Function: mosquitto_psk_key_get
  *
@@ -81,7 +81,6 @@ int mqtt3_socket_accept(struct mosquitto_db *db, int listensock)
 	int i;
 	int j;
 	int new_sock = -1;
-	struct mosquitto **tmp_contexts = NULL;
 	struct mosquitto *new_context;
 #ifdef WITH_TLS
 	BIO *bio;
@@ -144,6 +143,14 @@ int mqtt3_socket_accept(struct mosquitto_db *db, int listensock)
 		}
 
 #ifdef WITH_TLS
+		if(new_context->listener->ssl_ctx && new_context->listener->max_handshakes > 0
+				&& new_context->listener->handshake_count >= new_context->listener->max_handshakes){
+
+			_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Client connection from %s denied: max_handshakes exceeded.", new_context->address);
+			mqtt3_context_cleanup(NULL, new_context, true);
+			return -1;
+		}
+
 		/* TLS init */
 		for(i=0; i<db->config->listener_count; i++){
 			for(j=0; j<db->config->listeners[i].sock_count; j++){
@@ -159,23 +166,27 @@ int mqtt3_socket_accept(struct mosquitto_db *db, int listensock)
 						new_context->want_write = true;
 						bio = BIO_new_socket(new_sock, BIO_NOCLOSE);
 						SSL_set_bio(new_context->ssl, bio, bio);
-						rc = SSL_accept(new_context->ssl);
-						if(rc != 1){
-							rc = SSL_get_error(new_context->ssl, rc);
-							if(rc == SSL_ERROR_WANT_READ){
-								/* We always want to read. */
-							}else if(rc == SSL_ERROR_WANT_WRITE){
-								new_context->want_write = true;
-							}else{
-								e = ERR_get_error();
-								while(e){
-									_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE,
-											"Client connection from %s failed: %s.",
-											new_context->address, ERR_error_string(e, ebuf));
+						new_context->tls_handshaking = true;
+						new_context->listener->handshake_count++;
+						if(!mqtt3_tls_handshake_available(new_context)){
+							rc = SSL_accept(new_context->ssl);
+							if(rc != 1){
+								rc = SSL_get_error(new_context->ssl, rc);
+								if(rc == SSL_ERROR_WANT_READ){
+									/* We always want to read. */
+								}else if(rc == SSL_ERROR_WANT_WRITE){
+									new_context->want_write = true;
+								}else{
 									e = ERR_get_error();
+									while(e){
+										_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE,
+												"Client connection from %s failed: %s.",
+												new_context->address, ERR_error_string(e, ebuf));
+										e = ERR_get_error();
+									}
+									mqtt3_context_cleanup(NULL, new_context, true);
+									return -1;
 								}
-								mqtt3_context_cleanup(NULL, new_context, true);
-								return -1;
 							}
 						}
 					}
@@ -185,26 +196,21 @@ int mqtt3_socket_accept(struct mosquitto_db *db, int listensock)
 #endif
 
 		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New connection from %s on port %d.", new_context->address, new_context->listener->port);
-		for(i=0; i<db->context_count; i++){
-			if(db->contexts[i] == NULL){
-				db->contexts[i] = new_context;
-				break;
-			}
-		}
-		if(i==db->context_count){
-			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*(db->context_count+1));
-			if(tmp_contexts){
-				db->context_count++;
-				db->contexts = tmp_contexts;
-				db->contexts[i] = new_context;
-			}else{
-				// Out of memory
+#ifdef WITH_TLS
+		if(new_context->ssl && mqtt3_tls_handshake_available(new_context)){
+			if(mqtt3_tls_handshake_submit(new_context)){
 				mqtt3_context_cleanup(NULL, new_context, true);
 				return -1;
 			}
+			/* Added to db->contexts once the handshake is done. */
+			return new_sock;
+		}
+#endif
+		if(mqtt3_context_add(db, new_context)){
+			// Out of memory
+			mqtt3_context_cleanup(NULL, new_context, true);
+			return -1;
 		}
-		// If we got here then the context's DB index is "i" regardless of how we got here
-		new_context->db_index = i;
 
 #ifdef WITH_WRAP
 	}
@@ -267,6 +273,20 @@ static unsigned int psk_server_callback(SSL *ssl, const char *identity, unsigned
  * Returns 1 on failure
  * Returns 0 on success.
  */
+#ifdef WITH_TLS
+static void _listener_ktls_init(struct _mqtt3_listener *listener)
+{
+	if(!listener->tls_ktls) return;
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	/* openssl only enables kTLS for connections using a cipher the kernel
+	 * supports, the others carry on using openssl for encryption. */
+	SSL_CTX_set_options(listener->ssl_ctx, SSL_OP_ENABLE_KTLS);
+#else
+	_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Kernel TLS not supported by this build, ignoring tls_ktls on port %d.", listener->port);
+#endif
+}
+#endif
+
 int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 {
 	int sock = -1;
@@ -352,6 +372,14 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 	/* We need to have at least one working socket. */
 	if(listener->sock_count > 0){
 #ifdef WITH_TLS
+		/* Every TLS connection is given its context and listener, which are
+		 * also needed when the handshake isn't run on the main thread. */
+		if(tls_ex_index_context == -1){
+			tls_ex_index_context = SSL_get_ex_new_index(0, "client context", NULL, NULL, NULL);
+		}
+		if(tls_ex_index_listener == -1){
+			tls_ex_index_listener = SSL_get_ex_new_index(0, "listener", NULL, NULL, NULL);
+		}
 		if((listener->cafile || listener->capath) && listener->certfile && listener->keyfile){
 #if OPENSSL_VERSION_NUMBER >= 0x10001000L
 			if(listener->tls_version == NULL){
@@ -390,6 +418,8 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 #endif
 			snprintf(buf, 256, "mosquitto-%d", listener->port);
 			SSL_CTX_set_session_id_context(listener->ssl_ctx, (unsigned char *)buf, strlen(buf));
+			mqtt3_tls_session_ctx_init(listener->ssl_ctx);
+			_listener_ktls_init(listener);
 
 			if(listener->ciphers){
 				rc = SSL_CTX_set_cipher_list(listener->ssl_ctx, listener->ciphers);
@@ -462,13 +492,6 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 
 #  ifdef REAL_WITH_TLS_PSK
 		}else if(listener->psk_hint){
-			if(tls_ex_index_context == -1){
-				tls_ex_index_context = SSL_get_ex_new_index(0, "client context", NULL, NULL, NULL);
-			}
-			if(tls_ex_index_listener == -1){
-				tls_ex_index_listener = SSL_get_ex_new_index(0, "listener", NULL, NULL, NULL);
-			}
-
 #if OPENSSL_VERSION_NUMBER >= 0x10001000L
 			if(listener->tls_version == NULL){
 				listener->ssl_ctx = SSL_CTX_new(TLSv1_2_server_method());
@@ -487,6 +510,12 @@ int mqtt3_socket_listen(struct _mqtt3_listener *listener)
 				COMPAT_CLOSE(sock);
 				return 1;
 			}
+			/* The session cache is shared between listeners, so sessions must
+			 * only be resumed on the listener that created them. */
+			snprintf(buf, 256, "mosquitto-psk-%d", listener->port);
+			SSL_CTX_set_session_id_context(listener->ssl_ctx, (unsigned char *)buf, strlen(buf));
+			mqtt3_tls_session_ctx_init(listener->ssl_ctx);
+			_listener_ktls_init(listener);
 			SSL_CTX_set_psk_server_callback(listener->ssl_ctx, psk_server_callback);
 			if(listener->psk_hint){
 				rc = SSL_CTX_use_psk_identity_hint(listener->ssl_ctx, listener->psk_hint);
@@ -40,435 +40,1722 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
+#ifndef WIN32
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
 
 #include <mosquitto_broker.h>
 #include <memory_mosq.h>
+#include <mqtt3_protocol.h>
 #include <persist.h>
+#include <send_mosq.h>
 #include <time_mosq.h>
+#include "crc32c.h"
 #include "util_mosq.h"
 
 static uint32_t db_version;
 
+/* Files are restored through a large stdio buffer rather than the default of
+ * a few kB. */
+#define DB_RESTORE_BUFFER_SIZE (1024*1024)
+static char *restore_buffer = NULL;
 
-static int _db_restore_sub(struct mosquitto_db *db, const char *client_id, const char *sub, int qos);
+/* Chunks are built up in memory and written out in large pieces. With
+ * persistence_compression, each DB_BLOCK_SIZE piece is compressed as a
+ * DB_CHUNK_BLOCK. */
+#define DB_WRITE_BUFFER_SIZE (1024*1024)
+#define DB_BLOCK_SIZE (64*1024)
 
-static struct mosquitto *_db_find_or_add_context(struct mosquitto_db *db, const char *client_id, uint16_t last_mid)
-{
+struct _db_writer{
+	FILE *fptr;
+	uint8_t *buf;
+	uint32_t size;
+	uint32_t len;
+	/* Start of the chunk being built. */
+	uint32_t chunk;
+	/* Write out once len reaches this. */
+	uint32_t flush_at;
+	bool crc;
+	bool compress;
+	uint8_t *zbuf;
+	unsigned long zsize;
+	/* Set by the first failure. Nothing more is written after it, so that a
+	 * file missing part of its contents can't be completed by mistake. */
+	bool error;
+};
+
+#define chunk_write_e(w, b, c) if(_db_write(w, b, c)){ goto error; }
+
+/* A chunk read into memory, so that its CRC can be checked before it is
+ * parsed, and so that chunks from inside a block can be parsed the same way.
+ * Parsing must copy out anything it needs before reading another chunk. */
+struct _db_chunk{
+	uint16_t type;
+	uint32_t length;
+	const uint8_t *data;
+	uint32_t pos;
+};
+
+#define chunk_read_e(c, b, n) if(_db_chunk_read(c, b, n)){ goto error; }
+
+struct _db_reader{
+	uint32_t version;
+	/* Position of the next chunk, and of the last chunk read. */
+	long pos;
+	long offset;
+	long file_size;
+	uint8_t *buf;
+	uint32_t size;
+	/* Last block uncompressed, and its offset in the file. */
+	uint8_t *block;
+	uint32_t block_size;
+	uint32_t block_len;
+	long block_offset;
+};
+
+static struct _db_reader restore_reader;
+static struct _db_reader lazy_reader;
+
+/* Write-ahead log. Changes to persistent state made between saves are
+ * appended here, so that they can be replayed on top of the last save after
+ * an unclean shutdown. */
+static FILE *wal_fptr = NULL;
+static struct _db_writer wal_writer;
+static char *wal_path = NULL;
+static char *wal_old_path = NULL;
+static uint32_t wal_generation = 0;
+static bool wal_dirty = false;
+static time_t wal_last_sync = 0;
+static bool wal_replaying = false;
+/* After the log fails, a new one isn't started until wal_retry_time. The
+ * delay doubles with each failure until the log is synced successfully. */
+static time_t wal_retry_time = 0;
+static int wal_retry_delay = 0;
+#define WAL_RETRY_MAX 300
+
+/* PUBACK and PUBREC packets waiting for the write-ahead log to be synced, in
+ * the order they were queued. Entries whose client has disconnected have a
+ * NULL context. */
+struct _wal_ack{
 	struct mosquitto *context;
-	struct mosquitto **tmp_contexts;
-	int i;
+	uint16_t mid;
+	uint8_t command;
+};
+static struct _wal_ack *wal_acks = NULL;
+static int wal_ack_count = 0;
+static int wal_ack_size = 0;
+static unsigned long wal_ack_first = 0;
+/* Set if the log fails while acknowledgements are waiting on it. */
+static bool wal_ack_failed = false;
 
-	context = NULL;
-	for(i=0; i<db->context_count; i++){
-		if(db->contexts[i] && !strcmp(db->contexts[i]->id, client_id)){
-			context = db->contexts[i];
-			break;
-		}
+#ifndef WIN32
+static pid_t backup_pid = 0;
+static unsigned long backup_start = 0;
+#endif
+
+#ifdef WITH_SYS_TREE
+extern unsigned long g_db_save_duration;
+extern unsigned long g_db_save_size;
+#endif
+
+static int _db_restore_sub(struct mosquitto_db *db, const char *client_id, const char *sub, int qos);
+static struct mosquitto_msg_store *_db_store_get(struct mosquitto_db *db, dbid_t db_id);
+
+/* Index of message store entries by db_id, used while restoring. With
+ * persistence_lazy_load it is kept afterwards for the stored messages that
+ * are still only in the database file, with offset and inner set to the
+ * position of the chunk in lazy_fptr as for struct _mosquitto_lazy_msg, and
+ * lazy_refs counting the client queues that are yet to be loaded and refer to
+ * it. While lazy_refs is non-zero, a loaded store holds a reference so that it
+ * can't be freed before they are. */
+struct _db_store_index{
+	dbid_t db_id;
+	struct mosquitto_msg_store *store;
+	long offset;
+	uint32_t inner;
+	int lazy_refs;
+	UT_hash_handle hh;
+};
+
+static struct _db_store_index *store_index = NULL;
+/* First slot of db->contexts that may be free while restoring. */
+static int context_free_hint = 0;
+/* Subscriptions read from the database file, added to the tree in batches.
+ * Entries in sub_batch own their topic. Entries in sub_node_batch are from
+ * DB_CHUNK_CLIENT_SUBS, with order set to the number of the tree node they
+ * were saved from, and share the topic kept for that node in
+ * sub_node_topics. */
+struct _db_sub_batch{
+	struct _mosquitto_sub_restore *subs;
+	int count;
+	int size;
+};
+static struct _db_sub_batch sub_batch = {NULL, 0, 0};
+static struct _db_sub_batch sub_node_batch = {NULL, 0, 0};
+static char **sub_node_topics = NULL;
+static uint32_t sub_node_size = 0;
+
+/* Database file restored with persistence_lazy_load. Queued messages for
+ * clients that haven't reconnected since are read from here when needed. It
+ * is kept open, so remains readable after later saves have replaced it. */
+static FILE *lazy_fptr = NULL;
+static int lazy_context_count = 0;
+static bool lazy_loading = false;
+static bool restoring = false;
+
+/* Results from _db_chunk_fread() other than MOSQ_ERR_SUCCESS. */
+#define DB_READ_END 1
+#define DB_READ_TRUNCATED 2
+#define DB_READ_CORRUPT 3
+#define DB_READ_NOMEM 4
+
+static int _db_writer_flush(struct _db_writer *writer);
+
+static int _db_writer_init(struct _db_writer *writer, FILE *fptr, uint32_t size, uint32_t flush_at, bool crc, bool compress)
+{
+	memset(writer, 0, sizeof(struct _db_writer));
+	writer->fptr = fptr;
+	writer->flush_at = flush_at;
+	writer->crc = crc;
+	writer->compress = compress;
+	if(size){
+		writer->buf = _mosquitto_malloc(size);
+		if(!writer->buf) return MOSQ_ERR_NOMEM;
+		writer->size = size;
 	}
-	if(!context){
-		context = mqtt3_context_init(-1);
-		if(!context) return NULL;
+	return MOSQ_ERR_SUCCESS;
+}
 
-		context->clean_session = false;
+static void _db_writer_free(struct _db_writer *writer)
+{
+	if(writer->buf) _mosquitto_free(writer->buf);
+	if(writer->zbuf) _mosquitto_free(writer->zbuf);
+	memset(writer, 0, sizeof(struct _db_writer));
+}
 
-		for(i=0; i<db->context_count; i++){
-			if(!db->contexts[i]){
-				db->contexts[i] = context;
-				break;
-			}
+static int _db_write(struct _db_writer *writer, const void *buf, uint32_t count)
+{
+	uint8_t *tmp;
+	uint32_t size;
+
+	if(writer->error) return 1;
+	if(count > writer->size - writer->len){
+		size = writer->size ? writer->size : 1024;
+		while(count > size - writer->len){
+			size *= 2;
 		}
-		if(i==db->context_count){
-			db->context_count++;
-			tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*db->context_count);
-			if(tmp_contexts){
-				db->contexts = tmp_contexts;
-				db->contexts[db->context_count-1] = context;
-			}else{
-				mqtt3_context_cleanup(db, context, true);
-				return NULL;
-			}
+		tmp = _mosquitto_realloc(writer->buf, size);
+		if(!tmp){
+			errno = ENOMEM;
+			writer->error = true;
+			return 1;
 		}
-		context->id = _mosquitto_strdup(client_id);
-		context->db_index = i;
-	}
-	if(last_mid){
-		context->last_mid = last_mid;
+		writer->buf = tmp;
+		writer->size = size;
 	}
-	return context;
+	memcpy(writer->buf + writer->len, buf, count);
+	writer->len += count;
+	return MOSQ_ERR_SUCCESS;
 }
 
-static int mqtt3_db_client_messages_write(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto *context)
+static int _db_chunk_begin(struct _db_writer *writer, uint16_t chunk)
 {
-	uint32_t length;
-	dbid_t i64temp;
-	uint16_t i16temp, slen;
-	uint8_t i8temp;
-	struct mosquitto_client_msg *cmsg;
-
-	assert(db);
-	assert(db_fptr);
-	assert(context);
-
-	cmsg = context->msgs;
-	while(cmsg){
-		slen = strlen(context->id);
-
-		length = htonl(sizeof(dbid_t) + sizeof(uint16_t) + sizeof(uint8_t) +
-				sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint8_t) +
-				sizeof(uint8_t) + 2+slen);
-
-		i16temp = htons(DB_CHUNK_CLIENT_MSG);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, &length, sizeof(uint32_t));
-
-		i16temp = htons(slen);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, context->id, slen);
-
-		i64temp = cmsg->store->db_id;
-		write_e(db_fptr, &i64temp, sizeof(dbid_t));
-
-		i16temp = htons(cmsg->mid);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-
-		i8temp = (uint8_t )cmsg->qos;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
-
-		i8temp = (uint8_t )cmsg->retain;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
-
-		i8temp = (uint8_t )cmsg->direction;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	uint16_t i16temp;
+	uint32_t i32temp = 0;
 
-		i8temp = (uint8_t )cmsg->state;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	writer->chunk = writer->len;
+	i16temp = htons(chunk);
+	if(_db_write(writer, &i16temp, sizeof(uint16_t))) return 1;
+	/* The length is filled in by _db_chunk_end(). */
+	return _db_write(writer, &i32temp, sizeof(uint32_t));
+}
 
-		i8temp = (uint8_t )cmsg->dup;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+static int _db_chunk_end(struct _db_writer *writer)
+{
+	uint32_t i32temp;
 
-		cmsg = cmsg->next;
+	if(writer->error) return 1;
+	i32temp = htonl(writer->len - writer->chunk - sizeof(uint16_t) - sizeof(uint32_t));
+	memcpy(writer->buf + writer->chunk + sizeof(uint16_t), &i32temp, sizeof(uint32_t));
+	if(writer->crc){
+		i32temp = htonl(_mosquitto_crc32c(0, writer->buf + writer->chunk, writer->len - writer->chunk));
+		if(_db_write(writer, &i32temp, sizeof(uint32_t))) return 1;
+	}
+	if(writer->len >= writer->flush_at){
+		return _db_writer_flush(writer);
 	}
-
 	return MOSQ_ERR_SUCCESS;
-error:
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	return 1;
 }
 
-
-static int mqtt3_db_message_store_write(struct mosquitto_db *db, FILE *db_fptr)
+#ifdef WITH_ZLIB
+/* Write the buffered chunks as a single DB_CHUNK_BLOCK. Returns 1 without
+ * writing anything if they don't compress. */
+static int _db_writer_compress(struct _db_writer *writer)
 {
-	uint32_t length;
-	dbid_t i64temp;
+	uLongf zlen;
+	unsigned long size;
+	uint8_t *tmp;
 	uint32_t i32temp;
-	uint16_t i16temp, slen;
-	uint8_t i8temp;
-	struct mosquitto_msg_store *stored;
-	bool force_no_retain;
-
-	assert(db);
-	assert(db_fptr);
-
-	stored = db->msg_store;
-	while(stored){
-		if(!strncmp(stored->msg.topic, "$SYS", 4)){
-			/* Don't save $SYS messages as retained otherwise they can give
-			 * misleading information when reloaded. They should still be saved
-			 * because a disconnected durable client may have them in their
-			 * queue. */
-			force_no_retain = true;
-		}else{
-			force_no_retain = false;
-		}
-		length = htonl(sizeof(dbid_t) + 2+strlen(stored->source_id) +
-				sizeof(uint16_t) + sizeof(uint16_t) +
-				2+strlen(stored->msg.topic) + sizeof(uint32_t) +
-				stored->msg.payloadlen + sizeof(uint8_t) + sizeof(uint8_t));
-
-		i16temp = htons(DB_CHUNK_MSG_STORE);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, &length, sizeof(uint32_t));
-
-		i64temp = stored->db_id;
-		write_e(db_fptr, &i64temp, sizeof(dbid_t));
-
-		slen = strlen(stored->source_id);
-		i16temp = htons(slen);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		if(slen){
-			write_e(db_fptr, stored->source_id, slen);
-		}
-
-		i16temp = htons(stored->source_mid);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-
-		i16temp = htons(stored->msg.mid);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
+	uint16_t i16temp;
+	size_t hlen = sizeof(uint16_t) + 2*sizeof(uint32_t);
+
+	zlen = compressBound(writer->len);
+	size = hlen + zlen + sizeof(uint32_t);
+	if(size > writer->zsize){
+		tmp = _mosquitto_realloc(writer->zbuf, size);
+		if(!tmp) return 1;
+		writer->zbuf = tmp;
+		writer->zsize = size;
+	}
+	if(compress2(writer->zbuf + hlen, &zlen, writer->buf, writer->len, Z_BEST_SPEED) != Z_OK
+			|| hlen + zlen + sizeof(uint32_t) >= writer->len){
 
-		slen = strlen(stored->msg.topic);
-		i16temp = htons(slen);
-		write_e(db_fptr, &i16temp, sizeof(uint16_t));
-		write_e(db_fptr, stored->msg.topic, slen);
+		return 1;
+	}
 
-		i8temp = (uint8_t )stored->msg.qos;
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+	i16temp = htons(DB_CHUNK_BLOCK);
+	memcpy(writer->zbuf, &i16temp, sizeof(uint16_t));
+	i32temp = htonl(sizeof(uint32_t) + zlen);
+	memcpy(writer->zbuf + sizeof(uint16_t), &i32temp, sizeof(uint32_t));
+	i32temp = htonl(writer->len);
+	memcpy(writer->zbuf + sizeof(uint16_t) + sizeof(uint32_t), &i32temp, sizeof(uint32_t));
+	i32temp = htonl(_mosquitto_crc32c(0, writer->zbuf, hlen + zlen));
+	memcpy(writer->zbuf + hlen + zlen, &i32temp, sizeof(uint32_t));
+
+	if(fwrite(writer->zbuf, 1, hlen + zlen + sizeof(uint32_t), writer->fptr) != hlen + zlen + sizeof(uint32_t)){
+		return -1;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
 
-		if(force_no_retain == false){
-			i8temp = (uint8_t )stored->msg.retain;
-		}else{
-			i8temp = 0;
-		}
-		write_e(db_fptr, &i8temp, sizeof(uint8_t));
+static int _db_writer_flush(struct _db_writer *writer)
+{
+#ifdef WITH_ZLIB
+	int rc;
+#endif
 
-		i32temp = htonl(stored->msg.payloadlen);
-		write_e(db_fptr, &i32temp, sizeof(uint32_t));
-		if(stored->msg.payloadlen){
-			write_e(db_fptr, stored->msg.payload, (unsigned int)stored->msg.payloadlen);
+	if(writer->error) return 1;
+	if(writer->len == 0) return MOSQ_ERR_SUCCESS;
+#ifdef WITH_ZLIB
+	if(writer->compress){
+		rc = _db_writer_compress(writer);
+		if(rc == MOSQ_ERR_SUCCESS){
+			writer->len = 0;
+			return MOSQ_ERR_SUCCESS;
+		}else if(rc < 0){
+			goto error;
 		}
-
-		stored = stored->next;
+		/* Not worth compressing, so written as they are. */
 	}
-
+#endif
+	write_e(writer->fptr, writer->buf, writer->len);
+	writer->len = 0;
 	return MOSQ_ERR_SUCCESS;
 error:
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	writer->len = 0;
+	writer->error = true;
 	return 1;
 }
 
-static int mqtt3_db_client_write(struct mosquitto_db *db, FILE *db_fptr)
+static int _db_buffer_reserve(uint8_t **buf, uint32_t *size, uint32_t len)
 {
-	int i;
-	struct mosquitto *context;
-	uint16_t i16temp, slen;
-	uint32_t length;
+	uint8_t *tmp;
 
-	assert(db);
-	assert(db_fptr);
-
-	for(i=0; i<db->context_count; i++){
-		context = db->contexts[i];
-		if(context && context->clean_session == false){
-			length = htonl(2+strlen(context->id) + sizeof(uint16_t) + sizeof(time_t));
-
-			i16temp = htons(DB_CHUNK_CLIENT);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &length, sizeof(uint32_t));
-
-			slen = strlen(context->id);
-			i16temp = htons(slen);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, context->id, slen);
-			i16temp = htons(context->last_mid);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &(context->disconnect_t), sizeof(time_t));
+	if(len <= *size) return MOSQ_ERR_SUCCESS;
+	tmp = _mosquitto_realloc(*buf, len);
+	if(!tmp) return MOSQ_ERR_NOMEM;
+	*buf = tmp;
+	*size = len;
+	return MOSQ_ERR_SUCCESS;
+}
 
-			if(mqtt3_db_client_messages_write(db, db_fptr, context)) return 1;
-		}
-	}
+static void _db_reader_free(struct _db_reader *reader)
+{
+	if(reader->buf) _mosquitto_free(reader->buf);
+	if(reader->block) _mosquitto_free(reader->block);
+	memset(reader, 0, sizeof(struct _db_reader));
+}
 
+static int _db_chunk_read(struct _db_chunk *chunk, void *buf, uint32_t count)
+{
+	if(count > chunk->length - chunk->pos) return 1;
+	memcpy(buf, chunk->data + chunk->pos, count);
+	chunk->pos += count;
 	return MOSQ_ERR_SUCCESS;
-error:
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	return 1;
 }
 
-static int _db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr, struct _mosquitto_subhier *node, const char *topic)
+/* Parse the chunk framing at data[pos], checking that the chunk lies within
+ * len bytes and, if crc is set, that its CRC matches. *next is set to the
+ * position following the chunk. */
+static int _db_chunk_parse(const uint8_t *data, uint32_t len, uint32_t pos, bool crc, struct _db_chunk *chunk, uint32_t *next)
 {
-	struct _mosquitto_subhier *subhier;
-	struct _mosquitto_subleaf *sub;
-	char *thistopic;
-	uint32_t length;
 	uint16_t i16temp;
-	dbid_t i64temp;
-	size_t slen;
-
-	slen = strlen(topic) + strlen(node->topic) + 2;
-	thistopic = _mosquitto_malloc(sizeof(char)*slen);
-	if(!thistopic) return MOSQ_ERR_NOMEM;
-	if(strlen(topic)){
-		snprintf(thistopic, slen, "%s/%s", topic, node->topic);
-	}else{
-		snprintf(thistopic, slen, "%s", node->topic);
+	uint32_t i32temp, hlen, clen;
+
+	hlen = sizeof(uint16_t) + sizeof(uint32_t);
+	clen = crc ? sizeof(uint32_t) : 0;
+	if(pos > len || len - pos < hlen + clen) return 1;
+
+	memcpy(&i16temp, data + pos, sizeof(uint16_t));
+	memcpy(&i32temp, data + pos + sizeof(uint16_t), sizeof(uint32_t));
+	chunk->type = ntohs(i16temp);
+	chunk->length = ntohl(i32temp);
+	if(chunk->length > len - pos - hlen - clen) return 1;
+	if(crc){
+		memcpy(&i32temp, data + pos + hlen + chunk->length, sizeof(uint32_t));
+		if(ntohl(i32temp) != _mosquitto_crc32c(0, data + pos, hlen + chunk->length)) return 1;
 	}
+	chunk->data = data + pos + hlen;
+	chunk->pos = 0;
+	*next = pos + hlen + chunk->length + clen;
+	return MOSQ_ERR_SUCCESS;
+}
 
-	sub = node->subs;
-	while(sub){
-		if(sub->context->clean_session == false){
-			length = htonl(2+strlen(sub->context->id) + 2+strlen(thistopic) + sizeof(uint8_t));
-
-			i16temp = htons(DB_CHUNK_SUB);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &length, sizeof(uint32_t));
+/* Read the next chunk from fptr, which must be at reader->pos in a file of
+ * reader->file_size bytes. reader->offset is set to the position of the chunk. */
+static int _db_chunk_fread(struct _db_reader *reader, FILE *fptr, bool crc, struct _db_chunk *chunk)
+{
+	uint8_t header[sizeof(uint16_t) + sizeof(uint32_t)];
+	uint32_t i32temp, length, total, next;
+	size_t rlen;
+
+	reader->offset = reader->pos;
+	rlen = fread(header, 1, sizeof(header), fptr);
+	if(rlen == 0 && feof(fptr)) return DB_READ_END;
+	if(rlen != sizeof(header)) return DB_READ_TRUNCATED;
+
+	memcpy(&i32temp, header + sizeof(uint16_t), sizeof(uint32_t));
+	length = ntohl(i32temp);
+	total = sizeof(header) + (crc ? sizeof(uint32_t) : 0);
+	if(reader->file_size - reader->pos < (long)total
+			|| (unsigned long)(reader->file_size - reader->pos - total) < length){
+
+		return DB_READ_TRUNCATED;
+	}
+	total += length;
+	if(_db_buffer_reserve(&reader->buf, &reader->size, total)) return DB_READ_NOMEM;
 
-			slen = strlen(sub->context->id);
-			i16temp = htons(slen);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, sub->context->id, slen);
+	memcpy(reader->buf, header, sizeof(header));
+	if(fread(reader->buf + sizeof(header), 1, total - sizeof(header), fptr) != total - sizeof(header)){
+		return DB_READ_TRUNCATED;
+	}
+	reader->pos += total;
+	if(_db_chunk_parse(reader->buf, total, 0, crc, chunk, &next)) return DB_READ_CORRUPT;
+	return MOSQ_ERR_SUCCESS;
+}
 
-			slen = strlen(thistopic);
-			i16temp = htons(slen);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, thistopic, slen);
+/* Uncompress the DB_CHUNK_BLOCK in chunk into reader->block. */
+static int _db_block_inflate(struct _db_reader *reader, struct _db_chunk *chunk)
+{
+#ifdef WITH_ZLIB
+	uint32_t i32temp, len;
+	uLongf dlen;
+
+	reader->block_offset = 0;
+	if(_db_chunk_read(chunk, &i32temp, sizeof(uint32_t))) return 1;
+	len = ntohl(i32temp);
+	if(_db_buffer_reserve(&reader->block, &reader->block_size, len)) return 1;
+	dlen = len;
+	if(uncompress(reader->block, &dlen, chunk->data + chunk->pos, chunk->length - chunk->pos) != Z_OK
+			|| dlen != len){
 
-			write_e(db_fptr, &sub->qos, sizeof(uint8_t));
-		}
-		sub = sub->next;
+		return 1;
 	}
-	if(node->retained){
-		if(strncmp(node->retained->msg.topic, "$SYS", 4)){
-			/* Don't save $SYS messages. */
-			length = htonl(sizeof(dbid_t));
+	reader->block_len = len;
+	return MOSQ_ERR_SUCCESS;
+#else
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is compressed, but compression support not available.");
+	return 1;
+#endif
+}
+
+static int _db_pread(FILE *fptr, void *buf, uint32_t len, long offset)
+{
+#ifndef WIN32
+	if(pread(fileno(fptr), buf, len, offset) != (ssize_t)len) return 1;
+#else
+	if(fseek(fptr, offset, SEEK_SET)) return 1;
+	if(fread(buf, 1, len, fptr) != len) return 1;
+#endif
+	return MOSQ_ERR_SUCCESS;
+}
 
-			i16temp = htons(DB_CHUNK_RETAIN);
-			write_e(db_fptr, &i16temp, sizeof(uint16_t));
-			write_e(db_fptr, &length, sizeof(uint32_t));
+/* Read the chunk at offset, or at inner in the block at offset, from a
+ * database file restored with persistence_lazy_load. The file is read with
+ * pread(), so this is also safe from a background save process. */
+static int _db_chunk_load(struct _db_reader *reader, FILE *fptr, long offset, uint32_t inner, struct _db_chunk *chunk)
+{
+	uint8_t header[sizeof(uint16_t) + sizeof(uint32_t)];
+	uint32_t i32temp, length, total, next;
+	bool crc = reader->version >= 4;
 
-			i64temp = node->retained->db_id;
-			write_e(db_fptr, &i64temp, sizeof(dbid_t));
-		}
+	if(reader->block_offset && reader->block_offset == offset){
+		return _db_chunk_parse(reader->block, reader->block_len, inner, true, chunk, &next);
 	}
 
-	subhier = node->children;
-	while(subhier){
-		_db_subs_retain_write(db, db_fptr, subhier, thistopic);
-		subhier = subhier->next;
+	if(_db_pread(fptr, header, sizeof(header), offset)) return 1;
+	memcpy(&i32temp, header + sizeof(uint16_t), sizeof(uint32_t));
+	length = ntohl(i32temp);
+	total = sizeof(header) + (crc ? sizeof(uint32_t) : 0);
+	if(length > UINT32_MAX - total) return 1;
+	total += length;
+	if(_db_buffer_reserve(&reader->buf, &reader->size, total)) return 1;
+	memcpy(reader->buf, header, sizeof(header));
+	if(_db_pread(fptr, reader->buf + sizeof(header), total - sizeof(header), offset + sizeof(header))) return 1;
+	if(_db_chunk_parse(reader->buf, total, 0, crc, chunk, &next)) return 1;
+
+	if(chunk->type == DB_CHUNK_BLOCK){
+		if(_db_block_inflate(reader, chunk)) return 1;
+		reader->block_offset = offset;
+		return _db_chunk_parse(reader->block, reader->block_len, inner, true, chunk, &next);
 	}
-	_mosquitto_free(thistopic);
 	return MOSQ_ERR_SUCCESS;
-error:
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	return 1;
 }
 
-static int mqtt3_db_subs_retain_write(struct mosquitto_db *db, FILE *db_fptr)
+static int _db_store_index_add(struct mosquitto_msg_store *stored)
 {
-	struct _mosquitto_subhier *subhier;
+	struct _db_store_index *index;
 
-	subhier = db->subs.children;
-	while(subhier){
-		_db_subs_retain_write(db, db_fptr, subhier, "");
-		subhier = subhier->next;
+	HASH_FIND(hh, store_index, &stored->db_id, sizeof(dbid_t), index);
+	if(index){
+		index->store = stored;
+		return MOSQ_ERR_SUCCESS;
 	}
-	
+	index = _mosquitto_calloc(1, sizeof(struct _db_store_index));
+	if(!index) return MOSQ_ERR_NOMEM;
+	index->db_id = stored->db_id;
+	index->store = stored;
+	HASH_ADD(hh, store_index, db_id, sizeof(dbid_t), index);
 	return MOSQ_ERR_SUCCESS;
 }
 
-int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown)
+static void _db_store_index_free(void)
 {
-	int rc = 0;
-	FILE *db_fptr = NULL;
-	uint32_t db_version_w = htonl(MOSQ_DB_VERSION);
-	uint32_t crc = htonl(0);
-	dbid_t i64temp;
-	uint32_t i32temp;
-	uint16_t i16temp;
-	uint8_t i8temp;
-	char err[256];
-	char *outfile = NULL;
-	int len;
+	struct _db_store_index *index, *tmp;
 
-	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
-	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", db->config->persistence_filepath);
-	if(cleanup){
-		mqtt3_db_store_clean(db);
+	HASH_ITER(hh, store_index, index, tmp){
+		if(index->store && index->offset && index->lazy_refs > 0){
+			index->store->ref_count--;
+		}
+		HASH_DEL(store_index, index);
+		_mosquitto_free(index);
 	}
+}
 
-	len = strlen(db->config->persistence_filepath)+5;
-	outfile = _mosquitto_calloc(len+1, 1);
-	if(!outfile){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Error saving in-memory database, out of memory.");
-		return MOSQ_ERR_NOMEM;
-	}
-	snprintf(outfile, len, "%s.new", db->config->persistence_filepath);
-	db_fptr = _mosquitto_fopen(outfile, "wb");
-	if(db_fptr == NULL){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Error saving in-memory database, unable to open %s for writing.", outfile);
-		goto error;
+/* Drop the entries that no client queue still in the lazy file refers to. */
+static void _db_store_index_trim(void)
+{
+	struct _db_store_index *index, *tmp;
+
+	HASH_ITER(hh, store_index, index, tmp){
+		if(index->lazy_refs == 0){
+			HASH_DEL(store_index, index);
+			_mosquitto_free(index);
+		}
 	}
+}
 
-	/* Header */
-	write_e(db_fptr, magic, 15);
-	write_e(db_fptr, &crc, sizeof(uint32_t));
-	write_e(db_fptr, &db_version_w, sizeof(uint32_t));
+/* A client queue entry referring to db_id has been loaded or discarded. */
+static void _db_store_lazy_release(dbid_t db_id)
+{
+	struct _db_store_index *index;
 
-	/* DB config */
-	i16temp = htons(DB_CHUNK_CFG);
-	write_e(db_fptr, &i16temp, sizeof(uint16_t));
-	/* chunk length */
-	i32temp = htonl(sizeof(dbid_t) + sizeof(uint8_t) + sizeof(uint8_t));
-	write_e(db_fptr, &i32temp, sizeof(uint32_t));
-	/* db written at broker shutdown or not */
-	i8temp = shutdown;
-	write_e(db_fptr, &i8temp, sizeof(uint8_t));
-	i8temp = sizeof(dbid_t);
-	write_e(db_fptr, &i8temp, sizeof(uint8_t));
-	/* last db mid */
-	i64temp = db->last_db_id;
-	write_e(db_fptr, &i64temp, sizeof(dbid_t));
+	HASH_FIND(hh, store_index, &db_id, sizeof(dbid_t), index);
+	if(!index || index->lazy_refs == 0) return;
 
-	if(mqtt3_db_message_store_write(db, db_fptr)){
-		goto error;
+	index->lazy_refs--;
+	if(index->lazy_refs == 0 && index->store){
+		index->store->ref_count--;
+		index->store = NULL;
 	}
+}
 
-	mqtt3_db_client_write(db, db_fptr);
-	mqtt3_db_subs_retain_write(db, db_fptr);
+static void _db_lazy_close(void)
+{
+	if(lazy_fptr){
+		fclose(lazy_fptr);
+		lazy_fptr = NULL;
+	}
+	_db_reader_free(&lazy_reader);
+	_db_store_index_free();
+}
 
-	fclose(db_fptr);
+/* Grow db->contexts by count empty slots, so restoring a large number of
+ * clients doesn't realloc once per client. */
+static int _db_contexts_reserve(struct mosquitto_db *db, int count)
+{
+	struct mosquitto **tmp_contexts;
+	int i;
 
-	if(rename(outfile, db->config->persistence_filepath) != 0){
-		goto error;
+	if(count <= 0) return MOSQ_ERR_SUCCESS;
+
+	tmp_contexts = _mosquitto_realloc(db->contexts, sizeof(struct mosquitto*)*(db->context_count+count));
+	if(!tmp_contexts) return MOSQ_ERR_NOMEM;
+	db->contexts = tmp_contexts;
+	for(i=db->context_count; i<db->context_count+count; i++){
+		db->contexts[i] = NULL;
 	}
-	_mosquitto_free(outfile);
-	outfile = NULL;
-	return rc;
-error:
-	if(outfile) _mosquitto_free(outfile);
-	strerror_r(errno, err, 256);
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	if(db_fptr) fclose(db_fptr);
-	return 1;
+	db->context_count += count;
+	return MOSQ_ERR_SUCCESS;
 }
 
-static int _db_client_msg_restore(struct mosquitto_db *db, const char *client_id, uint16_t mid, uint8_t qos, uint8_t retain, uint8_t direction, uint8_t state, uint8_t dup, uint64_t store_id)
+static struct mosquitto *_db_context_find(struct mosquitto_db *db, const char *client_id)
 {
-	struct mosquitto_client_msg *cmsg;
-	struct mosquitto_msg_store *store;
-	struct mosquitto *context;
+	struct _clientid_index_hash *find_cih;
 
-	cmsg = _mosquitto_calloc(1, sizeof(struct mosquitto_client_msg));
-	if(!cmsg){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
+	HASH_FIND_STR(db->clientid_index_hash, client_id, find_cih);
+	if(find_cih){
+		return db->contexts[find_cih->db_context_index];
 	}
+	return NULL;
+}
 
-	cmsg->store = NULL;
-	cmsg->mid = mid;
-	cmsg->qos = qos;
-	cmsg->retain = retain;
-	cmsg->direction = direction;
+static struct mosquitto *_db_find_or_add_context(struct mosquitto_db *db, const char *client_id, uint16_t last_mid)
+{
+	struct mosquitto *context;
+	struct _clientid_index_hash *new_cih;
+	int i;
+
+	context = _db_context_find(db, client_id);
+	if(!context){
+		context = mqtt3_context_init(-1);
+		if(!context) return NULL;
+
+		context->clean_session = false;
+		context->id = _mosquitto_strdup(client_id);
+		new_cih = _mosquitto_malloc(sizeof(struct _clientid_index_hash));
+		if(!context->id || !new_cih){
+			if(new_cih) _mosquitto_free(new_cih);
+			mqtt3_context_cleanup(db, context, true);
+			return NULL;
+		}
+
+		for(i=context_free_hint; i<db->context_count; i++){
+			if(!db->contexts[i]) break;
+		}
+		if(i==db->context_count){
+			if(_db_contexts_reserve(db, db->context_count)){
+				_mosquitto_free(new_cih);
+				mqtt3_context_cleanup(db, context, true);
+				return NULL;
+			}
+		}
+		db->contexts[i] = context;
+		context_free_hint = i+1;
+		context->db_index = i;
+
+		new_cih->id = context->id;
+		new_cih->db_context_index = i;
+		HASH_ADD_KEYPTR(hh, db->clientid_index_hash, context->id, strlen(context->id), new_cih);
+
+		mqtt3_spill_restore(db, context);
+	}
+	if(last_mid){
+		context->last_mid = last_mid;
+	}
+	context->is_persisted = true;
+	return context;
+}
+
+static char *_wal_path_get(struct mosquitto_db *db, const char *suffix)
+{
+	char *path;
+	int len;
+
+	len = strlen(db->config->persistence_filepath)+strlen(suffix)+1;
+	path = _mosquitto_malloc(len);
+	if(!path) return NULL;
+	snprintf(path, len, "%s%s", db->config->persistence_filepath, suffix);
+	return path;
+}
+
+static int _wal_paths_get(struct mosquitto_db *db)
+{
+	if(!wal_path){
+		wal_path = _wal_path_get(db, ".wal");
+	}
+	if(!wal_old_path){
+		wal_old_path = _wal_path_get(db, ".wal.old");
+	}
+	if(!wal_path || !wal_old_path){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _wal_close(struct mosquitto_db *db, bool remove_file)
+{
+	if(wal_fptr){
+		fclose(wal_fptr);
+		wal_fptr = NULL;
+	}
+	_db_writer_free(&wal_writer);
+	wal_dirty = false;
+	if(remove_file && !_wal_paths_get(db)){
+		remove(wal_path);
+		remove(wal_old_path);
+	}
+}
+
+/* A failed write leaves the log in an unknown state, so stop using it. The
+ * next mqtt3_wal_sync() call makes a full save and starts a new one. */
+static void _wal_retry_schedule(void)
+{
+	if(wal_retry_delay == 0){
+		wal_retry_delay = 1;
+	}else if(wal_retry_delay < WAL_RETRY_MAX){
+		wal_retry_delay *= 2;
+		if(wal_retry_delay > WAL_RETRY_MAX) wal_retry_delay = WAL_RETRY_MAX;
+	}
+	wal_retry_time = mosquitto_time() + wal_retry_delay;
+}
+
+static void _wal_write_error(void)
+{
+	/* Only reported the first time, the disk is likely to keep failing. */
+	_mosquitto_log_printf(NULL, wal_retry_delay?MOSQ_LOG_DEBUG:MOSQ_LOG_ERR,
+			"Error: Unable to write to write-ahead log %s: %s.", wal_path, strerror(errno));
+	fclose(wal_fptr);
+	wal_fptr = NULL;
+	_db_writer_free(&wal_writer);
+	wal_dirty = false;
+	if(wal_ack_count) wal_ack_failed = true;
+	_wal_retry_schedule();
+}
+
+/* Called after the log has been synced to disk. */
+static void _wal_synced(time_t now)
+{
+	wal_dirty = false;
+	wal_last_sync = now;
+	if(wal_retry_delay){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Write-ahead log %s is being written again.", wal_path);
+		wal_retry_delay = 0;
+	}
+}
+
+/* Start a new, empty write-ahead log that applies on top of the database file
+ * with the same generation. */
+static int _wal_open(struct mosquitto_db *db, uint32_t generation)
+{
+	uint32_t i32temp;
+
+	_wal_close(db, false);
+	if(_wal_paths_get(db)) return MOSQ_ERR_NOMEM;
+
+	wal_fptr = _mosquitto_fopen(wal_path, "wb");
+	if(!wal_fptr){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open write-ahead log %s for writing.", wal_path);
+		return 1;
+	}
+	write_e(wal_fptr, wal_magic, 15);
+	i32temp = htonl(generation);
+	write_e(wal_fptr, &i32temp, sizeof(uint32_t));
+	/* Each change is passed to stdio as soon as it is complete. */
+	_db_writer_init(&wal_writer, wal_fptr, 0, 0, false, false);
+
+	wal_generation = generation;
+	wal_dirty = true;
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	_wal_close(db, true);
+	return 1;
+}
+
+#ifndef WIN32
+/* Used when a background save starts. The current log still applies until
+ * the new database file is in place, so is kept alongside the new log. */
+static int _wal_rotate(struct mosquitto_db *db, uint32_t generation)
+{
+	if(_wal_paths_get(db)) return MOSQ_ERR_NOMEM;
+	if(wal_fptr){
+		fclose(wal_fptr);
+		wal_fptr = NULL;
+		if(rename(wal_path, wal_old_path)){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to rename write-ahead log %s: %s.", wal_path, strerror(errno));
+		}
+	}
+	return _wal_open(db, generation);
+}
+#endif
+
+static int _db_client_msg_chunk_write(struct _db_writer *writer, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	dbid_t i64temp;
+	uint16_t i16temp, slen;
+	uint8_t i8temp;
+
+	slen = strlen(context->id);
+
+	if(_db_chunk_begin(writer, DB_CHUNK_CLIENT_MSG)) goto error;
+
+	i16temp = htons(slen);
+	chunk_write_e(writer, &i16temp, sizeof(uint16_t));
+	chunk_write_e(writer, context->id, slen);
+
+	i64temp = cmsg->store->db_id;
+	chunk_write_e(writer, &i64temp, sizeof(dbid_t));
+
+	i16temp = htons(cmsg->mid);
+	chunk_write_e(writer, &i16temp, sizeof(uint16_t));
+
+	i8temp = (uint8_t )cmsg->qos;
+	chunk_write_e(writer, &i8temp, sizeof(uint8_t));
+
+	i8temp = (uint8_t )cmsg->retain;
+	chunk_write_e(writer, &i8temp, sizeof(uint8_t));
+
+	i8temp = (uint8_t )cmsg->direction;
+	chunk_write_e(writer, &i8temp, sizeof(uint8_t));
+
+	i8temp = (uint8_t )cmsg->state;
+	chunk_write_e(writer, &i8temp, sizeof(uint8_t));
+
+	i8temp = (uint8_t )cmsg->dup;
+	chunk_write_e(writer, &i8temp, sizeof(uint8_t));
+
+	if(_db_chunk_end(writer)) goto error;
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+/* Copy a chunk that hasn't been loaded from the lazy file to a new file. */
+static int _db_lazy_chunk_copy(struct _db_writer *writer, long offset, uint32_t inner)
+{
+	struct _db_chunk chunk;
+
+	if(!lazy_fptr || _db_chunk_load(&lazy_reader, lazy_fptr, offset, inner, &chunk)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to read queued message from persistent database.");
+		writer->error = true;
+		return 1;
+	}
+	if(_db_chunk_begin(writer, chunk.type)) goto error;
+	chunk_write_e(writer, chunk.data, chunk.length);
+	if(_db_chunk_end(writer)) goto error;
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+static int mqtt3_db_client_messages_write(struct mosquitto_db *db, struct _db_writer *writer, struct mosquitto *context)
+{
+	struct mosquitto_client_msg *cmsg;
+	int i;
+
+	assert(db);
+	assert(writer);
+	assert(context);
+
+	if(context->lazy){
+		for(i=0; i<context->lazy->count; i++){
+			if(_db_lazy_chunk_copy(writer, context->lazy->msgs[i].offset, context->lazy->msgs[i].inner)) return 1;
+		}
+	}
+	cmsg = context->msgs;
+	while(cmsg){
+		if(_db_client_msg_chunk_write(writer, context, cmsg)) return 1;
+		cmsg = cmsg->next;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int _db_msg_store_chunk_write(struct _db_writer *writer, struct mosquitto_msg_store *stored)
+{
+	dbid_t i64temp;
+	uint32_t i32temp;
+	uint16_t i16temp, slen;
+	uint8_t i8temp;
+	bool force_no_retain;
+
+	if(!strncmp(stored->msg.topic, "$SYS", 4)){
+		/* Don't save $SYS messages as retained otherwise they can give
+		 * misleading information when reloaded. They should still be saved
+		 * because a disconnected durable client may have them in their
+		 * queue. */
+		force_no_retain = true;
+	}else{
+		force_no_retain = false;
+	}
+	if(_db_chunk_begin(writer, DB_CHUNK_MSG_STORE)) goto error;
+
+	i64temp = stored->db_id;
+	chunk_write_e(writer, &i64temp, sizeof(dbid_t));
+
+	slen = strlen(stored->source_id);
+	i16temp = htons(slen);
+	chunk_write_e(writer, &i16temp, sizeof(uint16_t));
+	if(slen){
+		chunk_write_e(writer, stored->source_id, slen);
+	}
+
+	i16temp = htons(stored->source_mid);
+	chunk_write_e(writer, &i16temp, sizeof(uint16_t));
+
+	i16temp = htons(stored->msg.mid);
+	chunk_write_e(writer, &i16temp, sizeof(uint16_t));
+
+	slen = strlen(stored->msg.topic);
+	i16temp = htons(slen);
+	chunk_write_e(writer, &i16temp, sizeof(uint16_t));
+	chunk_write_e(writer, stored->msg.topic, slen);
+
+	i8temp = (uint8_t )stored->msg.qos;
+	chunk_write_e(writer, &i8temp, sizeof(uint8_t));
+
+	if(force_no_retain == false){
+		i8temp = (uint8_t )stored->msg.retain;
+	}else{
+		i8temp = 0;
+	}
+	chunk_write_e(writer, &i8temp, sizeof(uint8_t));
+
+	i32temp = htonl(stored->msg.payloadlen);
+	chunk_write_e(writer, &i32temp, sizeof(uint32_t));
+	if(stored->msg.payloadlen){
+		chunk_write_e(writer, stored->msg.payload, (unsigned int)stored->msg.payloadlen);
+	}
+	if(_db_chunk_end(writer)) goto error;
+	stored->persisted = true;
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+static int mqtt3_db_message_store_write(struct mosquitto_db *db, struct _db_writer *writer)
+{
+	struct mosquitto_msg_store *stored;
+	struct _db_store_index *index, *tmp;
+
+	assert(db);
+	assert(writer);
+
+	stored = db->msg_store;
+	while(stored){
+		if(_db_msg_store_chunk_write(writer, stored)) return 1;
+		stored = stored->next;
+	}
+	HASH_ITER(hh, store_index, index, tmp){
+		if(index->offset && !index->store && index->lazy_refs > 0){
+			if(_db_lazy_chunk_copy(writer, index->offset, index->inner)) return 1;
+		}
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_client_chunk_write(struct _db_writer *writer, struct mosquitto *context)
+{
+	uint16_t i16temp, slen;
+
+	if(_db_chunk_begin(writer, DB_CHUNK_CLIENT)) goto error;
+
+	slen = strlen(context->id);
+	i16temp = htons(slen);
+	chunk_write_e(writer, &i16temp, sizeof(uint16_t));
+	chunk_write_e(writer, context->id, slen);
+	i16temp = htons(context->last_mid);
+	chunk_write_e(writer, &i16temp, sizeof(uint16_t));
+	chunk_write_e(writer, &(context->disconnect_t), sizeof(time_t));
+	if(_db_chunk_end(writer)) goto error;
+	context->is_persisted = true;
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+static int _db_sub_chunk_write(struct _db_writer *writer, const char *client_id, const char *topic, uint8_t qos)
+{
+	uint16_t i16temp, slen;
+
+	if(_db_chunk_begin(writer, DB_CHUNK_SUB)) goto error;
+
+	slen = strlen(client_id);
+	i16temp = htons(slen);
+	chunk_write_e(writer, &i16temp, sizeof(uint16_t));
+	chunk_write_e(writer, client_id, slen);
+
+	slen = strlen(topic);
+	i16temp = htons(slen);
+	chunk_write_e(writer, &i16temp, sizeof(uint16_t));
+	chunk_write_e(writer, topic, slen);
+
+	chunk_write_e(writer, &qos, sizeof(uint8_t));
+
+	if(_db_chunk_end(writer)) goto error;
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+static int mqtt3_db_client_write(struct mosquitto_db *db, struct _db_writer *writer)
+{
+	int i;
+	struct mosquitto *context;
+
+	assert(db);
+	assert(writer);
+
+	for(i=0; i<db->context_count; i++){
+		context = db->contexts[i];
+		if(context && context->clean_session == false){
+			if(_db_client_chunk_write(writer, context)) return 1;
+			if(mqtt3_db_client_messages_write(db, writer, context)) return 1;
+		}
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Subscriptions of persistent clients, gathered from the tree so that they
+ * can be written grouped by client. Each distinct topic is stored once in
+ * topics, and each client's entries are linked in the order the tree was
+ * walked, which keeps topics with shared leading levels together. Nodes with
+ * subscriptions are numbered in the same order. */
+struct _db_sub_client{
+	struct mosquitto *context;
+	uint32_t count;
+	uint32_t first;
+	uint32_t last;
+	UT_hash_handle hh;
+};
+
+struct _db_sub_entry{
+	uint32_t node;
+	uint32_t topic;
+	uint32_t next;
+	uint16_t len;
+	uint8_t qos;
+};
+
+struct _db_subs{
+	struct _db_sub_client *clients;
+	struct _db_sub_entry *entries;
+	uint32_t count;
+	uint32_t size;
+	char *topics;
+	uint32_t topics_len;
+	uint32_t topics_size;
+	uint32_t nodes;
+	/* Topic of the node being visited. */
+	char *path;
+	uint32_t path_len;
+	uint32_t path_size;
+};
+
+static int _db_subs_reserve(char **buf, uint32_t *size, uint32_t len)
+{
+	char *tmp;
+	uint32_t newsize;
+
+	if(len <= *size) return MOSQ_ERR_SUCCESS;
+	newsize = *size ? *size : 1024;
+	while(newsize < len){
+		newsize *= 2;
+	}
+	tmp = _mosquitto_realloc(*buf, newsize);
+	if(!tmp) return MOSQ_ERR_NOMEM;
+	*buf = tmp;
+	*size = newsize;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_subs_add(struct _db_subs *subs, struct mosquitto *context, uint32_t topic, uint8_t qos)
+{
+	struct _db_sub_client *client;
+	struct _db_sub_entry *tmp;
+	uint32_t size;
+
+	HASH_FIND(hh, subs->clients, &context, sizeof(struct mosquitto *), client);
+	if(!client){
+		client = _mosquitto_calloc(1, sizeof(struct _db_sub_client));
+		if(!client) return MOSQ_ERR_NOMEM;
+		client->context = context;
+		HASH_ADD(hh, subs->clients, context, sizeof(struct mosquitto *), client);
+	}
+	if(subs->count == subs->size){
+		size = subs->size ? subs->size*2 : 1024;
+		tmp = _mosquitto_realloc(subs->entries, sizeof(struct _db_sub_entry)*size);
+		if(!tmp) return MOSQ_ERR_NOMEM;
+		subs->entries = tmp;
+		subs->size = size;
+	}
+	subs->entries[subs->count].node = subs->nodes-1;
+	subs->entries[subs->count].topic = topic;
+	subs->entries[subs->count].len = subs->path_len;
+	subs->entries[subs->count].qos = qos;
+	subs->entries[subs->count].next = UINT32_MAX;
+	if(client->count){
+		subs->entries[client->last].next = subs->count;
+	}else{
+		client->first = subs->count;
+	}
+	client->last = subs->count;
+	client->count++;
+	subs->count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _db_subs_free(struct _db_subs *subs)
+{
+	struct _db_sub_client *client, *tmp;
+
+	HASH_ITER(hh, subs->clients, client, tmp){
+		HASH_DEL(subs->clients, client);
+		_mosquitto_free(client);
+	}
+	if(subs->entries) _mosquitto_free(subs->entries);
+	if(subs->topics) _mosquitto_free(subs->topics);
+	if(subs->path) _mosquitto_free(subs->path);
+	memset(subs, 0, sizeof(struct _db_subs));
+}
+
+/* Write value as a variable length integer, in the same way as the remaining
+ * length of an MQTT packet. */
+static int _db_varint_write(struct _db_writer *writer, uint32_t value)
+{
+	uint8_t buf[5];
+	int len = 0;
+
+	do{
+		buf[len] = value % 128;
+		value = value / 128;
+		if(value > 0){
+			buf[len] = buf[len] | 0x80;
+		}
+		len++;
+	}while(value > 0);
+	return _db_write(writer, buf, len);
+}
+
+/* Write a DB_CHUNK_CLIENT_SUBS for each client. */
+static int _db_client_subs_write(struct _db_writer *writer, struct _db_subs *subs)
+{
+	struct _db_sub_client *client, *tmp;
+	struct _db_sub_entry *entry, *prev;
+	uint32_t i32temp;
+	uint16_t i16temp, slen, shared;
+	uint32_t e;
+
+	HASH_ITER(hh, subs->clients, client, tmp){
+		if(_db_chunk_begin(writer, DB_CHUNK_CLIENT_SUBS)) goto error;
+
+		slen = strlen(client->context->id);
+		i16temp = htons(slen);
+		chunk_write_e(writer, &i16temp, sizeof(uint16_t));
+		chunk_write_e(writer, client->context->id, slen);
+		i32temp = htonl(client->count);
+		chunk_write_e(writer, &i32temp, sizeof(uint32_t));
+
+		prev = NULL;
+		for(e=client->first; e!=UINT32_MAX; e=entry->next){
+			entry = &subs->entries[e];
+			shared = 0;
+			if(prev){
+				while(shared < entry->len && shared < prev->len
+						&& subs->topics[entry->topic+shared] == subs->topics[prev->topic+shared]){
+
+					shared++;
+				}
+			}
+			if(_db_varint_write(writer, prev ? entry->node - prev->node : entry->node)) goto error;
+			i16temp = htons(shared);
+			chunk_write_e(writer, &i16temp, sizeof(uint16_t));
+			i16temp = htons(entry->len - shared);
+			chunk_write_e(writer, &i16temp, sizeof(uint16_t));
+			chunk_write_e(writer, &subs->topics[entry->topic+shared], entry->len - shared);
+			chunk_write_e(writer, &entry->qos, sizeof(uint8_t));
+			prev = entry;
+		}
+		if(_db_chunk_end(writer)) goto error;
+	}
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+/* Write the retained messages below node, and gather the subscriptions of
+ * persistent clients into subs. */
+static int _db_subs_retain_write(struct mosquitto_db *db, struct _db_writer *writer, struct _mosquitto_subhier *node, struct _db_subs *subs, int depth)
+{
+	struct _mosquitto_subhier *subhier;
+	struct _mosquitto_subleaf *sub;
+	dbid_t i64temp;
+	uint32_t path_len, tlen, topic = 0;
+	bool stored = false;
+
+	/* Append this level to the topic of the parent. The first level below the
+	 * root is repeated at the second, and topics not beginning with $ have an
+	 * extra empty first level, neither of which are part of the topic. */
+	path_len = subs->path_len;
+	tlen = strlen(node->topic);
+	if(_db_subs_reserve(&subs->path, &subs->path_size, path_len + tlen + 2)) goto nomem;
+	if((depth == 2 && node->topic[0] == '$') || depth >= 3){
+		if(depth > 3 || (depth == 3 && path_len)){
+			subs->path[subs->path_len++] = '/';
+		}
+		memcpy(&subs->path[subs->path_len], node->topic, tlen);
+		subs->path_len += tlen;
+	}
+
+	sub = node->subs;
+	while(sub){
+		if(sub->context->clean_session == false){
+			if(!stored){
+				if(_db_subs_reserve(&subs->topics, &subs->topics_size, subs->topics_len + subs->path_len + 1)) goto nomem;
+				topic = subs->topics_len;
+				memcpy(&subs->topics[topic], subs->path, subs->path_len);
+				subs->topics_len += subs->path_len;
+				subs->nodes++;
+				stored = true;
+			}
+			if(_db_subs_add(subs, sub->context, topic, (uint8_t)sub->qos)) goto nomem;
+		}
+		sub = sub->next;
+	}
+	if(node->retained){
+		if(strncmp(node->retained->msg.topic, "$SYS", 4)){
+			/* Don't save $SYS messages. */
+			if(_db_chunk_begin(writer, DB_CHUNK_RETAIN)) goto error;
+
+			i64temp = node->retained->db_id;
+			chunk_write_e(writer, &i64temp, sizeof(dbid_t));
+			if(_db_chunk_end(writer)) goto error;
+		}
+	}
+
+	subhier = node->children;
+	while(subhier){
+		if(_db_subs_retain_write(db, writer, subhier, subs, depth+1)) return 1;
+		subhier = subhier->next;
+	}
+	subs->path_len = path_len;
+	return MOSQ_ERR_SUCCESS;
+nomem:
+	errno = ENOMEM;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+	return 1;
+}
+
+/* Retained messages are written first, as they were in the tree, so that they
+ * aren't queued again on restore for clients that had already received them. */
+static int mqtt3_db_subs_retain_write(struct mosquitto_db *db, struct _db_writer *writer)
+{
+	struct _mosquitto_subhier *subhier;
+	struct _db_subs subs;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	memset(&subs, 0, sizeof(struct _db_subs));
+	subhier = db->subs.children;
+	while(subhier && !rc){
+		rc = _db_subs_retain_write(db, writer, subhier, &subs, 1);
+		subhier = subhier->next;
+	}
+	if(!rc){
+		rc = _db_client_subs_write(writer, &subs);
+	}
+	_db_subs_free(&subs);
+	return rc;
+}
+
+#ifndef WIN32
+/* Make a rename in the directory containing path durable. */
+static int _db_dir_sync(const char *path)
+{
+	char *dir;
+	char *slash;
+	int fd;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	dir = _mosquitto_strdup(path);
+	if(!dir) return MOSQ_ERR_NOMEM;
+	slash = strrchr(dir, '/');
+	if(slash == dir){
+		slash[1] = '\0';
+	}else if(slash){
+		slash[0] = '\0';
+	}else{
+		strcpy(dir, ".");
+	}
+	fd = open(dir, O_RDONLY);
+	if(fd < 0 || fsync(fd)){
+		rc = 1;
+	}
+	if(fd >= 0) close(fd);
+	_mosquitto_free(dir);
+	return rc;
+}
+#endif
+
+/* Write the database to a temporary file and move it into place. This is the
+ * only part of a save that runs in the background process, so must not touch
+ * anything shared with the broker other than the files it writes. */
+static int _db_snapshot_write(struct mosquitto_db *db, bool shutdown, uint32_t generation)
+{
+	FILE *db_fptr = NULL;
+	struct _db_writer writer;
+	uint8_t header[15+2*sizeof(uint32_t)];
+	dbid_t i64temp;
+	uint32_t i32temp, crc;
+	uint8_t i8temp;
+	char err[256];
+	char *outfile = NULL;
+	int len;
+
+	memset(&writer, 0, sizeof(struct _db_writer));
+	len = strlen(db->config->persistence_filepath)+5;
+	outfile = _mosquitto_calloc(len+1, 1);
+	if(!outfile){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Error saving in-memory database, out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	snprintf(outfile, len, "%s.new", db->config->persistence_filepath);
+	db_fptr = _mosquitto_fopen(outfile, "wb");
+	if(db_fptr == NULL){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Error saving in-memory database, unable to open %s for writing.", outfile);
+		goto error;
+	}
+	/* Everything is written from the writer's own buffer. */
+	setvbuf(db_fptr, NULL, _IONBF, 0);
+	if(_db_writer_init(&writer, db_fptr, DB_WRITE_BUFFER_SIZE,
+				db->config->persistence_compression ? DB_BLOCK_SIZE : DB_WRITE_BUFFER_SIZE,
+				true, db->config->persistence_compression)){
+		errno = ENOMEM;
+		goto error;
+	}
+
+	/* Header. The CRC covers the magic and version. */
+	memcpy(header, magic, 15);
+	i32temp = htonl(MOSQ_DB_VERSION);
+	memcpy(&header[15+sizeof(uint32_t)], &i32temp, sizeof(uint32_t));
+	crc = _mosquitto_crc32c(0, magic, 15);
+	crc = _mosquitto_crc32c(crc, &i32temp, sizeof(uint32_t));
+	i32temp = htonl(crc);
+	memcpy(&header[15], &i32temp, sizeof(uint32_t));
+	write_e(db_fptr, header, sizeof(header));
+
+	/* DB config */
+	if(_db_chunk_begin(&writer, DB_CHUNK_CFG)) goto error;
+	/* db written at broker shutdown or not */
+	i8temp = shutdown;
+	chunk_write_e(&writer, &i8temp, sizeof(uint8_t));
+	i8temp = sizeof(dbid_t);
+	chunk_write_e(&writer, &i8temp, sizeof(uint8_t));
+	/* last db mid */
+	i64temp = db->last_db_id;
+	chunk_write_e(&writer, &i64temp, sizeof(dbid_t));
+	if(_db_chunk_end(&writer)) goto error;
+
+	if(db->config->persistence_wal){
+		/* Only a write-ahead log with this generation applies to this file. */
+		if(_db_chunk_begin(&writer, DB_CHUNK_WAL_GEN)) goto error;
+		i32temp = htonl(generation);
+		chunk_write_e(&writer, &i32temp, sizeof(uint32_t));
+		if(_db_chunk_end(&writer)) goto error;
+	}
+
+	if(mqtt3_db_message_store_write(db, &writer)){
+		goto error;
+	}
+
+	if(mqtt3_db_client_write(db, &writer)) goto error;
+	if(mqtt3_db_subs_retain_write(db, &writer)) goto error;
+	if(_db_writer_flush(&writer)) goto error;
+	_db_writer_free(&writer);
+
+#ifndef WIN32
+	/* With the write-ahead log, the log is about to be discarded, so this
+	 * file must be on disk first. */
+	if(db->config->persistence_fsync != pf_none || db->config->persistence_wal){
+		if(fsync(fileno(db_fptr))) goto error;
+	}
+#endif
+	if(fclose(db_fptr)){
+		db_fptr = NULL;
+		goto error;
+	}
+	db_fptr = NULL;
+
+	if(rename(outfile, db->config->persistence_filepath) != 0){
+		goto error;
+	}
+#ifndef WIN32
+	if(db->config->persistence_fsync == pf_directory){
+		if(_db_dir_sync(db->config->persistence_filepath)) goto error;
+	}
+#endif
+	_mosquitto_free(outfile);
+	return MOSQ_ERR_SUCCESS;
+error:
+	if(outfile) _mosquitto_free(outfile);
+	strerror_r(errno, err, 256);
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
+	_db_writer_free(&writer);
+	if(db_fptr) fclose(db_fptr);
+	return 1;
+}
+
+static unsigned long _db_time_ms(void)
+{
+#ifdef WIN32
+	return mosquitto_time()*1000;
+#else
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec*1000 + tp.tv_nsec/1000000;
+#endif
+}
+
+static void _db_backup_stats(struct mosquitto_db *db, unsigned long start)
+{
+#ifdef WITH_SYS_TREE
+	struct stat buf;
+
+	g_db_save_duration = _db_time_ms() - start;
+	if(!stat(db->config->persistence_filepath, &buf)){
+		g_db_save_size = buf.st_size;
+	}
+#endif
+}
+
+static int _wal_ack_send(struct mosquitto *context, uint8_t command, uint16_t mid)
+{
+	if(command == PUBACK){
+		return _mosquitto_send_puback(context, mid);
+	}else{
+		return _mosquitto_send_pubrec(context, mid);
+	}
+}
+
+/* Sync the write-ahead log once for every acknowledgement waiting on it, then
+ * send them. If the log could not be synced, the clients are disconnected
+ * instead so that they send the messages again. */
+static void _wal_acks_commit(struct mosquitto_db *db)
+{
+	struct mosquitto *context;
+	int i;
+
+	if(wal_fptr && wal_dirty){
+		if(fflush(wal_fptr)){
+			_wal_write_error();
+#ifndef WIN32
+		}else if(fsync(fileno(wal_fptr))){
+			_wal_write_error();
+#endif
+		}else{
+			_wal_synced(mosquitto_time());
+		}
+	}else if(!wal_fptr){
+		wal_ack_failed = true;
+	}
+	/* Messages spilled to disk aren't in the log, so their files are synced
+	 * too. */
+	if(!wal_ack_failed && mqtt3_spill_flush(db, true)){
+		wal_ack_failed = true;
+	}
+	for(i=0; i<wal_ack_count; i++){
+		context = wal_acks[i].context;
+		if(!context) continue;
+		wal_acks[i].context = NULL;
+		context->acks_held--;
+		if(wal_ack_failed){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Client %s disconnected, its messages could not be made durable.", context->id);
+			mqtt3_context_disconnect(db, context);
+		}else{
+			_wal_ack_send(context, wal_acks[i].command, wal_acks[i].mid);
+		}
+	}
+	wal_ack_count = 0;
+	wal_ack_failed = false;
+}
+
+/* Send a PUBACK or PUBREC for an incoming message. If durable is set the
+ * acknowledgement is held until the write-ahead log has been synced, and any
+ * that the client is owed after it are held too, so they stay in order. */
+int mqtt3_wal_ack(struct mosquitto_db *db, struct mosquitto *context, uint8_t command, uint16_t mid, bool durable)
+{
+	struct _wal_ack *acks;
+
+	if(durable && !wal_fptr){
+		/* The log has failed and a new one hasn't been started yet, so the
+		 * message can't be made durable. Disconnecting means the client
+		 * sends it again once it reconnects. */
+		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Client %s disconnected, its messages could not be made durable.", context->id);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	if(!context->acks_held && !durable){
+		return _wal_ack_send(context, command, mid);
+	}
+	if(wal_ack_count == wal_ack_size){
+		acks = _mosquitto_realloc(wal_acks, (wal_ack_size+64)*sizeof(struct _wal_ack));
+		if(!acks) return MOSQ_ERR_NOMEM;
+		wal_acks = acks;
+		wal_ack_size += 64;
+	}
+	if(!wal_ack_count){
+		wal_ack_first = _db_time_ms();
+	}
+	wal_acks[wal_ack_count].context = context;
+	wal_acks[wal_ack_count].mid = mid;
+	wal_acks[wal_ack_count].command = command;
+	wal_ack_count++;
+	context->acks_held++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Forget the acknowledgements held for a client whose connection is going
+ * away. It will send the messages again if it reconnects. */
+void mqtt3_wal_acks_drop(struct mosquitto *context)
+{
+	int i;
+
+	if(!context->acks_held) return;
+	for(i=0; i<wal_ack_count; i++){
+		if(wal_acks[i].context == context){
+			wal_acks[i].context = NULL;
+		}
+	}
+	context->acks_held = 0;
+}
+
+/* The number of milliseconds until held acknowledgements are due to be sent,
+ * or -1 if there are none. */
+int mqtt3_wal_ack_wait(struct mosquitto_db *db)
+{
+	unsigned long elapsed;
+
+	if(!wal_ack_count) return -1;
+	if(wal_ack_count >= db->config->persistence_wal_commit_count) return 0;
+	elapsed = _db_time_ms() - wal_ack_first;
+	if(elapsed >= (unsigned long)db->config->persistence_wal_commit_interval) return 0;
+	return db->config->persistence_wal_commit_interval - elapsed;
+}
+
+static int _db_backup_foreground(struct mosquitto_db *db, bool shutdown)
+{
+	uint32_t generation = wal_generation;
+	unsigned long start;
+
+	if(db->config->persistence_wal){
+		generation = wal_generation + 1;
+	}
+	start = _db_time_ms();
+	/* Spilled messages go with the save, so must be on disk first. */
+	mqtt3_spill_flush(db, false);
+	if(_db_snapshot_write(db, shutdown, generation)){
+		return 1;
+	}
+	_db_backup_stats(db, start);
+
+	mqtt3_spill_sync(db, true);
+	if(db->config->persistence_wal && !shutdown){
+		_wal_open(db, generation);
+		if(wal_old_path) remove(wal_old_path);
+	}else{
+		_wal_close(db, true);
+		if(shutdown && wal_path){
+			_mosquitto_free(wal_path);
+			wal_path = NULL;
+			_mosquitto_free(wal_old_path);
+			wal_old_path = NULL;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+#ifndef WIN32
+/* Save from a forked child process, which sees a point in time copy of the
+ * database while the broker carries on. The result is picked up by
+ * mqtt3_db_backup_check(). */
+static int _db_backup_background(struct mosquitto_db *db)
+{
+	struct mosquitto_msg_store *stored;
+	pid_t pid;
+	uint32_t generation = wal_generation;
+	int i;
+	int rc;
+
+	if(db->config->persistence_wal){
+		generation = wal_generation + 1;
+	}
+
+	/* Anything left in stdio buffers would otherwise be written by both
+	 * processes. */
+	fflush(NULL);
+	backup_start = _db_time_ms();
+	pid = fork();
+	if(pid == -1){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to start background save (%s), saving in the foreground.", strerror(errno));
+		return _db_backup_foreground(db, false);
+	}else if(pid == 0){
+		mqtt3_spill_sync(db, false);
+		rc = _db_snapshot_write(db, false, generation);
+		if(!rc && !db->config->persistence_wal){
+			rc = mqtt3_spill_sync(db, true);
+		}
+		_exit(rc?1:0);
+	}
+	backup_pid = pid;
+
+	/* Everything is in the file being written now, so further changes only
+	 * need logging against it. The current log is kept until the file is in
+	 * place. */
+	stored = db->msg_store;
+	while(stored){
+		stored->persisted = true;
+		stored = stored->next;
+	}
+	for(i=0; i<db->context_count; i++){
+		if(db->contexts[i] && db->contexts[i]->clean_session == false){
+			db->contexts[i]->is_persisted = true;
+		}
+	}
+	if(db->config->persistence_wal){
+		_wal_rotate(db, generation);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _db_backup_wait(struct mosquitto_db *db, bool block)
+{
+	pid_t pid;
+	int status;
+
+	pid = waitpid(backup_pid, &status, block?0:WNOHANG);
+	if(pid == 0) return;
+	backup_pid = 0;
+
+	if(pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+		if(block) return;
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Background save of in-memory database failed, saving in the foreground.");
+		_db_backup_foreground(db, false);
+		return;
+	}
+	_db_backup_stats(db, backup_start);
+	if(wal_old_path){
+		remove(wal_old_path);
+	}
+}
+#endif
+
+/* Called from the main loop to pick up a finished background save. */
+void mqtt3_db_backup_check(struct mosquitto_db *db)
+{
+#ifndef WIN32
+	if(backup_pid){
+		_db_backup_wait(db, false);
+	}
+#endif
+}
+
+int mqtt3_db_backup(struct mosquitto_db *db, bool cleanup, bool shutdown)
+{
+	if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
+#ifndef WIN32
+	if(backup_pid){
+		if(!shutdown){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Background save already in progress.");
+			return MOSQ_ERR_SUCCESS;
+		}
+		/* The save below supersedes it. */
+		kill(backup_pid, SIGKILL);
+		_db_backup_wait(db, true);
+	}
+#endif
+	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", db->config->persistence_filepath);
+	/* The current log is about to be replaced, so anything waiting on it is
+	 * settled first. */
+	if(wal_ack_count){
+		_wal_acks_commit(db);
+	}
+	if(cleanup){
+		mqtt3_db_store_clean(db);
+	}
+
+#ifndef WIN32
+	if(db->config->persistence_background && !shutdown){
+		return _db_backup_background(db);
+	}
+#endif
+	return _db_backup_foreground(db, shutdown);
+}
+
+static int _db_client_msg_restore(struct mosquitto_db *db, struct mosquitto *context, const char *client_id, uint16_t mid, uint8_t qos, uint8_t retain, uint8_t direction, uint8_t state, uint8_t dup, uint64_t store_id)
+{
+	struct mosquitto_client_msg *cmsg;
+	struct mosquitto_msg_store *store;
+
+	cmsg = _mosquitto_calloc(1, sizeof(struct mosquitto_client_msg));
+	if(!cmsg){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+
+	cmsg->store = NULL;
+	cmsg->mid = mid;
+	cmsg->qos = qos;
+	cmsg->retain = retain;
+	cmsg->direction = direction;
 	cmsg->state = state;
 	cmsg->dup = dup;
 
-	store = db->msg_store;
-	while(store){
-		if(store->db_id == store_id){
-			cmsg->store = store;
-			cmsg->store->ref_count++;
-			break;
+	store = _db_store_get(db, store_id);
+	if(store){
+		cmsg->store = store;
+		cmsg->store->ref_count++;
+		if(lazy_loading){
+			_db_store_lazy_release(store_id);
 		}
-		store = store->next;
-	}
-	if(!cmsg->store){
+	}else{
 		_mosquitto_free(cmsg);
+		if(wal_replaying){
+			/* Only possible if the machine failed during a background
+			 * save, in which case this message was never saved. */
+			_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Ignoring message for client %s missing from write-ahead log.", client_id);
+			return MOSQ_ERR_SUCCESS;
+		}else if(lazy_loading){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Ignoring message for client %s missing from persistent database.", client_id);
+			return MOSQ_ERR_SUCCESS;
+		}
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
 		return 1;
 	}
-	context = _db_find_or_add_context(db, client_id, 0);
+	if(!context){
+		context = _db_find_or_add_context(db, client_id, 0);
+	}
 	if(!context){
 		_mosquitto_free(cmsg);
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
 		return 1;
 	}
+	if(context->lazy){
+		/* Added by the write-ahead log, so goes after the queue in the
+		 * database file. */
+		mqtt3_db_lazy_load(db, context);
+	}
 	if(context->msgs){
 		context->last_msg->next = cmsg;
 	}else{
@@ -476,41 +1763,50 @@ static int _db_client_msg_restore(struct mosquitto_db *db, const char *client_id
 	}
 	cmsg->next = NULL;
 	context->last_msg = cmsg;
+	context->msg_count++;
+	if(cmsg->qos > 0){
+		context->msg_count12++;
+	}
+	context->msg_bytes += cmsg->store->msg.payloadlen;
+	if(direction == mosq_md_out){
+		mqtt3_db_expiry_context_add(context, cmsg->store);
+	}
+	if(wal_replaying && direction == mosq_md_out && mid){
+		/* The last_mid saved with the client may be older than this. */
+		context->last_mid = mid;
+	}
 
 	return MOSQ_ERR_SUCCESS;
 }
 
-static int _db_client_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+static int _db_client_chunk_restore(struct mosquitto_db *db, struct _db_chunk *chunk)
 {
 	uint16_t i16temp, slen, last_mid;
 	char *client_id = NULL;
 	int rc = 0;
 	struct mosquitto *context;
 	time_t disconnect_t;
-	struct _clientid_index_hash *new_cih;
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
 	slen = ntohs(i16temp);
 	if(!slen){
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
-		fclose(db_fptr);
 		return 1;
 	}
 	client_id = _mosquitto_calloc(slen+1, sizeof(char));
 	if(!client_id){
-		fclose(db_fptr);
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return MOSQ_ERR_NOMEM;
 	}
-	read_e(db_fptr, client_id, slen);
+	chunk_read_e(chunk, client_id, slen);
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
 	last_mid = ntohs(i16temp);
 
 	if(db_version == 2){
 		disconnect_t = mosquitto_time();
 	}else{
-		read_e(db_fptr, &disconnect_t, sizeof(time_t));
+		chunk_read_e(chunk, &disconnect_t, sizeof(time_t));
 	}
 
 	context = _db_find_or_add_context(db, client_id, last_mid);
@@ -520,75 +1816,61 @@ static int _db_client_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
 		rc = 1;
 	}
 
-	_mosquitto_free(client_id);
-
-	if(!rc){
-		new_cih = _mosquitto_malloc(sizeof(struct _clientid_index_hash));
-		if(!new_cih){
-			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-			return MOSQ_ERR_NOMEM;
-		}
-		new_cih->id = context->id;
-		new_cih->db_context_index = context->db_index;
-		HASH_ADD_KEYPTR(hh, db->clientid_index_hash, context->id, strlen(context->id), new_cih);
-	}
+	_mosquitto_free(client_id);
+
 	return rc;
 error:
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
-	fclose(db_fptr);
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
 	if(client_id) _mosquitto_free(client_id);
 	return 1;
 }
 
-static int _db_client_msg_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+/* context is the client the message is for if known, otherwise it is found
+ * or added using the client id in the chunk. */
+static int _db_client_msg_chunk_restore(struct mosquitto_db *db, struct _db_chunk *chunk, struct mosquitto *context)
 {
 	dbid_t i64temp, store_id;
 	uint16_t i16temp, slen, mid;
 	uint8_t qos, retain, direction, state, dup;
 	char *client_id = NULL;
 	int rc;
-	char err[256];
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
 	slen = ntohs(i16temp);
 	if(!slen){
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
-		fclose(db_fptr);
 		return 1;
 	}
 	client_id = _mosquitto_calloc(slen+1, sizeof(char));
 	if(!client_id){
-		fclose(db_fptr);
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return MOSQ_ERR_NOMEM;
 	}
-	read_e(db_fptr, client_id, slen);
+	chunk_read_e(chunk, client_id, slen);
 
-	read_e(db_fptr, &i64temp, sizeof(dbid_t));
+	chunk_read_e(chunk, &i64temp, sizeof(dbid_t));
 	store_id = i64temp;
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
 	mid = ntohs(i16temp);
 
-	read_e(db_fptr, &qos, sizeof(uint8_t));
-	read_e(db_fptr, &retain, sizeof(uint8_t));
-	read_e(db_fptr, &direction, sizeof(uint8_t));
-	read_e(db_fptr, &state, sizeof(uint8_t));
-	read_e(db_fptr, &dup, sizeof(uint8_t));
+	chunk_read_e(chunk, &qos, sizeof(uint8_t));
+	chunk_read_e(chunk, &retain, sizeof(uint8_t));
+	chunk_read_e(chunk, &direction, sizeof(uint8_t));
+	chunk_read_e(chunk, &state, sizeof(uint8_t));
+	chunk_read_e(chunk, &dup, sizeof(uint8_t));
 
-	rc = _db_client_msg_restore(db, client_id, mid, qos, retain, direction, state, dup, store_id);
+	rc = _db_client_msg_restore(db, context, client_id, mid, qos, retain, direction, state, dup, store_id);
 	_mosquitto_free(client_id);
 
 	return rc;
 error:
-	strerror_r(errno, err, 256);
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	fclose(db_fptr);
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
 	if(client_id) _mosquitto_free(client_id);
 	return 1;
 }
 
-static int _db_msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+static int _db_msg_store_chunk_restore(struct mosquitto_db *db, struct _db_chunk *chunk)
 {
 	dbid_t i64temp, store_id;
 	uint32_t i32temp, payloadlen;
@@ -598,157 +1880,713 @@ static int _db_msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
 	char *topic = NULL;
 	int rc = 0;
 	struct mosquitto_msg_store *stored = NULL;
-	char err[256];
 
-	read_e(db_fptr, &i64temp, sizeof(dbid_t));
+	chunk_read_e(chunk, &i64temp, sizeof(dbid_t));
 	store_id = i64temp;
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
 	slen = ntohs(i16temp);
 	if(slen){
 		source_id = _mosquitto_calloc(slen+1, sizeof(char));
 		if(!source_id){
-			fclose(db_fptr);
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 			return MOSQ_ERR_NOMEM;
 		}
-		read_e(db_fptr, source_id, slen);
+		chunk_read_e(chunk, source_id, slen);
 	}
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
 	source_mid = ntohs(i16temp);
 
 	/* This is the mid - don't need it */
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
 	slen = ntohs(i16temp);
 	if(slen){
 		topic = _mosquitto_calloc(slen+1, sizeof(char));
 		if(!topic){
-			fclose(db_fptr);
 			if(source_id) _mosquitto_free(source_id);
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 			return MOSQ_ERR_NOMEM;
 		}
-		read_e(db_fptr, topic, slen);
+		chunk_read_e(chunk, topic, slen);
 	}else{
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid msg_store chunk when restoring persistent database.");
-		fclose(db_fptr);
 		if(source_id) _mosquitto_free(source_id);
 		return 1;
 	}
-	read_e(db_fptr, &qos, sizeof(uint8_t));
-	read_e(db_fptr, &retain, sizeof(uint8_t));
+	chunk_read_e(chunk, &qos, sizeof(uint8_t));
+	chunk_read_e(chunk, &retain, sizeof(uint8_t));
 	
-	read_e(db_fptr, &i32temp, sizeof(uint32_t));
+	chunk_read_e(chunk, &i32temp, sizeof(uint32_t));
 	payloadlen = ntohl(i32temp);
 
 	if(payloadlen){
 		payload = _mosquitto_malloc(payloadlen);
 		if(!payload){
-			fclose(db_fptr);
 			if(source_id) _mosquitto_free(source_id);
 			_mosquitto_free(topic);
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 			return MOSQ_ERR_NOMEM;
 		}
-		read_e(db_fptr, payload, payloadlen);
+		chunk_read_e(chunk, payload, payloadlen);
 	}
 
 	rc = mqtt3_db_message_store(db, source_id, source_mid, topic, qos, payloadlen, payload, retain, &stored, store_id);
+	if(!rc){
+		stored->persisted = true;
+		if(store_id > db->last_db_id){
+			db->last_db_id = store_id;
+		}
+		rc = _db_store_index_add(stored);
+		if(rc){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		}
+	}
 	if(source_id) _mosquitto_free(source_id);
 	_mosquitto_free(topic);
 	_mosquitto_free(payload);
 
 	return rc;
 error:
-	strerror_r(errno, err, 256);
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	fclose(db_fptr);
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
 	if(source_id) _mosquitto_free(source_id);
 	if(topic) _mosquitto_free(topic);
 	if(payload) _mosquitto_free(payload);
 	return 1;
 }
 
-static int _db_retain_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+/* With persistence_lazy_load, stored messages are only indexed while
+ * restoring and read from lazy_fptr when first needed. */
+static int _db_msg_store_chunk_index(struct mosquitto_db *db, struct _db_chunk *chunk, long offset, uint32_t inner)
+{
+	struct _db_store_index *index;
+	dbid_t i64temp;
+
+	chunk_read_e(chunk, &i64temp, sizeof(dbid_t));
+	if(i64temp > db->last_db_id){
+		db->last_db_id = i64temp;
+	}
+
+	index = _mosquitto_calloc(1, sizeof(struct _db_store_index));
+	if(!index){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	index->db_id = i64temp;
+	index->offset = offset;
+	index->inner = inner;
+	HASH_ADD(hh, store_index, db_id, sizeof(dbid_t), index);
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+/* With persistence_lazy_load, queued messages are only indexed against
+ * their client while restoring, and loaded by mqtt3_db_lazy_load(). */
+static int _db_client_msg_chunk_index(struct mosquitto_db *db, struct _db_chunk *chunk, long offset, uint32_t inner)
+{
+	struct _db_store_index *index;
+	struct _mosquitto_lazy *lazy;
+	struct _mosquitto_lazy_msg *tmp_msgs;
+	struct mosquitto *context;
+	dbid_t i64temp;
+	uint16_t i16temp, slen;
+	char *client_id = NULL;
+	int size;
+
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
+	slen = ntohs(i16temp);
+	if(!slen){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+		return 1;
+	}
+	client_id = _mosquitto_calloc(slen+1, sizeof(char));
+	if(!client_id){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	chunk_read_e(chunk, client_id, slen);
+	chunk_read_e(chunk, &i64temp, sizeof(dbid_t));
+
+	HASH_FIND(hh, store_index, &i64temp, sizeof(dbid_t), index);
+	if(!index){
+		_mosquitto_free(client_id);
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
+		return 1;
+	}
+	context = _db_find_or_add_context(db, client_id, 0);
+	_mosquitto_free(client_id);
+	client_id = NULL;
+	if(!context){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
+		return 1;
+	}
+
+	lazy = context->lazy;
+	if(!lazy){
+		lazy = _mosquitto_calloc(1, sizeof(struct _mosquitto_lazy));
+		if(!lazy){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return MOSQ_ERR_NOMEM;
+		}
+		context->lazy = lazy;
+		lazy_context_count++;
+	}
+	if(lazy->count == lazy->size){
+		size = lazy->size ? lazy->size*2 : 8;
+		tmp_msgs = _mosquitto_realloc(lazy->msgs, sizeof(struct _mosquitto_lazy_msg)*size);
+		if(!tmp_msgs){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return MOSQ_ERR_NOMEM;
+		}
+		lazy->msgs = tmp_msgs;
+		lazy->size = size;
+	}
+	lazy->msgs[lazy->count].offset = offset;
+	lazy->msgs[lazy->count].inner = inner;
+	lazy->count++;
+	index->lazy_refs++;
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	if(client_id) _mosquitto_free(client_id);
+	return 1;
+}
+
+static struct mosquitto_msg_store *_db_store_get(struct mosquitto_db *db, dbid_t db_id)
+{
+	struct _db_store_index *index;
+	struct _db_chunk chunk;
+
+	HASH_FIND(hh, store_index, &db_id, sizeof(dbid_t), index);
+	if(!index) return NULL;
+
+	if(!index->store && index->offset && lazy_fptr){
+		if(_db_chunk_load(&lazy_reader, lazy_fptr, index->offset, index->inner, &chunk)
+				|| _db_msg_store_chunk_restore(db, &chunk)){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to read stored message from persistent database.");
+			return NULL;
+		}
+		/* index->store has been set by _db_store_index_add(). */
+		if(index->store && index->lazy_refs > 0){
+			index->store->ref_count++;
+		}
+	}
+	return index->store;
+}
+
+static void _db_lazy_free(struct mosquitto *context)
+{
+	_mosquitto_free(context->lazy->msgs);
+	_mosquitto_free(context->lazy);
+	context->lazy = NULL;
+
+	lazy_context_count--;
+	if(lazy_context_count == 0 && !restoring){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "All queued messages loaded from persistent database.");
+		_db_lazy_close();
+	}
+}
+
+/* Load the queued messages for a client restored with
+ * persistence_lazy_load, ahead of any already in memory. */
+int mqtt3_db_lazy_load(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct _mosquitto_lazy *lazy;
+	struct mosquitto_client_msg *msgs, *last_msg;
+	struct _db_chunk chunk;
+	int msg_count, msg_count12;
+	unsigned long msg_bytes;
+	int i;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	assert(db);
+	assert(context);
+
+	lazy = context->lazy;
+	if(!lazy) return MOSQ_ERR_SUCCESS;
+
+	msgs = context->msgs;
+	last_msg = context->last_msg;
+	msg_count = context->msg_count;
+	msg_count12 = context->msg_count12;
+	msg_bytes = context->msg_bytes;
+	context->msgs = NULL;
+	context->last_msg = NULL;
+	context->msg_count = 0;
+	context->msg_count12 = 0;
+	context->msg_bytes = 0;
+
+	context->lazy = NULL;
+	lazy_loading = true;
+	for(i=0; i<lazy->count; i++){
+		if(!lazy_fptr || _db_chunk_load(&lazy_reader, lazy_fptr, lazy->msgs[i].offset, lazy->msgs[i].inner, &chunk)
+				|| _db_client_msg_chunk_restore(db, &chunk, context)){
+
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to load queued messages from persistent database.");
+			rc = 1;
+			break;
+		}
+	}
+	lazy_loading = false;
+	context->lazy = lazy;
+
+	if(msgs){
+		if(context->last_msg){
+			context->last_msg->next = msgs;
+		}else{
+			context->msgs = msgs;
+		}
+		context->last_msg = last_msg;
+	}
+	context->msg_count += msg_count;
+	context->msg_count12 += msg_count12;
+	context->msg_bytes += msg_bytes;
+
+	if(!rc && mqtt3_db_conflate_rebuild(context)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		rc = MOSQ_ERR_NOMEM;
+	}
+	_db_lazy_free(context);
+	return rc;
+}
+
+/* Drop the queued messages for a client restored with persistence_lazy_load
+ * without loading them. */
+void mqtt3_db_lazy_discard(struct mosquitto *context)
+{
+	struct _mosquitto_lazy *lazy;
+	struct _db_chunk chunk;
+	dbid_t i64temp;
+	uint16_t i16temp;
+	int i;
+
+	assert(context);
+
+	lazy = context->lazy;
+	if(!lazy) return;
+
+	for(i=0; i<lazy->count && lazy_fptr; i++){
+		if(_db_chunk_load(&lazy_reader, lazy_fptr, lazy->msgs[i].offset, lazy->msgs[i].inner, &chunk)) break;
+		/* Only the store id is needed, which follows the client id. */
+		if(_db_chunk_read(&chunk, &i16temp, sizeof(uint16_t))) break;
+		chunk.pos += ntohs(i16temp);
+		if(_db_chunk_read(&chunk, &i64temp, sizeof(dbid_t))) break;
+		_db_store_lazy_release(i64temp);
+	}
+	_db_lazy_free(context);
+}
+
+/* Queue a subscription from the database file. */
+static int _db_sub_batch_add(struct _db_sub_batch *batch, struct mosquitto *context, char *topic, int qos, int order)
+{
+	struct _mosquitto_sub_restore *tmp_subs;
+	int size;
+
+	if(batch->count == batch->size){
+		size = batch->size ? batch->size*2 : 1024;
+		tmp_subs = _mosquitto_realloc(batch->subs, sizeof(struct _mosquitto_sub_restore)*size);
+		if(!tmp_subs){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return MOSQ_ERR_NOMEM;
+		}
+		batch->subs = tmp_subs;
+		batch->size = size;
+	}
+	batch->subs[batch->count].context = context;
+	batch->subs[batch->count].topic = topic;
+	batch->subs[batch->count].qos = qos;
+	batch->subs[batch->count].order = order;
+	batch->count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Return the topic kept for a tree node numbered in a DB_CHUNK_CLIENT_SUBS,
+ * copying it from topic if this is the first subscription seen on it. */
+static char *_db_sub_node_topic(uint32_t node, const char *topic, uint16_t len)
+{
+	char **tmp_topics;
+	uint32_t size;
+
+	if(node >= sub_node_size){
+		size = sub_node_size ? sub_node_size : 1024;
+		while(size <= node){
+			if(size > UINT32_MAX/2) return NULL;
+			size *= 2;
+		}
+		tmp_topics = _mosquitto_realloc(sub_node_topics, sizeof(char *)*size);
+		if(!tmp_topics) return NULL;
+		memset(&tmp_topics[sub_node_size], 0, sizeof(char *)*(size-sub_node_size));
+		sub_node_topics = tmp_topics;
+		sub_node_size = size;
+	}
+	if(!sub_node_topics[node]){
+		sub_node_topics[node] = _mosquitto_malloc(len+1);
+		if(!sub_node_topics[node]) return NULL;
+		memcpy(sub_node_topics[node], topic, len);
+		sub_node_topics[node][len] = '\0';
+	}
+	return sub_node_topics[node];
+}
+
+static void _db_sub_node_topics_free(void)
+{
+	uint32_t i;
+
+	for(i=0; i<sub_node_size; i++){
+		if(sub_node_topics[i]) _mosquitto_free(sub_node_topics[i]);
+	}
+	if(sub_node_topics) _mosquitto_free(sub_node_topics);
+	sub_node_topics = NULL;
+	sub_node_size = 0;
+}
+
+static void _db_sub_batch_free(void)
+{
+	int i;
+
+	for(i=0; i<sub_batch.count; i++){
+		_mosquitto_free(sub_batch.subs[i].topic);
+	}
+	if(sub_batch.subs) _mosquitto_free(sub_batch.subs);
+	memset(&sub_batch, 0, sizeof(struct _db_sub_batch));
+	if(sub_node_batch.subs) _mosquitto_free(sub_node_batch.subs);
+	memset(&sub_node_batch, 0, sizeof(struct _db_sub_batch));
+	_db_sub_node_topics_free();
+}
+
+/* Put the subscriptions from DB_CHUNK_CLIENT_SUBS back in the order of the
+ * tree they were saved from, with a counting sort on the node number, so that
+ * they can be added without sorting them by topic. */
+static int _db_sub_node_batch_flush(struct mosquitto_db *db)
+{
+	struct _mosquitto_sub_restore *sorted;
+	uint32_t *start;
+	uint32_t i;
+	int j;
+	int rc;
+
+	if(sub_node_batch.count == 0) return MOSQ_ERR_SUCCESS;
+
+	start = _mosquitto_calloc(sub_node_size+1, sizeof(uint32_t));
+	sorted = _mosquitto_malloc(sizeof(struct _mosquitto_sub_restore)*sub_node_batch.count);
+	if(!start || !sorted){
+		if(start) _mosquitto_free(start);
+		if(sorted) _mosquitto_free(sorted);
+		return MOSQ_ERR_NOMEM;
+	}
+	for(j=0; j<sub_node_batch.count; j++){
+		start[sub_node_batch.subs[j].order+1]++;
+	}
+	for(i=1; i<=sub_node_size; i++){
+		start[i] += start[i-1];
+	}
+	for(j=0; j<sub_node_batch.count; j++){
+		sorted[start[sub_node_batch.subs[j].order]++] = sub_node_batch.subs[j];
+	}
+	_mosquitto_free(start);
+
+	rc = mqtt3_sub_add_batch(db, sorted, sub_node_batch.count, &db->subs, true);
+	_mosquitto_free(sorted);
+	sub_node_batch.count = 0;
+	_db_sub_node_topics_free();
+	return rc;
+}
+
+/* Add the queued subscriptions to the tree, keeping the batch for reuse. */
+static int _db_sub_batch_flush(struct mosquitto_db *db)
+{
+	int rc;
+	int i;
+
+	rc = _db_sub_node_batch_flush(db);
+	if(!rc){
+		rc = mqtt3_sub_add_batch(db, sub_batch.subs, sub_batch.count, &db->subs, false);
+	}
+	for(i=0; i<sub_batch.count; i++){
+		_mosquitto_free(sub_batch.subs[i].topic);
+	}
+	sub_batch.count = 0;
+	return rc;
+}
+
+static int _db_retain_chunk_restore(struct mosquitto_db *db, struct _db_chunk *chunk)
 {
 	dbid_t i64temp, store_id;
 	struct mosquitto_msg_store *store;
-	char err[256];
+	struct _mosquitto_sub_restore entry;
+	int rc;
 
-	if(fread(&i64temp, sizeof(dbid_t), 1, db_fptr) != 1){
-		strerror_r(errno, err, 256);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-		fclose(db_fptr);
+	if(_db_chunk_read(chunk, &i64temp, sizeof(dbid_t))){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
 		return 1;
 	}
 	store_id = i64temp;
-	store = db->msg_store;
-	while(store){
-		if(store->db_id == store_id){
-			mqtt3_db_messages_queue(db, NULL, store->msg.topic, store->msg.qos, store->msg.retain, store);
-			break;
+	store = _db_store_get(db, store_id);
+	if(store){
+		/* Retained messages are queued to the subscriptions read before
+		 * them. Adding the branch for the message through the batch as well
+		 * means mqtt3_db_messages_queue() won't need to add any nodes. */
+		rc = _db_sub_batch_flush(db);
+		if(!rc){
+			entry.context = NULL;
+			entry.topic = store->msg.topic;
+			entry.qos = 0;
+			entry.order = 0;
+			rc = mqtt3_sub_add_batch(db, &entry, 1, &db->subs, false);
+		}
+		if(rc){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return 1;
+		}
+		mqtt3_db_messages_queue(db, NULL, store->msg.topic, store->msg.qos, store->msg.retain, store);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_sub_chunk_restore(struct mosquitto_db *db, struct _db_chunk *chunk)
+{
+	struct mosquitto *context;
+	uint16_t i16temp, slen;
+	uint8_t qos;
+	char *client_id = NULL;
+	char *topic = NULL;
+	int rc = 0;
+
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
+	slen = ntohs(i16temp);
+	client_id = _mosquitto_calloc(slen+1, sizeof(char));
+	if(!client_id){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	chunk_read_e(chunk, client_id, slen);
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
+	slen = ntohs(i16temp);
+	topic = _mosquitto_calloc(slen+1, sizeof(char));
+	if(!topic){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		_mosquitto_free(client_id);
+		return MOSQ_ERR_NOMEM;
+	}
+	chunk_read_e(chunk, topic, slen);
+	chunk_read_e(chunk, &qos, sizeof(uint8_t));
+	if(wal_replaying){
+		if(_db_restore_sub(db, client_id, topic, qos)){
+			rc = 1;
+		}
+		_mosquitto_free(topic);
+	}else{
+		context = _db_find_or_add_context(db, client_id, 0);
+		if(context){
+			rc = _db_sub_batch_add(&sub_batch, context, topic, qos, sub_batch.count);
+		}else{
+			rc = 1;
+		}
+		if(rc){
+			_mosquitto_free(topic);
+		}
+	}
+	_mosquitto_free(client_id);
+
+	return rc;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	if(client_id) _mosquitto_free(client_id);
+	if(topic) _mosquitto_free(topic);
+	return 1;
+}
+
+/* Read a variable length integer written by _db_varint_write(). */
+static int _db_chunk_varint_read(struct _db_chunk *chunk, uint32_t *value)
+{
+	uint8_t byte;
+	uint32_t multiplier = 1;
+	int i;
+
+	*value = 0;
+	for(i=0; i<5; i++){
+		if(_db_chunk_read(chunk, &byte, sizeof(uint8_t))) return 1;
+		*value += (byte & 127) * multiplier;
+		if(!(byte & 128)) return MOSQ_ERR_SUCCESS;
+		multiplier *= 128;
+	}
+	return 1;
+}
+
+/* Queue the subscriptions of a client from a DB_CHUNK_CLIENT_SUBS. Each is
+ * stored as the difference between the number of its tree node and that of
+ * the previous subscription, the number of leading bytes its topic shares
+ * with the previous topic, the rest of the topic, and the QoS. */
+static int _db_client_subs_chunk_restore(struct mosquitto_db *db, struct _db_chunk *chunk)
+{
+	struct mosquitto *context;
+	uint32_t i32temp, count, i;
+	uint32_t node = 0, delta;
+	uint16_t i16temp, slen, shared, prev_len = 0;
+	uint8_t qos;
+	char *client_id = NULL;
+	char topic[UINT16_MAX+1];
+	char *node_topic;
+
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
+	slen = ntohs(i16temp);
+	client_id = _mosquitto_calloc(slen+1, sizeof(char));
+	if(!client_id) goto nomem;
+	chunk_read_e(chunk, client_id, slen);
+	context = _db_find_or_add_context(db, client_id, 0);
+	_mosquitto_free(client_id);
+	client_id = NULL;
+	if(!context) return 1;
+
+	chunk_read_e(chunk, &i32temp, sizeof(uint32_t));
+	count = ntohl(i32temp);
+	for(i=0; i<count; i++){
+		if(_db_chunk_varint_read(chunk, &delta)) goto error;
+		if(i > 0 && delta == 0) goto error;
+		node += delta;
+		chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
+		shared = ntohs(i16temp);
+		chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
+		slen = ntohs(i16temp);
+		if(shared > prev_len || (uint32_t)shared + slen > UINT16_MAX) goto error;
+		chunk_read_e(chunk, &topic[shared], slen);
+		prev_len = shared + slen;
+		chunk_read_e(chunk, &qos, sizeof(uint8_t));
+
+		node_topic = _db_sub_node_topic(node, topic, prev_len);
+		if(!node_topic) goto nomem;
+		if(_db_sub_batch_add(&sub_node_batch, context, node_topic, qos, node)) return 1;
+	}
+	return MOSQ_ERR_SUCCESS;
+nomem:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+	if(client_id) _mosquitto_free(client_id);
+	return MOSQ_ERR_NOMEM;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
+}
+
+/* Count the client chunks that follow, reading only the chunk headers, then
+ * return to the current position. Clients inside blocks aren't counted. */
+static int _db_client_chunk_count(FILE *db_fptr, bool crc)
+{
+	uint32_t i32temp;
+	uint16_t i16temp;
+	long pos;
+	int count = 0;
+
+	pos = ftell(db_fptr);
+	if(pos < 0) return 0;
+
+	while(fread(&i16temp, sizeof(uint16_t), 1, db_fptr) == 1){
+		if(fread(&i32temp, sizeof(uint32_t), 1, db_fptr) != 1) break;
+		if(ntohs(i16temp) == DB_CHUNK_CLIENT){
+			count++;
 		}
-		store = store->next;
+		if(fseek(db_fptr, ntohl(i32temp) + (crc ? sizeof(uint32_t) : 0), SEEK_CUR)) break;
+	}
+	clearerr(db_fptr);
+	if(fseek(db_fptr, pos, SEEK_SET)) return 0;
+	return count;
+}
+
+/* offset and inner are the position of the chunk, for
+ * persistence_lazy_load. */
+static int _db_chunk_restore(struct mosquitto_db *db, struct _db_chunk *chunk, long offset, uint32_t inner)
+{
+	dbid_t i64temp;
+	uint32_t i32temp;
+	uint8_t i8temp;
+
+	switch(chunk->type){
+		case DB_CHUNK_CFG:
+			chunk_read_e(chunk, &i8temp, sizeof(uint8_t)); // shutdown
+			chunk_read_e(chunk, &i8temp, sizeof(uint8_t)); // sizeof(dbid_t)
+			if(i8temp != sizeof(dbid_t)){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Incompatible database configuration (dbid size is %d bytes, expected %lu)",
+						i8temp, (unsigned long)sizeof(dbid_t));
+				return 1;
+			}
+			chunk_read_e(chunk, &i64temp, sizeof(dbid_t));
+			db->last_db_id = i64temp;
+			return MOSQ_ERR_SUCCESS;
+
+		case DB_CHUNK_WAL_GEN:
+			chunk_read_e(chunk, &i32temp, sizeof(uint32_t));
+			wal_generation = ntohl(i32temp);
+			return MOSQ_ERR_SUCCESS;
+
+		case DB_CHUNK_MSG_STORE:
+			if(lazy_fptr){
+				return _db_msg_store_chunk_index(db, chunk, offset, inner);
+			}else{
+				return _db_msg_store_chunk_restore(db, chunk);
+			}
+
+		case DB_CHUNK_CLIENT_MSG:
+			if(lazy_fptr){
+				return _db_client_msg_chunk_index(db, chunk, offset, inner);
+			}else{
+				return _db_client_msg_chunk_restore(db, chunk, NULL);
+			}
+
+		case DB_CHUNK_RETAIN:
+			return _db_retain_chunk_restore(db, chunk);
+
+		case DB_CHUNK_SUB:
+			return _db_sub_chunk_restore(db, chunk);
+
+		case DB_CHUNK_CLIENT_SUBS:
+			return _db_client_subs_chunk_restore(db, chunk);
+
+		case DB_CHUNK_CLIENT:
+			return _db_client_chunk_restore(db, chunk);
+
+		default:
+			_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk->type);
+			return MOSQ_ERR_SUCCESS;
 	}
-	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+	return 1;
 }
 
-static int _db_sub_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+static int _db_block_restore(struct mosquitto_db *db, struct _db_chunk *block, long offset)
 {
-	uint16_t i16temp, slen;
-	uint8_t qos;
-	char *client_id;
-	char *topic;
-	int rc = 0;
-	char err[256];
+	struct _db_chunk chunk;
+	uint32_t pos = 0, next;
 
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	client_id = _mosquitto_calloc(slen+1, sizeof(char));
-	if(!client_id){
-		fclose(db_fptr);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		return MOSQ_ERR_NOMEM;
-	}
-	read_e(db_fptr, client_id, slen);
-	read_e(db_fptr, &i16temp, sizeof(uint16_t));
-	slen = ntohs(i16temp);
-	topic = _mosquitto_calloc(slen+1, sizeof(char));
-	if(!topic){
-		fclose(db_fptr);
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		_mosquitto_free(client_id);
-		return MOSQ_ERR_NOMEM;
-	}
-	read_e(db_fptr, topic, slen);
-	read_e(db_fptr, &qos, sizeof(uint8_t));
-	if(_db_restore_sub(db, client_id, topic, qos)){
-		rc = 1;
+	if(_db_block_inflate(&restore_reader, block)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+		return 1;
 	}
-	_mosquitto_free(client_id);
-	_mosquitto_free(topic);
+	while(pos < restore_reader.block_len){
+		if(_db_chunk_parse(restore_reader.block, restore_reader.block_len, pos, true, &chunk, &next)
+				|| chunk.type == DB_CHUNK_BLOCK){
 
-	return rc;
-error:
-	strerror_r(errno, err, 256);
-	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-	fclose(db_fptr);
-	return 1;
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+			return 1;
+		}
+		if(_db_chunk_restore(db, &chunk, offset, pos)) return 1;
+		pos = next;
+	}
+	return MOSQ_ERR_SUCCESS;
 }
 
-int mqtt3_db_restore(struct mosquitto_db *db)
+static int _db_snapshot_restore(struct mosquitto_db *db)
 {
 	FILE *fptr;
 	char header[15];
 	int rc = 0;
 	uint32_t crc;
-	dbid_t i64temp;
-	uint32_t i32temp, length;
-	uint16_t i16temp, chunk;
-	uint8_t i8temp;
-	ssize_t rlen;
+	uint32_t i32temp;
+	struct _db_chunk chunk;
 	char err[256];
 
 	assert(db);
@@ -757,6 +2595,13 @@ int mqtt3_db_restore(struct mosquitto_db *db)
 
 	fptr = _mosquitto_fopen(db->config->persistence_filepath, "rb");
 	if(fptr == NULL) return MOSQ_ERR_SUCCESS;
+	if(restore_buffer){
+		setvbuf(fptr, restore_buffer, _IOFBF, DB_RESTORE_BUFFER_SIZE);
+	}
+	if(fseek(fptr, 0, SEEK_END)) goto error;
+	restore_reader.file_size = ftell(fptr);
+	if(restore_reader.file_size < 0 || fseek(fptr, 0, SEEK_SET)) goto error;
+
 	read_e(fptr, &header, 15);
 	if(!memcmp(header, magic, 15)){
 		// Restore DB as normal
@@ -775,52 +2620,56 @@ int mqtt3_db_restore(struct mosquitto_db *db)
 				return 1;
 			}
 		}
+		if(db_version >= 4){
+			/* Addition of CRCs and compressed blocks in v4. */
+			if(ntohl(crc) != _mosquitto_crc32c(_mosquitto_crc32c(0, header, 15), &i32temp, sizeof(uint32_t))){
+				fclose(fptr);
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database.");
+				return 1;
+			}
+		}
+		restore_reader.version = db_version;
+		restore_reader.pos = 15 + 2*sizeof(uint32_t);
+
+		if(db->config->persistence_lazy_load){
+			/* A second handle, because messages are read from here at
+			 * random, where the large buffer used for restoring would only
+			 * slow things down. */
+			lazy_fptr = _mosquitto_fopen(db->config->persistence_filepath, "rb");
+			lazy_reader.version = db_version;
+		}
+		if(_db_contexts_reserve(db, _db_client_chunk_count(fptr, db_version >= 4))){
+			fclose(fptr);
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return 1;
+		}
 
-		while(rlen = fread(&i16temp, sizeof(uint16_t), 1, fptr), rlen == 1){
-			chunk = ntohs(i16temp);
-			read_e(fptr, &i32temp, sizeof(uint32_t));
-			length = ntohl(i32temp);
-			switch(chunk){
-				case DB_CHUNK_CFG:
-					read_e(fptr, &i8temp, sizeof(uint8_t)); // shutdown
-					read_e(fptr, &i8temp, sizeof(uint8_t)); // sizeof(dbid_t)
-					if(i8temp != sizeof(dbid_t)){
-						_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Incompatible database configuration (dbid size is %d bytes, expected %lu)",
-								i8temp, (unsigned long)sizeof(dbid_t));
-						fclose(fptr);
-						return 1;
-					}
-					read_e(fptr, &i64temp, sizeof(dbid_t));
-					db->last_db_id = i64temp;
-					break;
-
-				case DB_CHUNK_MSG_STORE:
-					if(_db_msg_store_chunk_restore(db, fptr)) return 1;
-					break;
-
-				case DB_CHUNK_CLIENT_MSG:
-					if(_db_client_msg_chunk_restore(db, fptr)) return 1;
-					break;
-
-				case DB_CHUNK_RETAIN:
-					if(_db_retain_chunk_restore(db, fptr)) return 1;
-					break;
-
-				case DB_CHUNK_SUB:
-					if(_db_sub_chunk_restore(db, fptr)) return 1;
-					break;
-
-				case DB_CHUNK_CLIENT:
-					if(_db_client_chunk_restore(db, fptr)) return 1;
-					break;
-
-				default:
-					_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
-					fseek(fptr, length, SEEK_CUR);
-					break;
+		while(1){
+			rc = _db_chunk_fread(&restore_reader, fptr, db_version >= 4, &chunk);
+			if(rc == DB_READ_END){
+				rc = MOSQ_ERR_SUCCESS;
+				break;
+			}else if(rc == DB_READ_NOMEM){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			}else if(rc){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt persistent database at offset %ld.", restore_reader.offset);
+			}else if(chunk.type == DB_CHUNK_BLOCK){
+				rc = _db_block_restore(db, &chunk, restore_reader.offset);
+			}else{
+				rc = _db_chunk_restore(db, &chunk, restore_reader.offset, 0);
 			}
+			if(rc){
+				fclose(fptr);
+				return 1;
+			}
+		}
+		rc = _db_sub_batch_flush(db);
+		mqtt3_sub_add_batch_end();
+		if(rc){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			fclose(fptr);
+			return 1;
 		}
-		if(rlen < 0) goto error;
 	}else{
 		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore persistent database. Unrecognised file format.");
 		rc = 1;
@@ -846,7 +2695,553 @@ static int _db_restore_sub(struct mosquitto_db *db, const char *client_id, const
 
 	context = _db_find_or_add_context(db, client_id, 0);
 	if(!context) return 1;
-	return mqtt3_sub_add(db, context, sub, qos, &db->subs);
+	return mqtt3_sub_add(db, context, sub, qos, mosq_sa_check, &db->subs);
+}
+
+/* Start a chunk with the client id, which starts the body of every chunk
+ * type that is only used in the write-ahead log. */
+static int _wal_chunk_begin(uint16_t chunk, const char *id)
+{
+	uint16_t i16temp, slen;
+
+	slen = strlen(id);
+	if(_db_chunk_begin(&wal_writer, chunk)) return 1;
+	i16temp = htons(slen);
+	if(_db_write(&wal_writer, &i16temp, sizeof(uint16_t))) return 1;
+	return _db_write(&wal_writer, id, slen);
+}
+
+/* Messages are written to the log the first time a client message refers to
+ * them. Removal of unreferenced messages isn't logged, they are cleaned up
+ * again after a restore. */
+static int _wal_store_ensure(struct mosquitto_msg_store *stored)
+{
+	if(stored->persisted) return MOSQ_ERR_SUCCESS;
+	return _db_msg_store_chunk_write(&wal_writer, stored);
+}
+
+void mqtt3_wal_client(struct mosquitto *context)
+{
+	if(!wal_fptr || context->clean_session || !context->id) return;
+
+	if(_db_client_chunk_write(&wal_writer, context)){
+		_wal_write_error();
+		return;
+	}
+	wal_dirty = true;
+}
+
+void mqtt3_wal_client_delete(struct mosquitto *context)
+{
+	if(!context->is_persisted) return;
+	context->is_persisted = false;
+	if(!wal_fptr || !context->id) return;
+
+	if(_wal_chunk_begin(DB_CHUNK_CLIENT_DELETE, context->id) || _db_chunk_end(&wal_writer)){
+		_wal_write_error();
+		return;
+	}
+	wal_dirty = true;
+}
+
+void mqtt3_wal_client_msg_add(struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	if(!wal_fptr || !context->is_persisted) return;
+	/* QoS 0 messages that are about to be sent aren't worth recovering. */
+	if(cmsg->qos == 0 && cmsg->state != mosq_ms_queued) return;
+
+	if(_wal_store_ensure(cmsg->store) || _db_client_msg_chunk_write(&wal_writer, context, cmsg)){
+		_wal_write_error();
+		return;
+	}
+	wal_dirty = true;
+}
+
+void mqtt3_wal_client_msg_update(struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	uint16_t i16temp;
+	uint8_t i8temp;
+
+	if(!wal_fptr || !context->is_persisted) return;
+
+	if(_wal_chunk_begin(DB_CHUNK_CLIENT_MSG_UPDATE, context->id)) goto error;
+	i16temp = htons(cmsg->mid);
+	chunk_write_e(&wal_writer, &i16temp, sizeof(uint16_t));
+	i8temp = (uint8_t )cmsg->direction;
+	chunk_write_e(&wal_writer, &i8temp, sizeof(uint8_t));
+	i8temp = (uint8_t )cmsg->state;
+	chunk_write_e(&wal_writer, &i8temp, sizeof(uint8_t));
+	i8temp = (uint8_t )cmsg->dup;
+	chunk_write_e(&wal_writer, &i8temp, sizeof(uint8_t));
+	if(_db_chunk_end(&wal_writer)) goto error;
+
+	wal_dirty = true;
+	return;
+error:
+	_wal_write_error();
+}
+
+void mqtt3_wal_client_msg_delete(struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+	dbid_t i64temp;
+	uint16_t i16temp;
+	uint8_t i8temp;
+
+	if(!wal_fptr || !context->is_persisted) return;
+
+	if(_wal_chunk_begin(DB_CHUNK_CLIENT_MSG_DELETE, context->id)) goto error;
+	i64temp = cmsg->store->db_id;
+	chunk_write_e(&wal_writer, &i64temp, sizeof(dbid_t));
+	i16temp = htons(cmsg->mid);
+	chunk_write_e(&wal_writer, &i16temp, sizeof(uint16_t));
+	i8temp = (uint8_t )cmsg->direction;
+	chunk_write_e(&wal_writer, &i8temp, sizeof(uint8_t));
+	if(_db_chunk_end(&wal_writer)) goto error;
+
+	wal_dirty = true;
+	return;
+error:
+	_wal_write_error();
+}
+
+void mqtt3_wal_client_msgs_delete(struct mosquitto *context)
+{
+	if(!wal_fptr || !context->is_persisted || !context->msgs) return;
+
+	if(_wal_chunk_begin(DB_CHUNK_CLIENT_MSGS_DELETE, context->id) || _db_chunk_end(&wal_writer)){
+		_wal_write_error();
+		return;
+	}
+	wal_dirty = true;
+}
+
+void mqtt3_wal_sub_add(struct mosquitto *context, const char *sub, int qos)
+{
+	if(!wal_fptr || !context->is_persisted) return;
+
+	if(_db_sub_chunk_write(&wal_writer, context->id, sub, (uint8_t )qos)){
+		_wal_write_error();
+		return;
+	}
+	wal_dirty = true;
+}
+
+void mqtt3_wal_sub_delete(struct mosquitto *context, const char *sub)
+{
+	uint16_t i16temp, slen;
+
+	if(!wal_fptr || !context->is_persisted) return;
+
+	slen = strlen(sub);
+	if(_wal_chunk_begin(DB_CHUNK_SUB_DELETE, context->id)) goto error;
+	i16temp = htons(slen);
+	chunk_write_e(&wal_writer, &i16temp, sizeof(uint16_t));
+	chunk_write_e(&wal_writer, sub, slen);
+	if(_db_chunk_end(&wal_writer)) goto error;
+
+	wal_dirty = true;
+	return;
+error:
+	_wal_write_error();
+}
+
+void mqtt3_wal_subs_delete(struct mosquitto *context)
+{
+	if(!wal_fptr || !context->is_persisted) return;
+
+	if(_wal_chunk_begin(DB_CHUNK_SUBS_DELETE, context->id) || _db_chunk_end(&wal_writer)){
+		_wal_write_error();
+		return;
+	}
+	wal_dirty = true;
+}
+
+/* Set the retained message for topic, or clear it if stored is NULL. The body
+ * starts with the topic in place of a client id. */
+void mqtt3_wal_retain(const char *topic, struct mosquitto_msg_store *stored)
+{
+	dbid_t i64temp;
+
+	if(!wal_fptr) return;
+
+	if(stored && _wal_store_ensure(stored)) goto error;
+	if(_wal_chunk_begin(DB_CHUNK_RETAIN_TOPIC, topic)) goto error;
+	i64temp = stored?stored->db_id:0;
+	chunk_write_e(&wal_writer, &i64temp, sizeof(dbid_t));
+	if(_db_chunk_end(&wal_writer)) goto error;
+
+	wal_dirty = true;
+	return;
+error:
+	_wal_write_error();
+}
+
+/* Called from the main loop. Sends held acknowledgements once
+ * persistence_wal_commit_interval or persistence_wal_commit_count is reached.
+ * Otherwise flushes the log to disk at most once every
+ * persistence_wal_sync_interval seconds, and replaces it with a full save once
+ * it grows past persistence_wal_max_size. */
+int mqtt3_wal_sync(struct mosquitto_db *db)
+{
+	time_t now;
+	long size;
+	int rc;
+
+	if(mqtt3_wal_ack_wait(db) == 0){
+		_wal_acks_commit(db);
+	}
+	if(!db->config->persistence || !db->config->persistence_filepath) return MOSQ_ERR_SUCCESS;
+
+	now = mosquitto_time();
+	if(!wal_fptr){
+		/* Either enabled by a config reload, or closed after an error. A full
+		 * save starts a new log, and is retried with a growing delay for as
+		 * long as that fails. */
+		if(db->config->persistence_wal && now >= wal_retry_time){
+			rc = mqtt3_db_backup(db, false, false);
+			if(!wal_fptr) _wal_retry_schedule();
+			return rc;
+		}
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(!wal_dirty && !mqtt3_spill_dirty()) return MOSQ_ERR_SUCCESS;
+	if(db->config->persistence_wal_sync_interval > 0
+			&& now - wal_last_sync < db->config->persistence_wal_sync_interval){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	if(wal_dirty){
+		if(fflush(wal_fptr)){
+			_wal_write_error();
+			return 1;
+		}
+#ifndef WIN32
+		if(fsync(fileno(wal_fptr))){
+			_wal_write_error();
+			return 1;
+		}
+#endif
+	}
+	/* Spill files are synced with the log, as the read offsets mustn't move
+	 * past drained messages until they are in the log on disk. */
+	mqtt3_spill_flush(db, true);
+	_wal_synced(now);
+
+#ifndef WIN32
+	if(backup_pid) return MOSQ_ERR_SUCCESS;
+#endif
+	size = ftell(wal_fptr);
+	if(db->config->persistence_wal_max_size && size > 0
+			&& (unsigned long)size > db->config->persistence_wal_max_size){
+
+		return mqtt3_db_backup(db, false, false);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _wal_msg_chunk_replay(struct mosquitto_db *db, struct _db_chunk *chunk, struct mosquitto *context)
+{
+	struct mosquitto_client_msg *tail, *last = NULL;
+	dbid_t i64temp = 0;
+	uint16_t i16temp, mid;
+	uint8_t direction, state = 0, dup = 0;
+
+	if(chunk->type == DB_CHUNK_CLIENT_MSG_DELETE){
+		chunk_read_e(chunk, &i64temp, sizeof(dbid_t));
+	}
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
+	mid = ntohs(i16temp);
+	chunk_read_e(chunk, &direction, sizeof(uint8_t));
+	if(chunk->type == DB_CHUNK_CLIENT_MSG_UPDATE){
+		chunk_read_e(chunk, &state, sizeof(uint8_t));
+		chunk_read_e(chunk, &dup, sizeof(uint8_t));
+	}
+	if(!context) return MOSQ_ERR_SUCCESS;
+
+	tail = context->msgs;
+	while(tail){
+		if(tail->mid == mid && tail->direction == direction){
+			if(chunk->type == DB_CHUNK_CLIENT_MSG_UPDATE){
+				tail->state = state;
+				tail->dup = dup;
+				return MOSQ_ERR_SUCCESS;
+			}else if(tail->store->db_id == i64temp){
+				if(last){
+					last->next = tail->next;
+				}else{
+					context->msgs = tail->next;
+				}
+				if(context->last_msg == tail){
+					context->last_msg = last;
+				}
+				context->msg_count--;
+				if(tail->qos > 0){
+					context->msg_count12--;
+				}
+				context->msg_bytes -= tail->store->msg.payloadlen;
+				if(tail->conflate){
+					mqtt3_db_conflate_remove(context, tail);
+				}
+				tail->store->ref_count--;
+				_mosquitto_free(tail);
+				return MOSQ_ERR_SUCCESS;
+			}
+		}
+		last = tail;
+		tail = tail->next;
+	}
+	return MOSQ_ERR_SUCCESS;
+error:
+	return 1;
+}
+
+static int _wal_retain_chunk_replay(struct mosquitto_db *db, struct _db_chunk *chunk, const char *topic)
+{
+	dbid_t i64temp;
+	struct mosquitto_msg_store *store = NULL;
+
+	chunk_read_e(chunk, &i64temp, sizeof(dbid_t));
+	if(i64temp){
+		store = _db_store_get(db, i64temp);
+		if(!store) return MOSQ_ERR_SUCCESS;
+	}
+	return mqtt3_retain_set(db, topic, store);
+error:
+	return 1;
+}
+
+static int _wal_chunk_replay(struct mosquitto_db *db, struct _db_chunk *chunk)
+{
+	struct mosquitto *context;
+	uint16_t i16temp, slen;
+	char *id = NULL;
+	char *topic = NULL;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	switch(chunk->type){
+		case DB_CHUNK_MSG_STORE:
+			return _db_msg_store_chunk_restore(db, chunk);
+		case DB_CHUNK_CLIENT_MSG:
+			return _db_client_msg_chunk_restore(db, chunk, NULL);
+		case DB_CHUNK_SUB:
+			return _db_sub_chunk_restore(db, chunk);
+		case DB_CHUNK_CLIENT:
+			return _db_client_chunk_restore(db, chunk);
+		case DB_CHUNK_CLIENT_MSG_UPDATE:
+		case DB_CHUNK_CLIENT_MSG_DELETE:
+		case DB_CHUNK_CLIENT_MSGS_DELETE:
+		case DB_CHUNK_SUB_DELETE:
+		case DB_CHUNK_SUBS_DELETE:
+		case DB_CHUNK_CLIENT_DELETE:
+		case DB_CHUNK_RETAIN_TOPIC:
+			break;
+		default:
+			_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in write-ahead log. Ignoring.", chunk->type);
+			return MOSQ_ERR_SUCCESS;
+	}
+
+	chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
+	slen = ntohs(i16temp);
+	id = _mosquitto_calloc(slen+1, sizeof(char));
+	if(!id){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	chunk_read_e(chunk, id, slen);
+
+	if(chunk->type == DB_CHUNK_RETAIN_TOPIC){
+		rc = _wal_retain_chunk_replay(db, chunk, id);
+		_mosquitto_free(id);
+		if(rc) goto error;
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	context = _db_context_find(db, id);
+	_mosquitto_free(id);
+	id = NULL;
+
+	switch(chunk->type){
+		case DB_CHUNK_CLIENT_MSG_UPDATE:
+		case DB_CHUNK_CLIENT_MSG_DELETE:
+			if(context && context->lazy){
+				mqtt3_db_lazy_load(db, context);
+			}
+			if(_wal_msg_chunk_replay(db, chunk, context)) goto error;
+			break;
+		case DB_CHUNK_CLIENT_MSGS_DELETE:
+			if(context) mqtt3_db_messages_delete(context);
+			break;
+		case DB_CHUNK_SUB_DELETE:
+			chunk_read_e(chunk, &i16temp, sizeof(uint16_t));
+			slen = ntohs(i16temp);
+			topic = _mosquitto_calloc(slen+1, sizeof(char));
+			if(!topic){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+				return MOSQ_ERR_NOMEM;
+			}
+			chunk_read_e(chunk, topic, slen);
+			if(context) rc = mqtt3_sub_remove(db, context, topic, &db->subs);
+			_mosquitto_free(topic);
+			topic = NULL;
+			break;
+		case DB_CHUNK_SUBS_DELETE:
+			if(context) mqtt3_subs_clean_session(db, context, &db->subs);
+			break;
+		case DB_CHUNK_CLIENT_DELETE:
+			if(context){
+				context->clean_session = true;
+				db->contexts[context->db_index] = NULL;
+				mqtt3_context_cleanup(db, context, true);
+			}
+			break;
+	}
+	if(rc) goto error;
+	return MOSQ_ERR_SUCCESS;
+error:
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt write-ahead log.");
+	if(id) _mosquitto_free(id);
+	if(topic) _mosquitto_free(topic);
+	return 1;
+}
+
+/* Apply the changes in a write-ahead log, if it is for the given generation.
+ * A partly written change at the end of the log, from the broker stopping
+ * mid-write, is ignored. */
+static int _wal_replay(struct mosquitto_db *db, const char *path, uint32_t generation, int *changes, bool *matched, uint32_t *max_generation)
+{
+	FILE *fptr;
+	char header[15];
+	uint32_t i32temp;
+	struct _db_chunk chunk;
+	int rc;
+
+	*changes = 0;
+	*matched = false;
+	fptr = _mosquitto_fopen(path, "rb");
+	if(fptr == NULL) return MOSQ_ERR_SUCCESS;
+	if(restore_buffer){
+		setvbuf(fptr, restore_buffer, _IOFBF, DB_RESTORE_BUFFER_SIZE);
+	}
+
+	fseek(fptr, 0, SEEK_END);
+	restore_reader.file_size = ftell(fptr);
+	fseek(fptr, 0, SEEK_SET);
+	restore_reader.pos = 15 + sizeof(uint32_t);
+
+	if(fread(header, 1, 15, fptr) != 15 || memcmp(header, wal_magic, 15)
+			|| fread(&i32temp, sizeof(uint32_t), 1, fptr) != 1){
+
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Ignoring unrecognised write-ahead log %s.", path);
+		fclose(fptr);
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(ntohl(i32temp) > *max_generation){
+		*max_generation = ntohl(i32temp);
+	}
+	if(ntohl(i32temp) != generation){
+		/* Left over from before the last save, so already included. */
+		fclose(fptr);
+		return MOSQ_ERR_SUCCESS;
+	}
+	*matched = true;
+
+	db_version = MOSQ_DB_VERSION;
+	wal_replaying = true;
+	while(1){
+		rc = _db_chunk_fread(&restore_reader, fptr, false, &chunk);
+		if(rc == DB_READ_END){
+			break;
+		}else if(rc == DB_READ_TRUNCATED){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Ignoring incomplete change at end of write-ahead log %s.", path);
+			break;
+		}else if(rc){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		}
+		if(rc || _wal_chunk_replay(db, &chunk)){
+			wal_replaying = false;
+			fclose(fptr);
+			return 1;
+		}
+		(*changes)++;
+	}
+	wal_replaying = false;
+	fclose(fptr);
+
+	_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Replayed %d changes from write-ahead log %s.", *changes, path);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static int _db_restore(struct mosquitto_db *db)
+{
+	int changes, old_changes;
+	bool matched;
+	uint32_t generation, max_generation;
+
+	wal_generation = 0;
+	if(_db_snapshot_restore(db)) return 1;
+	if(_wal_paths_get(db)) return 1;
+
+	/* If a background save didn't complete, the log from before it started
+	 * applies first, followed by the log started with it. */
+	generation = wal_generation;
+	max_generation = wal_generation;
+	if(_wal_replay(db, wal_old_path, generation, &old_changes, &matched, &max_generation)) return 1;
+	if(matched) generation++;
+	if(_wal_replay(db, wal_path, generation, &changes, &matched, &max_generation)) return 1;
+
+	if(changes + old_changes){
+		/* Fold the replayed changes into a new database file, which also
+		 * starts a new log if needed. Its generation must not match any log
+		 * already on disk. */
+		wal_generation = max_generation;
+		_db_store_index_trim();
+		_db_backup_foreground(db, false);
+	}else if(db->config->persistence_wal){
+		_wal_open(db, wal_generation);
+		remove(wal_old_path);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt3_db_restore(struct mosquitto_db *db)
+{
+	int rc;
+	int i;
+
+	assert(db);
+	assert(db->config);
+	assert(db->config->persistence_filepath);
+
+	context_free_hint = 0;
+	restore_buffer = _mosquitto_malloc(DB_RESTORE_BUFFER_SIZE);
+	restoring = true;
+
+	rc = _db_restore(db);
+	if(!rc){
+		for(i=0; i<db->context_count; i++){
+			if(db->contexts[i] && mqtt3_db_conflate_rebuild(db->contexts[i])){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+				rc = MOSQ_ERR_NOMEM;
+				break;
+			}
+		}
+	}
+
+	restoring = false;
+	_db_sub_batch_free();
+	_db_reader_free(&restore_reader);
+	mqtt3_sub_add_batch_end();
+	if(lazy_context_count > 0){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Queued messages for %d clients will be loaded from the persistent database when needed.", lazy_context_count);
+		_db_store_index_trim();
+	}else{
+		_db_lazy_close();
+	}
+	if(restore_buffer){
+		_mosquitto_free(restore_buffer);
+		restore_buffer = NULL;
+	}
+	return rc;
 }
 
 #endif
@@ -30,7 +30,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifndef PERSIST_H
 #define PERSIST_H
 
-#define MOSQ_DB_VERSION 3
+#define MOSQ_DB_VERSION 4
 
 /* DB read/write */
 const unsigned char magic[15] = {0x00, 0xB5, 0x00, 'm','o','s','q','u','i','t','t','o',' ','d','b'};
@@ -40,8 +40,32 @@ const unsigned char magic[15] = {0x00, 0xB5, 0x00, 'm','o','s','q','u','i','t','
 #define DB_CHUNK_RETAIN 4
 #define DB_CHUNK_SUB 5
 #define DB_CHUNK_CLIENT 6
+#define DB_CHUNK_WAL_GEN 7
+/* From version 4, the subscriptions of each client are written together as a
+ * DB_CHUNK_CLIENT_SUBS rather than one DB_CHUNK_SUB each. */
+#define DB_CHUNK_CLIENT_SUBS 16
+/* A run of whole chunks compressed together. The body is the uncompressed
+ * length followed by the zlib data. */
+#define DB_CHUNK_BLOCK 15
+/* From version 4, the header CRC is the CRC32C of the magic and version, and
+ * every chunk, including those inside a block, is followed by the CRC32C of
+ * its type, length and body. */
 /* End DB read/write */
 
+/* Write-ahead log. Uses the same chunk framing as the DB, without CRCs or
+ * blocks, and with these extra
+ * chunk types alongside DB_CHUNK_MSG_STORE, DB_CHUNK_CLIENT_MSG,
+ * DB_CHUNK_SUB and DB_CHUNK_CLIENT. */
+const unsigned char wal_magic[15] = {0x00, 0xB5, 0x00, 'm','o','s','q','u','i','t','t','o','w','a','l'};
+#define DB_CHUNK_CLIENT_MSG_UPDATE 8
+#define DB_CHUNK_CLIENT_MSG_DELETE 9
+#define DB_CHUNK_CLIENT_MSGS_DELETE 10
+#define DB_CHUNK_SUB_DELETE 11
+#define DB_CHUNK_SUBS_DELETE 12
+#define DB_CHUNK_CLIENT_DELETE 13
+#define DB_CHUNK_RETAIN_TOPIC 14
+/* End write-ahead log */
+
 #define read_e(f, b, c) if(fread(b, 1, c, f) != c){ goto error; }
 #define write_e(f, b, c) if(fwrite(b, 1, c, f) != c){ goto error; }
 
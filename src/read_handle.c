@@ -42,6 +42,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #ifdef WITH_SYS_TREE
 extern uint64_t g_pub_bytes_received;
+extern unsigned long g_evicted_publishes_rejected;
 #endif
 
 int mqtt3_packet_handle(struct mosquitto_db *db, struct mosquitto *context)
@@ -85,19 +86,125 @@ int mqtt3_packet_handle(struct mosquitto_db *db, struct mosquitto *context)
 	}
 }
 
+/* Send a PUBACK or PUBREC for an incoming message. With durable set, it is
+ * held until the message is safely in the write-ahead log. */
+static int _publish_ack(struct mosquitto_db *db, struct mosquitto *context, uint8_t command, uint16_t mid, bool durable)
+{
+#ifdef WITH_PERSISTENCE
+	return mqtt3_wal_ack(db, context, command, mid, durable);
+#else
+	if(command == PUBACK){
+		return _mosquitto_send_puback(context, mid);
+	}else{
+		return _mosquitto_send_pubrec(context, mid);
+	}
+#endif
+}
+
+/* Reply to a PUBLISH that has been refused or dropped. */
+static int _publish_bad(struct mosquitto_db *db, struct mosquitto *context, uint8_t qos, uint16_t mid)
+{
+	struct mosquitto_msg_store *stored = NULL;
+	int res;
+
+	switch(qos){
+		case 0:
+			return MOSQ_ERR_SUCCESS;
+		case 1:
+			return _publish_ack(db, context, PUBACK, mid, false);
+		case 2:
+			mqtt3_db_message_store_find(context, mid, &stored);
+			if(!stored){
+				if(mqtt3_db_message_store(db, context->id, mid, NULL, qos, 0, NULL, false, &stored, 0)){
+					return 1;
+				}
+				res = mqtt3_db_message_insert(db, context, mid, mosq_md_in, qos, false, stored);
+			}else{
+				res = 0;
+			}
+			if(!res){
+				res = _publish_ack(db, context, PUBREC, mid, false);
+			}
+			return res;
+	}
+	return 1;
+}
+
+/* Handle a PUBLISH once its topic has been checked. acl_rc is the result of
+ * the check. */
+static int _publish_process(struct mosquitto_db *db, struct mosquitto *context, const char *topic, const void *payload, uint32_t payloadlen, uint8_t dup, uint8_t qos, uint8_t retain, uint16_t mid, int acl_rc)
+{
+	struct mosquitto_msg_store *stored = NULL;
+	int rc = 0;
+	int res = 0;
+
+	if(acl_rc == MOSQ_ERR_ACL_DENIED){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Denied PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
+		return _publish_bad(db, context, qos, mid);
+	}else if(acl_rc != MOSQ_ERR_SUCCESS){
+		return acl_rc;
+	}
+
+	if(context->is_throttled && mqtt3_db_memory_limit_exceeded(db)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Rejected PUBLISH from %s due to memory limit (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
+#ifdef WITH_SYS_TREE
+		g_evicted_publishes_rejected++;
+#endif
+		return _publish_bad(db, context, qos, mid);
+	}
+
+	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
+	if(qos > 0){
+		mqtt3_db_message_store_find(context, mid, &stored);
+	}
+	if(!stored){
+		dup = 0;
+		if(mqtt3_db_message_store(db, context->id, mid, topic, qos, payloadlen, payload, retain, &stored, 0)){
+			return 1;
+		}
+	}else{
+		dup = 1;
+	}
+	switch(qos){
+		case 0:
+			if(mqtt3_db_messages_queue(db, context->id, topic, qos, retain, stored)) rc = 1;
+			break;
+		case 1:
+			if(mqtt3_db_messages_queue(db, context->id, topic, qos, retain, stored)) rc = 1;
+			if(_publish_ack(db, context, PUBACK, mid, mqtt3_db_message_durable(db, topic))) rc = 1;
+			break;
+		case 2:
+			if(!dup){
+				res = mqtt3_db_message_insert(db, context, mid, mosq_md_in, qos, retain, stored);
+			}else{
+				res = 0;
+			}
+			/* mqtt3_db_message_insert() returns 2 to indicate dropped message
+			 * due to queue. This isn't an error so don't disconnect them. */
+			if(!res){
+				if(_publish_ack(db, context, PUBREC, mid, mqtt3_db_message_durable(db, topic))) rc = 1;
+			}else if(res == 1){
+				rc = 1;
+			}
+			break;
+	}
+
+	return rc;
+}
+
 int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 {
 	char *topic;
-	void *payload = NULL;
+	const void *payload = NULL;
 	uint32_t payloadlen;
 	uint8_t dup, qos, retain;
 	uint16_t mid = 0;
 	int rc = 0;
 	uint8_t header = context->in_packet.command;
-	int res = 0;
-	struct mosquitto_msg_store *stored = NULL;
+	uint32_t payload_pos;
 	int len;
 	char *topic_mount;
+	struct _mosquitto_auth_request *request;
 #ifdef WITH_BRIDGE
 	char *topic_temp;
 	int i;
@@ -187,6 +294,7 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 #ifdef WITH_SYS_TREE
 	g_pub_bytes_received += payloadlen;
 #endif
+	context->pub_bytes += payloadlen;
 	if(context->listener && context->listener->mount_point){
 		len = strlen(context->listener->mount_point) + strlen(topic) + 1;
 		topic_mount = _mosquitto_calloc(len, sizeof(char));
@@ -199,98 +307,61 @@ int mqtt3_handle_publish(struct mosquitto_db *db, struct mosquitto *context)
 		topic = topic_mount;
 	}
 
+	payload_pos = context->in_packet.pos;
 	if(payloadlen){
 		if(db->config->message_size_limit && payloadlen > db->config->message_size_limit){
 			_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Dropped too large PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
-			goto process_bad_message;
-		}
-		payload = _mosquitto_calloc(payloadlen+1, sizeof(uint8_t));
-		if(!payload){
 			_mosquitto_free(topic);
-			return 1;
-		}
-		if(_mosquitto_read_bytes(&context->in_packet, payload, payloadlen)){
-			_mosquitto_free(topic);
-			_mosquitto_free(payload);
-			return 1;
+			return _publish_bad(db, context, qos, mid);
 		}
+		/* The payload is the remainder of the packet, so refer to it in place
+		 * rather than making an intermediate copy. It is copied exactly once,
+		 * into the message store entry. */
+		payload = &(context->in_packet.payload[payload_pos]);
+		context->in_packet.pos += payloadlen;
 	}
 
 	/* Check for topic access */
-	rc = mosquitto_acl_check(db, context, topic, MOSQ_ACL_WRITE);
-	if(rc == MOSQ_ERR_ACL_DENIED){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Denied PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
-		goto process_bad_message;
-	}else if(rc != MOSQ_ERR_SUCCESS){
-		_mosquitto_free(topic);
-		if(payload) _mosquitto_free(payload);
-		return rc;
-	}
-
-	_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Received PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
-	if(qos > 0){
-		mqtt3_db_message_store_find(context, mid, &stored);
-	}
-	if(!stored){
-		dup = 0;
-		if(mqtt3_db_message_store(db, context->id, mid, topic, qos, payloadlen, payload, retain, &stored, 0)){
-			_mosquitto_free(topic);
-			if(payload) _mosquitto_free(payload);
-			return 1;
+	if(mosquitto_auth_async_available(db, mosq_ar_acl)){
+		rc = mosquitto_acl_cache_check(db, context, topic, MOSQ_ACL_WRITE);
+		if(rc == MOSQ_ERR_NOT_FOUND){
+			/* Hold the packet until the check completes and
+			 * mqtt3_handle_publish_auth() is called. Nothing more is read
+			 * from the client in the meantime. */
+			request = mosquitto_auth_request_new(context, mosq_ar_acl);
+			if(!request){
+				_mosquitto_free(topic);
+				return MOSQ_ERR_NOMEM;
+			}
+			request->topic = topic;
+			request->access = MOSQ_ACL_WRITE;
+			request->packet = context->in_packet.payload;
+			context->in_packet.payload = NULL;
+			request->payload_pos = payload_pos;
+			request->payloadlen = payloadlen;
+			request->mid = mid;
+			request->dup = dup;
+			request->qos = qos;
+			request->retain = retain;
+			return mosquitto_auth_request_submit(db, request);
 		}
 	}else{
-		dup = 1;
-	}
-	switch(qos){
-		case 0:
-			if(mqtt3_db_messages_queue(db, context->id, topic, qos, retain, stored)) rc = 1;
-			break;
-		case 1:
-			if(mqtt3_db_messages_queue(db, context->id, topic, qos, retain, stored)) rc = 1;
-			if(_mosquitto_send_puback(context, mid)) rc = 1;
-			break;
-		case 2:
-			if(!dup){
-				res = mqtt3_db_message_insert(db, context, mid, mosq_md_in, qos, retain, stored);
-			}else{
-				res = 0;
-			}
-			/* mqtt3_db_message_insert() returns 2 to indicate dropped message
-			 * due to queue. This isn't an error so don't disconnect them. */
-			if(!res){
-				if(_mosquitto_send_pubrec(context, mid)) rc = 1;
-			}else if(res == 1){
-				rc = 1;
-			}
-			break;
+		rc = mosquitto_acl_check(db, context, topic, MOSQ_ACL_WRITE);
 	}
+	rc = _publish_process(db, context, topic, payload, payloadlen, dup, qos, retain, mid, rc);
 	_mosquitto_free(topic);
-	if(payload) _mosquitto_free(payload);
-
 	return rc;
-process_bad_message:
-	_mosquitto_free(topic);
-	if(payload) _mosquitto_free(payload);
-	switch(qos){
-		case 0:
-			return MOSQ_ERR_SUCCESS;
-		case 1:
-			return _mosquitto_send_puback(context, mid);
-		case 2:
-			mqtt3_db_message_store_find(context, mid, &stored);
-			if(!stored){
-				if(mqtt3_db_message_store(db, context->id, mid, NULL, qos, 0, NULL, false, &stored, 0)){
-					return 1;
-				}
-				res = mqtt3_db_message_insert(db, context, mid, mosq_md_in, qos, false, stored);
-			}else{
-				res = 0;
-			}
-			if(!res){
-				res = _mosquitto_send_pubrec(context, mid);
-			}
-			return res;
+}
+
+/* The topic check for a held PUBLISH has completed. */
+int mqtt3_handle_publish_auth(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_auth_request *request)
+{
+	const void *payload = NULL;
+
+	if(request->payloadlen){
+		payload = &(request->packet[request->payload_pos]);
 	}
-	return 1;
+	return _publish_process(db, context, request->topic, payload, request->payloadlen,
+			request->dup, request->qos, request->retain, request->mid, request->result);
 }
 
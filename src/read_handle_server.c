@@ -44,6 +44,148 @@ POSSIBILITY OF SUCH DAMAGE.
 extern unsigned int g_connection_count;
 #endif
 
+static void _will_free(struct mosquitto_message *will)
+{
+	if(will->topic) _mosquitto_free(will->topic);
+	if(will->payload) _mosquitto_free(will->payload);
+	_mosquitto_free(will);
+}
+
+/* Finish handling a CONNECT once the client has been authenticated. Takes
+ * ownership of client_id and will. */
+static int _connect_accept(struct mosquitto_db *db, struct mosquitto *context, char *client_id, struct mosquitto_message *will, uint8_t clean_session, uint8_t protocol_version)
+{
+	int i;
+	int rc;
+	struct _clientid_index_hash *find_cih;
+	struct _clientid_index_hash *new_cih;
+
+	/* Find if this client already has an entry. This must be done *after* any security checks. */
+	HASH_FIND_STR(db->clientid_index_hash, client_id, find_cih);
+	if(find_cih){
+		i = find_cih->db_context_index;
+		/* Found a matching client */
+		if(db->contexts[i]->sock == -1){
+			/* Client is reconnecting after a disconnect */
+			/* FIXME - does anything else need to be done here? */
+		}else{
+			/* Client is already connected, disconnect old version */
+			if(db->config->connection_messages == true){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Client %s already connected, closing old connection.", client_id);
+			}
+		}
+		db->contexts[i]->clean_session = clean_session;
+		if((context->username == NULL) != (db->contexts[i]->username == NULL)
+				|| (context->username && strcmp(context->username, db->contexts[i]->username))){
+			/* Any subscriptions kept from the previous session were classified
+			 * for the ACLs of the old username. */
+			db->contexts[i]->acl_generation++;
+		}
+		mqtt3_context_cleanup(db, db->contexts[i], false);
+		db->contexts[i]->state = mosq_cs_connected;
+		db->contexts[i]->address = _mosquitto_strdup(context->address);
+		db->contexts[i]->sock = context->sock;
+		db->contexts[i]->listener = context->listener;
+		db->contexts[i]->last_msg_in = mosquitto_time();
+		db->contexts[i]->last_msg_out = mosquitto_time();
+		db->contexts[i]->keepalive = context->keepalive;
+		db->contexts[i]->pollfd_index = context->pollfd_index;
+#ifdef WITH_TLS
+		db->contexts[i]->ssl = context->ssl;
+#endif
+		if(context->username){
+			db->contexts[i]->username = _mosquitto_strdup(context->username);
+		}
+		context->sock = -1;
+#ifdef WITH_TLS
+		context->ssl = NULL;
+#endif
+		context->state = mosq_cs_disconnecting;
+		context = db->contexts[i];
+#ifdef WITH_PERSISTENCE
+		if(context->lazy){
+			mqtt3_db_lazy_load(db, context);
+		}
+#endif
+		if(context->msgs){
+			mqtt3_db_message_reconnect_reset(context);
+		}
+	}
+
+	context->id = client_id;
+	client_id = NULL;
+	context->clean_session = clean_session;
+	context->ping_t = 0;
+	context->is_dropping = false;
+	if((protocol_version&0x80) == 0x80){
+		context->is_bridge = true;
+	}
+
+	// Add the client ID to the DB hash table here
+	new_cih = _mosquitto_malloc(sizeof(struct _clientid_index_hash));
+	if(!new_cih){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		mqtt3_context_disconnect(db, context);
+		rc = MOSQ_ERR_NOMEM;
+		goto handle_connect_error;
+	}
+	new_cih->id = context->id;
+	new_cih->db_context_index = context->db_index;
+	HASH_ADD_KEYPTR(hh, db->clientid_index_hash, context->id, strlen(context->id), new_cih);
+
+#ifdef WITH_PERSISTENCE
+	if(!clean_session){
+		db->persistence_changes++;
+		mqtt3_wal_client(context);
+	}
+#endif
+	/* Associate user with its ACL, assuming we have ACLs loaded. */
+	context->acl_list = mosquitto_acl_user_find_default(db, context->username);
+	context->acl_list_generation = db->acl_generation;
+	/* Resolve %c and %u in the acl patterns once for this connection. */
+	rc = mosquitto_acl_context_init_default(db, context);
+	if(rc){
+		mqtt3_context_disconnect(db, context);
+		goto handle_connect_error;
+	}
+	mqtt3_db_limits_context_set(db, context);
+
+	if(will){
+		if(mosquitto_acl_check(db, context, will->topic, MOSQ_ACL_WRITE) != MOSQ_ERR_SUCCESS){
+			_mosquitto_send_connack(context, CONNACK_REFUSED_NOT_AUTHORIZED);
+			mqtt3_context_disconnect(db, context);
+			rc = MOSQ_ERR_SUCCESS;
+			goto handle_connect_error;
+		}
+		context->will = will;
+		will = NULL;
+	}
+
+	if(db->config->connection_messages == true){
+		if(context->is_bridge){
+			if(context->username){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New bridge connected from %s as %s (c%d, k%d, u%s).", context->address, context->id, context->clean_session, context->keepalive, context->username);
+			}else{
+				_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New bridge connected from %s as %s (c%d, k%d).", context->address, context->id, context->clean_session, context->keepalive);
+			}
+		}else{
+			if(context->username){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New client connected from %s as %s (c%d, k%d, u%s).", context->address, context->id, context->clean_session, context->keepalive, context->username);
+			}else{
+				_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New client connected from %s as %s (c%d, k%d).", context->address, context->id, context->clean_session, context->keepalive);
+			}
+		}
+	}
+
+	context->state = mosq_cs_connected;
+	return _mosquitto_send_connack(context, CONNACK_ACCEPTED);
+
+handle_connect_error:
+	if(client_id) _mosquitto_free(client_id);
+	if(will) _will_free(will);
+	return rc;
+}
+
 int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 {
 	char *protocol_name = NULL;
@@ -58,15 +200,13 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 	char *username = NULL, *password = NULL;
 	int i;
 	int rc;
-	struct _mosquitto_acl_user *acl_tail;
 	int slen;
 #ifdef WITH_TLS
 	X509 *client_cert;
 	X509_NAME *name;
 	X509_NAME_ENTRY *name_entry;
 #endif
-	struct _clientid_index_hash *find_cih;
-	struct _clientid_index_hash *new_cih;
+	struct _mosquitto_auth_request *request;
 
 #ifdef WITH_SYS_TREE
 	g_connection_count++;
@@ -249,6 +389,13 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 				goto handle_connect_error;
 			}
 		}
+		will_struct->topic = will_topic;
+		will_struct->payload = will_payload;
+		will_struct->payloadlen = will_payloadlen;
+		will_struct->qos = will_qos;
+		will_struct->retain = will_retain;
+		will_topic = NULL;
+		will_payload = NULL;
 	}else{
 		if(context->protocol == mosq_p_mqtt311){
 			if(will_qos != 0 || will_retain != 0){
@@ -354,8 +501,35 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 #endif /* REAL_WITH_TLS_PSK */
 	}else{
 #endif /* WITH_TLS */
+		if(username_flag && mosquitto_auth_async_available(db, mosq_ar_unpwd)
+				&& mosquitto_unpwd_cache_check(db, username, password) != MOSQ_ERR_SUCCESS){
+
+			/* Hold the CONNECT until the check completes and
+			 * mqtt3_handle_connect_auth() is called. */
+			request = mosquitto_auth_request_new(context, mosq_ar_unpwd);
+			if(!request){
+				mqtt3_context_disconnect(db, context);
+				rc = MOSQ_ERR_NOMEM;
+				goto handle_connect_error;
+			}
+			request->clientid = client_id;
+			request->username = username;
+			request->password = password;
+			request->will = will_struct;
+			request->clean_session = clean_session;
+			request->protocol_version = protocol_version;
+			context->state = mosq_cs_auth_pending;
+			if(mosquitto_auth_request_submit(db, request)){
+				_mosquitto_send_connack(context, CONNACK_REFUSED_NOT_AUTHORIZED);
+				mqtt3_context_disconnect(db, context);
+			}
+			return MOSQ_ERR_SUCCESS;
+		}
 		if(username_flag){
-			rc = mosquitto_unpwd_check(db, username, password);
+			rc = mosquitto_unpwd_cache_check(db, username, password);
+			if(rc != MOSQ_ERR_SUCCESS){
+				rc = mosquitto_unpwd_check(db, username, password);
+			}
 			if(rc == MOSQ_ERR_AUTH){
 				_mosquitto_send_connack(context, CONNACK_REFUSED_BAD_USERNAME_PASSWORD);
 				mqtt3_context_disconnect(db, context);
@@ -380,132 +554,9 @@ int mqtt3_handle_connect(struct mosquitto_db *db, struct mosquitto *context)
 	}
 #endif
 
-	/* Find if this client already has an entry. This must be done *after* any security checks. */
-	HASH_FIND_STR(db->clientid_index_hash, client_id, find_cih);
-	if(find_cih){
-		i = find_cih->db_context_index;
-		/* Found a matching client */
-		if(db->contexts[i]->sock == -1){
-			/* Client is reconnecting after a disconnect */
-			/* FIXME - does anything else need to be done here? */
-		}else{
-			/* Client is already connected, disconnect old version */
-			if(db->config->connection_messages == true){
-				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Client %s already connected, closing old connection.", client_id);
-			}
-		}
-		db->contexts[i]->clean_session = clean_session;
-		mqtt3_context_cleanup(db, db->contexts[i], false);
-		db->contexts[i]->state = mosq_cs_connected;
-		db->contexts[i]->address = _mosquitto_strdup(context->address);
-		db->contexts[i]->sock = context->sock;
-		db->contexts[i]->listener = context->listener;
-		db->contexts[i]->last_msg_in = mosquitto_time();
-		db->contexts[i]->last_msg_out = mosquitto_time();
-		db->contexts[i]->keepalive = context->keepalive;
-		db->contexts[i]->pollfd_index = context->pollfd_index;
-#ifdef WITH_TLS
-		db->contexts[i]->ssl = context->ssl;
-#endif
-		if(context->username){
-			db->contexts[i]->username = _mosquitto_strdup(context->username);
-		}
-		context->sock = -1;
-#ifdef WITH_TLS
-		context->ssl = NULL;
-#endif
-		context->state = mosq_cs_disconnecting;
-		context = db->contexts[i];
-		if(context->msgs){
-			mqtt3_db_message_reconnect_reset(context);
-		}
-	}
-
-	context->id = client_id;
-	client_id = NULL;
-	context->clean_session = clean_session;
-	context->ping_t = 0;
-	context->is_dropping = false;
-	if((protocol_version&0x80) == 0x80){
-		context->is_bridge = true;
-	}
-
-	// Add the client ID to the DB hash table here
-	new_cih = _mosquitto_malloc(sizeof(struct _clientid_index_hash));
-	if(!new_cih){
-		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-		mqtt3_context_disconnect(db, context);
-		rc = MOSQ_ERR_NOMEM;
-		goto handle_connect_error;
-	}
-	new_cih->id = context->id;
-	new_cih->db_context_index = context->db_index;
-	HASH_ADD_KEYPTR(hh, db->clientid_index_hash, context->id, strlen(context->id), new_cih);
-
-#ifdef WITH_PERSISTENCE
-	if(!clean_session){
-		db->persistence_changes++;
-	}
-#endif
-	/* Associate user with its ACL, assuming we have ACLs loaded. */
-	if(db->acl_list){
-		acl_tail = db->acl_list;
-		while(acl_tail){
-			if(context->username){
-				if(acl_tail->username && !strcmp(context->username, acl_tail->username)){
-					context->acl_list = acl_tail;
-					break;
-				}
-			}else{
-				if(acl_tail->username == NULL){
-					context->acl_list = acl_tail;
-					break;
-				}
-			}
-			acl_tail = acl_tail->next;
-		}
-	}else{
-		context->acl_list = NULL;
-	}
-
-	if(will_struct){
-		if(mosquitto_acl_check(db, context, will_topic, MOSQ_ACL_WRITE) != MOSQ_ERR_SUCCESS){
-			_mosquitto_send_connack(context, CONNACK_REFUSED_NOT_AUTHORIZED);
-			mqtt3_context_disconnect(db, context);
-			rc = MOSQ_ERR_SUCCESS;
-			goto handle_connect_error;
-		}
-		context->will = will_struct;
-		context->will->topic = will_topic;
-		if(will_payload){
-			context->will->payload = will_payload;
-			context->will->payloadlen = will_payloadlen;
-		}else{
-			context->will->payload = NULL;
-			context->will->payloadlen = 0;
-		}
-		context->will->qos = will_qos;
-		context->will->retain = will_retain;
-	}
-
-	if(db->config->connection_messages == true){
-		if(context->is_bridge){
-			if(context->username){
-				_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New bridge connected from %s as %s (c%d, k%d, u%s).", context->address, context->id, context->clean_session, context->keepalive, context->username);
-			}else{
-				_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New bridge connected from %s as %s (c%d, k%d).", context->address, context->id, context->clean_session, context->keepalive);
-			}
-		}else{
-			if(context->username){
-				_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New client connected from %s as %s (c%d, k%d, u%s).", context->address, context->id, context->clean_session, context->keepalive, context->username);
-			}else{
-				_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "New client connected from %s as %s (c%d, k%d).", context->address, context->id, context->clean_session, context->keepalive);
-			}
-		}
-	}
-
-	context->state = mosq_cs_connected;
-	return _mosquitto_send_connack(context, CONNACK_ACCEPTED);
+	if(username) _mosquitto_free(username);
+	if(password) _mosquitto_free(password);
+	return _connect_accept(db, context, client_id, will_struct, clean_session, protocol_version);
 
 handle_connect_error:
 	if(client_id) _mosquitto_free(client_id);
@@ -513,10 +564,40 @@ handle_connect_error:
 	if(password) _mosquitto_free(password);
 	if(will_payload) _mosquitto_free(will_payload);
 	if(will_topic) _mosquitto_free(will_topic);
-	if(will_struct) _mosquitto_free(will_struct);
+	if(will_struct) _will_free(will_struct);
 	return rc;
 }
 
+/* The username and password check for a held CONNECT has completed. */
+int mqtt3_handle_connect_auth(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_auth_request *request)
+{
+	char *client_id;
+	struct mosquitto_message *will;
+
+	if(request->result == MOSQ_ERR_AUTH){
+		_mosquitto_send_connack(context, CONNACK_REFUSED_BAD_USERNAME_PASSWORD);
+		mqtt3_context_disconnect(db, context);
+		return MOSQ_ERR_SUCCESS;
+	}else if(request->result != MOSQ_ERR_SUCCESS){
+		return request->result;
+	}
+	if(request->acl_generation == db->acl_generation){
+		mosquitto_unpwd_cache_store(db, request->username, request->password);
+	}
+
+	context->username = request->username;
+	context->password = request->password;
+	client_id = request->clientid;
+	will = request->will;
+	request->username = NULL;
+	request->password = NULL;
+	request->clientid = NULL;
+	request->will = NULL;
+
+	context->state = mosq_cs_new;
+	return _connect_accept(db, context, client_id, will, request->clean_session, request->protocol_version);
+}
+
 int mqtt3_handle_disconnect(struct mosquitto_db *db, struct mosquitto *context)
 {
 	if(!context){
@@ -542,6 +623,7 @@ int mqtt3_handle_subscribe(struct mosquitto_db *db, struct mosquitto *context)
 {
 	int rc = 0;
 	int rc2;
+	enum mosquitto_sub_acl acl;
 	uint16_t mid;
 	char *sub;
 	uint8_t qos;
@@ -619,7 +701,8 @@ int mqtt3_handle_subscribe(struct mosquitto_db *db, struct mosquitto *context)
 			}
 
 			if(qos != 0x80){
-				rc2 = mqtt3_sub_add(db, context, sub, qos, &db->subs);
+				acl = mosquitto_acl_sub_classify(db, context, sub);
+				rc2 = mqtt3_sub_add(db, context, sub, qos, acl, &db->subs);
 				if(rc2 == MOSQ_ERR_SUCCESS){
 					if(mqtt3_retain_queue(db, context, sub, qos)) rc = 1;
 				}else if(rc2 != -1){
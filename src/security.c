@@ -35,8 +35,14 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <mosquitto_broker.h>
 #include "mosquitto_plugin.h"
 #include <memory_mosq.h>
+#include <time_mosq.h>
 #include "lib_load.h"
 
+#ifdef WITH_SYS_TREE
+extern unsigned long g_acl_cache_hits;
+extern unsigned long g_acl_cache_misses;
+#endif
+
 typedef int (*FUNC_auth_plugin_version)(void);
 typedef int (*FUNC_auth_plugin_init)(void **, struct mosquitto_auth_opt *, int);
 typedef int (*FUNC_auth_plugin_cleanup)(void *, struct mosquitto_auth_opt *, int);
@@ -45,6 +51,18 @@ typedef int (*FUNC_auth_plugin_security_cleanup)(void *, struct mosquitto_auth_o
 typedef int (*FUNC_auth_plugin_acl_check)(void *, const char *, const char *, const char *, int);
 typedef int (*FUNC_auth_plugin_unpwd_check)(void *, const char *, const char *);
 typedef int (*FUNC_auth_plugin_psk_key_get)(void *, const char *, const char *, char *, int);
+typedef int (*FUNC_auth_plugin_unpwd_check_async)(void *, const char *, const char *, void (*)(void *, int), void *);
+typedef int (*FUNC_auth_plugin_acl_check_async)(void *, const char *, const char *, const char *, int, void (*)(void *, int), void *);
+typedef int (*FUNC_auth_plugin_acl_check_batch)(void *, const char *, int, const struct mosquitto_acl_client *, int *, int);
+
+/* Set when a plugin has been reloaded, for mosquitto_security_reload_finish(). */
+static bool security_reloaded = false;
+
+/* Arguments for the plugin's acl_check_batch(), grown as needed. */
+static struct mosquitto_acl_client *acl_batch_clients = NULL;
+static struct _mosquitto_subleaf **acl_batch_leaves = NULL;
+static int *acl_batch_results = NULL;
+static int acl_batch_size = 0;
 
 int mosquitto_security_module_init(struct mosquitto_db *db)
 {
@@ -68,9 +86,9 @@ int mosquitto_security_module_init(struct mosquitto_db *db)
 			return 1;
 		}
 		version = plugin_version();
-		if(version != MOSQ_AUTH_PLUGIN_VERSION){
+		if(version != 2 && version != MOSQ_AUTH_PLUGIN_VERSION){
 			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR,
-					"Error: Incorrect auth plugin version (got %d, expected %d).",
+					"Error: Incorrect auth plugin version (got %d, expected 2 or %d).",
 					version, MOSQ_AUTH_PLUGIN_VERSION);
 
 			LIB_CLOSE(lib);
@@ -124,6 +142,17 @@ int mosquitto_security_module_init(struct mosquitto_db *db)
 			return 1;
 		}
 
+		/* The asynchronous and batch functions are optional. */
+		if(version >= 3){
+			db->auth_plugin.unpwd_check_async = (FUNC_auth_plugin_unpwd_check_async)LIB_SYM(lib, "mosquitto_auth_unpwd_check_async");
+			db->auth_plugin.acl_check_async = (FUNC_auth_plugin_acl_check_async)LIB_SYM(lib, "mosquitto_auth_acl_check_async");
+			db->auth_plugin.acl_check_batch = (FUNC_auth_plugin_acl_check_batch)LIB_SYM(lib, "mosquitto_auth_acl_check_batch");
+		}else{
+			db->auth_plugin.unpwd_check_async = NULL;
+			db->auth_plugin.acl_check_async = NULL;
+			db->auth_plugin.acl_check_batch = NULL;
+		}
+
 		db->auth_plugin.lib = lib;
 		db->auth_plugin.user_data = NULL;
 		if(db->auth_plugin.plugin_init){
@@ -131,8 +160,8 @@ int mosquitto_security_module_init(struct mosquitto_db *db)
 			if(rc){
 				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR,
 						"Error: Authentication plugin returned %d when initialising.", rc);
+				return rc;
 			}
-			return rc;
 		}
 	}else{
 		db->auth_plugin.lib = NULL;
@@ -143,13 +172,17 @@ int mosquitto_security_module_init(struct mosquitto_db *db)
 		db->auth_plugin.acl_check = NULL;
 		db->auth_plugin.unpwd_check = NULL;
 		db->auth_plugin.psk_key_get = NULL;
+		db->auth_plugin.unpwd_check_async = NULL;
+		db->auth_plugin.acl_check_async = NULL;
+		db->auth_plugin.acl_check_batch = NULL;
 	}
 
-	return MOSQ_ERR_SUCCESS;
+	return mosquitto_auth_async_init(db);
 }
 
 int mosquitto_security_module_cleanup(struct mosquitto_db *db)
 {
+	mosquitto_auth_async_cleanup(db);
 	mosquitto_security_cleanup(db, false);
 
 	if(db->auth_plugin.plugin_cleanup){
@@ -169,12 +202,27 @@ int mosquitto_security_module_cleanup(struct mosquitto_db *db)
 	db->auth_plugin.acl_check = NULL;
 	db->auth_plugin.unpwd_check = NULL;
 	db->auth_plugin.psk_key_get = NULL;
+	db->auth_plugin.unpwd_check_async = NULL;
+	db->auth_plugin.acl_check_async = NULL;
+	db->auth_plugin.acl_check_batch = NULL;
+
+	if(acl_batch_clients) _mosquitto_free(acl_batch_clients);
+	if(acl_batch_leaves) _mosquitto_free(acl_batch_leaves);
+	if(acl_batch_results) _mosquitto_free(acl_batch_results);
+	acl_batch_clients = NULL;
+	acl_batch_leaves = NULL;
+	acl_batch_results = NULL;
+	acl_batch_size = 0;
 
 	return MOSQ_ERR_SUCCESS;
 }
 
 int mosquitto_security_init(struct mosquitto_db *db, bool reload)
 {
+	if(reload){
+		/* Cached ACL results may no longer be valid. */
+		db->acl_generation++;
+	}
 	if(!db->auth_plugin.lib){
 		return mosquitto_security_init_default(db, reload);
 	}else{
@@ -182,18 +230,38 @@ int mosquitto_security_init(struct mosquitto_db *db, bool reload)
 	}
 }
 
-/* Apply security settings after a reload.
- * Includes:
- * - Disconnecting anonymous users if appropriate
- * - Disconnecting users with invalid passwords
- * - Reapplying ACLs
- */
-int mosquitto_security_apply(struct mosquitto_db *db)
+/* Reload the security settings after the configuration has been reread.
+ * Plugins are reloaded straight away. Without a plugin, the files are read in
+ * the background and swapped in by mosquitto_security_reload_finish(). */
+int mosquitto_security_reload(struct mosquitto_db *db)
 {
+	int rc;
+
 	if(!db->auth_plugin.lib){
-		return mosquitto_security_apply_default(db);
+		return mosquitto_security_reload_start_default(db);
 	}
-	return MOSQ_ERR_SUCCESS;
+
+	mosquitto_auth_async_pause();
+	mosquitto_security_cleanup(db, true);
+	rc = mosquitto_security_init(db, true);
+	mosquitto_auth_async_resume();
+	security_reloaded = true;
+	return rc;
+}
+
+/* Called from the main loop. Returns true once the reloaded security
+ * settings are in use. */
+bool mosquitto_security_reload_finish(struct mosquitto_db *db)
+{
+	if(!db->auth_plugin.lib){
+		return mosquitto_security_reload_finish_default(db);
+	}
+
+	if(security_reloaded){
+		security_reloaded = false;
+		return true;
+	}
+	return false;
 }
 
 int mosquitto_security_cleanup(struct mosquitto_db *db, bool reload)
@@ -205,7 +273,7 @@ int mosquitto_security_cleanup(struct mosquitto_db *db, bool reload)
 	}
 }
 
-int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
+static int _acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
 {
 	if(!db->auth_plugin.lib){
 		return mosquitto_acl_check_default(db, context, topic, access);
@@ -214,15 +282,262 @@ int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, cons
 	}
 }
 
+enum mosquitto_sub_acl mosquitto_acl_sub_classify(struct mosquitto_db *db, struct mosquitto *context, const char *sub)
+{
+	if(!db->auth_plugin.lib){
+		return mosquitto_acl_sub_classify_default(db, context, sub);
+	}else{
+		/* Plugins are asked about each topic. */
+		return mosq_sa_check;
+	}
+}
+
+void mosquitto_acl_cache_cleanup(struct mosquitto *context)
+{
+	struct _mosquitto_acl_cache *entry, *tmp;
+
+	if(!context) return;
+
+	HASH_ITER(hh, context->acl_cache, entry, tmp){
+		HASH_DEL(context->acl_cache, entry);
+		_mosquitto_free(entry->topic);
+		_mosquitto_free(entry);
+	}
+	context->acl_cache_count = 0;
+}
+
+/* Look up the cached result for topic. Entries are kept in least recently
+ * used order, so a hit is moved to the end of the hash. */
+static struct _mosquitto_acl_cache *_acl_cache_find(struct mosquitto_db *db, struct mosquitto *context, const char *topic, time_t now)
+{
+	struct _mosquitto_acl_cache *entry;
+
+	if(context->acl_cache_generation != db->acl_generation){
+		mosquitto_acl_cache_cleanup(context);
+		context->acl_cache_generation = db->acl_generation;
+		return NULL;
+	}
+
+	HASH_FIND_STR(context->acl_cache, topic, entry);
+	if(!entry) return NULL;
+
+	HASH_DEL(context->acl_cache, entry);
+	if(db->config->acl_cache_ttl && now - entry->added >= db->config->acl_cache_ttl){
+		_mosquitto_free(entry->topic);
+		_mosquitto_free(entry);
+		context->acl_cache_count--;
+		return NULL;
+	}
+	HASH_ADD_KEYPTR(hh, context->acl_cache, entry->topic, strlen(entry->topic), entry);
+	return entry;
+}
+
+static struct _mosquitto_acl_cache *_acl_cache_add(struct mosquitto_db *db, struct mosquitto *context, const char *topic, time_t now)
+{
+	struct _mosquitto_acl_cache *entry;
+
+	if(context->acl_cache_count >= db->config->acl_cache_size){
+		/* Evict the least recently used entry. */
+		entry = context->acl_cache;
+		HASH_DEL(context->acl_cache, entry);
+		_mosquitto_free(entry->topic);
+	}else{
+		entry = _mosquitto_malloc(sizeof(struct _mosquitto_acl_cache));
+		if(!entry) return NULL;
+		context->acl_cache_count++;
+	}
+	entry->topic = _mosquitto_strdup(topic);
+	if(!entry->topic){
+		_mosquitto_free(entry);
+		context->acl_cache_count--;
+		return NULL;
+	}
+	entry->added = now;
+	entry->allowed = 0;
+	entry->denied = 0;
+	HASH_ADD_KEYPTR(hh, context->acl_cache, entry->topic, strlen(entry->topic), entry);
+	return entry;
+}
+
+/* Returns the cached result of checking access to topic, or
+ * MOSQ_ERR_NOT_FOUND if the check must be made. */
+int mosquitto_acl_cache_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
+{
+	struct _mosquitto_acl_cache *entry;
+
+	if(db->config->acl_cache_size <= 0){
+		return MOSQ_ERR_NOT_FOUND;
+	}
+
+	entry = _acl_cache_find(db, context, topic, mosquitto_time());
+	if(entry){
+		if((entry->allowed & access) == access){
+#ifdef WITH_SYS_TREE
+			g_acl_cache_hits++;
+#endif
+			return MOSQ_ERR_SUCCESS;
+		}else if(entry->denied & access){
+#ifdef WITH_SYS_TREE
+			g_acl_cache_hits++;
+#endif
+			return MOSQ_ERR_ACL_DENIED;
+		}
+	}
+#ifdef WITH_SYS_TREE
+	g_acl_cache_misses++;
+#endif
+	return MOSQ_ERR_NOT_FOUND;
+}
+
+/* Record the result of a check made after mosquitto_acl_cache_check()
+ * returned MOSQ_ERR_NOT_FOUND. */
+void mosquitto_acl_cache_store(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access, int result)
+{
+	struct _mosquitto_acl_cache *entry;
+
+	if(db->config->acl_cache_size <= 0){
+		return;
+	}
+	if(result != MOSQ_ERR_SUCCESS && result != MOSQ_ERR_ACL_DENIED){
+		/* Errors are not cached. */
+		return;
+	}
+	if(context->acl_cache_generation != db->acl_generation){
+		mosquitto_acl_cache_cleanup(context);
+		context->acl_cache_generation = db->acl_generation;
+	}
+
+	HASH_FIND_STR(context->acl_cache, topic, entry);
+	if(!entry){
+		entry = _acl_cache_add(db, context, topic, mosquitto_time());
+		if(!entry) return;
+	}
+	if(result == MOSQ_ERR_SUCCESS){
+		entry->allowed |= access;
+	}else{
+		entry->denied |= access;
+	}
+}
+
+int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
+{
+	int rc;
+
+	rc = mosquitto_acl_cache_check(db, context, topic, access);
+	if(rc != MOSQ_ERR_NOT_FOUND){
+		return rc;
+	}
+
+	rc = _acl_check(db, context, topic, access);
+	mosquitto_acl_cache_store(db, context, topic, access, rc);
+	return rc;
+}
+
+bool mosquitto_acl_batch_available(struct mosquitto_db *db)
+{
+	return db->auth_plugin.lib && db->auth_plugin.acl_check_batch;
+}
+
+static int _acl_batch_grow(int count)
+{
+	struct mosquitto_acl_client *clients;
+	struct _mosquitto_subleaf **leaves;
+	int *results;
+
+	if(count <= acl_batch_size) return MOSQ_ERR_SUCCESS;
+
+	clients = _mosquitto_realloc(acl_batch_clients, count*sizeof(struct mosquitto_acl_client));
+	if(!clients) return MOSQ_ERR_NOMEM;
+	acl_batch_clients = clients;
+	leaves = _mosquitto_realloc(acl_batch_leaves, count*sizeof(struct _mosquitto_subleaf *));
+	if(!leaves) return MOSQ_ERR_NOMEM;
+	acl_batch_leaves = leaves;
+	results = _mosquitto_realloc(acl_batch_results, count*sizeof(int));
+	if(!results) return MOSQ_ERR_NOMEM;
+	acl_batch_results = results;
+
+	acl_batch_size = count;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Check access to topic for each subscription in leaves whose acl_result is
+ * MOSQ_ERR_NOT_FOUND, and set acl_result to the result. Subscriptions that
+ * aren't answered by the ACL cache are passed to the plugin in one call. */
+void mosquitto_acl_check_batch(struct mosquitto_db *db, struct _mosquitto_subleaf *leaves, const char *topic, int access)
+{
+	struct _mosquitto_subleaf *leaf;
+	int count = 0;
+	int i;
+	int rc;
+
+	for(leaf=leaves; leaf; leaf=leaf->next){
+		if(leaf->acl_result != MOSQ_ERR_NOT_FOUND) continue;
+		leaf->acl_result = mosquitto_acl_cache_check(db, leaf->context, topic, access);
+		if(leaf->acl_result == MOSQ_ERR_NOT_FOUND) count++;
+	}
+	if(!count) return;
+
+	if(_acl_batch_grow(count) == MOSQ_ERR_SUCCESS){
+		i = 0;
+		for(leaf=leaves; leaf; leaf=leaf->next){
+			if(leaf->acl_result != MOSQ_ERR_NOT_FOUND) continue;
+			acl_batch_clients[i].clientid = leaf->context->id;
+			acl_batch_clients[i].username = leaf->context->username;
+			acl_batch_leaves[i] = leaf;
+			i++;
+		}
+		rc = db->auth_plugin.acl_check_batch(db->auth_plugin.user_data, topic, access, acl_batch_clients, acl_batch_results, count);
+		if(rc == MOSQ_ERR_SUCCESS){
+			for(i=0; i<count; i++){
+				leaf = acl_batch_leaves[i];
+				leaf->acl_result = acl_batch_results[i];
+				mosquitto_acl_cache_store(db, leaf->context, topic, access, leaf->acl_result);
+			}
+			return;
+		}
+	}
+
+	/* Check each one in turn instead. */
+	for(leaf=leaves; leaf; leaf=leaf->next){
+		if(leaf->acl_result != MOSQ_ERR_NOT_FOUND) continue;
+		leaf->acl_result = _acl_check(db, leaf->context, topic, access);
+		mosquitto_acl_cache_store(db, leaf->context, topic, access, leaf->acl_result);
+	}
+}
+
 int mosquitto_unpwd_check(struct mosquitto_db *db, const char *username, const char *password)
 {
+	int rc;
+
 	if(!db->auth_plugin.lib){
-		return mosquitto_unpwd_check_default(db, username, password);
+		rc = mosquitto_unpwd_check_default(db, username, password);
+		if(rc == MOSQ_ERR_SUCCESS){
+			mosquitto_unpwd_cache_store_default(db, username, password);
+		}
+		return rc;
 	}else{
 		return db->auth_plugin.unpwd_check(db->auth_plugin.user_data, username, password);
 	}
 }
 
+/* Returns MOSQ_ERR_SUCCESS if username and password were verified within the
+ * last password_cache_ttl seconds, or MOSQ_ERR_NOT_FOUND if they must be
+ * checked. Only password_file checks are cached. */
+int mosquitto_unpwd_cache_check(struct mosquitto_db *db, const char *username, const char *password)
+{
+	if(db->auth_plugin.lib) return MOSQ_ERR_NOT_FOUND;
+
+	return mosquitto_unpwd_cache_check_default(db, username, password);
+}
+
+/* Record that username and password have been verified. */
+void mosquitto_unpwd_cache_store(struct mosquitto_db *db, const char *username, const char *password)
+{
+	if(db->auth_plugin.lib) return;
+
+	mosquitto_unpwd_cache_store_default(db, username, password);
+}
+
 int mosquitto_psk_key_get(struct mosquitto_db *db, const char *hint, const char *identity, char *key, int max_key_len)
 {
 	if(!db->auth_plugin.lib){
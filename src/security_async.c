@@ -0,0 +1,413 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#ifdef WITH_THREADING
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#include <mosquitto_broker.h>
+#include "mosquitto_plugin.h"
+#include <memory_mosq.h>
+
+#ifdef WITH_THREADING
+/* mosquitto_internal.h turns these into no-ops for the broker. */
+#undef pthread_create
+#undef pthread_join
+#undef pthread_mutex_lock
+#undef pthread_mutex_unlock
+
+/* Requests waiting for a worker, and completed requests waiting for the main
+ * loop. Both lists and async_closed are protected by async_mutex. */
+static pthread_mutex_t async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static struct _mosquitto_auth_request *async_jobs = NULL;
+static struct _mosquitto_auth_request *async_jobs_last = NULL;
+static struct _mosquitto_auth_request *async_done = NULL;
+static struct _mosquitto_auth_request *async_done_last = NULL;
+static bool async_stopping = false;
+static bool async_closed = true;
+
+/* Held for reading by workers while they call the plugin, and for writing
+ * while the security settings are reloaded. */
+static pthread_rwlock_t async_plugin_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_t *async_workers = NULL;
+static int async_worker_count = 0;
+/* Written to when async_done becomes non-empty, to wake the main loop. */
+static int async_wake[2] = {-1, -1};
+
+static void _auth_request_complete(void *request, int result)
+{
+	struct _mosquitto_auth_request *req = request;
+	char c = 0;
+
+	pthread_mutex_lock(&async_mutex);
+	if(async_closed){
+		/* The broker is shutting down. */
+		pthread_mutex_unlock(&async_mutex);
+		mosquitto_auth_request_free(req);
+		return;
+	}
+	req->result = result;
+	req->next = NULL;
+	if(async_done_last){
+		async_done_last->next = req;
+	}else{
+		async_done = req;
+		if(write(async_wake[1], &c, 1) != 1){
+			/* The pipe is full, so the main loop will be woken anyway. */
+		}
+	}
+	async_done_last = req;
+	pthread_mutex_unlock(&async_mutex);
+}
+
+static void *_auth_worker(void *arg)
+{
+	struct mosquitto_db *db = arg;
+	struct _mosquitto_auth_request *req;
+	int rc;
+
+	while(1){
+		pthread_mutex_lock(&async_mutex);
+		while(!async_jobs && !async_stopping){
+			pthread_cond_wait(&async_cond, &async_mutex);
+		}
+		if(async_stopping){
+			pthread_mutex_unlock(&async_mutex);
+			break;
+		}
+		req = async_jobs;
+		async_jobs = req->next;
+		if(!async_jobs) async_jobs_last = NULL;
+		pthread_mutex_unlock(&async_mutex);
+
+		pthread_rwlock_rdlock(&async_plugin_lock);
+		if(req->type == mosq_ar_unpwd){
+			if(db->auth_plugin.lib){
+				rc = db->auth_plugin.unpwd_check(db->auth_plugin.user_data, req->username, req->password);
+			}else{
+				rc = mosquitto_unpwd_check_default(db, req->username, req->password);
+			}
+		}else{
+			rc = db->auth_plugin.acl_check(db->auth_plugin.user_data, req->clientid, req->username, req->topic, req->access);
+		}
+		pthread_rwlock_unlock(&async_plugin_lock);
+
+		_auth_request_complete(req, rc);
+	}
+	return NULL;
+}
+
+static void _request_list_free(struct _mosquitto_auth_request *req)
+{
+	struct _mosquitto_auth_request *next;
+
+	while(req){
+		next = req->next;
+		mosquitto_auth_request_free(req);
+		req = next;
+	}
+}
+#endif
+
+int mosquitto_auth_async_init(struct mosquitto_db *db)
+{
+#ifdef WITH_THREADING
+	sigset_t sigblock, origsig;
+	int i;
+
+	if(!db->auth_plugin.unpwd_check_async && !db->auth_plugin.acl_check_async
+			&& db->config->auth_workers <= 0){
+
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	if(pipe(async_wake)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to create pipe: %s.", strerror(errno));
+		return MOSQ_ERR_ERRNO;
+	}
+	for(i=0; i<2; i++){
+		fcntl(async_wake[i], F_SETFL, fcntl(async_wake[i], F_GETFL, 0) | O_NONBLOCK);
+	}
+	async_stopping = false;
+	async_closed = false;
+
+	if(db->config->auth_workers > 0){
+		async_workers = _mosquitto_calloc(db->config->auth_workers, sizeof(pthread_t));
+		if(!async_workers){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return MOSQ_ERR_NOMEM;
+		}
+		/* Signals are handled by the main thread. */
+		sigfillset(&sigblock);
+		pthread_sigmask(SIG_SETMASK, &sigblock, &origsig);
+		for(i=0; i<db->config->auth_workers; i++){
+			if(pthread_create(&async_workers[i], NULL, _auth_worker, db)){
+				break;
+			}
+			async_worker_count++;
+		}
+		pthread_sigmask(SIG_SETMASK, &origsig, NULL);
+		if(async_worker_count != db->config->auth_workers){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to start authentication worker threads.");
+			return MOSQ_ERR_UNKNOWN;
+		}
+	}
+#else
+	if(db->config->auth_workers > 0){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: auth_workers is not supported without threading support.");
+	}
+#endif
+	return MOSQ_ERR_SUCCESS;
+}
+
+void mosquitto_auth_async_cleanup(struct mosquitto_db *db)
+{
+#ifdef WITH_THREADING
+	int i;
+
+	pthread_mutex_lock(&async_mutex);
+	async_stopping = true;
+	pthread_cond_broadcast(&async_cond);
+	pthread_mutex_unlock(&async_mutex);
+	for(i=0; i<async_worker_count; i++){
+		pthread_join(async_workers[i], NULL);
+	}
+	if(async_workers) _mosquitto_free(async_workers);
+	async_workers = NULL;
+	async_worker_count = 0;
+
+	pthread_mutex_lock(&async_mutex);
+	_request_list_free(async_jobs);
+	async_jobs = NULL;
+	async_jobs_last = NULL;
+	_request_list_free(async_done);
+	async_done = NULL;
+	async_done_last = NULL;
+	async_closed = true;
+	pthread_mutex_unlock(&async_mutex);
+
+	for(i=0; i<2; i++){
+		if(async_wake[i] != -1){
+			close(async_wake[i]);
+			async_wake[i] = -1;
+		}
+	}
+#endif
+}
+
+/* Returns true if checks of this type should be started with
+ * mosquitto_auth_request_submit() rather than made directly. */
+bool mosquitto_auth_async_available(struct mosquitto_db *db, enum mosquitto_auth_request_type type)
+{
+#ifdef WITH_THREADING
+	if(async_closed) return false;
+	if(!db->auth_plugin.lib){
+		/* Passwords from password_file are hashed on the workers. Checking
+		 * acl_file is cheap enough to do directly. */
+		return type == mosq_ar_unpwd && db->unpwd && async_worker_count > 0;
+	}
+	if(type == mosq_ar_unpwd && db->auth_plugin.unpwd_check_async) return true;
+	if(type == mosq_ar_acl && db->auth_plugin.acl_check_async) return true;
+	return async_worker_count > 0;
+#else
+	return false;
+#endif
+}
+
+/* The socket to poll for completed requests, or -1 if there is none. */
+int mosquitto_auth_async_sock(void)
+{
+#ifdef WITH_THREADING
+	return async_wake[0];
+#else
+	return -1;
+#endif
+}
+
+/* Resume the packets whose checks have completed. Called from the main loop
+ * when mosquitto_auth_async_sock() is readable. */
+void mosquitto_auth_async_process(struct mosquitto_db *db)
+{
+#ifdef WITH_THREADING
+	struct _mosquitto_auth_request *list, *req;
+	struct mosquitto *context;
+	char buf[64];
+	int rc;
+
+	while(read(async_wake[0], buf, sizeof(buf)) > 0){
+	}
+	pthread_mutex_lock(&async_mutex);
+	list = async_done;
+	async_done = NULL;
+	async_done_last = NULL;
+	pthread_mutex_unlock(&async_mutex);
+
+	while(list){
+		req = list;
+		list = list->next;
+
+		context = req->context;
+		if(context){
+			context->auth_request = NULL;
+			if(req->type == mosq_ar_unpwd){
+				rc = mqtt3_handle_connect_auth(db, context, req);
+			}else{
+				if(req->acl_generation == db->acl_generation){
+					mosquitto_acl_cache_store(db, context, req->topic, req->access, req->result);
+				}
+				rc = mqtt3_handle_publish_auth(db, context, req);
+			}
+			if(rc && context->sock != INVALID_SOCKET){
+				mqtt3_context_disconnect(db, context);
+			}
+		}
+		mosquitto_auth_request_free(req);
+	}
+#endif
+}
+
+/* Stop the workers calling the plugin while the security settings are
+ * reloaded. */
+void mosquitto_auth_async_pause(void)
+{
+#ifdef WITH_THREADING
+	pthread_rwlock_wrlock(&async_plugin_lock);
+#endif
+}
+
+void mosquitto_auth_async_resume(void)
+{
+#ifdef WITH_THREADING
+	pthread_rwlock_unlock(&async_plugin_lock);
+#endif
+}
+
+struct _mosquitto_auth_request *mosquitto_auth_request_new(struct mosquitto *context, enum mosquitto_auth_request_type type)
+{
+	struct _mosquitto_auth_request *req;
+
+	req = _mosquitto_calloc(1, sizeof(struct _mosquitto_auth_request));
+	if(!req) return NULL;
+
+	req->type = type;
+	req->context = context;
+	if(context->id){
+		req->clientid = _mosquitto_strdup(context->id);
+		if(!req->clientid){
+			_mosquitto_free(req);
+			return NULL;
+		}
+	}
+	if(context->username){
+		req->username = _mosquitto_strdup(context->username);
+		if(!req->username){
+			mosquitto_auth_request_free(req);
+			return NULL;
+		}
+	}
+	return req;
+}
+
+/* Start the check for request, which must have been created with
+ * mosquitto_auth_request_new() and have the packet it is holding filled in.
+ * The context's packet handling is resumed by mosquitto_auth_async_process()
+ * when the check completes. On failure, request is freed and the check has
+ * not been started. */
+int mosquitto_auth_request_submit(struct mosquitto_db *db, struct _mosquitto_auth_request *request)
+{
+	int rc = MOSQ_ERR_NOT_SUPPORTED;
+
+	request->context->auth_request = request;
+	request->acl_generation = db->acl_generation;
+#ifdef WITH_THREADING
+	if(request->type == mosq_ar_unpwd && db->auth_plugin.unpwd_check_async){
+		rc = db->auth_plugin.unpwd_check_async(db->auth_plugin.user_data,
+				request->username, request->password,
+				_auth_request_complete, request);
+	}else if(request->type == mosq_ar_acl && db->auth_plugin.acl_check_async){
+		rc = db->auth_plugin.acl_check_async(db->auth_plugin.user_data,
+				request->clientid, request->username, request->topic, request->access,
+				_auth_request_complete, request);
+	}else if(async_worker_count > 0){
+		pthread_mutex_lock(&async_mutex);
+		request->next = NULL;
+		if(async_jobs_last){
+			async_jobs_last->next = request;
+		}else{
+			async_jobs = request;
+		}
+		async_jobs_last = request;
+		pthread_cond_signal(&async_cond);
+		pthread_mutex_unlock(&async_mutex);
+		rc = MOSQ_ERR_SUCCESS;
+	}
+#endif
+	if(rc != MOSQ_ERR_SUCCESS){
+		request->context->auth_request = NULL;
+		mosquitto_auth_request_free(request);
+	}
+	return rc;
+}
+
+/* The context is going away, so drop the result of any check it is waiting
+ * for. */
+void mosquitto_auth_request_cancel(struct mosquitto *context)
+{
+	if(context->auth_request){
+		context->auth_request->context = NULL;
+		context->auth_request = NULL;
+	}
+}
+
+void mosquitto_auth_request_free(struct _mosquitto_auth_request *request)
+{
+	if(!request) return;
+
+	if(request->clientid) _mosquitto_free(request->clientid);
+	if(request->username) _mosquitto_free(request->username);
+	if(request->password) _mosquitto_free(request->password);
+	if(request->topic) _mosquitto_free(request->topic);
+	if(request->will){
+		if(request->will->topic) _mosquitto_free(request->will->topic);
+		if(request->will->payload) _mosquitto_free(request->will->payload);
+		_mosquitto_free(request->will);
+	}
+	if(request->packet) _mosquitto_free(request->packet);
+	_mosquitto_free(request);
+}
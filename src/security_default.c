@@ -32,15 +32,36 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <stdio.h>
 #include <string.h>
 
+#ifdef WITH_TLS
+#  include <openssl/hmac.h>
+#  include <openssl/rand.h>
+#endif
+#ifdef WITH_THREADING
+#  include <pthread.h>
+#  include <signal.h>
+#endif
+
 #include <mosquitto_broker.h>
 #include <memory_mosq.h>
+#include <time_mosq.h>
 #include "util_mosq.h"
 
+#ifdef WITH_THREADING
+/* mosquitto_internal.h turns these into no-ops for the broker. */
+#undef pthread_create
+#undef pthread_join
+#undef pthread_mutex_lock
+#undef pthread_mutex_unlock
+#endif
+
 static int _aclfile_parse(struct mosquitto_db *db);
 static int _unpwd_file_parse(struct mosquitto_db *db);
 static int _acl_cleanup(struct mosquitto_db *db, bool reload);
 static int _unpwd_cleanup(struct _mosquitto_unpwd **unpwd, bool reload);
 static int _psk_file_parse(struct mosquitto_db *db);
+struct _security_reload;
+static struct _security_reload *_security_reload_take(bool wait);
+static void _security_reload_free(struct _security_reload *reload);
 #ifdef WITH_TLS
 static int _pw_digest(const char *password, const unsigned char *salt, unsigned int salt_len, unsigned char *hash, unsigned int *hash_len);
 static int _base64_decode(char *in, unsigned char **decoded, unsigned int *decoded_len);
@@ -82,7 +103,14 @@ int mosquitto_security_init_default(struct mosquitto_db *db, bool reload)
 
 int mosquitto_security_cleanup_default(struct mosquitto_db *db, bool reload)
 {
+	struct _security_reload *unused;
 	int rc;
+
+	if(!reload){
+		/* Shutting down, so discard any reload being read. */
+		unused = _security_reload_take(true);
+		if(unused) _security_reload_free(unused);
+	}
 	rc = _acl_cleanup(db, reload);
 	if(rc != MOSQ_ERR_SUCCESS) return rc;
 	rc = _unpwd_cleanup(&db->unpwd, reload);
@@ -91,85 +119,173 @@ int mosquitto_security_cleanup_default(struct mosquitto_db *db, bool reload)
 }
 
 
-int _add_acl(struct mosquitto_db *db, const char *user, const char *topic, int access)
+static struct _mosquitto_acl_node *_acl_node_new(const char *topic, int len)
 {
-	struct _mosquitto_acl_user *acl_user=NULL, *user_tail;
-	struct _mosquitto_acl *acl, *acl_tail;
-	char *local_topic;
-	bool new_user = false;
+	struct _mosquitto_acl_node *node;
+
+	node = _mosquitto_calloc(1, sizeof(struct _mosquitto_acl_node));
+	if(!node) return NULL;
+	if(topic){
+		node->topic = _mosquitto_malloc(len+1);
+		if(!node->topic){
+			_mosquitto_free(node);
+			return NULL;
+		}
+		memcpy(node->topic, topic, len);
+		node->topic[len] = '\0';
+	}
+	return node;
+}
 
-	if(!db || !topic) return MOSQ_ERR_INVAL;
+static void _acl_node_free(struct _mosquitto_acl_node *node)
+{
+	struct _mosquitto_acl_node *child, *tmp;
 
-	local_topic = _mosquitto_strdup(topic);
-	if(!local_topic){
-		return MOSQ_ERR_NOMEM;
+	if(!node) return;
+
+	HASH_ITER(hh, node->children, child, tmp){
+		HASH_DEL(node->children, child);
+		_acl_node_free(child);
 	}
+	_acl_node_free(node->plus);
+	_acl_node_free(node->hash);
+	if(node->topic) _mosquitto_free(node->topic);
+	_mosquitto_free(node);
+}
 
-	if(db->acl_list){
-		user_tail = db->acl_list;
-		while(user_tail){
-			if(user == NULL){
-				if(user_tail->username == NULL){
-					acl_user = user_tail;
-					break;
-				}
-			}else if(user_tail->username && !strcmp(user_tail->username, user)){
-				acl_user = user_tail;
-				break;
+/* Add an ACL topic to the trie at *root, one node per topic level. */
+static int _acl_node_add(struct _mosquitto_acl_node **root, const char *topic, int access)
+{
+	struct _mosquitto_acl_node *node, *child;
+	const char *end;
+	int len;
+
+	if(!*root){
+		*root = _acl_node_new(NULL, 0);
+		if(!*root) return MOSQ_ERR_NOMEM;
+	}
+	node = *root;
+	while(1){
+		end = strchr(topic, '/');
+		if(end){
+			len = end - topic;
+		}else{
+			len = strlen(topic);
+		}
+		if(len == 1 && topic[0] == '+'){
+			if(!node->plus){
+				node->plus = _acl_node_new(topic, len);
+				if(!node->plus) return MOSQ_ERR_NOMEM;
+			}
+			child = node->plus;
+		}else if(len == 1 && topic[0] == '#'){
+			if(!node->hash){
+				node->hash = _acl_node_new(topic, len);
+				if(!node->hash) return MOSQ_ERR_NOMEM;
+			}
+			child = node->hash;
+		}else{
+			HASH_FIND(hh, node->children, topic, len, child);
+			if(!child){
+				child = _acl_node_new(topic, len);
+				if(!child) return MOSQ_ERR_NOMEM;
+				HASH_ADD_KEYPTR(hh, node->children, child->topic, len, child);
 			}
-			user_tail = user_tail->next;
 		}
+		node = child;
+		if(!end) break;
+		topic = end + 1;
+	}
+	node->access |= access;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Check whether the topic levels starting at level match an ACL below node
+ * that grants access. level is NULL once every level has been matched. As with
+ * mosquitto_topic_matches_sub(), wildcards at the first level do not match
+ * topics beginning with $. */
+static bool _acl_node_check(struct _mosquitto_acl_node *node, const char *level, int access, bool first)
+{
+	struct _mosquitto_acl_node *child;
+	const char *end, *next;
+	int len;
+	bool wildcards;
+
+	wildcards = !(first && level && level[0] == '$');
+
+	/* "#" matches this level, everything below it and the parent itself. */
+	if(wildcards && node->hash && (node->hash->access & access)){
+		return true;
+	}
+	if(!level){
+		return (node->access & access) != 0;
+	}
+
+	end = strchr(level, '/');
+	if(end){
+		len = end - level;
+		next = end + 1;
+	}else{
+		len = strlen(level);
+		next = NULL;
 	}
+	HASH_FIND(hh, node->children, level, len, child);
+	if(child && _acl_node_check(child, next, access, false)){
+		return true;
+	}
+	if(wildcards && node->plus && _acl_node_check(node->plus, next, access, false)){
+		return true;
+	}
+	return false;
+}
+
+/* Find the ACLs for username, or for anonymous clients if username is NULL. */
+struct _mosquitto_acl_user *mosquitto_acl_user_find_default(struct mosquitto_db *db, const char *username)
+{
+	struct _mosquitto_acl_user *acl_user;
+
+	if(!username) return db->acl_anonymous;
+
+	HASH_FIND_STR(db->acl_users, username, acl_user);
+	return acl_user;
+}
+
+int _add_acl(struct mosquitto_db *db, const char *user, const char *topic, int access)
+{
+	struct _mosquitto_acl_user *acl_user=NULL;
+	int rc;
+
+	if(!db || !topic) return MOSQ_ERR_INVAL;
+
+	acl_user = mosquitto_acl_user_find_default(db, user);
 	if(!acl_user){
 		acl_user = _mosquitto_malloc(sizeof(struct _mosquitto_acl_user));
 		if(!acl_user){
-			_mosquitto_free(local_topic);
 			return MOSQ_ERR_NOMEM;
 		}
-		new_user = true;
 		if(user){
 			acl_user->username = _mosquitto_strdup(user);
 			if(!acl_user->username){
-				_mosquitto_free(local_topic);
 				_mosquitto_free(acl_user);
 				return MOSQ_ERR_NOMEM;
 			}
+			HASH_ADD_KEYPTR(hh, db->acl_users, acl_user->username, strlen(acl_user->username), acl_user);
 		}else{
 			acl_user->username = NULL;
+			db->acl_anonymous = acl_user;
 		}
-		acl_user->next = NULL;
 		acl_user->acl = NULL;
-	}
-
-	acl= _mosquitto_malloc(sizeof(struct _mosquitto_acl));
-	if(!acl) return MOSQ_ERR_NOMEM;
-	acl->access = access;
-	acl->topic = local_topic;
-	acl->next = NULL;
 
-	/* Add acl to user acl list */
-	if(acl_user->acl){
-		acl_tail = acl_user->acl;
-		while(acl_tail->next){
-			acl_tail = acl_tail->next;
-		}
-		acl_tail->next = acl;
-	}else{
-		acl_user->acl = acl;
+		/* Users are looked up through acl_users, so the order of the list
+		 * doesn't matter. */
+		acl_user->next = db->acl_list;
+		db->acl_list = acl_user;
 	}
 
-	if(new_user){
-		/* Add to end of list */
-		if(db->acl_list){
-			user_tail = db->acl_list;
-			while(user_tail->next){
-				user_tail = user_tail->next;
-			}
-			user_tail->next = acl_user;
-		}else{
-			db->acl_list = acl_user;
-		}
-	}
+	/* Add acl to user acl trie */
+	rc = _acl_node_add(&acl_user->acl, topic, access);
+	if(rc) return rc;
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -205,91 +321,77 @@ int _add_acl_pattern(struct mosquitto_db *db, const char *topic, int access)
 	return MOSQ_ERR_SUCCESS;
 }
 
-int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
+/* Compile the acl patterns for this client, with %c and %u replaced by its
+ * client id and username. Patterns are skipped if the substitution is not
+ * possible or would introduce a wildcard. */
+int mosquitto_acl_context_init_default(struct mosquitto_db *db, struct mosquitto *context)
 {
-	char *local_acl;
 	struct _mosquitto_acl *acl_root;
-	bool result;
+	char *local_acl;
+	char *s;
 	int i;
 	int len, tlen, clen, ulen;
 	int ccount, ucount;
-	char *s;
+	bool id_ok, username_ok;
+	int rc;
 
-	if(!db || !context || !topic) return MOSQ_ERR_INVAL;
-	if(!db->acl_list && !db->acl_patterns) return MOSQ_ERR_SUCCESS;
-	if(context->bridge) return MOSQ_ERR_SUCCESS;
-	if(!context->acl_list && !db->acl_patterns) return MOSQ_ERR_ACL_DENIED;
+	if(!db || !context) return MOSQ_ERR_INVAL;
 
-	if(context->acl_list){
-		acl_root = context->acl_list->acl;
-	}else{
-		acl_root = NULL;
-	}
+	mosquitto_acl_context_cleanup_default(context);
+	if(!db->acl_patterns || !context->id) return MOSQ_ERR_SUCCESS;
 
-	/* Loop through all ACLs for this client. */
-	while(acl_root){
-		/* Loop through the topic looking for matches to this ACL. */
+	/* An empty root records that the patterns have been compiled even if none
+	 * apply to this client. */
+	context->acl_patterns = _acl_node_new(NULL, 0);
+	if(!context->acl_patterns) return MOSQ_ERR_NOMEM;
 
-		/* If subscription starts with $, acl_root->topic must also start with $. */
-		if(topic[0] == '$' && acl_root->topic[0] != '$'){
-			acl_root = acl_root->next;
-			continue;
-		}
-		mosquitto_topic_matches_sub(acl_root->topic, topic, &result);
-		if(result){
-			if(access & acl_root->access){
-				/* And access is allowed. */
-				return MOSQ_ERR_SUCCESS;
-			}
-		}
-		acl_root = acl_root->next;
+	clen = strlen(context->id);
+	id_ok = !strpbrk(context->id, "+#");
+	if(context->username){
+		ulen = strlen(context->username);
+		username_ok = !strpbrk(context->username, "+#");
+	}else{
+		ulen = 0;
+		username_ok = false;
 	}
 
-	acl_root = db->acl_patterns;
-	/* Loop through all pattern ACLs. */
-	clen = strlen(context->id);
-	while(acl_root){
+	for(acl_root = db->acl_patterns; acl_root; acl_root = acl_root->next){
 		tlen = strlen(acl_root->topic);
 
 		ccount = 0;
-		s = acl_root->topic;
-		while(s){
-			s = strstr(s, "%c");
-			if(s){
-				ccount++;
-				s+=2;
-			}
-		}
-
 		ucount = 0;
-		s = acl_root->topic;
-		while(s){
-			s = strstr(s, "%u");
-			if(s){
-				ucount++;
-				s+=2;
+		for(i=0; i<tlen-1; i++){
+			if(acl_root->topic[i] == '%'){
+				if(acl_root->topic[i+1] == 'c'){
+					ccount++;
+					i++;
+				}else if(acl_root->topic[i+1] == 'u'){
+					ucount++;
+					i++;
+				}
 			}
 		}
-
-		if(ucount && !context->username){
+		if((ccount && !id_ok) || (ucount && !username_ok)){
 			continue;
 		}
 
-		ulen = strlen(context->username);
 		len = tlen + ccount*(clen-2) + ucount*(ulen-2);
-		local_acl = malloc(len+1);
-		if(!local_acl) return 1; // FIXME
+		local_acl = _mosquitto_malloc(len+1);
+		if(!local_acl){
+			mosquitto_acl_context_cleanup_default(context);
+			return MOSQ_ERR_NOMEM;
+		}
 		s = local_acl;
 		for(i=0; i<tlen; i++){
 			if(i<tlen-1 && acl_root->topic[i] == '%'){
 				if(acl_root->topic[i+1] == 'c'){
 					i++;
-					strncpy(s, context->id, clen);
+					memcpy(s, context->id, clen);
 					s+=clen;
 					continue;
 				}else if(acl_root->topic[i+1] == 'u'){
 					i++;
-					strncpy(s, context->username, ulen);
+					memcpy(s, context->username, ulen);
 					s+=ulen;
 					continue;
 				}
@@ -299,22 +401,214 @@ int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *conte
 		}
 		local_acl[len] = '\0';
 
-		mosquitto_topic_matches_sub(local_acl, topic, &result);
-		if(result){
-			if(access & acl_root->access){
-				/* And access is allowed. */
-				return MOSQ_ERR_SUCCESS;
-			}
+		rc = _acl_node_add(&context->acl_patterns, local_acl, acl_root->access);
+		_mosquitto_free(local_acl);
+		if(rc){
+			mosquitto_acl_context_cleanup_default(context);
+			return rc;
 		}
+	}
 
-		_mosquitto_free(local_acl);
+	return MOSQ_ERR_SUCCESS;
+}
 
-		acl_root = acl_root->next;
+void mosquitto_acl_context_cleanup_default(struct mosquitto *context)
+{
+	if(context && context->acl_patterns){
+		_acl_node_free(context->acl_patterns);
+		context->acl_patterns = NULL;
+	}
+}
+
+/* The ACLs of the context's user. After a reload they are looked up again
+ * the first time they are needed, rather than for every client at once. */
+static struct _mosquitto_acl_user *_acl_context_user(struct mosquitto_db *db, struct mosquitto *context)
+{
+	if(context->acl_list_generation != db->acl_generation){
+		context->acl_list = mosquitto_acl_user_find_default(db, context->username);
+		context->acl_list_generation = db->acl_generation;
+		/* Recompiled from the new patterns on first use. */
+		mosquitto_acl_context_cleanup_default(context);
+	}
+	return context->acl_list;
+}
+
+int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
+{
+	struct _mosquitto_acl_user *acl_user;
+	int rc;
+
+	if(!db || !context || !topic) return MOSQ_ERR_INVAL;
+	if(!db->acl_list && !db->acl_patterns) return MOSQ_ERR_SUCCESS;
+	if(context->bridge) return MOSQ_ERR_SUCCESS;
+	acl_user = _acl_context_user(db, context);
+	if(!acl_user && !db->acl_patterns) return MOSQ_ERR_ACL_DENIED;
+
+	if(acl_user && acl_user->acl){
+		if(_acl_node_check(acl_user->acl, topic, access, true)){
+			return MOSQ_ERR_SUCCESS;
+		}
+	}
+
+	if(db->acl_patterns){
+		/* Clients restored from the persistent database or reapplied after a
+		 * reload are compiled on first use rather than at connect. */
+		if(!context->acl_patterns){
+			rc = mosquitto_acl_context_init_default(db, context);
+			if(rc) return rc;
+		}
+		if(context->acl_patterns && _acl_node_check(context->acl_patterns, topic, access, true)){
+			return MOSQ_ERR_SUCCESS;
+		}
 	}
 
 	return MOSQ_ERR_ACL_DENIED;
 }
 
+/* Split off the first level of a subscription, as for _acl_node_check(). */
+static const char *_acl_sub_level(const char *level, int *len)
+{
+	const char *end;
+
+	end = strchr(level, '/');
+	if(end){
+		*len = end - level;
+		return end + 1;
+	}else{
+		*len = strlen(level);
+		return NULL;
+	}
+}
+
+/* Whether any ACL at or below node grants access. At the first level, ACLs
+ * for $ topics are ignored because the subscription wildcard that led here
+ * does not match them. */
+static bool _acl_node_any(struct _mosquitto_acl_node *node, int access, bool first)
+{
+	struct _mosquitto_acl_node *child, *tmp;
+
+	if(node->access & access) return true;
+	if(node->hash && (node->hash->access & access)) return true;
+	if(node->plus && _acl_node_any(node->plus, access, false)) return true;
+	HASH_ITER(hh, node->children, child, tmp){
+		if(first && child->topic[0] == '$') continue;
+		if(_acl_node_any(child, access, false)) return true;
+	}
+	return false;
+}
+
+/* Whether every topic matching the subscription levels starting at level is
+ * granted access by an ACL below node. A literal ACL level only covers the
+ * same literal subscription level, so this may return false for a
+ * subscription that is covered by several ACLs together. */
+static bool _acl_node_covers(struct _mosquitto_acl_node *node, const char *level, int access, bool first)
+{
+	struct _mosquitto_acl_node *child;
+	const char *next;
+	int len;
+	bool wildcards;
+
+	wildcards = !(first && level && level[0] == '$');
+
+	if(wildcards && node->hash && (node->hash->access & access)){
+		return true;
+	}
+	if(!level){
+		return (node->access & access) != 0;
+	}
+
+	next = _acl_sub_level(level, &len);
+	if(len == 1 && level[0] == '#'){
+		/* Only an ACL "#" covers this, checked above. */
+		return false;
+	}else if(len == 1 && level[0] == '+'){
+		return node->plus && _acl_node_covers(node->plus, next, access, false);
+	}
+
+	HASH_FIND(hh, node->children, level, len, child);
+	if(child && _acl_node_covers(child, next, access, false)){
+		return true;
+	}
+	if(wildcards && node->plus && _acl_node_covers(node->plus, next, access, false)){
+		return true;
+	}
+	return false;
+}
+
+/* Whether any topic matching the subscription levels starting at level could
+ * be granted access by an ACL below node. */
+static bool _acl_node_overlaps(struct _mosquitto_acl_node *node, const char *level, int access, bool first)
+{
+	struct _mosquitto_acl_node *child, *tmp;
+	const char *next;
+	int len;
+	bool wildcards;
+
+	wildcards = !(first && level && level[0] == '$');
+
+	if(wildcards && node->hash && (node->hash->access & access)){
+		return true;
+	}
+	if(!level){
+		return (node->access & access) != 0;
+	}
+
+	next = _acl_sub_level(level, &len);
+	if(len == 1 && level[0] == '#'){
+		/* Matches this level and everything below it. */
+		return _acl_node_any(node, access, first);
+	}else if(len == 1 && level[0] == '+'){
+		if(node->plus && _acl_node_overlaps(node->plus, next, access, false)){
+			return true;
+		}
+		HASH_ITER(hh, node->children, child, tmp){
+			if(first && child->topic[0] == '$') continue;
+			if(_acl_node_overlaps(child, next, access, false)) return true;
+		}
+		return false;
+	}
+
+	HASH_FIND(hh, node->children, level, len, child);
+	if(child && _acl_node_overlaps(child, next, access, false)){
+		return true;
+	}
+	if(wildcards && node->plus && _acl_node_overlaps(node->plus, next, access, false)){
+		return true;
+	}
+	return false;
+}
+
+/* Classify READ access for every topic the subscription can deliver, using
+ * the compiled ACLs. */
+enum mosquitto_sub_acl mosquitto_acl_sub_classify_default(struct mosquitto_db *db, struct mosquitto *context, const char *sub)
+{
+	struct _mosquitto_acl_user *acl_user;
+	struct _mosquitto_acl_node *user_acl = NULL;
+
+	if(!db || !context || !sub) return mosq_sa_check;
+	if(!db->acl_list && !db->acl_patterns) return mosq_sa_allow;
+	if(context->bridge) return mosq_sa_allow;
+	acl_user = _acl_context_user(db, context);
+	if(!acl_user && !db->acl_patterns) return mosq_sa_deny;
+
+	if(acl_user){
+		user_acl = acl_user->acl;
+	}
+	if(db->acl_patterns && !context->acl_patterns){
+		if(mosquitto_acl_context_init_default(db, context)) return mosq_sa_check;
+	}
+
+	if((user_acl && _acl_node_covers(user_acl, sub, MOSQ_ACL_READ, true))
+			|| (context->acl_patterns && _acl_node_covers(context->acl_patterns, sub, MOSQ_ACL_READ, true))){
+		return mosq_sa_allow;
+	}
+	if((user_acl && _acl_node_overlaps(user_acl, sub, MOSQ_ACL_READ, true))
+			|| (context->acl_patterns && _acl_node_overlaps(context->acl_patterns, sub, MOSQ_ACL_READ, true))){
+		return mosq_sa_check;
+	}
+	return mosq_sa_deny;
+}
+
 static int _aclfile_parse(struct mosquitto_db *db)
 {
 	FILE *aclfile;
@@ -440,7 +734,7 @@ static int _acl_cleanup(struct mosquitto_db *db, bool reload)
 	struct _mosquitto_acl_user *user_tail;
 
 	if(!db) return MOSQ_ERR_INVAL;
-	if(!db->acl_list) return MOSQ_ERR_SUCCESS;
+	if(!db->acl_list && !db->acl_patterns) return MOSQ_ERR_SUCCESS;
 
 	/* As we're freeing ACLs, we must clear context->acl_list to ensure no
 	 * invalid memory accesses take place later.
@@ -450,16 +744,19 @@ static int _acl_cleanup(struct mosquitto_db *db, bool reload)
 	 */
 	if(db->contexts){
 		for(i=0; i<db->context_count; i++){
-			if(db->contexts[i] && db->contexts[i]->acl_list){
+			if(db->contexts[i]){
 				db->contexts[i]->acl_list = NULL;
+				mosquitto_acl_context_cleanup_default(db->contexts[i]);
 			}
 		}
 	}
 
+	HASH_CLEAR(hh, db->acl_users);
+	db->acl_anonymous = NULL;
 	while(db->acl_list){
 		user_tail = db->acl_list->next;
 
-		_free_acl(db->acl_list->acl);
+		_acl_node_free(db->acl_list->acl);
 		if(db->acl_list->username){
 			_mosquitto_free(db->acl_list->username);
 		}
@@ -540,6 +837,7 @@ static int _unpwd_file_parse(struct mosquitto_db *db)
 #ifdef WITH_TLS
 	struct _mosquitto_unpwd *u, *tmp;
 	char *token;
+	char *saveptr = NULL;
 	unsigned char *salt;
 	unsigned int salt_len;
 	unsigned char *password;
@@ -557,9 +855,9 @@ static int _unpwd_file_parse(struct mosquitto_db *db)
 	HASH_ITER(hh, db->unpwd, u, tmp){
 		/* Need to decode password into hashed data + salt. */
 		if(u->password){
-			token = strtok(u->password, "$");
+			token = strtok_r(u->password, "$", &saveptr);
 			if(token && !strcmp(token, "6")){
-				token = strtok(NULL, "$");
+				token = strtok_r(NULL, "$", &saveptr);
 				if(token){
 					rc = _base64_decode(token, &salt, &salt_len);
 					if(rc){
@@ -568,7 +866,7 @@ static int _unpwd_file_parse(struct mosquitto_db *db)
 					}
 					u->salt = salt;
 					u->salt_len = salt_len;
-					token = strtok(NULL, "$");
+					token = strtok_r(NULL, "$", &saveptr);
 					if(token){
 						rc = _base64_decode(token, &password, &password_len);
 						if(rc){
@@ -623,9 +921,23 @@ static int _psk_file_parse(struct mosquitto_db *db)
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Compare len bytes of a and b in a time that doesn't depend on where they
+ * differ. Returns 0 if they are the same. */
+static int _memcmp_const(const void *a, const void *b, size_t len)
+{
+	const unsigned char *pa = a, *pb = b;
+	unsigned char diff = 0;
+	size_t i;
+
+	for(i=0; i<len; i++){
+		diff |= pa[i] ^ pb[i];
+	}
+	return diff;
+}
+
 int mosquitto_unpwd_check_default(struct mosquitto_db *db, const char *username, const char *password)
 {
-	struct _mosquitto_unpwd *u, *tmp;
+	struct _mosquitto_unpwd *u;
 #ifdef WITH_TLS
 	unsigned char hash[EVP_MAX_MD_SIZE];
 	unsigned int hash_len;
@@ -635,36 +947,92 @@ int mosquitto_unpwd_check_default(struct mosquitto_db *db, const char *username,
 	if(!db || !username) return MOSQ_ERR_INVAL;
 	if(!db->unpwd) return MOSQ_ERR_SUCCESS;
 
-	HASH_ITER(hh, db->unpwd, u, tmp){
-		if(!strcmp(u->username, username)){
-			if(u->password){
-				if(password){
+	HASH_FIND_STR(db->unpwd, username, u);
+	if(!u) return MOSQ_ERR_AUTH;
+
+	if(!u->password) return MOSQ_ERR_SUCCESS;
+	if(!password) return MOSQ_ERR_AUTH;
+
 #ifdef WITH_TLS
-					rc = _pw_digest(password, u->salt, u->salt_len, hash, &hash_len);
-					if(rc == MOSQ_ERR_SUCCESS){
-						if(hash_len == u->password_len && !memcmp(u->password, hash, hash_len)){
-							return MOSQ_ERR_SUCCESS;
-						}else{
-							return MOSQ_ERR_AUTH;
-						}
-					}else{
-						return rc;
-					}
+	rc = _pw_digest(password, u->salt, u->salt_len, hash, &hash_len);
+	if(rc) return rc;
+	if(hash_len == u->password_len && !_memcmp_const(u->password, hash, hash_len)){
+		return MOSQ_ERR_SUCCESS;
+	}
 #else
-					if(!strcmp(u->password, password)){
-						return MOSQ_ERR_SUCCESS;
-					}
+	if(strlen(u->password) == strlen(password) && !_memcmp_const(u->password, password, strlen(password))){
+		return MOSQ_ERR_SUCCESS;
+	}
 #endif
-				}else{
-					return MOSQ_ERR_AUTH;
-				}
-			}else{
-				return MOSQ_ERR_SUCCESS;
-			}
+
+	return MOSQ_ERR_AUTH;
+}
+
+#ifdef WITH_TLS
+/* Key for the password cache hashes, chosen when first needed. */
+static unsigned char unpwd_cache_key[32];
+static bool unpwd_cache_key_set = false;
+
+static int _unpwd_cache_hash(const char *password, unsigned char *hash)
+{
+	unsigned int hash_len;
+
+	if(!unpwd_cache_key_set){
+		if(RAND_bytes(unpwd_cache_key, sizeof(unpwd_cache_key)) != 1){
+			return MOSQ_ERR_UNKNOWN;
 		}
+		unpwd_cache_key_set = true;
 	}
+	if(!HMAC(EVP_sha256(), unpwd_cache_key, sizeof(unpwd_cache_key),
+			(const unsigned char *)password, strlen(password), hash, &hash_len)){
 
-	return MOSQ_ERR_AUTH;
+		return MOSQ_ERR_UNKNOWN;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
+
+int mosquitto_unpwd_cache_check_default(struct mosquitto_db *db, const char *username, const char *password)
+{
+#ifdef WITH_TLS
+	struct _mosquitto_unpwd *u;
+	unsigned char hash[32];
+
+	if(!db->config->password_cache_ttl || !username || !password) return MOSQ_ERR_NOT_FOUND;
+
+	HASH_FIND_STR(db->unpwd, username, u);
+	if(!u || !u->cache_time) return MOSQ_ERR_NOT_FOUND;
+
+	if(mosquitto_time() - u->cache_time >= db->config->password_cache_ttl){
+		u->cache_time = 0;
+		return MOSQ_ERR_NOT_FOUND;
+	}
+	if(_unpwd_cache_hash(password, hash)) return MOSQ_ERR_NOT_FOUND;
+	if(_memcmp_const(hash, u->cache_hash, sizeof(hash))) return MOSQ_ERR_NOT_FOUND;
+
+	return MOSQ_ERR_SUCCESS;
+#else
+	/* Plain text passwords are cheap to check. */
+	return MOSQ_ERR_NOT_FOUND;
+#endif
+}
+
+void mosquitto_unpwd_cache_store_default(struct mosquitto_db *db, const char *username, const char *password)
+{
+#ifdef WITH_TLS
+	struct _mosquitto_unpwd *u;
+
+	if(!db->config->password_cache_ttl || !username || !password) return;
+
+	HASH_FIND_STR(db->unpwd, username, u);
+	if(!u) return;
+
+	if(_unpwd_cache_hash(password, u->cache_hash)){
+		u->cache_time = 0;
+	}else{
+		u->cache_time = mosquitto_time();
+	}
+#endif
 }
 
 static int _unpwd_cleanup(struct _mosquitto_unpwd **root, bool reload)
@@ -688,78 +1056,243 @@ static int _unpwd_cleanup(struct _mosquitto_unpwd **root, bool reload)
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Whether a password_file entry is the same as before a reload. */
+static bool _unpwd_same(struct _mosquitto_unpwd *a, struct _mosquitto_unpwd *b)
+{
+	if(!a->password || !b->password) return a->password == b->password;
+#ifdef WITH_TLS
+	return a->password_len == b->password_len
+		&& !memcmp(a->password, b->password, a->password_len)
+		&& a->salt_len == b->salt_len
+		&& (!a->salt_len || !memcmp(a->salt, b->salt, a->salt_len));
+#else
+	return !strcmp(a->password, b->password);
+#endif
+}
+
 /* Apply security settings after a reload.
  * Includes:
  * - Disconnecting anonymous users if appropriate
  * - Disconnecting users with invalid passwords
- * - Reapplying ACLs
+ * Clients whose entry in password_file has not changed are not checked
+ * again. ACLs are applied to each client when they are next needed.
  */
-int mosquitto_security_apply_default(struct mosquitto_db *db)
+static void _security_apply(struct mosquitto_db *db, struct _mosquitto_unpwd *old_unpwd)
 {
-	struct _mosquitto_acl_user *acl_user_tail;
-	bool allow_anonymous;
+	struct mosquitto *context;
+	struct _mosquitto_unpwd *u_old, *u_new;
 	int i;
 
-	if(!db) return MOSQ_ERR_INVAL;
+	for(i=0; i<db->context_count; i++){
+		context = db->contexts[i];
+		if(!context) continue;
 
-	allow_anonymous = db->config->allow_anonymous;
-	
-	if(db->contexts){
-		for(i=0; i<db->context_count; i++){
-			if(db->contexts[i]){
-				/* Check for anonymous clients when allow_anonymous is false */
-				if(!allow_anonymous && !db->contexts[i]->username){
-					db->contexts[i]->state = mosq_cs_disconnecting;
-					_mosquitto_socket_close(db->contexts[i]);
-					continue;
-				}
-				/* Check for connected clients that are no longer authorised */
-				if(mosquitto_unpwd_check_default(db, db->contexts[i]->username, db->contexts[i]->password) != MOSQ_ERR_SUCCESS){
-					db->contexts[i]->state = mosq_cs_disconnecting;
-					_mosquitto_socket_close(db->contexts[i]);
-					continue;
-				}
-				/* Check for ACLs and apply to user. */
-				if(db->acl_list){
-  					acl_user_tail = db->acl_list;
-					while(acl_user_tail){
-						if(acl_user_tail->username){
-							if(db->contexts[i]->username){
-								if(!strcmp(acl_user_tail->username, db->contexts[i]->username)){
-									db->contexts[i]->acl_list = acl_user_tail;
-									break;
-								}
-							}
-						}else{
-							if(!db->contexts[i]->username){
-								db->contexts[i]->acl_list = acl_user_tail;
-								break;
-							}
-						}
-						acl_user_tail = acl_user_tail->next;
-					}
-				}
+		/* Check for anonymous clients when allow_anonymous is false */
+		if(!db->config->allow_anonymous && !context->username){
+			context->state = mosq_cs_disconnecting;
+			_mosquitto_socket_close(context);
+			continue;
+		}
+		if(context->username && context->password){
+			HASH_FIND_STR(old_unpwd, context->username, u_old);
+			HASH_FIND_STR(db->unpwd, context->username, u_new);
+			if(u_old && u_new && _unpwd_same(u_old, u_new)){
+				continue;
 			}
 		}
+		/* Check for connected clients that are no longer authorised */
+		if(mosquitto_unpwd_check_default(db, context->username, context->password) != MOSQ_ERR_SUCCESS){
+			context->state = mosq_cs_disconnecting;
+			_mosquitto_socket_close(context);
+		}
 	}
+}
+
+/* A reload of password_file, acl_file and psk_file. The files are read into
+ * the security fields of a separate mosquitto_db, on a thread if possible, and
+ * swapped in by mosquitto_security_reload_finish_default(). */
+struct _security_reload{
+	struct mosquitto_db db;
+	struct mqtt3_config config;
+	int rc;
+	bool done;
+	bool threaded;
+};
+
+static struct _security_reload *security_reload = NULL;
+/* Set if the configuration was reloaded again while reading the files. */
+static bool security_reload_again = false;
+#ifdef WITH_THREADING
+static pthread_t security_reload_thread;
+static pthread_mutex_t security_reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void _security_reload_free(struct _security_reload *reload)
+{
+	/* With no contexts, this only frees the file data. */
+	mosquitto_security_cleanup_default(&reload->db, false);
+	if(reload->config.password_file) _mosquitto_free(reload->config.password_file);
+	if(reload->config.acl_file) _mosquitto_free(reload->config.acl_file);
+	if(reload->config.psk_file) _mosquitto_free(reload->config.psk_file);
+	_mosquitto_free(reload);
+}
+
+/* Runs on security_reload_thread, and only touches reload->db. The
+ * allocator's memory counters are safe to update from here. */
+static void *_security_reload_read(void *arg)
+{
+	struct _security_reload *reload = arg;
+	int rc;
+
+	rc = mosquitto_security_init_default(&reload->db, true);
+#ifdef WITH_THREADING
+	pthread_mutex_lock(&security_reload_mutex);
+#endif
+	reload->rc = rc;
+	reload->done = true;
+#ifdef WITH_THREADING
+	pthread_mutex_unlock(&security_reload_mutex);
+#endif
+	return NULL;
+}
+
+/* Start reading the security files named in the newly reloaded
+ * configuration. */
+int mosquitto_security_reload_start_default(struct mosquitto_db *db)
+{
+	struct _security_reload *reload;
+#ifdef WITH_THREADING
+	sigset_t sigblock, origsig;
+	int rc;
+#endif
+
+	if(security_reload){
+		security_reload_again = true;
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	reload = _mosquitto_calloc(1, sizeof(struct _security_reload));
+	if(!reload) return MOSQ_ERR_NOMEM;
+	reload->db.config = &reload->config;
+	if((db->config->password_file && !(reload->config.password_file = _mosquitto_strdup(db->config->password_file)))
+			|| (db->config->acl_file && !(reload->config.acl_file = _mosquitto_strdup(db->config->acl_file)))
+			|| (db->config->psk_file && !(reload->config.psk_file = _mosquitto_strdup(db->config->psk_file)))){
+
+		_security_reload_free(reload);
+		return MOSQ_ERR_NOMEM;
+	}
+	security_reload = reload;
+
+#ifdef WITH_THREADING
+	/* Signals are handled by the main thread. */
+	sigfillset(&sigblock);
+	pthread_sigmask(SIG_SETMASK, &sigblock, &origsig);
+	rc = pthread_create(&security_reload_thread, NULL, _security_reload_read, reload);
+	pthread_sigmask(SIG_SETMASK, &origsig, NULL);
+	if(!rc){
+		reload->threaded = true;
+		return MOSQ_ERR_SUCCESS;
+	}
+	_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to start reload thread, reading security files directly.");
+#endif
+	_security_reload_read(reload);
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Take the reload being read once it has finished, waiting for it if wait is
+ * true. Returns NULL if there is no reload or it hasn't finished. */
+static struct _security_reload *_security_reload_take(bool wait)
+{
+	struct _security_reload *reload = security_reload;
+	bool done;
+
+	if(!reload) return NULL;
+#ifdef WITH_THREADING
+	pthread_mutex_lock(&security_reload_mutex);
+	done = reload->done;
+	pthread_mutex_unlock(&security_reload_mutex);
+	if(!done && !wait) return NULL;
+	if(reload->threaded){
+		pthread_join(security_reload_thread, NULL);
+	}
+#else
+	done = reload->done;
+	if(!done && !wait) return NULL;
+#endif
+	security_reload = NULL;
+	return reload;
+}
+
+/* Swap in the security files read by mosquitto_security_reload_start_default()
+ * if they are ready. Returns true if the settings have changed. */
+bool mosquitto_security_reload_finish_default(struct mosquitto_db *db)
+{
+	struct _security_reload *reload;
+	struct mosquitto_db *new_db;
+	struct _mosquitto_unpwd *unpwd;
+	struct _mosquitto_acl_user *acl_list, *acl_users, *acl_anonymous;
+	struct _mosquitto_acl *acl_patterns;
+	struct _mosquitto_unpwd *psk_id;
+	bool again;
+
+	reload = _security_reload_take(false);
+	if(!reload) return false;
+
+	again = security_reload_again;
+	security_reload_again = false;
+
+	if(reload->rc){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to reload security files, keeping the current settings.");
+		_security_reload_free(reload);
+		if(again) mosquitto_security_reload_start_default(db);
+		return false;
+	}
+
+	/* Exchange the old settings for the new ones, so the old ones are freed
+	 * with the reload. */
+	new_db = &reload->db;
+	mosquitto_auth_async_pause();
+	unpwd = db->unpwd;
+	acl_list = db->acl_list;
+	acl_users = db->acl_users;
+	acl_anonymous = db->acl_anonymous;
+	acl_patterns = db->acl_patterns;
+	psk_id = db->psk_id;
+	db->unpwd = new_db->unpwd;
+	db->acl_list = new_db->acl_list;
+	db->acl_users = new_db->acl_users;
+	db->acl_anonymous = new_db->acl_anonymous;
+	db->acl_patterns = new_db->acl_patterns;
+	db->psk_id = new_db->psk_id;
+	new_db->unpwd = unpwd;
+	new_db->acl_list = acl_list;
+	new_db->acl_users = acl_users;
+	new_db->acl_anonymous = acl_anonymous;
+	new_db->acl_patterns = acl_patterns;
+	new_db->psk_id = psk_id;
+	/* Cached ACL results and context ACLs may no longer be valid. */
+	db->acl_generation++;
+
+	_security_apply(db, new_db->unpwd);
+	mosquitto_auth_async_resume();
+
+	_security_reload_free(reload);
+	if(again) mosquitto_security_reload_start_default(db);
+	return true;
+}
+
 int mosquitto_psk_key_get_default(struct mosquitto_db *db, const char *hint, const char *identity, char *key, int max_key_len)
 {
-	struct _mosquitto_unpwd *u, *tmp;
+	struct _mosquitto_unpwd *u;
 
 	if(!db || !hint || !identity || !key) return MOSQ_ERR_INVAL;
 	if(!db->psk_id) return MOSQ_ERR_AUTH;
 
-	HASH_ITER(hh, db->psk_id, u, tmp){
-		if(!strcmp(u->username, identity)){
-			strncpy(key, u->password, max_key_len);
-			return MOSQ_ERR_SUCCESS;
-		}
-	}
+	HASH_FIND_STR(db->psk_id, identity, u);
+	if(!u) return MOSQ_ERR_AUTH;
 
-	return MOSQ_ERR_AUTH;
+	strncpy(key, u->password, max_key_len);
+	return MOSQ_ERR_SUCCESS;
 }
 
 #ifdef WITH_TLS
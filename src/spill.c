@@ -0,0 +1,679 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#ifdef WITH_PERSISTENCE
+
+#ifndef WIN32
+#include <arpa/inet.h>
+#endif
+#include <assert.h>
+#include <errno.h>
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+#include <time_mosq.h>
+#include "util_mosq.h"
+
+#ifdef WITH_SYS_TREE
+extern unsigned long g_msgs_expired;
+#endif
+
+/* Spill file layout:
+ *
+ * [15 byte magic][uint32 version][uint32 read offset]
+ * then for each message:
+ * [uint32 record length][uint32 expiry][uint8 qos][uint8 retain][uint16 topic length][topic][payload]
+ *
+ * All integers are in network byte order. The record length covers
+ * everything after itself. The expiry is a wall clock time in seconds, or 0
+ * if the message does not expire, so that it remains valid across restarts.
+ * The read offset is only rewritten when the in-memory database is saved (or
+ * once the write-ahead log has been synced after a drain when it is in use),
+ * so that after an unclean shutdown any messages drained since then are
+ * delivered again rather than lost.
+ */
+static const unsigned char spill_magic[15] = {0x00, 0xB5, 0x00, 'm','o','s','q','u','i','t','t','o','s','p','l'};
+#define SPILL_VERSION 1
+#define SPILL_READ_POS_OFFSET (15 + sizeof(uint32_t))
+#define SPILL_HEADER_LEN (15 + 2*sizeof(uint32_t))
+#define SPILL_RECORD_HEADER_LEN (sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint16_t))
+
+/* A deep offline queue is most likely when many clients are offline at
+ * once, so files are opened when needed and the least recently used is
+ * closed once this many are open. */
+#define SPILL_OPEN_MAX 64
+
+static struct _mosquitto_spill *spill_open_first = NULL;
+static struct _mosquitto_spill *spill_open_last = NULL;
+static int spill_open_count = 0;
+
+/* Files written to since they were last synced, whether still open or not. */
+static struct _mosquitto_spill *spill_dirty = NULL;
+
+static char *_spill_path(struct mosquitto_db *db, const char *id)
+{
+	char *path;
+	int len;
+	int i;
+	const char *hex = "0123456789abcdef";
+	char *pos;
+
+	/* Client ids may contain any character, so hex encode them to get a safe
+	 * filename. */
+	len = strlen(db->config->persistence_filepath) + strlen(".spill.") + 2*strlen(id) + 1;
+	path = _mosquitto_malloc(len);
+	if(!path) return NULL;
+
+	snprintf(path, len, "%s.spill.", db->config->persistence_filepath);
+	pos = path + strlen(path);
+	for(i=0; id[i]; i++){
+		*pos++ = hex[((unsigned char)id[i])>>4];
+		*pos++ = hex[((unsigned char)id[i])&0x0F];
+	}
+	*pos = '\0';
+
+	return path;
+}
+
+static void _spill_open_unlink(struct _mosquitto_spill *spill)
+{
+	if(spill->open_prev){
+		spill->open_prev->open_next = spill->open_next;
+	}else{
+		spill_open_first = spill->open_next;
+	}
+	if(spill->open_next){
+		spill->open_next->open_prev = spill->open_prev;
+	}else{
+		spill_open_last = spill->open_prev;
+	}
+	spill->open_prev = NULL;
+	spill->open_next = NULL;
+}
+
+static void _spill_open_push(struct _mosquitto_spill *spill)
+{
+	spill->open_prev = NULL;
+	spill->open_next = spill_open_first;
+	if(spill_open_first){
+		spill_open_first->open_prev = spill;
+	}else{
+		spill_open_last = spill;
+	}
+	spill_open_first = spill;
+}
+
+/* Close the file, leaving the spill itself in place. Anything still dirty is
+ * synced by the next mqtt3_spill_flush(). */
+static int _spill_file_close(struct _mosquitto_spill *spill)
+{
+	int rc = MOSQ_ERR_SUCCESS;
+
+	if(!spill->fptr) return MOSQ_ERR_SUCCESS;
+
+	_spill_open_unlink(spill);
+	spill_open_count--;
+	if(fclose(spill->fptr)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to write spill file %s: %s.", spill->path, strerror(errno));
+		rc = 1;
+	}
+	spill->fptr = NULL;
+	return rc;
+}
+
+/* Make sure the spill file is open, with mode used only when opening it. */
+static int _spill_file_open(struct _mosquitto_spill *spill, const char *mode)
+{
+	if(spill->fptr){
+		if(spill_open_first != spill){
+			_spill_open_unlink(spill);
+			_spill_open_push(spill);
+		}
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(spill_open_count >= SPILL_OPEN_MAX){
+		_spill_file_close(spill_open_last);
+	}
+	spill->fptr = _mosquitto_fopen(spill->path, mode);
+	if(!spill->fptr) return 1;
+	_spill_open_push(spill);
+	spill_open_count++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _spill_dirty_set(struct _mosquitto_spill *spill)
+{
+	if(spill->dirty) return;
+	spill->dirty = true;
+	spill->dirty_next = spill_dirty;
+	spill_dirty = spill;
+}
+
+static void _spill_dirty_remove(struct _mosquitto_spill *spill)
+{
+	struct _mosquitto_spill **prev;
+
+	if(!spill->dirty) return;
+	prev = &spill_dirty;
+	while(*prev){
+		if(*prev == spill){
+			*prev = spill->dirty_next;
+			break;
+		}
+		prev = &(*prev)->dirty_next;
+	}
+	spill->dirty = false;
+	spill->dirty_next = NULL;
+}
+
+/* Write the read offset. The file must be open. */
+static int _spill_header_write(struct _mosquitto_spill *spill)
+{
+	uint32_t i32temp;
+
+	i32temp = htonl(spill->read_pos);
+#ifndef WIN32
+	/* pwrite() leaves the shared file position alone, so this is also safe
+	 * from a background save process. */
+	if(pwrite(fileno(spill->fptr), &i32temp, sizeof(uint32_t), SPILL_READ_POS_OFFSET) != sizeof(uint32_t)) return 1;
+#else
+	if(fseek(spill->fptr, SPILL_READ_POS_OFFSET, SEEK_SET)) return 1;
+	if(fwrite(&i32temp, sizeof(uint32_t), 1, spill->fptr) != 1) return 1;
+	if(fflush(spill->fptr)) return 1;
+#endif
+	spill->header_pos = spill->read_pos;
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Get everything written so far onto the disk, and the read offset too if
+ * header is set. */
+static int _spill_commit(struct _mosquitto_spill *spill, bool header)
+{
+	if(_spill_file_open(spill, "r+b")) return 1;
+	if(fflush(spill->fptr)) return 1;
+	if(header && spill->header_pos != spill->read_pos){
+		if(_spill_header_write(spill)) return 1;
+	}
+#ifndef WIN32
+	if(fsync(fileno(spill->fptr))) return 1;
+#endif
+	return MOSQ_ERR_SUCCESS;
+}
+
+static void _spill_free(struct mosquitto_db *db, struct mosquitto *context, bool remove_file)
+{
+	struct _mosquitto_spill *spill = context->spill;
+
+	_spill_file_close(spill);
+	_spill_dirty_remove(spill);
+	if(remove_file){
+		remove(spill->path);
+	}
+	db->msg_spilled_count -= spill->count;
+	_mosquitto_free(spill->path);
+	_mosquitto_free(spill);
+	context->spill = NULL;
+}
+
+static struct _mosquitto_spill *_spill_new(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct _mosquitto_spill *spill;
+
+	spill = _mosquitto_calloc(1, sizeof(struct _mosquitto_spill));
+	if(!spill) return NULL;
+
+	spill->path = _spill_path(db, context->id);
+	if(!spill->path){
+		_mosquitto_free(spill);
+		return NULL;
+	}
+	return spill;
+}
+
+/* Start a new, empty spill file. */
+static int _spill_create(struct _mosquitto_spill *spill)
+{
+	uint32_t i32temp;
+
+	if(_spill_file_open(spill, "w+b")) return 1;
+	spill->read_pos = SPILL_HEADER_LEN;
+	spill->write_pos = SPILL_HEADER_LEN;
+	spill->header_pos = SPILL_HEADER_LEN;
+
+	if(fwrite(spill_magic, 1, 15, spill->fptr) != 15) return 1;
+	i32temp = htonl(SPILL_VERSION);
+	if(fwrite(&i32temp, sizeof(uint32_t), 1, spill->fptr) != 1) return 1;
+	i32temp = htonl(spill->read_pos);
+	if(fwrite(&i32temp, sizeof(uint32_t), 1, spill->fptr) != 1) return 1;
+	/* The read offset is later rewritten with pwrite(), which must not be
+	 * overtaken by this. */
+	if(fflush(spill->fptr)) return 1;
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt3_spill_message(struct mosquitto_db *db, struct mosquitto *context, int qos, bool retain, struct mosquitto_msg_store *stored)
+{
+	struct _mosquitto_spill *spill;
+	uint32_t i32temp;
+	uint16_t i16temp, tlen;
+	uint8_t i8temp;
+	uint32_t length;
+	uint32_t expiry = 0;
+	time_t now;
+	char err[256];
+
+	assert(db);
+	assert(context);
+	assert(stored);
+
+	if(!context->id || !stored->msg.topic) return MOSQ_ERR_INVAL;
+
+	if(!context->spill){
+		spill = _spill_new(db, context);
+		if(!spill) return MOSQ_ERR_NOMEM;
+		context->spill = spill;
+
+		if(_spill_create(spill)){
+			strerror_r(errno, err, 256);
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to create spill file %s: %s.", spill->path, err);
+			_spill_free(db, context, true);
+			return 1;
+		}
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Spilling queued messages for client %s to disk.", context->id);
+	}
+	spill = context->spill;
+	if(_spill_file_open(spill, "r+b")) goto error;
+
+	tlen = strlen(stored->msg.topic);
+	length = SPILL_RECORD_HEADER_LEN - sizeof(uint32_t) + tlen + stored->msg.payloadlen;
+	if(stored->expiry_time){
+		now = mosquitto_time();
+		expiry = (uint32_t)time(NULL);
+		if(stored->expiry_time > now){
+			expiry += stored->expiry_time - now;
+		}
+	}
+
+	_spill_dirty_set(spill);
+	if(fseek(spill->fptr, spill->write_pos, SEEK_SET)) goto error;
+	i32temp = htonl(length);
+	if(fwrite(&i32temp, sizeof(uint32_t), 1, spill->fptr) != 1) goto error;
+	i32temp = htonl(expiry);
+	if(fwrite(&i32temp, sizeof(uint32_t), 1, spill->fptr) != 1) goto error;
+	i8temp = (uint8_t )qos;
+	if(fwrite(&i8temp, sizeof(uint8_t), 1, spill->fptr) != 1) goto error;
+	i8temp = (uint8_t )retain;
+	if(fwrite(&i8temp, sizeof(uint8_t), 1, spill->fptr) != 1) goto error;
+	i16temp = htons(tlen);
+	if(fwrite(&i16temp, sizeof(uint16_t), 1, spill->fptr) != 1) goto error;
+	if(fwrite(stored->msg.topic, 1, tlen, spill->fptr) != tlen) goto error;
+	if(stored->msg.payloadlen){
+		if(fwrite(stored->msg.payload, 1, stored->msg.payloadlen, spill->fptr) != stored->msg.payloadlen) goto error;
+	}
+	/* Find out about a failed write now, while the message can still be
+	 * refused, rather than when it is drained. */
+	if(fflush(spill->fptr)) goto error;
+
+	spill->write_pos += sizeof(uint32_t) + length;
+	spill->count++;
+	db->msg_spilled_count++;
+
+	return MOSQ_ERR_SUCCESS;
+error:
+	strerror_r(errno, err, 256);
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error writing spill file %s: %s.", spill->path, err);
+	/* Anything past write_pos is ignored on restore and overwritten by the
+	 * next record, so a partial record is harmless. Only give up on the file
+	 * if nothing has been spilled yet. Otherwise it is kept, and the caller
+	 * must not queue this message in memory ahead of those on disk. The file
+	 * is reopened for the next message so nothing of this one is left
+	 * buffered. */
+	if(spill->count == 0){
+		_spill_free(db, context, true);
+	}else{
+		_spill_file_close(spill);
+	}
+	return 1;
+}
+
+/* Record that messages before read_pos have been moved to the in-memory
+ * queue, if any have since it was old_read_pos. */
+static void _spill_drained(struct mosquitto_db *db, struct _mosquitto_spill *spill, uint32_t old_read_pos)
+{
+	if(db->config->persistence_wal && spill->read_pos != old_read_pos){
+		/* Drained messages are now in the write-ahead log, so the read
+		 * offset on disk moves past them once that has been synced. */
+		_spill_dirty_set(spill);
+	}
+}
+
+/* Move spilled messages back into the in-memory queue of a connected client,
+ * until the queue reaches queue_spill_threshold again. */
+int mqtt3_spill_drain(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct _mosquitto_spill *spill;
+	struct mosquitto_msg_store *stored;
+	uint32_t i32temp, length;
+	uint32_t expiry;
+	time_t now;
+	uint16_t i16temp, tlen;
+	uint8_t qos, retain;
+	char *buf = NULL;
+	uint32_t buflen = 0;
+	char *tmp;
+	uint32_t payloadlen;
+	uint16_t mid;
+	uint32_t read_pos;
+	int rc = MOSQ_ERR_SUCCESS;
+	char err[256];
+
+	assert(db);
+	assert(context);
+
+	spill = context->spill;
+	if(!spill) return MOSQ_ERR_SUCCESS;
+	if(context->msg_count12 >= db->config->queue_spill_threshold) return MOSQ_ERR_SUCCESS;
+
+	read_pos = spill->read_pos;
+	if(_spill_file_open(spill, "r+b")) goto error;
+	if(fseek(spill->fptr, spill->read_pos, SEEK_SET)) goto error;
+	while(spill->count > 0 && context->msg_count12 < db->config->queue_spill_threshold){
+		if(fread(&i32temp, sizeof(uint32_t), 1, spill->fptr) != 1) goto error;
+		length = ntohl(i32temp);
+		if(fread(&i32temp, sizeof(uint32_t), 1, spill->fptr) != 1) goto error;
+		expiry = ntohl(i32temp);
+		if(fread(&qos, sizeof(uint8_t), 1, spill->fptr) != 1) goto error;
+		if(fread(&retain, sizeof(uint8_t), 1, spill->fptr) != 1) goto error;
+		if(fread(&i16temp, sizeof(uint16_t), 1, spill->fptr) != 1) goto error;
+		tlen = ntohs(i16temp);
+		length -= SPILL_RECORD_HEADER_LEN - sizeof(uint32_t);
+		if(tlen > length) goto corrupt;
+
+		now = time(NULL);
+		if(expiry && expiry <= now){
+			/* Expired while on disk, skip it without reading the body. */
+			if(fseek(spill->fptr, length, SEEK_CUR)) goto error;
+			spill->read_pos += SPILL_RECORD_HEADER_LEN + length;
+			spill->count--;
+			db->msg_spilled_count--;
+#ifdef WITH_SYS_TREE
+			g_msgs_expired++;
+#endif
+			continue;
+		}
+
+		/* Topic, terminator, payload. */
+		if(length+1 > buflen){
+			tmp = _mosquitto_realloc(buf, length+1);
+			if(!tmp){
+				rc = MOSQ_ERR_NOMEM;
+				break;
+			}
+			buf = tmp;
+			buflen = length+1;
+		}
+		if(fread(buf, 1, tlen, spill->fptr) != tlen) goto error;
+		buf[tlen] = '\0';
+		payloadlen = length - tlen;
+		if(payloadlen){
+			if(fread(&buf[tlen+1], 1, payloadlen, spill->fptr) != payloadlen) goto error;
+		}
+
+		if(mqtt3_db_message_store(db, "", 0, buf, qos, payloadlen, &buf[tlen+1], retain, &stored, 0)){
+			rc = MOSQ_ERR_NOMEM;
+			break;
+		}
+		if(expiry){
+			stored->expiry_time = mosquitto_time() + (expiry - now);
+		}
+		mid = _mosquitto_mid_generate(context);
+		spill->draining = true;
+		rc = mqtt3_db_message_insert(db, context, mid, mosq_md_out, qos, retain, stored);
+		spill->draining = false;
+		if(rc == 1 || rc == MOSQ_ERR_NOMEM){
+			break;
+		}
+		rc = MOSQ_ERR_SUCCESS;
+
+		spill->read_pos += SPILL_RECORD_HEADER_LEN + length;
+		spill->count--;
+		db->msg_spilled_count--;
+	}
+	if(buf) _mosquitto_free(buf);
+
+	if(spill->read_error){
+		spill->read_error = false;
+		_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE, "Spill file %s is being read again.", spill->path);
+	}
+	if(spill->count == 0){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_DEBUG, "Spilled messages for client %s drained.", context->id);
+		_spill_free(db, context, true);
+		return rc;
+	}
+	_spill_drained(db, spill, read_pos);
+	return rc;
+error:
+	/* Records only end at write_pos, so running out of file early means
+	 * it has been damaged rather than that it couldn't be read. */
+	if(spill->fptr && feof(spill->fptr)) goto corrupt;
+
+	if(buf) _mosquitto_free(buf);
+	strerror_r(errno, err, 256);
+	/* Probably temporary, such as running out of file descriptors, so keep
+	 * the file and the read offset and try again on the next drain. */
+	_mosquitto_log_printf(NULL, spill->read_error?MOSQ_LOG_DEBUG:MOSQ_LOG_ERR,
+			"Error reading spill file %s, will retry: %s.", spill->path, err);
+	spill->read_error = true;
+	_spill_file_close(spill);
+	_spill_drained(db, spill, read_pos);
+	return 1;
+corrupt:
+	if(buf) _mosquitto_free(buf);
+	_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Spill file %s is corrupt, discarding %d messages.", spill->path, spill->count);
+	_spill_free(db, context, true);
+	return 1;
+}
+
+/* Reattach an existing spill file to a client restored from the persistent
+ * database. Records are counted from the saved read offset, and anything
+ * after the last complete record is discarded. */
+int mqtt3_spill_restore(struct mosquitto_db *db, struct mosquitto *context)
+{
+	struct _mosquitto_spill *spill;
+	unsigned char header[15];
+	uint32_t i32temp;
+	uint32_t length;
+	long end;
+
+	assert(db);
+	assert(context);
+
+	if(!context->id || context->spill) return MOSQ_ERR_SUCCESS;
+
+	spill = _spill_new(db, context);
+	if(!spill) return MOSQ_ERR_NOMEM;
+
+	if(_spill_file_open(spill, "r+b")){
+		/* No spill file for this client. */
+		_mosquitto_free(spill->path);
+		_mosquitto_free(spill);
+		return MOSQ_ERR_SUCCESS;
+	}
+	context->spill = spill;
+
+	if(fseek(spill->fptr, 0, SEEK_END) || (end = ftell(spill->fptr)) < 0){
+		_spill_free(db, context, true);
+		return 1;
+	}
+	if(fseek(spill->fptr, 0, SEEK_SET)
+			|| fread(header, 1, 15, spill->fptr) != 15
+			|| memcmp(header, spill_magic, 15)
+			|| fread(&i32temp, sizeof(uint32_t), 1, spill->fptr) != 1
+			|| ntohl(i32temp) != SPILL_VERSION){
+
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: Ignoring unrecognised spill file %s.", spill->path);
+		_spill_free(db, context, false);
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(fread(&i32temp, sizeof(uint32_t), 1, spill->fptr) != 1){
+		_spill_free(db, context, true);
+		return MOSQ_ERR_SUCCESS;
+	}
+	spill->read_pos = ntohl(i32temp);
+	spill->header_pos = spill->read_pos;
+	if(spill->read_pos < SPILL_HEADER_LEN || spill->read_pos > end){
+		_spill_free(db, context, true);
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	spill->write_pos = spill->read_pos;
+	fseek(spill->fptr, spill->read_pos, SEEK_SET);
+	while(fread(&i32temp, sizeof(uint32_t), 1, spill->fptr) == 1){
+		length = ntohl(i32temp);
+		if(length < SPILL_RECORD_HEADER_LEN - sizeof(uint32_t)
+				|| spill->write_pos + sizeof(uint32_t) + length > (uint32_t)end){
+			break;
+		}
+		spill->write_pos += sizeof(uint32_t) + length;
+		spill->count++;
+		if(fseek(spill->fptr, length, SEEK_CUR)) break;
+	}
+
+	if(spill->count == 0){
+		_spill_free(db, context, true);
+	}else{
+		_spill_file_close(spill);
+		db->msg_spilled_count += spill->count;
+		_mosquitto_log_printf(NULL, MOSQ_LOG_INFO, "Restored %d spilled messages for client %s.", spill->count, context->id);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* As _spill_commit(), but through a new descriptor, so that a background
+ * save process doesn't disturb the streams it shares with the broker. Those
+ * have been flushed before the fork. */
+static int _spill_file_sync(struct _mosquitto_spill *spill, bool header)
+{
+#ifndef WIN32
+	uint32_t i32temp;
+	int fd;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	fd = open(spill->path, O_WRONLY);
+	if(fd < 0) return 1;
+	if(header){
+		i32temp = htonl(spill->read_pos);
+		if(pwrite(fd, &i32temp, sizeof(uint32_t), SPILL_READ_POS_OFFSET) != sizeof(uint32_t)) rc = 1;
+	}
+	if(!rc && fsync(fd)) rc = 1;
+	close(fd);
+	if(!rc && header) spill->header_pos = spill->read_pos;
+	return rc;
+#else
+	return _spill_commit(spill, header);
+#endif
+}
+
+/* Called around a save of the in-memory database. Before it, with headers
+ * false, spilled messages are synced so that they are on disk before the
+ * save that they follow on from. After it, with headers set, the read
+ * offsets are updated to match the messages held in the database file. Safe
+ * to call from a background save process. */
+int mqtt3_spill_sync(struct mosquitto_db *db, bool headers)
+{
+	struct _mosquitto_spill *spill;
+	int i;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	assert(db);
+
+	for(i=0; i<db->context_count; i++){
+		if(db->contexts[i] && db->contexts[i]->spill){
+			spill = db->contexts[i]->spill;
+			if(headers && spill->header_pos == spill->read_pos) continue;
+			if(!headers && !spill->dirty) continue;
+			if(_spill_file_sync(spill, headers)){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to sync spill file %s: %s.", spill->path, strerror(errno));
+				rc = 1;
+			}
+		}
+	}
+	return rc;
+}
+
+/* Sync every spill file written to since the last call. Used whenever the
+ * write-ahead log is synced, so that spilled messages are on disk before any
+ * acknowledgement waiting on the log is sent, in which case the read offsets
+ * are updated with headers set. Also used before a save in the foreground. */
+int mqtt3_spill_flush(struct mosquitto_db *db, bool headers)
+{
+	struct _mosquitto_spill *spill;
+	int rc = MOSQ_ERR_SUCCESS;
+
+	assert(db);
+
+	while(spill_dirty){
+		spill = spill_dirty;
+		spill_dirty = spill->dirty_next;
+		spill->dirty = false;
+		spill->dirty_next = NULL;
+		if(_spill_commit(spill, headers)){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to sync spill file %s: %s.", spill->path, strerror(errno));
+			rc = 1;
+		}
+	}
+	return rc;
+}
+
+bool mqtt3_spill_dirty(void)
+{
+	return spill_dirty != NULL;
+}
+
+void mqtt3_spill_close(struct mosquitto_db *db, struct mosquitto *context, bool remove_file)
+{
+	assert(db);
+	assert(context);
+
+	if(!context->spill) return;
+	_spill_free(db, context, remove_file);
+}
+
+#endif
@@ -62,12 +62,18 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <mosquitto_broker.h>
 #include <memory_mosq.h>
+#include <time_mosq.h>
 #include <util_mosq.h>
 
+#ifdef WITH_SYS_TREE
+extern unsigned long g_msgs_expired;
+#endif
+
 struct _sub_token {
 	struct _sub_token *next;
 	char *topic;
@@ -81,6 +87,7 @@ static int _subs_process(struct mosquitto_db *db, struct _mosquitto_subhier *hie
 	uint16_t mid;
 	struct _mosquitto_subleaf *leaf;
 	bool client_retain;
+	bool batch;
 
 	leaf = hier->subs;
 
@@ -90,6 +97,7 @@ static int _subs_process(struct mosquitto_db *db, struct _mosquitto_subhier *hie
 			/* Retained messages count as a persistence change, but only if
 			 * they aren't for $SYS. */
 			db->persistence_changes++;
+			mqtt3_wal_retain(topic, stored->msg.payloadlen?stored:NULL);
 		}
 #endif
 		if(hier->retained){
@@ -101,17 +109,41 @@ static int _subs_process(struct mosquitto_db *db, struct _mosquitto_subhier *hie
 			hier->retained = stored;
 			hier->retained->ref_count++;
 			db->retained_count++;
+			mqtt3_db_expiry_retain_add(stored);
 		}else{
 			hier->retained = NULL;
 		}
 	}
+	/* If the plugin can check many clients at once, check all of the
+	 * subscriptions that need it before delivering to any of them. */
+	batch = source_id && leaf && mosquitto_acl_batch_available(db);
+	if(batch){
+		for(; leaf; leaf=leaf->next){
+			if(leaf->context->is_bridge && !strcmp(leaf->context->id, source_id)){
+				leaf->acl_result = MOSQ_ERR_ACL_DENIED;
+			}else if(leaf->acl != mosq_sa_check && leaf->acl_generation == leaf->context->acl_generation){
+				leaf->acl_result = (leaf->acl == mosq_sa_allow) ? MOSQ_ERR_SUCCESS : MOSQ_ERR_ACL_DENIED;
+			}else{
+				leaf->acl_result = MOSQ_ERR_NOT_FOUND;
+			}
+		}
+		leaf = hier->subs;
+		mosquitto_acl_check_batch(db, leaf, topic, MOSQ_ACL_READ);
+	}
 	while(source_id && leaf){
 		if(leaf->context->is_bridge && !strcmp(leaf->context->id, source_id)){
 			leaf = leaf->next;
 			continue;
 		}
-		/* Check for ACL topic access. */
-		rc2 = mosquitto_acl_check(db, leaf->context, topic, MOSQ_ACL_READ);
+		/* Check for ACL topic access, unless it was decided for every topic
+		 * of this subscription when it was made. */
+		if(batch){
+			rc2 = leaf->acl_result;
+		}else if(leaf->acl != mosq_sa_check && leaf->acl_generation == leaf->context->acl_generation){
+			rc2 = (leaf->acl == mosq_sa_allow) ? MOSQ_ERR_SUCCESS : MOSQ_ERR_ACL_DENIED;
+		}else{
+			rc2 = mosquitto_acl_check(db, leaf->context, topic, MOSQ_ACL_READ);
+		}
 		if(rc2 == MOSQ_ERR_ACL_DENIED){
 			leaf = leaf->next;
 			continue;
@@ -174,21 +206,9 @@ static int _sub_topic_tokenise(const char *subtopic, struct _sub_token **topics)
 
 	len = strlen(subtopic);
 
-	if(subtopic[0] == '/'){
-		new_topic = _mosquitto_malloc(sizeof(struct _sub_token));
-		if(!new_topic) goto cleanup;
-		new_topic->next = NULL;
-		new_topic->topic = _mosquitto_strdup("");
-		if(!new_topic->topic) goto cleanup;
-
-		*topics = new_topic;
-		tail = new_topic;
-
-		start = 1;
-	}else{
-		start = 0;
-	}
-
+	/* A leading '/' gives an empty first level, so "/a" and "a" are
+	 * different topics. */
+	start = 0;
 	stop = 0;
 	for(i=start; i<len+1; i++){
 		if(subtopic[i] == '/' || subtopic[i] == '\0'){
@@ -232,7 +252,7 @@ cleanup:
 	return 1;
 }
 
-static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos, struct _mosquitto_subhier *subhier, struct _sub_token *tokens)
+static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos, enum mosquitto_sub_acl acl, struct _mosquitto_subhier *subhier, struct _sub_token *tokens)
 {
 	struct _mosquitto_subhier *branch, *last = NULL;
 	struct _mosquitto_subleaf *leaf, *last_leaf;
@@ -247,6 +267,8 @@ static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos,
 					 * need to update QoS. Return -1 to indicate this to the
 					 * calling function. */
 					leaf->qos = qos;
+					leaf->acl = acl;
+					leaf->acl_generation = context->acl_generation;
 					return -1;
 				}
 				last_leaf = leaf;
@@ -257,6 +279,8 @@ static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos,
 			leaf->next = NULL;
 			leaf->context = context;
 			leaf->qos = qos;
+			leaf->acl = acl;
+			leaf->acl_generation = context->acl_generation;
 			if(last_leaf){
 				last_leaf->next = leaf;
 				leaf->prev = last_leaf;
@@ -272,7 +296,7 @@ static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos,
 	branch = subhier->children;
 	while(branch){
 		if(!strcmp(branch->topic, tokens->topic)){
-			return _sub_add(db, context, qos, branch, tokens->next);
+			return _sub_add(db, context, qos, acl, branch, tokens->next);
 		}
 		last = branch;
 		branch = branch->next;
@@ -290,7 +314,7 @@ static int _sub_add(struct mosquitto_db *db, struct mosquitto *context, int qos,
 	}else{
 		last->next = branch;
 	}
-	return _sub_add(db, context, qos, branch, tokens->next);
+	return _sub_add(db, context, qos, acl, branch, tokens->next);
 }
 
 static int _sub_remove(struct mosquitto_db *db, struct mosquitto *context, struct _mosquitto_subhier *subhier, struct _sub_token *tokens)
@@ -372,7 +396,7 @@ static void _sub_search(struct mosquitto_db *db, struct _mosquitto_subhier *subh
 	}
 }
 
-int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, struct _mosquitto_subhier *root)
+int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, enum mosquitto_sub_acl acl, struct _mosquitto_subhier *root)
 {
 	int rc = 0;
 	struct _mosquitto_subhier *subhier, *child;
@@ -386,7 +410,7 @@ int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char
 	subhier = root->children;
 	while(subhier){
 		if(!strcmp(subhier->topic, tokens->topic)){
-			rc = _sub_add(db, context, qos, subhier, tokens);
+			rc = _sub_add(db, context, qos, acl, subhier, tokens);
 			break;
 		}
 		subhier = subhier->next;
@@ -408,7 +432,7 @@ int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char
 		child->retained = NULL;
 		db->subs.children = child;
 
-		rc = _sub_add(db, context, qos, child, tokens);
+		rc = _sub_add(db, context, qos, acl, child, tokens);
 	}
 
 	while(tokens){
@@ -419,9 +443,336 @@ int mqtt3_sub_add(struct mosquitto_db *db, struct mosquitto *context, const char
 	}
 	/* We aren't worried about -1 (already subscribed) return codes. */
 	if(rc == -1) rc = MOSQ_ERR_SUCCESS;
+#ifdef WITH_PERSISTENCE
+	if(!rc && context){
+		mqtt3_wal_sub_add(context, sub, qos);
+	}
+#endif
+	return rc;
+}
+
+/* Index of tree nodes by parent and topic, only kept while restoring the
+ * persistent database. Finding a child otherwise means scanning all of its
+ * siblings, which makes restoring a large flat tree quadratic. Only the
+ * children of nodes with more than SUB_RESTORE_SCAN children are indexed,
+ * and only once they are first looked up. A node's children are either all
+ * indexed, marked by an entry with a NULL node and a topic of "/", which no
+ * level can have, or none are. */
+struct _sub_restore_index {
+	char *key;
+	struct _mosquitto_subhier *node;
+	UT_hash_handle hh;
+};
+
+#define SUB_RESTORE_SCAN 16
+
+static struct _sub_restore_index *restore_index = NULL;
+
+/* A topic level, as a pointer into a topic string and a length, and the tree
+ * node it leads to. fresh is set if the node was added by the current batch,
+ * so had no children before it. */
+struct _sub_restore_level{
+	const char *topic;
+	int len;
+	struct _mosquitto_subhier *node;
+	bool fresh;
+};
+
+/* Build the key for parent and topic in buf if it fits, otherwise in newly
+ * allocated memory. */
+static char *_sub_restore_key(struct _mosquitto_subhier *parent, const char *topic, int tlen, char *buf, int buflen, int *keylen)
+{
+	char *key;
+
+	*keylen = sizeof(struct _mosquitto_subhier *) + tlen;
+	if(*keylen <= buflen){
+		key = buf;
+	}else{
+		key = _mosquitto_malloc(*keylen);
+		if(!key) return NULL;
+	}
+	memcpy(key, &parent, sizeof(struct _mosquitto_subhier *));
+	memcpy(&key[sizeof(struct _mosquitto_subhier *)], topic, tlen);
+	return key;
+}
+
+/* Add node to the index as a child of parent, or mark parent as indexed if
+ * node is NULL. */
+static int _sub_restore_index_add(struct _mosquitto_subhier *parent, struct _mosquitto_subhier *node)
+{
+	struct _sub_restore_index *index;
+	int keylen;
+
+	index = _mosquitto_malloc(sizeof(struct _sub_restore_index));
+	if(!index) return MOSQ_ERR_NOMEM;
+	if(node){
+		index->key = _sub_restore_key(parent, node->topic, strlen(node->topic), NULL, 0, &keylen);
+	}else{
+		index->key = _sub_restore_key(parent, "/", 1, NULL, 0, &keylen);
+	}
+	if(!index->key){
+		_mosquitto_free(index);
+		return MOSQ_ERR_NOMEM;
+	}
+	index->node = node;
+	HASH_ADD_KEYPTR(hh, restore_index, index->key, keylen, index);
+	return MOSQ_ERR_SUCCESS;
+}
+
+static struct _sub_restore_index *_sub_restore_index_find(struct _mosquitto_subhier *parent, const char *topic, int len)
+{
+	struct _sub_restore_index *index;
+	char buf[256];
+	char *key;
+	int keylen;
+
+	key = _sub_restore_key(parent, topic, len, buf, sizeof(buf), &keylen);
+	if(!key) return NULL;
+	HASH_FIND(hh, restore_index, key, keylen, index);
+	if(key != buf) _mosquitto_free(key);
+	return index;
+}
+
+static struct _mosquitto_subhier *_sub_restore_child_add(struct _mosquitto_subhier *subhier, const char *topic, int len, bool indexed)
+{
+	struct _mosquitto_subhier *branch;
+
+	branch = _mosquitto_calloc(1, sizeof(struct _mosquitto_subhier));
+	if(!branch) return NULL;
+	branch->topic = _mosquitto_malloc(len+1);
+	if(!branch->topic){
+		_mosquitto_free(branch);
+		return NULL;
+	}
+	memcpy(branch->topic, topic, len);
+	branch->topic[len] = '\0';
+	if(indexed && _sub_restore_index_add(subhier, branch)){
+		_mosquitto_free(branch->topic);
+		_mosquitto_free(branch);
+		return NULL;
+	}
+	branch->next = subhier->children;
+	subhier->children = branch;
+	return branch;
+}
+
+/* Find the child of subhier for the first len characters of topic, adding it
+ * if needed. *fresh is set if it was added. */
+static struct _mosquitto_subhier *_sub_restore_child_get(struct _mosquitto_subhier *subhier, const char *topic, int len, bool *fresh)
+{
+	struct _mosquitto_subhier *branch;
+	struct _sub_restore_index *index;
+	int i;
+
+	*fresh = false;
+	branch = subhier->children;
+	for(i=0; branch && i<SUB_RESTORE_SCAN; i++){
+		if(!strncmp(branch->topic, topic, len) && branch->topic[len] == '\0'){
+			return branch;
+		}
+		branch = branch->next;
+	}
+	*fresh = true;
+	if(!branch){
+		/* All of the children have been checked. */
+		return _sub_restore_child_add(subhier, topic, len, false);
+	}
+
+	if(!_sub_restore_index_find(subhier, "/", 1)){
+		if(_sub_restore_index_add(subhier, NULL)) return NULL;
+		branch = subhier->children;
+		while(branch){
+			if(_sub_restore_index_add(subhier, branch)) return NULL;
+			branch = branch->next;
+		}
+	}
+	index = _sub_restore_index_find(subhier, topic, len);
+	if(index && index->node){
+		*fresh = false;
+		return index->node;
+	}
+	return _sub_restore_child_add(subhier, topic, len, true);
+}
+
+/* Split topic into the levels of its branch, without copying, in the same way
+ * as _sub_topic_tokenise(). The first token appears twice in the tree, see
+ * mqtt3_sub_add(). Returns the number of levels, or -1 if out of memory. */
+static int _sub_restore_levels(const char *topic, struct _sub_restore_level **levels, int *size)
+{
+	struct _sub_restore_level *tmp;
+	const char *start, *c;
+	int count;
+
+	start = topic;
+	/* One level per '/', two for the first token and one more
+	 * for the empty token of topics that don't start with '$'. */
+	count = 3;
+	for(c=start; *c; c++){
+		if(*c == '/') count++;
+	}
+	if(count > *size){
+		tmp = _mosquitto_realloc(*levels, sizeof(struct _sub_restore_level)*count);
+		if(!tmp) return -1;
+		*levels = tmp;
+		*size = count;
+	}
+
+	count = 0;
+	if(topic[0] != '$'){
+		(*levels)[count].topic = topic;
+		(*levels)[count].len = 0;
+		count++;
+	}
+	c = start;
+	while(1){
+		if(*c == '/' || *c == '\0'){
+			(*levels)[count].topic = start;
+			(*levels)[count].len = c-start;
+			count++;
+			if(*c == '\0') break;
+			start = c+1;
+		}
+		c++;
+	}
+	/* Repeat the first token. */
+	memmove(&(*levels)[1], &(*levels)[0], sizeof(struct _sub_restore_level)*count);
+	return count+1;
+}
+
+/* Order topics level by level, so that the topics below any node are
+ * together. */
+static int _sub_restore_cmp(const void *a, const void *b)
+{
+	const struct _mosquitto_sub_restore *sa = a, *sb = b;
+	const unsigned char *ta, *tb;
+	int ca, cb;
+
+	ta = (const unsigned char *)sa->topic;
+	tb = (const unsigned char *)sb->topic;
+	while(*ta && *ta == *tb){
+		ta++;
+		tb++;
+	}
+	ca = (*ta == '/') ? 1 : (*ta ? *ta+1 : 0);
+	cb = (*tb == '/') ? 1 : (*tb ? *tb+1 : 0);
+	if(ca != cb) return ca - cb;
+	return sa->order - sb->order;
+}
+
+/* Add subscriptions restored from the persistent database. The batch is
+ * sorted by topic, unless sorted is set to say that the caller has already
+ * put it in an order where the topics below any node are together, as they
+ * are when walking the tree. Equal topics must be next to each other in
+ * either case. Each topic is then split and its branch found only once, and
+ * all of its subscribers are appended in a single pass. Topics that
+ * follow each other share their leading levels, so the branch is only looked
+ * up from the first level that differs from the previous topic rather than
+ * from the root each time. Below a node added by this batch nothing needs to
+ * be looked up at all, as the topics below any node are together and so its
+ * children are all new. Entries with a NULL context only make sure the branch
+ * exists. Entries must be for different clients on any one topic, as they are
+ * when written from the tree. The batch is reordered but not freed.
+ *
+ * Nodes are found through an index that lasts until mqtt3_sub_add_batch_end()
+ * is called, so no other function may add nodes to the tree until then. */
+int mqtt3_sub_add_batch(struct mosquitto_db *db, struct _mosquitto_sub_restore *subs, int count, struct _mosquitto_subhier *root, bool sorted)
+{
+	struct _mosquitto_subhier *subhier;
+	struct _mosquitto_subleaf *leaf, *last_leaf;
+	struct _sub_restore_level *path = NULL, *levels = NULL, *tmp_path;
+	int path_count = 0, path_size = 0, level_size = 0;
+	int level_count;
+	bool fresh;
+	int i, j, k;
+	int rc = MOSQ_ERR_NOMEM;
+
+	assert(db);
+	assert(root);
+
+	if(count <= 0) return MOSQ_ERR_SUCCESS;
+	if(!sorted){
+		qsort(subs, count, sizeof(struct _mosquitto_sub_restore), _sub_restore_cmp);
+	}
+
+	for(i=0; i<count; i=j){
+		for(j=i+1; j<count; j++){
+			if(subs[i].topic != subs[j].topic && strcmp(subs[i].topic, subs[j].topic)) break;
+		}
+
+		level_count = _sub_restore_levels(subs[i].topic, &levels, &level_size);
+		if(level_count < 0) goto cleanup;
+		if(level_count > path_size){
+			tmp_path = _mosquitto_realloc(path, sizeof(struct _sub_restore_level)*level_count);
+			if(!tmp_path) goto cleanup;
+			path = tmp_path;
+			path_size = level_count;
+		}
+
+		/* Reuse the nodes of the levels shared with the previous topic. */
+		for(k=0; k<level_count && k<path_count; k++){
+			if(levels[k].len != path[k].len
+					|| memcmp(levels[k].topic, path[k].topic, levels[k].len)){
+				break;
+			}
+		}
+		subhier = k ? path[k-1].node : root;
+		fresh = k ? path[k-1].fresh : false;
+		for(; k<level_count; k++){
+			if(fresh){
+				subhier = _sub_restore_child_add(subhier, levels[k].topic, levels[k].len, false);
+			}else{
+				subhier = _sub_restore_child_get(subhier, levels[k].topic, levels[k].len, &fresh);
+			}
+			if(!subhier) goto cleanup;
+			path[k] = levels[k];
+			path[k].node = subhier;
+			path[k].fresh = fresh;
+		}
+		path_count = level_count;
+
+		last_leaf = subhier->subs;
+		while(last_leaf && last_leaf->next){
+			last_leaf = last_leaf->next;
+		}
+		for(; i<j; i++){
+			if(!subs[i].context) continue;
+
+			leaf = _mosquitto_malloc(sizeof(struct _mosquitto_subleaf));
+			if(!leaf) goto cleanup;
+			leaf->next = NULL;
+			leaf->prev = last_leaf;
+			leaf->context = subs[i].context;
+			leaf->qos = subs[i].qos;
+			/* Usernames are not known until the client connects. */
+			leaf->acl = mosq_sa_check;
+			leaf->acl_generation = 0;
+			if(last_leaf){
+				last_leaf->next = leaf;
+			}else{
+				subhier->subs = leaf;
+			}
+			last_leaf = leaf;
+			db->subscription_count++;
+		}
+	}
+	rc = MOSQ_ERR_SUCCESS;
+cleanup:
+	if(path) _mosquitto_free(path);
+	if(levels) _mosquitto_free(levels);
 	return rc;
 }
 
+void mqtt3_sub_add_batch_end(void)
+{
+	struct _sub_restore_index *index, *tmp;
+
+	HASH_ITER(hh, restore_index, index, tmp){
+		HASH_DEL(restore_index, index);
+		_mosquitto_free(index->key);
+		_mosquitto_free(index);
+	}
+}
+
 int mqtt3_sub_remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct _mosquitto_subhier *root)
 {
 	int rc = 0;
@@ -448,6 +799,9 @@ int mqtt3_sub_remove(struct mosquitto_db *db, struct mosquitto *context, const c
 		_mosquitto_free(tokens);
 		tokens = tail;
 	}
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_sub_delete(context, sub);
+#endif
 
 	return rc;
 }
@@ -470,7 +824,7 @@ int mqtt3_db_messages_queue(struct mosquitto_db *db, const char *source_id, cons
 				/* We have a message that needs to be retained, so ensure that the subscription
 				 * tree for its topic exists.
 				 */
-				_sub_add(db, NULL, 0, subhier, tokens);
+				_sub_add(db, NULL, 0, mosq_sa_check, subhier, tokens);
 			}
 			_sub_search(db, subhier, tokens, source_id, topic, qos, retain, stored, true);
 		}
@@ -549,6 +903,9 @@ int mqtt3_subs_clean_session(struct mosquitto_db *db, struct mosquitto *context,
 		_subs_clean_session(db, context, child);
 		child = child->next;
 	}
+#ifdef WITH_PERSISTENCE
+	mqtt3_wal_subs_delete(context);
+#endif
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -584,12 +941,143 @@ void mqtt3_sub_tree_print(struct _mosquitto_subhier *root, int level)
 	}
 }
 
+/* Find the node for topic, or NULL if it has none. */
+static struct _mosquitto_subhier *_retain_node_find(struct mosquitto_db *db, const char *topic)
+{
+	struct _mosquitto_subhier *subhier, *branch;
+	struct _sub_token *tokens = NULL, *token, *tail;
+
+	if(_sub_topic_tokenise(topic, &tokens)) return NULL;
+
+	subhier = db->subs.children;
+	while(subhier){
+		if(!strcmp(subhier->topic, tokens->topic)){
+			break;
+		}
+		subhier = subhier->next;
+	}
+	token = tokens;
+	while(subhier && token){
+		branch = subhier->children;
+		while(branch){
+			if(!strcmp(branch->topic, token->topic)){
+				break;
+			}
+			branch = branch->next;
+		}
+		subhier = branch;
+		token = token->next;
+	}
+
+	while(tokens){
+		tail = tokens->next;
+		_mosquitto_free(tokens->topic);
+		_mosquitto_free(tokens);
+		tokens = tail;
+	}
+	return subhier;
+}
+
+/* Remove retained messages whose expiry time has passed. Only the messages
+ * that are due are visited, through the expiry index. */
+int mqtt3_subs_retain_expire(struct mosquitto_db *db, time_t now)
+{
+	struct mosquitto_msg_store *stored;
+	struct _mosquitto_subhier *node;
+
+	while((stored = mqtt3_db_expiry_retain_due(now))){
+		node = _retain_node_find(db, stored->msg.topic);
+		if(!node || node->retained != stored){
+			/* Replaced or cleared since it was added. */
+			continue;
+		}
+#ifdef WITH_PERSISTENCE
+		if(strncmp(stored->msg.topic, "$SYS", 4)){
+			db->persistence_changes++;
+			mqtt3_wal_retain(stored->msg.topic, NULL);
+		}
+#endif
+		stored->ref_count--;
+		node->retained = NULL;
+		db->retained_count--;
+#ifdef WITH_SYS_TREE
+		g_msgs_expired++;
+#endif
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+/* Classify the leaves below subhier, which is at the given depth of the tree
+ * and has the subscription path. The first level below the root is repeated
+ * at the second, and subscriptions not beginning with $ have an extra empty
+ * first level, neither of which are part of the subscription. */
+static int _subs_acl_classify(struct mosquitto_db *db, struct _mosquitto_subhier *subhier, int depth, char **path, int *path_size, int path_len)
+{
+	struct _mosquitto_subhier *branch;
+	struct _mosquitto_subleaf *leaf;
+	char *tmp_path;
+	int len;
+
+	if(depth >= 2){
+		len = strlen(subhier->topic);
+		if(path_len + len + 2 > *path_size){
+			tmp_path = _mosquitto_realloc(*path, path_len + len + 64);
+			if(!tmp_path) return MOSQ_ERR_NOMEM;
+			*path = tmp_path;
+			*path_size = path_len + len + 64;
+		}
+		if(depth == 2){
+			if(subhier->topic[0] == '$'){
+				memcpy(*path, subhier->topic, len);
+				path_len = len;
+			}else{
+				path_len = 0;
+			}
+		}else{
+			if(depth > 3 || path_len){
+				(*path)[path_len++] = '/';
+			}
+			memcpy(&(*path)[path_len], subhier->topic, len);
+			path_len += len;
+		}
+		(*path)[path_len] = '\0';
+
+		for(leaf = subhier->subs; leaf; leaf = leaf->next){
+			leaf->acl = mosquitto_acl_sub_classify(db, leaf->context, *path);
+			leaf->acl_generation = leaf->context->acl_generation;
+		}
+	}
+
+	for(branch = subhier->children; branch; branch = branch->next){
+		if(_subs_acl_classify(db, branch, depth+1, path, path_size, path_len)){
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt3_subs_acl_classify(struct mosquitto_db *db, struct _mosquitto_subhier *root)
+{
+	char *path = NULL;
+	int path_size = 0;
+	int rc;
+
+	rc = _subs_acl_classify(db, root, 0, &path, &path_size, 0);
+	if(path) _mosquitto_free(path);
+	return rc;
+}
+
 static int _retain_process(struct mosquitto_db *db, struct mosquitto_msg_store *retained, struct mosquitto *context, const char *sub, int sub_qos)
 {
 	int rc = 0;
 	int qos;
 	uint16_t mid;
 
+	if(retained->expiry_time && retained->expiry_time <= mosquitto_time()){
+		/* Will be removed by the next mqtt3_subs_retain_expire() call. */
+		return MOSQ_ERR_SUCCESS;
+	}
+
 	rc = mosquitto_acl_check(db, context, retained->msg.topic, MOSQ_ACL_READ);
 	if(rc == MOSQ_ERR_ACL_DENIED){
 		return MOSQ_ERR_SUCCESS;
@@ -680,3 +1168,59 @@ int mqtt3_retain_queue(struct mosquitto_db *db, struct mosquitto *context, const
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Set or clear (stored==NULL) the retained message for a topic directly,
+ * without queueing it to any subscribers. Used when replaying the
+ * persistence write-ahead log. */
+int mqtt3_retain_set(struct mosquitto_db *db, const char *topic, struct mosquitto_msg_store *stored)
+{
+	struct _mosquitto_subhier *subhier, *branch;
+	struct _sub_token *tokens = NULL, *token, *tail;
+
+	assert(db);
+	assert(topic);
+
+	if(_sub_topic_tokenise(topic, &tokens)) return 1;
+
+	subhier = db->subs.children;
+	while(subhier){
+		if(!strcmp(subhier->topic, tokens->topic)){
+			break;
+		}
+		subhier = subhier->next;
+	}
+	if(subhier && stored){
+		_sub_add(db, NULL, 0, mosq_sa_check, subhier, tokens);
+	}
+	token = tokens;
+	while(subhier && token){
+		branch = subhier->children;
+		while(branch){
+			if(!strcmp(branch->topic, token->topic)){
+				break;
+			}
+			branch = branch->next;
+		}
+		subhier = branch;
+		token = token->next;
+	}
+	if(subhier){
+		if(subhier->retained){
+			subhier->retained->ref_count--;
+			db->retained_count--;
+		}
+		subhier->retained = stored;
+		if(stored){
+			stored->ref_count++;
+			db->retained_count++;
+			mqtt3_db_expiry_retain_add(stored);
+		}
+	}
+
+	while(tokens){
+		tail = tokens->next;
+		_mosquitto_free(tokens->topic);
+		_mosquitto_free(tokens);
+		tokens = tail;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
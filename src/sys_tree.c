@@ -49,6 +49,17 @@ unsigned long g_msgs_sent = 0;
 unsigned long g_pub_msgs_received = 0;
 unsigned long g_pub_msgs_sent = 0;
 unsigned long g_msgs_dropped = 0;
+unsigned long g_msgs_expired = 0;
+unsigned long g_msgs_conflated = 0;
+unsigned long g_evicted_queue_bytes = 0;
+unsigned long g_evicted_oldest_qos0 = 0;
+unsigned long g_evicted_newest = 0;
+unsigned long g_evicted_publishes_rejected = 0;
+unsigned long g_evicted_clients_disconnected = 0;
+unsigned long g_db_save_duration = 0;
+unsigned long g_db_save_size = 0;
+unsigned long g_acl_cache_hits = 0;
+unsigned long g_acl_cache_misses = 0;
 int g_clients_expired = 0;
 unsigned int g_socket_connections = 0;
 unsigned int g_connection_count = 0;
@@ -94,6 +105,103 @@ static void _sys_update_clients(struct mosquitto_db *db, char *buf)
 	}
 }
 
+static void _sys_update_evictions(struct mosquitto_db *db, char *buf)
+{
+	static unsigned long queue_bytes = -1;
+	static unsigned long oldest_qos0 = -1;
+	static unsigned long newest = -1;
+	static unsigned long publishes_rejected = -1;
+	static unsigned long clients_disconnected = -1;
+
+	if(queue_bytes != g_evicted_queue_bytes){
+		queue_bytes = g_evicted_queue_bytes;
+		snprintf(buf, BUFLEN, "%lu", queue_bytes);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/evictions/queue bytes", 2, strlen(buf), buf, 1);
+	}
+	if(oldest_qos0 != g_evicted_oldest_qos0){
+		oldest_qos0 = g_evicted_oldest_qos0;
+		snprintf(buf, BUFLEN, "%lu", oldest_qos0);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/evictions/oldest qos0", 2, strlen(buf), buf, 1);
+	}
+	if(newest != g_evicted_newest){
+		newest = g_evicted_newest;
+		snprintf(buf, BUFLEN, "%lu", newest);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/evictions/newest", 2, strlen(buf), buf, 1);
+	}
+	if(publishes_rejected != g_evicted_publishes_rejected){
+		publishes_rejected = g_evicted_publishes_rejected;
+		snprintf(buf, BUFLEN, "%lu", publishes_rejected);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/evictions/publishes rejected", 2, strlen(buf), buf, 1);
+	}
+	if(clients_disconnected != g_evicted_clients_disconnected){
+		clients_disconnected = g_evicted_clients_disconnected;
+		snprintf(buf, BUFLEN, "%lu", clients_disconnected);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/evictions/clients disconnected", 2, strlen(buf), buf, 1);
+	}
+}
+
+static void _sys_update_acl_cache(struct mosquitto_db *db, char *buf)
+{
+	static unsigned long hits = -1;
+	static unsigned long misses = -1;
+
+	if(hits == g_acl_cache_hits && misses == g_acl_cache_misses){
+		return;
+	}
+	if(hits != g_acl_cache_hits){
+		hits = g_acl_cache_hits;
+		snprintf(buf, BUFLEN, "%lu", hits);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/acl/cache/hits", 2, strlen(buf), buf, 1);
+	}
+	if(misses != g_acl_cache_misses){
+		misses = g_acl_cache_misses;
+		snprintf(buf, BUFLEN, "%lu", misses);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/acl/cache/misses", 2, strlen(buf), buf, 1);
+	}
+	snprintf(buf, BUFLEN, "%.2f", hits+misses ? 100.0*hits/(hits+misses) : 0.0);
+	mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/acl/cache/hit ratio", 2, strlen(buf), buf, 1);
+}
+
+#ifdef WITH_TLS
+static void _sys_update_tls(struct mosquitto_db *db, char *buf)
+{
+	static unsigned long full = -1;
+	static unsigned long resumed = -1;
+	unsigned long full_now, resumed_now;
+
+	mqtt3_tls_handshake_counts(&full_now, &resumed_now);
+	if(full != full_now){
+		full = full_now;
+		snprintf(buf, BUFLEN, "%lu", full);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/tls/handshakes/full", 2, strlen(buf), buf, 1);
+	}
+	if(resumed != resumed_now){
+		resumed = resumed_now;
+		snprintf(buf, BUFLEN, "%lu", resumed);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/tls/handshakes/resumed", 2, strlen(buf), buf, 1);
+	}
+}
+#endif
+
+#ifdef WITH_PERSISTENCE
+static void _sys_update_persistence(struct mosquitto_db *db, char *buf)
+{
+	static unsigned long save_duration = -1;
+	static unsigned long save_size = -1;
+
+	if(save_duration != g_db_save_duration){
+		save_duration = g_db_save_duration;
+		snprintf(buf, BUFLEN, "%lu", save_duration);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/persistence/save/duration", 2, strlen(buf), buf, 1);
+	}
+	if(save_size != g_db_save_size){
+		save_size = g_db_save_size;
+		snprintf(buf, BUFLEN, "%lu", save_size);
+		mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/persistence/save/size", 2, strlen(buf), buf, 1);
+	}
+}
+#endif
+
 #ifdef REAL_WITH_MEMORY_TRACKING
 static void _sys_update_memory(struct mosquitto_db *db, char *buf)
 {
@@ -142,9 +250,12 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 	char buf[BUFLEN];
 
 	static int msg_store_count = -1;
+	static int msg_spilled_count = -1;
 	static unsigned long msgs_received = -1;
 	static unsigned long msgs_sent = -1;
 	static unsigned long publish_dropped = -1;
+	static unsigned long publish_expired = -1;
+	static unsigned long publish_conflated = -1;
 	static unsigned long pub_msgs_received = -1;
 	static unsigned long pub_msgs_sent = -1;
 	static unsigned long long bytes_received = -1;
@@ -266,6 +377,12 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/stored", 2, strlen(buf), buf, 1);
 		}
 
+		if(db->msg_spilled_count != msg_spilled_count){
+			msg_spilled_count = db->msg_spilled_count;
+			snprintf(buf, BUFLEN, "%d", msg_spilled_count);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/messages/spilled", 2, strlen(buf), buf, 1);
+		}
+
 		if(db->subscription_count != subscription_count){
 			subscription_count = db->subscription_count;
 			snprintf(buf, BUFLEN, "%d", subscription_count);
@@ -281,6 +398,18 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 #ifdef REAL_WITH_MEMORY_TRACKING
 		_sys_update_memory(db, buf);
 #endif
+		_sys_update_evictions(db, buf);
+		if(db->config->acl_cache_size){
+			_sys_update_acl_cache(db, buf);
+		}
+#ifdef WITH_TLS
+		_sys_update_tls(db, buf);
+#endif
+#ifdef WITH_PERSISTENCE
+		if(db->config->persistence){
+			_sys_update_persistence(db, buf);
+		}
+#endif
 
 		if(msgs_received != g_msgs_received){
 			msgs_received = g_msgs_received;
@@ -300,6 +429,18 @@ void mqtt3_db_sys_update(struct mosquitto_db *db, int interval, time_t start_tim
 			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/dropped", 2, strlen(buf), buf, 1);
 		}
 
+		if(publish_expired != g_msgs_expired){
+			publish_expired = g_msgs_expired;
+			snprintf(buf, BUFLEN, "%lu", publish_expired);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/expired", 2, strlen(buf), buf, 1);
+		}
+
+		if(publish_conflated != g_msgs_conflated){
+			publish_conflated = g_msgs_conflated;
+			snprintf(buf, BUFLEN, "%lu", publish_conflated);
+			mqtt3_db_messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/conflated", 2, strlen(buf), buf, 1);
+		}
+
 		if(pub_msgs_received != g_pub_msgs_received){
 			pub_msgs_received = g_pub_msgs_received;
 			snprintf(buf, BUFLEN, "%lu", pub_msgs_received);
@@ -0,0 +1,492 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#ifdef WITH_TLS
+#ifdef WITH_THREADING
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+#include <net_mosq.h>
+#include <time_mosq.h>
+
+#ifdef WITH_THREADING
+/* mosquitto_internal.h turns these into no-ops for the broker. */
+#undef pthread_create
+#undef pthread_join
+#undef pthread_mutex_lock
+#undef pthread_mutex_unlock
+
+/* A connection whose TLS handshake is being run on a worker. The worker owns
+ * the context, which is not in db->contexts, until the handshake is done. */
+struct _tls_handshake{
+	struct _tls_handshake *next;
+	struct mosquitto *context;
+	time_t timeout;
+	short events;
+	bool failed;
+	char error[256];
+};
+
+struct _tls_handshake_worker{
+	pthread_t thread;
+	/* Written to when jobs are added or the worker should stop. */
+	int wake[2];
+	/* Submitted by the main thread, protected by handshake_mutex. */
+	struct _tls_handshake *jobs;
+	/* Only used by the worker thread. */
+	struct _tls_handshake *active;
+	struct pollfd *pollfds;
+	int pollfd_count;
+	/* Handshakes submitted and not yet done, protected by handshake_mutex. */
+	int count;
+	bool started;
+};
+
+/* The done list and handshake_stopping are protected by handshake_mutex. */
+static pthread_mutex_t handshake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct _tls_handshake *handshake_done = NULL;
+static struct _tls_handshake *handshake_done_last = NULL;
+static bool handshake_stopping = false;
+
+static struct _tls_handshake_worker *handshake_workers = NULL;
+static int handshake_worker_count = 0;
+/* Written to when handshake_done becomes non-empty, to wake the main loop. */
+static int handshake_wake[2] = {-1, -1};
+
+static void _handshake_wake(int sock)
+{
+	char c = 0;
+
+	if(write(sock, &c, 1) != 1){
+		/* The pipe is full, so the reader will be woken anyway. */
+	}
+}
+
+/* Only called on the main thread: from mqtt3_tls_handshake_cleanup() once the
+ * workers have been joined. Workers never free a handshake, they hand it back
+ * through handshake_done and mqtt3_tls_handshake_process() frees it. */
+static void _handshake_free(struct _tls_handshake *hs)
+{
+	mqtt3_context_cleanup(NULL, hs->context, true);
+	_mosquitto_free(hs);
+}
+
+static void _handshake_list_free(struct _tls_handshake *hs)
+{
+	struct _tls_handshake *next;
+
+	while(hs){
+		next = hs->next;
+		_handshake_free(hs);
+		hs = next;
+	}
+}
+
+/* Continue the handshake. Returns true when it has finished, successfully or
+ * not. */
+static bool _handshake_step(struct _tls_handshake *hs)
+{
+	unsigned long e;
+	int rc;
+
+	ERR_clear_error();
+	rc = SSL_accept(hs->context->ssl);
+	if(rc == 1){
+		return true;
+	}
+	rc = SSL_get_error(hs->context->ssl, rc);
+	if(rc == SSL_ERROR_WANT_READ){
+		hs->events = POLLIN;
+		return false;
+	}else if(rc == SSL_ERROR_WANT_WRITE){
+		hs->events = POLLOUT;
+		return false;
+	}
+	hs->failed = true;
+	e = ERR_get_error();
+	if(e){
+		ERR_error_string_n(e, hs->error, sizeof(hs->error));
+	}else{
+		snprintf(hs->error, sizeof(hs->error), "handshake failed");
+	}
+	return true;
+}
+
+static void _handshake_finished(struct _tls_handshake_worker *worker, struct _tls_handshake *hs)
+{
+	pthread_mutex_lock(&handshake_mutex);
+	worker->count--;
+	hs->next = NULL;
+	if(handshake_done_last){
+		handshake_done_last->next = hs;
+	}else{
+		handshake_done = hs;
+		_handshake_wake(handshake_wake[1]);
+	}
+	handshake_done_last = hs;
+	pthread_mutex_unlock(&handshake_mutex);
+}
+
+static void *_handshake_worker(void *arg)
+{
+	struct _tls_handshake_worker *worker = arg;
+	struct _tls_handshake *hs, *prev, *next, *jobs;
+	struct pollfd *pollfds;
+	char buf[64];
+	int count;
+	int i;
+	time_t now;
+
+	while(1){
+		pthread_mutex_lock(&handshake_mutex);
+		if(handshake_stopping){
+			pthread_mutex_unlock(&handshake_mutex);
+			break;
+		}
+		jobs = worker->jobs;
+		worker->jobs = NULL;
+		pthread_mutex_unlock(&handshake_mutex);
+
+		/* Start new handshakes straight away, the client hello has
+		 * usually already arrived. */
+		while(jobs){
+			hs = jobs;
+			jobs = jobs->next;
+			if(_handshake_step(hs)){
+				_handshake_finished(worker, hs);
+			}else{
+				hs->next = worker->active;
+				worker->active = hs;
+			}
+		}
+
+		count = 1;
+		for(hs=worker->active; hs; hs=hs->next){
+			count++;
+		}
+		if(count > worker->pollfd_count){
+			/* The allocator's memory counters are atomic, so this is safe
+			 * to do on a worker. */
+			pollfds = _mosquitto_realloc(worker->pollfds, sizeof(struct pollfd)*count);
+			if(pollfds){
+				worker->pollfds = pollfds;
+				worker->pollfd_count = count;
+			}else{
+				count = worker->pollfd_count;
+			}
+		}
+		worker->pollfds[0].fd = worker->wake[0];
+		worker->pollfds[0].events = POLLIN;
+		worker->pollfds[0].revents = 0;
+		i = 1;
+		for(hs=worker->active; hs && i<count; hs=hs->next){
+			worker->pollfds[i].fd = hs->context->sock;
+			worker->pollfds[i].events = hs->events;
+			worker->pollfds[i].revents = 0;
+			i++;
+		}
+		count = i;
+
+		if(poll(worker->pollfds, count, 1000) == -1 && errno != EINTR){
+			break;
+		}
+		if(worker->pollfds[0].revents & POLLIN){
+			while(read(worker->wake[0], buf, sizeof(buf)) > 0){
+			}
+		}
+
+		now = mosquitto_time();
+		prev = NULL;
+		i = 1;
+		for(hs=worker->active; hs; hs=next){
+			next = hs->next;
+			if(i < count && worker->pollfds[i].revents){
+				if(worker->pollfds[i].revents & (POLLERR | POLLHUP | POLLNVAL)
+						&& !(worker->pollfds[i].revents & POLLIN)){
+
+					hs->failed = true;
+					snprintf(hs->error, sizeof(hs->error), "connection closed during handshake");
+				}else if(!_handshake_step(hs)){
+					prev = hs;
+					i++;
+					continue;
+				}
+			}else if(now > hs->timeout){
+				hs->failed = true;
+				snprintf(hs->error, sizeof(hs->error), "handshake timed out");
+			}else{
+				prev = hs;
+				i++;
+				continue;
+			}
+			i++;
+			if(prev){
+				prev->next = next;
+			}else{
+				worker->active = next;
+			}
+			_handshake_finished(worker, hs);
+		}
+	}
+	return NULL;
+}
+#endif
+
+int mqtt3_tls_handshake_init(struct mosquitto_db *db)
+{
+#ifdef WITH_THREADING
+	sigset_t sigblock, origsig;
+	int i, j;
+
+	if(db->config->tls_handshake_workers <= 0){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	if(pipe(handshake_wake)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to create pipe: %s.", strerror(errno));
+		return MOSQ_ERR_ERRNO;
+	}
+	for(i=0; i<2; i++){
+		fcntl(handshake_wake[i], F_SETFL, fcntl(handshake_wake[i], F_GETFL, 0) | O_NONBLOCK);
+	}
+	handshake_stopping = false;
+
+	handshake_workers = _mosquitto_calloc(db->config->tls_handshake_workers, sizeof(struct _tls_handshake_worker));
+	if(!handshake_workers){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return MOSQ_ERR_NOMEM;
+	}
+	handshake_worker_count = db->config->tls_handshake_workers;
+	for(i=0; i<handshake_worker_count; i++){
+		handshake_workers[i].wake[0] = -1;
+		handshake_workers[i].wake[1] = -1;
+		handshake_workers[i].pollfds = _mosquitto_malloc(sizeof(struct pollfd));
+		if(!handshake_workers[i].pollfds){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return MOSQ_ERR_NOMEM;
+		}
+		handshake_workers[i].pollfd_count = 1;
+		if(pipe(handshake_workers[i].wake)){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to create pipe: %s.", strerror(errno));
+			return MOSQ_ERR_ERRNO;
+		}
+		for(j=0; j<2; j++){
+			fcntl(handshake_workers[i].wake[j], F_SETFL, fcntl(handshake_workers[i].wake[j], F_GETFL, 0) | O_NONBLOCK);
+		}
+	}
+
+	/* Signals are handled by the main thread. */
+	sigfillset(&sigblock);
+	pthread_sigmask(SIG_SETMASK, &sigblock, &origsig);
+	for(i=0; i<handshake_worker_count; i++){
+		if(pthread_create(&handshake_workers[i].thread, NULL, _handshake_worker, &handshake_workers[i])){
+			break;
+		}
+		handshake_workers[i].started = true;
+	}
+	pthread_sigmask(SIG_SETMASK, &origsig, NULL);
+	if(i != handshake_worker_count){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to start TLS handshake worker threads.");
+		return MOSQ_ERR_UNKNOWN;
+	}
+#else
+	if(db->config->tls_handshake_workers > 0){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_WARNING, "Warning: tls_handshake_workers is not supported without threading support.");
+	}
+#endif
+	return MOSQ_ERR_SUCCESS;
+}
+
+void mqtt3_tls_handshake_cleanup(void)
+{
+#ifdef WITH_THREADING
+	int i, j;
+
+	if(!handshake_workers) return;
+
+	pthread_mutex_lock(&handshake_mutex);
+	handshake_stopping = true;
+	pthread_mutex_unlock(&handshake_mutex);
+	for(i=0; i<handshake_worker_count; i++){
+		if(handshake_workers[i].started){
+			_handshake_wake(handshake_workers[i].wake[1]);
+			pthread_join(handshake_workers[i].thread, NULL);
+		}
+	}
+
+	for(i=0; i<handshake_worker_count; i++){
+		_handshake_list_free(handshake_workers[i].jobs);
+		_handshake_list_free(handshake_workers[i].active);
+		if(handshake_workers[i].pollfds) _mosquitto_free(handshake_workers[i].pollfds);
+		for(j=0; j<2; j++){
+			if(handshake_workers[i].wake[j] != -1){
+				close(handshake_workers[i].wake[j]);
+			}
+		}
+	}
+	_mosquitto_free(handshake_workers);
+	handshake_workers = NULL;
+	handshake_worker_count = 0;
+
+	_handshake_list_free(handshake_done);
+	handshake_done = NULL;
+	handshake_done_last = NULL;
+
+	for(i=0; i<2; i++){
+		if(handshake_wake[i] != -1){
+			close(handshake_wake[i]);
+			handshake_wake[i] = -1;
+		}
+	}
+#endif
+}
+
+/* Returns true if the handshake of this newly accepted context should be
+ * started with mqtt3_tls_handshake_submit() rather than run on the main
+ * thread. */
+bool mqtt3_tls_handshake_available(struct mosquitto *context)
+{
+#ifdef WITH_THREADING
+	if(handshake_worker_count == 0) return false;
+	/* The PSK callback reads the security settings, which are only safe to
+	 * use on the main thread. */
+	return context->listener->psk_hint == NULL;
+#else
+	return false;
+#endif
+}
+
+/* Hand the TLS handshake of a newly accepted context to a worker. On success
+ * the context is added to db->contexts by mqtt3_tls_handshake_process() once
+ * the handshake has finished, and must not be used by the caller. */
+int mqtt3_tls_handshake_submit(struct mosquitto *context)
+{
+#ifdef WITH_THREADING
+	struct _tls_handshake *hs;
+	struct _tls_handshake_worker *worker;
+	int i;
+
+	hs = _mosquitto_calloc(1, sizeof(struct _tls_handshake));
+	if(!hs) return MOSQ_ERR_NOMEM;
+	hs->context = context;
+	/* The same limit as for a connection that doesn't send CONNECT. */
+	hs->timeout = mosquitto_time() + context->keepalive*3/2;
+
+	pthread_mutex_lock(&handshake_mutex);
+	worker = &handshake_workers[0];
+	for(i=1; i<handshake_worker_count; i++){
+		if(handshake_workers[i].count < worker->count){
+			worker = &handshake_workers[i];
+		}
+	}
+	worker->count++;
+	hs->next = worker->jobs;
+	worker->jobs = hs;
+	pthread_mutex_unlock(&handshake_mutex);
+	_handshake_wake(worker->wake[1]);
+
+	return MOSQ_ERR_SUCCESS;
+#else
+	return MOSQ_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/* The socket to poll for finished handshakes, or -1 if there is none. */
+int mqtt3_tls_handshake_sock(void)
+{
+#ifdef WITH_THREADING
+	return handshake_wake[0];
+#else
+	return -1;
+#endif
+}
+
+/* Add the contexts whose handshakes have finished to db->contexts, or close
+ * them if the handshake failed. Called from the main loop when
+ * mqtt3_tls_handshake_sock() is readable. */
+void mqtt3_tls_handshake_process(struct mosquitto_db *db)
+{
+#ifdef WITH_THREADING
+	struct _tls_handshake *list, *hs;
+	struct mosquitto *context;
+	char buf[64];
+
+	while(read(handshake_wake[0], buf, sizeof(buf)) > 0){
+	}
+	pthread_mutex_lock(&handshake_mutex);
+	list = handshake_done;
+	handshake_done = NULL;
+	handshake_done_last = NULL;
+	pthread_mutex_unlock(&handshake_mutex);
+
+	while(list){
+		hs = list;
+		list = list->next;
+		context = hs->context;
+
+		mqtt3_tls_handshake_end(context);
+		if(hs->failed){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_NOTICE,
+					"Client connection from %s failed: %s.",
+					context->address, hs->error);
+			mqtt3_context_cleanup(NULL, context, true);
+		}else if(mqtt3_context_add(db, context)){
+			mqtt3_context_cleanup(NULL, context, true);
+		}
+		_mosquitto_free(hs);
+	}
+#endif
+}
+
+/* The context's handshake has finished, or the context is being closed, so
+ * stop counting it against the listener's max_handshakes. */
+void mqtt3_tls_handshake_end(struct mosquitto *context)
+{
+	if(context->tls_handshaking){
+		context->tls_handshaking = false;
+		if(context->listener){
+			context->listener->handshake_count--;
+		}
+	}
+}
+#endif
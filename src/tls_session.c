@@ -0,0 +1,433 @@
+/*
+Copyright (c) 2014 Roger Light <roger@atchoo.org>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the distribution.
+3. Neither the name of mosquitto nor the names of its
+   contributors may be used to endorse or promote products derived from
+   this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <config.h>
+
+#ifdef WITH_TLS
+#ifdef WITH_THREADING
+#include <pthread.h>
+#endif
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+#include <mosquitto_broker.h>
+#include <memory_mosq.h>
+#include <time_mosq.h>
+#include "util_mosq.h"
+
+#ifdef WITH_THREADING
+/* mosquitto_internal.h turns these into no-ops for the broker. */
+#undef pthread_mutex_lock
+#undef pthread_mutex_unlock
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#  define SESSION_ID_CONST const
+#else
+#  define SESSION_ID_CONST
+#endif
+
+/* A session in the cache shared by all listeners, stored serialised so that
+ * no SSL_SESSION is shared between connections. */
+struct _tls_session{
+	UT_hash_handle hh;
+	unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	unsigned int id_len;
+	unsigned char *der;
+	int der_len;
+	time_t expiry;
+};
+
+/* A session ticket key as read from tls_ticket_key_file. */
+struct _tls_ticket_key{
+	unsigned char name[16];
+	unsigned char hmac_key[16];
+	unsigned char aes_key[16];
+};
+
+/* The cache, ticket keys and handshake counts are protected by
+ * tls_session_mutex. */
+#ifdef WITH_THREADING
+static pthread_mutex_t tls_session_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static struct _tls_session *tls_sessions = NULL;
+static int tls_session_count = 0;
+static int tls_session_cache_size = 0;
+static int tls_session_timeout = 300;
+static char *tls_ticket_key_file = NULL;
+/* The first key is used for new tickets. */
+static struct _tls_ticket_key *tls_ticket_keys = NULL;
+static int tls_ticket_key_count = 0;
+static unsigned long tls_handshakes_full = 0;
+static unsigned long tls_handshakes_resumed = 0;
+
+static void _tls_lock(void)
+{
+#ifdef WITH_THREADING
+	pthread_mutex_lock(&tls_session_mutex);
+#endif
+}
+
+static void _tls_unlock(void)
+{
+#ifdef WITH_THREADING
+	pthread_mutex_unlock(&tls_session_mutex);
+#endif
+}
+
+static void _tls_session_free(struct _tls_session *entry)
+{
+	HASH_DEL(tls_sessions, entry);
+	tls_session_count--;
+	_mosquitto_free(entry->der);
+	_mosquitto_free(entry);
+}
+
+/* The callbacks below run inside SSL_accept(), so on the handshake workers
+ * when tls_handshake_workers is set. */
+static int _tls_session_new(SSL *ssl, SSL_SESSION *session)
+{
+	struct _tls_session *entry;
+	const unsigned char *id;
+	unsigned int id_len;
+	unsigned char *p;
+	int der_len;
+
+	id = SSL_SESSION_get_id(session, &id_len);
+	if(!id_len || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) return 0;
+	der_len = i2d_SSL_SESSION(session, NULL);
+	if(der_len <= 0) return 0;
+
+	entry = _mosquitto_calloc(1, sizeof(struct _tls_session));
+	if(!entry) return 0;
+	entry->der = _mosquitto_malloc(der_len);
+	if(!entry->der){
+		_mosquitto_free(entry);
+		return 0;
+	}
+	p = entry->der;
+	entry->der_len = i2d_SSL_SESSION(session, &p);
+	memcpy(entry->id, id, id_len);
+	entry->id_len = id_len;
+	entry->expiry = SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+
+	_tls_lock();
+	/* Sessions are added to the end of the hash, so the oldest is first. */
+	while(tls_sessions && tls_session_count >= tls_session_cache_size){
+		_tls_session_free(tls_sessions);
+	}
+	HASH_ADD(hh, tls_sessions, id, id_len, entry);
+	tls_session_count++;
+	_tls_unlock();
+
+	/* The cache doesn't keep a reference to session. */
+	return 0;
+}
+
+static SSL_SESSION *_tls_session_get(SSL *ssl, SESSION_ID_CONST unsigned char *id, int id_len, int *copy)
+{
+	struct _tls_session *entry;
+	SSL_SESSION *session = NULL;
+	const unsigned char *p;
+
+	*copy = 0;
+	if(id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) return NULL;
+
+	_tls_lock();
+	HASH_FIND(hh, tls_sessions, id, id_len, entry);
+	if(entry){
+		if(entry->expiry < time(NULL)){
+			_tls_session_free(entry);
+		}else{
+			p = entry->der;
+			session = d2i_SSL_SESSION(NULL, &p, entry->der_len);
+		}
+	}
+	_tls_unlock();
+
+	return session;
+}
+
+static void _tls_session_remove(SSL_CTX *ctx, SSL_SESSION *session)
+{
+	struct _tls_session *entry;
+	const unsigned char *id;
+	unsigned int id_len;
+
+	id = SSL_SESSION_get_id(session, &id_len);
+	_tls_lock();
+	HASH_FIND(hh, tls_sessions, id, id_len, entry);
+	if(entry){
+		_tls_session_free(entry);
+	}
+	_tls_unlock();
+}
+
+static int _tls_ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *hmac_ctx, int enc)
+{
+	struct _tls_ticket_key key;
+	int i;
+	int rc = 0;
+
+	_tls_lock();
+	if(enc){
+		if(tls_ticket_key_count > 0){
+			memcpy(&key, &tls_ticket_keys[0], sizeof(key));
+			rc = 1;
+		}
+	}else{
+		for(i=0; i<tls_ticket_key_count; i++){
+			if(!memcmp(name, tls_ticket_keys[i].name, 16)){
+				memcpy(&key, &tls_ticket_keys[i], sizeof(key));
+				/* Ask for a new ticket if this one was made with an old key. */
+				rc = (i == 0) ? 1 : 2;
+				break;
+			}
+		}
+	}
+	_tls_unlock();
+
+	if(rc == 0){
+		/* No key: don't issue a ticket, or do a full handshake. */
+		return 0;
+	}
+	if(enc){
+		if(RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1){
+			rc = -1;
+		}else{
+			memcpy(name, key.name, 16);
+			if(!EVP_EncryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL, key.aes_key, iv)){
+				rc = -1;
+			}
+		}
+	}else{
+		if(!EVP_DecryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL, key.aes_key, iv)){
+			rc = -1;
+		}
+	}
+	if(rc > 0 && !HMAC_Init_ex(hmac_ctx, key.hmac_key, 16, EVP_sha256(), NULL)){
+		rc = -1;
+	}
+	memset(&key, 0, sizeof(key));
+	return rc;
+}
+
+static void _tls_info_cb(const SSL *ssl, int where, int ret)
+{
+	if(where & SSL_CB_HANDSHAKE_DONE){
+		_tls_lock();
+		if(SSL_session_reused((SSL *)ssl)){
+			tls_handshakes_resumed++;
+		}else{
+			tls_handshakes_full++;
+		}
+		_tls_unlock();
+	}
+}
+
+static int _hex_value(char c)
+{
+	if(c >= '0' && c <= '9') return c - '0';
+	c = tolower(c);
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return -1;
+}
+
+/* Read tls_ticket_key_file. Each key is one line of 96 hex characters: the
+ * 16 byte key name, 16 byte HMAC key and 16 byte AES key. The first key is
+ * used for new tickets, the others are only used to accept existing tickets.
+ * Blank lines and lines starting with # are ignored. */
+static int _tls_ticket_keys_load(const char *path, struct _tls_ticket_key **keys, int *count)
+{
+	FILE *fptr;
+	char buf[256];
+	char *line;
+	unsigned char raw[48];
+	struct _tls_ticket_key *new_keys = NULL, *tmp;
+	int new_count = 0;
+	int lineno = 0;
+	int len;
+	int i, hi, lo;
+
+	fptr = _mosquitto_fopen(path, "rt");
+	if(!fptr){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open tls_ticket_key_file \"%s\".", path);
+		return 1;
+	}
+	while(fgets(buf, sizeof(buf), fptr)){
+		lineno++;
+		line = buf;
+		while(*line == ' ' || *line == '\t') line++;
+		len = strlen(line);
+		while(len > 0 && (line[len-1] == '\n' || line[len-1] == '\r' || line[len-1] == ' ' || line[len-1] == '\t')){
+			line[--len] = '\0';
+		}
+		if(len == 0 || line[0] == '#') continue;
+
+		if(len != 96){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid key on line %d of tls_ticket_key_file \"%s\".", lineno, path);
+			goto error;
+		}
+		for(i=0; i<48; i++){
+			hi = _hex_value(line[i*2]);
+			lo = _hex_value(line[i*2+1]);
+			if(hi < 0 || lo < 0){
+				_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Invalid key on line %d of tls_ticket_key_file \"%s\".", lineno, path);
+				goto error;
+			}
+			raw[i] = (hi<<4) + lo;
+		}
+		tmp = _mosquitto_realloc(new_keys, sizeof(struct _tls_ticket_key)*(new_count+1));
+		if(!tmp){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			goto error;
+		}
+		new_keys = tmp;
+		memcpy(new_keys[new_count].name, raw, 16);
+		memcpy(new_keys[new_count].hmac_key, &raw[16], 16);
+		memcpy(new_keys[new_count].aes_key, &raw[32], 16);
+		new_count++;
+	}
+	fclose(fptr);
+	memset(buf, 0, sizeof(buf));
+	memset(raw, 0, sizeof(raw));
+
+	if(new_count == 0){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: No keys found in tls_ticket_key_file \"%s\".", path);
+		return 1;
+	}
+	*keys = new_keys;
+	*count = new_count;
+	return 0;
+
+error:
+	fclose(fptr);
+	memset(buf, 0, sizeof(buf));
+	memset(raw, 0, sizeof(raw));
+	if(new_keys){
+		memset(new_keys, 0, sizeof(struct _tls_ticket_key)*new_count);
+		_mosquitto_free(new_keys);
+	}
+	return 1;
+}
+
+static void _tls_ticket_keys_free(struct _tls_ticket_key *keys, int count)
+{
+	if(keys){
+		memset(keys, 0, sizeof(struct _tls_ticket_key)*count);
+		_mosquitto_free(keys);
+	}
+}
+
+int mqtt3_tls_session_init(struct mqtt3_config *config)
+{
+	tls_session_cache_size = config->tls_session_cache_size;
+	tls_session_timeout = config->tls_session_timeout;
+	if(config->tls_ticket_key_file){
+		tls_ticket_key_file = _mosquitto_strdup(config->tls_ticket_key_file);
+		if(!tls_ticket_key_file){
+			_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return MOSQ_ERR_NOMEM;
+		}
+		if(_tls_ticket_keys_load(tls_ticket_key_file, &tls_ticket_keys, &tls_ticket_key_count)){
+			return 1;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+void mqtt3_tls_session_ctx_init(SSL_CTX *ctx)
+{
+	SSL_CTX_set_timeout(ctx, tls_session_timeout);
+	if(tls_session_cache_size > 0){
+		/* Keep sessions in the shared cache only, so that a session can be
+		 * resumed whichever thread or listener context handles it. */
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+		SSL_CTX_sess_set_new_cb(ctx, _tls_session_new);
+		SSL_CTX_sess_set_get_cb(ctx, _tls_session_get);
+		SSL_CTX_sess_set_remove_cb(ctx, _tls_session_remove);
+	}
+	if(tls_ticket_key_file){
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, _tls_ticket_key_cb);
+	}
+	SSL_CTX_set_info_callback(ctx, _tls_info_cb);
+}
+
+/* The numbers of full and resumed handshakes so far. Handshakes may be
+ * counted on the handshake workers, so they are read under the lock. */
+void mqtt3_tls_handshake_counts(unsigned long *full, unsigned long *resumed)
+{
+	_tls_lock();
+	*full = tls_handshakes_full;
+	*resumed = tls_handshakes_resumed;
+	_tls_unlock();
+}
+
+void mqtt3_tls_session_reload(void)
+{
+	struct _tls_ticket_key *keys, *old_keys;
+	int count, old_count;
+
+	if(!tls_ticket_key_file) return;
+
+	if(_tls_ticket_keys_load(tls_ticket_key_file, &keys, &count)){
+		_mosquitto_log_printf(NULL, MOSQ_LOG_ERR, "Error: Unable to reload tls_ticket_key_file, keeping the current keys.");
+		return;
+	}
+	_tls_lock();
+	old_keys = tls_ticket_keys;
+	old_count = tls_ticket_key_count;
+	tls_ticket_keys = keys;
+	tls_ticket_key_count = count;
+	_tls_unlock();
+	_tls_ticket_keys_free(old_keys, old_count);
+}
+
+void mqtt3_tls_session_cleanup(void)
+{
+	_tls_lock();
+	while(tls_sessions){
+		_tls_session_free(tls_sessions);
+	}
+	_tls_ticket_keys_free(tls_ticket_keys, tls_ticket_key_count);
+	tls_ticket_keys = NULL;
+	tls_ticket_key_count = 0;
+	_tls_unlock();
+	if(tls_ticket_key_file){
+		_mosquitto_free(tls_ticket_key_file);
+		tls_ticket_key_file = NULL;
+	}
+}
+#endif
@@ -0,0 +1,56 @@
+#!/usr/bin/env python
+
+# Test whether a retained message on a topic matching message_expiry is
+# discarded once it has expired, while other retained messages are kept.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+mid = 16
+connect_packet = mosq_test.gen_connect("retain-expiry-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+expire_packet = mosq_test.gen_publish("retain/expiry/test", qos=0, payload="expiring message", retain=True)
+keep_packet = mosq_test.gen_publish("retain/keep/test", qos=0, payload="retained message", retain=True)
+subscribe_packet = mosq_test.gen_subscribe(mid, "retain/+/test", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+pingreq_packet = mosq_test.gen_pingreq()
+pingresp_packet = mosq_test.gen_pingresp()
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '04-retain-expiry.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(expire_packet)
+    sock.send(keep_packet)
+    time.sleep(2.5)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        if mosq_test.expect_packet(sock, "publish", keep_packet):
+            sock.send(pingreq_packet)
+            if mosq_test.expect_packet(sock, "pingresp", pingresp_packet):
+                rc = 0
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,118 @@
+#!/usr/bin/env python
+
+# Test whether queued QoS 1 messages saved in a compressed persistent database
+# spanning several blocks are restored in order, both with and without
+# persistence_lazy_load, and that a corrupted database is refused.
+
+import subprocess
+import socket
+import time
+import glob
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+count = 1000
+
+def cleanup():
+    for f in glob.glob('05-persistence-compression-qos1*.db*') + glob.glob('05-persistence-compression-qos1-lazy.conf'):
+        os.remove(f)
+
+def start_broker(conf='05-persistence-compression-qos1.conf'):
+    b = subprocess.Popen(['../../src/mosquitto', '-c', conf], stderr=subprocess.PIPE)
+    time.sleep(0.5)
+    return b
+
+def stop_broker(b):
+    b.terminate()
+    b.wait()
+
+def payload(i):
+    return "message "+str(i)+" "+("x"*(i%80))
+
+def receive(connect_packet):
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=30)
+    for i in range(count):
+        publish_packet = mosq_test.gen_publish("qos1/compression/test", qos=1, mid=i+1, payload=payload(i))
+        if not mosq_test.expect_packet(sock, "publish", publish_packet):
+            sock.close()
+            return False
+        sock.send(mosq_test.gen_puback(i+1))
+    sock.send(disconnect_packet)
+    sock.close()
+    return True
+
+rc = 1
+keepalive = 60
+connect_a_packet = mosq_test.gen_connect("persistence-compression-a", keepalive=keepalive, clean_session=False)
+connect_b_packet = mosq_test.gen_connect("persistence-compression-b", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+helper_connect_packet = mosq_test.gen_connect("persistence-compression-helper", keepalive=keepalive)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 110
+subscribe_packet = mosq_test.gen_subscribe(mid, "qos1/compression/test", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+cleanup()
+f = open('05-persistence-compression-qos1-lazy.conf', 'w')
+f.write(open('05-persistence-compression-qos1.conf').read())
+f.write('persistence_lazy_load true\n')
+f.close()
+
+broker = start_broker()
+
+try:
+    for connect_packet in [connect_a_packet, connect_b_packet]:
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+        sock.send(subscribe_packet)
+        if not mosq_test.expect_packet(sock, "suback", suback_packet):
+            raise ValueError
+        sock.send(disconnect_packet)
+        sock.close()
+
+    pub = mosq_test.do_client_connect(helper_connect_packet, connack_packet)
+    for i in range(count):
+        pub.send(mosq_test.gen_publish("qos1/compression/test", qos=1, mid=(i%65535)+1, payload=payload(i)))
+        if not mosq_test.expect_packet(pub, "puback", mosq_test.gen_puback((i%65535)+1)):
+            raise ValueError
+    pub.send(disconnect_packet)
+    pub.close()
+    stop_broker(broker)
+
+    broker = start_broker()
+    if not receive(connect_a_packet):
+        raise ValueError
+    stop_broker(broker)
+
+    broker = start_broker('05-persistence-compression-qos1-lazy.conf')
+    if not receive(connect_b_packet):
+        raise ValueError
+    stop_broker(broker)
+
+    # Flip a byte in the middle of the file, the broker must refuse it.
+    f = open('05-persistence-compression-qos1.db', 'r+b')
+    f.seek(0, 2)
+    f.seek(f.tell()/2)
+    b = f.read(1)
+    f.seek(-1, 1)
+    f.write(chr(ord(b) ^ 0xFF))
+    f.close()
+    broker = start_broker()
+    if broker.wait() != 0:
+        rc = 0
+finally:
+    if broker.returncode is None:
+        stop_broker(broker)
+    cleanup()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,65 @@
+#!/usr/bin/env python
+
+# Test that a message on a persistence_durable_topic is not acknowledged when
+# the write-ahead log can't be written. The log is a link to /dev/full, so
+# every write to it fails. The client is disconnected both when the log fails
+# while its PUBACK is held, and when it publishes again before a new log has
+# been started. Other topics are still acknowledged.
+
+import subprocess
+import socket
+import time
+import glob
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def cleanup():
+    for f in glob.glob('05-persistence-durable-failed.db*'):
+        os.remove(f)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("persistence-durable-failed", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+durable_publish_packet = mosq_test.gen_publish("durable/test", qos=1, mid=1, payload="durable message")
+durable2_publish_packet = mosq_test.gen_publish("durable/test", qos=1, mid=2, payload="durable message")
+other_publish_packet = mosq_test.gen_publish("other/test", qos=1, mid=3, payload="other message")
+other_puback_packet = mosq_test.gen_puback(3)
+
+cleanup()
+os.symlink('/dev/full', '05-persistence-durable-failed.db.wal')
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-persistence-durable-failed.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    # The log fails when it is synced for the held PUBACK.
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20)
+    sock.send(durable_publish_packet)
+    if sock.recv(1) == "":
+        sock.close()
+
+        # No new log is started for at least a second after a failure.
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20)
+        sock.send(other_publish_packet)
+        if mosq_test.expect_packet(sock, "puback", other_puback_packet):
+            sock.send(durable2_publish_packet)
+            if sock.recv(1) == "":
+                rc = 0
+    sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    cleanup()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
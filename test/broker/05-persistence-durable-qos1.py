@@ -0,0 +1,84 @@
+#!/usr/bin/env python
+
+# Test whether a PUBACK for a message on a persistence_durable_topic is only
+# sent once the message is in the write-ahead log, so that it survives the
+# broker being killed straight afterwards. Acknowledgements for other topics
+# must not overtake it.
+
+import subprocess
+import socket
+import time
+import glob
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def cleanup():
+    for f in glob.glob('05-persistence-durable-qos1.db*'):
+        os.remove(f)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("persistence-durable-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 109
+subscribe_packet = mosq_test.gen_subscribe(mid, "durable/test", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+helper_connect_packet = mosq_test.gen_connect("persistence-durable-helper", keepalive=keepalive)
+durable_publish_packet = mosq_test.gen_publish("durable/test", qos=1, mid=1, payload="durable message")
+durable_puback_packet = mosq_test.gen_puback(1)
+other_publish_packet = mosq_test.gen_publish("other/test", qos=1, mid=2, payload="other message")
+other_puback_packet = mosq_test.gen_puback(2)
+
+cleanup()
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-persistence-durable-qos1.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        sock.send(disconnect_packet)
+        sock.close()
+
+        pub = mosq_test.do_client_connect(helper_connect_packet, connack_packet)
+        pub.send(durable_publish_packet)
+        pub.send(other_publish_packet)
+        if not mosq_test.expect_packet(pub, "puback", durable_puback_packet):
+            raise ValueError
+        if not mosq_test.expect_packet(pub, "puback", other_puback_packet):
+            raise ValueError
+
+        # The log is otherwise only synced every hour.
+        broker.kill()
+        broker.wait()
+        pub.close()
+
+        broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-persistence-durable-qos1.conf'], stderr=subprocess.PIPE)
+        time.sleep(0.5)
+
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=30)
+        publish_packet = mosq_test.gen_publish("durable/test", qos=1, mid=1, payload="durable message")
+        if mosq_test.expect_packet(sock, "publish", publish_packet):
+            rc = 0
+        sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    cleanup()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
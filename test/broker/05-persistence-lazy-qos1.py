@@ -0,0 +1,101 @@
+#!/usr/bin/env python
+
+# Test whether queued QoS 1 messages restored with persistence_lazy_load are
+# delivered in order, both when they are still in the original database file
+# after another save and when a new message is queued behind them.
+
+import subprocess
+import socket
+import time
+import glob
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def cleanup():
+    for f in glob.glob('05-persistence-lazy-qos1.db*'):
+        os.remove(f)
+
+def start_broker():
+    b = subprocess.Popen(['../../src/mosquitto', '-c', '05-persistence-lazy-qos1.conf'], stderr=subprocess.PIPE)
+    time.sleep(0.5)
+    return b
+
+def stop_broker(b):
+    b.terminate()
+    b.wait()
+
+def receive(connect_packet, count):
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=30)
+    for i in range(count):
+        publish_packet = mosq_test.gen_publish("qos1/lazy/test", qos=1, mid=i+1, payload="message "+str(i))
+        if not mosq_test.expect_packet(sock, "publish", publish_packet):
+            sock.close()
+            return False
+        sock.send(mosq_test.gen_puback(i+1))
+    sock.send(disconnect_packet)
+    sock.close()
+    return True
+
+def publish(first, count):
+    pub = mosq_test.do_client_connect(helper_connect_packet, connack_packet)
+    for i in range(first, first+count):
+        pub.send(mosq_test.gen_publish("qos1/lazy/test", qos=1, mid=i+1, payload="message "+str(i)))
+        if not mosq_test.expect_packet(pub, "puback", mosq_test.gen_puback(i+1)):
+            raise ValueError
+    pub.send(disconnect_packet)
+    pub.close()
+
+rc = 1
+keepalive = 60
+connect_a_packet = mosq_test.gen_connect("persistence-lazy-a", keepalive=keepalive, clean_session=False)
+connect_b_packet = mosq_test.gen_connect("persistence-lazy-b", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+helper_connect_packet = mosq_test.gen_connect("persistence-lazy-helper", keepalive=keepalive)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 110
+subscribe_packet = mosq_test.gen_subscribe(mid, "qos1/lazy/test", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+cleanup()
+broker = start_broker()
+
+try:
+    for connect_packet in [connect_a_packet, connect_b_packet]:
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+        sock.send(subscribe_packet)
+        if not mosq_test.expect_packet(sock, "suback", suback_packet):
+            raise ValueError
+        sock.send(disconnect_packet)
+        sock.close()
+
+    publish(0, 2)
+    stop_broker(broker)
+
+    # Client a is loaded when it reconnects. The queue for b has not been
+    # loaded when the database is saved again.
+    broker = start_broker()
+    if not receive(connect_a_packet, 2):
+        raise ValueError
+    stop_broker(broker)
+
+    # Queueing a new message for b loads the two saved before it.
+    broker = start_broker()
+    publish(2, 1)
+    if receive(connect_b_packet, 3):
+        rc = 0
+finally:
+    stop_broker(broker)
+    cleanup()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
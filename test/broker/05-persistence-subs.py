@@ -0,0 +1,146 @@
+#!/usr/bin/env python
+
+# Test whether subscriptions of persistent clients, including wildcards, a
+# leading "/", many siblings and topics shared between clients, are restored
+# with their QoS from the persistent database, and are saved again correctly
+# after being restored. Retained messages are restored first, so the branch
+# with many siblings already exists when the subscriptions are added to it.
+
+import subprocess
+import socket
+import time
+import glob
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def cleanup():
+    for f in glob.glob('05-persistence-subs.db*'):
+        os.remove(f)
+
+def start_broker():
+    b = subprocess.Popen(['../../src/mosquitto', '-c', '05-persistence-subs.conf'], stderr=subprocess.PIPE)
+    time.sleep(0.5)
+    return b
+
+def stop_broker(b):
+    b.terminate()
+    b.wait()
+
+def subscribe(connect_packet, subs):
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    mid = 1
+    for (topic, qos) in subs:
+        sock.send(mosq_test.gen_subscribe(mid, topic, qos))
+        if not mosq_test.expect_packet(sock, "suback", mosq_test.gen_suback(mid, qos)):
+            sock.close()
+            return False
+        mid += 1
+    sock.send(disconnect_packet)
+    sock.close()
+    return True
+
+def publish(sock, topic, qos, mid):
+    sock.send(mosq_test.gen_publish(topic, qos=qos, mid=mid, payload=topic))
+    if qos == 1:
+        return mosq_test.expect_packet(sock, "puback", mosq_test.gen_puback(mid))
+    if not mosq_test.expect_packet(sock, "pubrec", mosq_test.gen_pubrec(mid)):
+        return False
+    sock.send(mosq_test.gen_pubrel(mid))
+    return mosq_test.expect_packet(sock, "pubcomp", mosq_test.gen_pubcomp(mid))
+
+def receive(connect_packet, messages):
+    # All of the queued messages are sent before any are acknowledged.
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    mid = 1
+    for (topic, qos) in messages:
+        if not mosq_test.expect_packet(sock, "publish", mosq_test.gen_publish(topic, qos=qos, mid=mid, payload=topic)):
+            sock.close()
+            return False
+        mid += 1
+    mid = 1
+    for (topic, qos) in messages:
+        if qos == 1:
+            sock.send(mosq_test.gen_puback(mid))
+        else:
+            sock.send(mosq_test.gen_pubrec(mid))
+            if not mosq_test.expect_packet(sock, "pubrel", mosq_test.gen_pubrel(mid)):
+                sock.close()
+                return False
+            sock.send(mosq_test.gen_pubcomp(mid))
+        mid += 1
+    sock.send(disconnect_packet)
+    sock.close()
+    return True
+
+rc = 1
+keepalive = 60
+connect_a_packet = mosq_test.gen_connect("persistence-subs-a", keepalive=keepalive, clean_session=False)
+connect_b_packet = mosq_test.gen_connect("persistence-subs-b", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+helper_connect_packet = mosq_test.gen_connect("persistence-subs-helper", keepalive=keepalive)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+subs_a = [("subs/a/#", 1), ("subs/+/c", 2), ("/subs/lead", 1)]
+for i in range(40):
+    subs_a.append(("subs/many/"+str(i), 1))
+subs_b = [("subs/many/7", 2), ("subs/a/#", 2), ("subs/b", 1)]
+
+cleanup()
+broker = start_broker()
+
+try:
+    pub = mosq_test.do_client_connect(helper_connect_packet, connack_packet)
+    for i in range(20):
+        pub.send(mosq_test.gen_publish("subs/many/r"+str(i), qos=0, payload="retained", retain=True))
+    pub.send(disconnect_packet)
+    pub.close()
+
+    if not subscribe(connect_a_packet, subs_a):
+        raise ValueError
+    if not subscribe(connect_b_packet, subs_b):
+        raise ValueError
+    stop_broker(broker)
+
+    # Restore, then save again what was restored.
+    broker = start_broker()
+    stop_broker(broker)
+
+    broker = start_broker()
+    pub = mosq_test.do_client_connect(helper_connect_packet, connack_packet)
+    mid = 1
+    for (topic, qos) in [("subs/a/b/c", 2), ("subs/x/c", 1), ("/subs/lead", 1), ("subs/many/7", 2), ("subs/many/39", 1), ("subs/b", 1)]:
+        if not publish(pub, topic, qos, mid):
+            raise ValueError
+        mid += 1
+    pub.send(disconnect_packet)
+    pub.close()
+
+    if not receive(connect_a_packet, [("subs/a/b/c", 1), ("subs/x/c", 1), ("/subs/lead", 1), ("subs/many/7", 1), ("subs/many/39", 1)]):
+        raise ValueError
+    if not receive(connect_b_packet, [("subs/a/b/c", 2), ("subs/many/7", 2), ("subs/b", 1)]):
+        raise ValueError
+
+    pub = mosq_test.do_client_connect(helper_connect_packet, connack_packet)
+    pub.send(mosq_test.gen_subscribe(1, "subs/many/r5", 0))
+    if not mosq_test.expect_packet(pub, "suback", mosq_test.gen_suback(1, 0)):
+        raise ValueError
+    if not mosq_test.expect_packet(pub, "publish", mosq_test.gen_publish("subs/many/r5", qos=0, payload="retained", retain=True)):
+        raise ValueError
+    pub.close()
+    rc = 0
+finally:
+    if broker.returncode is None:
+        stop_broker(broker)
+    cleanup()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
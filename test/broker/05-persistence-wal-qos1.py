@@ -0,0 +1,101 @@
+#!/usr/bin/env python
+
+# Test whether queued QoS 1 messages and retained messages are recovered from
+# the write-ahead log when the broker is killed without saving its database.
+
+import subprocess
+import socket
+import time
+import glob
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def cleanup():
+    for f in glob.glob('05-persistence-wal-qos1.db*'):
+        os.remove(f)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("persistence-wal-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 109
+subscribe_packet = mosq_test.gen_subscribe(mid, "qos1/wal/test", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+helper_connect_packet = mosq_test.gen_connect("persistence-wal-helper", keepalive=keepalive)
+retain_publish_packet = mosq_test.gen_publish("retain/wal/test", qos=0, payload="retained message", retain=True)
+
+retain_connect_packet = mosq_test.gen_connect("persistence-wal-retain", keepalive=keepalive)
+retain_subscribe_packet = mosq_test.gen_subscribe(mid, "retain/wal/test", 0)
+retain_suback_packet = mosq_test.gen_suback(mid, 0)
+
+cleanup()
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-persistence-wal-qos1.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        sock.send(disconnect_packet)
+        sock.close()
+
+        pub = mosq_test.do_client_connect(helper_connect_packet, connack_packet)
+        for i in range(2):
+            pub.send(mosq_test.gen_publish("qos1/wal/test", qos=1, mid=i+1, payload="message "+str(i)))
+            if not mosq_test.expect_packet(pub, "puback", mosq_test.gen_puback(i+1)):
+                raise ValueError
+        pub.send(retain_publish_packet)
+        pub.send(disconnect_packet)
+        pub.close()
+        time.sleep(0.5)
+
+        # No database has been saved, so everything must come from the log.
+        broker.kill()
+        broker.wait()
+        if os.path.exists('05-persistence-wal-qos1.db'):
+            print("FAIL: Database saved before kill.")
+            raise ValueError
+
+        broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-persistence-wal-qos1.conf'], stderr=subprocess.PIPE)
+        time.sleep(0.5)
+
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=30)
+        rc = 0
+        for i in range(2):
+            publish_packet = mosq_test.gen_publish("qos1/wal/test", qos=1, mid=i+1, payload="message "+str(i))
+            if mosq_test.expect_packet(sock, "publish", publish_packet):
+                sock.send(mosq_test.gen_puback(i+1))
+            else:
+                rc = 1
+                break
+        sock.close()
+
+        if rc == 0:
+            rc = 1
+            sock = mosq_test.do_client_connect(retain_connect_packet, connack_packet)
+            sock.send(retain_subscribe_packet)
+            if mosq_test.expect_packet(sock, "suback", retain_suback_packet):
+                if mosq_test.expect_packet(sock, "publish", retain_publish_packet):
+                    rc = 0
+            sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    cleanup()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,74 @@
+#!/usr/bin/env python
+
+# Test whether messages queued for a disconnected persistent client are
+# dropped once the client's queue would exceed max_queued_bytes.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("queue-bytes-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 109
+subscribe_packet = mosq_test.gen_subscribe(mid, "qos1/bytes/test", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+helper_connect_packet = mosq_test.gen_connect("queue-bytes-helper", keepalive=keepalive)
+
+pingreq_packet = mosq_test.gen_pingreq()
+pingresp_packet = mosq_test.gen_pingresp()
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-queue-bytes-limit.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        sock.send(disconnect_packet)
+        sock.close()
+
+        # The second message would take the queue over the limit so is
+        # dropped, the third fits exactly.
+        pub = mosq_test.do_client_connect(helper_connect_packet, connack_packet)
+        payloads = ["0123456789", "second message", "abcdefghij"]
+        for i in range(len(payloads)):
+            pub.send(mosq_test.gen_publish("qos1/bytes/test", qos=1, mid=i+1, payload=payloads[i]))
+            if not mosq_test.expect_packet(pub, "puback", mosq_test.gen_puback(i+1)):
+                raise ValueError
+        pub.close()
+
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=30)
+        publish1_packet = mosq_test.gen_publish("qos1/bytes/test", qos=1, mid=1, payload=payloads[0])
+        publish3_packet = mosq_test.gen_publish("qos1/bytes/test", qos=1, mid=3, payload=payloads[2])
+        if mosq_test.expect_packet(sock, "publish 1", publish1_packet) and mosq_test.expect_packet(sock, "publish 3", publish3_packet):
+            sock.send(mosq_test.gen_puback(1))
+            sock.send(mosq_test.gen_puback(3))
+            sock.send(pingreq_packet)
+            if mosq_test.expect_packet(sock, "pingresp", pingresp_packet):
+                rc = 0
+
+        sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+
+# Test whether messages queued for a disconnected persistent client on a
+# topic matching queue_conflate are still replaced by newer messages after
+# the queue has been restored from the persistent database with
+# persistence_lazy_load.
+
+import subprocess
+import socket
+import time
+import glob
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def cleanup():
+    for f in glob.glob('05-queue-conflate-persist.db*'):
+        os.remove(f)
+
+def start_broker():
+    b = subprocess.Popen(['../../src/mosquitto', '-c', '05-queue-conflate-persist.conf'], stderr=subprocess.PIPE)
+    time.sleep(0.5)
+    return b
+
+def publish(first, messages):
+    pub = mosq_test.do_client_connect(helper_connect_packet, connack_packet)
+    for i in range(len(messages)):
+        pub.send(mosq_test.gen_publish(messages[i][0], qos=1, mid=first+i, payload=messages[i][1]))
+        if not mosq_test.expect_packet(pub, "puback", mosq_test.gen_puback(first+i)):
+            raise ValueError
+    pub.close()
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("queue-conflate-persist-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 111
+subscribe_packet = mosq_test.gen_subscribe(mid, "state/#", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+helper_connect_packet = mosq_test.gen_connect("queue-conflate-persist-helper", keepalive=keepalive)
+
+pingreq_packet = mosq_test.gen_pingreq()
+pingresp_packet = mosq_test.gen_pingresp()
+
+cleanup()
+broker = start_broker()
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        sock.send(disconnect_packet)
+        sock.close()
+
+        publish(1, [("state/a", "a1"), ("state/b", "b1")])
+
+        broker.terminate()
+        broker.wait()
+        broker = start_broker()
+
+        # The restored message for state/a is replaced in place.
+        publish(3, [("state/a", "a2")])
+
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=30)
+        publish_a_packet = mosq_test.gen_publish("state/a", qos=1, mid=3, payload="a2")
+        publish_b_packet = mosq_test.gen_publish("state/b", qos=1, mid=2, payload="b1")
+        if mosq_test.expect_packet(sock, "publish a", publish_a_packet) and mosq_test.expect_packet(sock, "publish b", publish_b_packet):
+            sock.send(mosq_test.gen_puback(3))
+            sock.send(mosq_test.gen_puback(2))
+            sock.send(pingreq_packet)
+            if mosq_test.expect_packet(sock, "pingresp", pingresp_packet):
+                rc = 0
+
+        sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+    cleanup()
+
+exit(rc)
@@ -0,0 +1,76 @@
+#!/usr/bin/env python
+
+# Test whether messages queued for a disconnected persistent client on a
+# topic matching queue_conflate are replaced by newer messages on the same
+# topic, so only the latest value per topic is delivered. A newer message that
+# would take the queue over max_queued_bytes is dropped instead.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("queue-conflate-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 109
+subscribe_packet = mosq_test.gen_subscribe(mid, "state/#", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+helper_connect_packet = mosq_test.gen_connect("queue-conflate-helper", keepalive=keepalive)
+
+pingreq_packet = mosq_test.gen_pingreq()
+pingresp_packet = mosq_test.gen_pingresp()
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-queue-conflate.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        sock.send(disconnect_packet)
+        sock.close()
+
+        pub = mosq_test.do_client_connect(helper_connect_packet, connack_packet)
+        messages = [("state/a", "a1"), ("state/b", "b1"), ("state/a", "a2"), ("state/a", "a3"), ("state/a", "a4 is too long")]
+        for i in range(len(messages)):
+            pub.send(mosq_test.gen_publish(messages[i][0], qos=1, mid=i+1, payload=messages[i][1]))
+            if not mosq_test.expect_packet(pub, "puback", mosq_test.gen_puback(i+1)):
+                raise ValueError
+        pub.close()
+
+        # The latest value for state/a takes the place of the first one in
+        # the queue, with the mid of the latest message.
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=30)
+        publish_a_packet = mosq_test.gen_publish("state/a", qos=1, mid=4, payload="a3")
+        publish_b_packet = mosq_test.gen_publish("state/b", qos=1, mid=2, payload="b1")
+        if mosq_test.expect_packet(sock, "publish a", publish_a_packet) and mosq_test.expect_packet(sock, "publish b", publish_b_packet):
+            sock.send(mosq_test.gen_puback(4))
+            sock.send(mosq_test.gen_puback(2))
+            sock.send(pingreq_packet)
+            if mosq_test.expect_packet(sock, "pingresp", pingresp_packet):
+                rc = 0
+
+        sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,72 @@
+#!/usr/bin/env python
+
+# Test whether a message queued for a disconnected persistent client on a
+# topic matching message_expiry is removed from the queue once it has
+# expired, making room for a later message when the queue is otherwise full.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("queue-expiry-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 110
+subscribe_packet = mosq_test.gen_subscribe(mid, "queue/#", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+helper_connect_packet = mosq_test.gen_connect("queue-expiry-helper", keepalive=keepalive)
+
+pingreq_packet = mosq_test.gen_pingreq()
+pingresp_packet = mosq_test.gen_pingresp()
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-queue-expiry.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        sock.send(disconnect_packet)
+        sock.close()
+
+        pub = mosq_test.do_client_connect(helper_connect_packet, connack_packet)
+        pub.send(mosq_test.gen_publish("queue/expiry/test", qos=1, mid=1, payload="expiring message"))
+        if mosq_test.expect_packet(pub, "puback", mosq_test.gen_puback(1)):
+            time.sleep(2.5)
+            # The queue only has room for this if the first has expired.
+            pub.send(mosq_test.gen_publish("queue/keep/test", qos=1, mid=2, payload="queued message"))
+            if mosq_test.expect_packet(pub, "puback", mosq_test.gen_puback(2)):
+                pub.close()
+
+                sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=30)
+                publish_packet = mosq_test.gen_publish("queue/keep/test", qos=1, mid=2, payload="queued message")
+                if mosq_test.expect_packet(sock, "publish", publish_packet):
+                    sock.send(mosq_test.gen_puback(2))
+                    sock.send(pingreq_packet)
+                    if mosq_test.expect_packet(sock, "pingresp", pingresp_packet):
+                        rc = 0
+
+        sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,105 @@
+#!/usr/bin/env python
+
+# Test whether QoS 1 messages on a persistence_durable_topic that are spilled
+# to disk survive the broker being killed straight after they have been
+# acknowledged. The spill file must be synced along with the write-ahead log.
+
+import subprocess
+import socket
+import struct
+import time
+import glob
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def cleanup():
+    for f in glob.glob('05-queue-spill-durable.db*'):
+        os.remove(f)
+
+# Spilled messages are given new mids when they are read back, so read
+# whatever mid was used and check the rest of the packet against it.
+def expect_publish(sock, payload):
+    header = sock.recv(2)
+    if len(header) != 2:
+        print("FAIL: Connection closed.")
+        return None
+    body = ""
+    while len(body) < ord(header[1]):
+        data = sock.recv(ord(header[1]) - len(body))
+        if data == "":
+            break
+        body = body + data
+    packet = header + body
+    (tlen,) = struct.unpack("!H", body[0:2])
+    (mid,) = struct.unpack("!H", body[2+tlen:4+tlen])
+    expected = mosq_test.gen_publish("qos1/spill/test", qos=1, mid=mid, payload=payload)
+    if mosq_test.packet_matches("publish", packet, expected):
+        return mid
+    return None
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("queue-spill-durable-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 109
+subscribe_packet = mosq_test.gen_subscribe(mid, "qos1/spill/test", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+helper_connect_packet = mosq_test.gen_connect("queue-spill-durable-helper", keepalive=keepalive)
+
+cleanup()
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-queue-spill-durable.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        sock.send(disconnect_packet)
+        sock.close()
+
+        # Queue five messages, three of which go to the spill file.
+        pub = mosq_test.do_client_connect(helper_connect_packet, connack_packet)
+        for i in range(5):
+            pub.send(mosq_test.gen_publish("qos1/spill/test", qos=1, mid=i+1, payload="message "+str(i)))
+            if not mosq_test.expect_packet(pub, "puback", mosq_test.gen_puback(i+1)):
+                raise ValueError
+
+        # The log is otherwise only synced every hour.
+        broker.kill()
+        broker.wait()
+        pub.close()
+
+        broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-queue-spill-durable.conf'], stderr=subprocess.PIPE)
+        time.sleep(0.5)
+
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=30)
+        rc = 0
+        for i in range(5):
+            m = expect_publish(sock, "message "+str(i))
+            if m is None:
+                rc = 1
+                break
+            sock.send(mosq_test.gen_puback(m))
+
+        sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    cleanup()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,88 @@
+#!/usr/bin/env python
+
+# Test whether a message that can't be written to the spill file of a client
+# is dropped, rather than queued in memory ahead of the messages already
+# spilled. The broker is run with a file size limit so that a large message
+# can't be written.
+
+import subprocess
+import socket
+import time
+import glob
+import resource
+import signal
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def cleanup():
+    for f in glob.glob('05-queue-spill-failed.db*'):
+        os.remove(f)
+
+def limit_file_size():
+    # Writes past the limit fail with EFBIG instead of raising SIGXFSZ.
+    signal.signal(signal.SIGXFSZ, signal.SIG_IGN)
+    resource.setrlimit(resource.RLIMIT_FSIZE, (150, 150))
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("queue-spill-failed-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 112
+subscribe_packet = mosq_test.gen_subscribe(mid, "qos1/spill/test", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+helper_connect_packet = mosq_test.gen_connect("queue-spill-failed-helper", keepalive=keepalive)
+
+cleanup()
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-queue-spill-failed.conf'], stderr=subprocess.PIPE, preexec_fn=limit_file_size)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        sock.send(disconnect_packet)
+        sock.close()
+
+        # Two messages are queued in memory and the rest go to the spill
+        # file, except for the large one which doesn't fit.
+        payloads = ["message 0", "message 1", "message 2", "x"*100, "message 4"]
+        pub = mosq_test.do_client_connect(helper_connect_packet, connack_packet)
+        for i in range(len(payloads)):
+            pub.send(mosq_test.gen_publish("qos1/spill/test", qos=1, mid=i+1, payload=payloads[i]))
+            if not mosq_test.expect_packet(pub, "puback", mosq_test.gen_puback(i+1)):
+                raise ValueError
+        pub.close()
+
+        # The spilled messages get new mids when they are read back.
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=30)
+        rc = 0
+        for (i, m) in [(0, 1), (1, 2), (2, 6), (4, 7)]:
+            publish_packet = mosq_test.gen_publish("qos1/spill/test", qos=1, mid=m, payload=payloads[i])
+            if mosq_test.expect_packet(sock, "publish", publish_packet):
+                sock.send(mosq_test.gen_puback(m))
+            else:
+                rc = 1
+                break
+
+        sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    cleanup()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
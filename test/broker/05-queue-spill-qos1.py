@@ -0,0 +1,89 @@
+#!/usr/bin/env python
+
+# Test whether QoS 1 messages queued for a persistent client beyond
+# queue_spill_threshold are spilled to disk, survive a broker restart and are
+# delivered in order when the client reconnects.
+
+import subprocess
+import socket
+import time
+import glob
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def cleanup():
+    for f in glob.glob('05-queue-spill-qos1.db*'):
+        os.remove(f)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("queue-spill-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+mid = 109
+subscribe_packet = mosq_test.gen_subscribe(mid, "qos1/spill/test", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+helper_connect_packet = mosq_test.gen_connect("queue-spill-helper", keepalive=keepalive)
+
+cleanup()
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-queue-spill-qos1.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet)
+    sock.send(subscribe_packet)
+
+    if mosq_test.expect_packet(sock, "suback", suback_packet):
+        sock.send(disconnect_packet)
+        sock.close()
+
+        # Queue five messages, three of which go to the spill file.
+        pub = mosq_test.do_client_connect(helper_connect_packet, connack_packet)
+        for i in range(5):
+            pub.send(mosq_test.gen_publish("qos1/spill/test", qos=1, mid=i+1, payload="message "+str(i)))
+            if not mosq_test.expect_packet(pub, "puback", mosq_test.gen_puback(i+1)):
+                raise ValueError
+        pub.close()
+
+        if len(glob.glob('05-queue-spill-qos1.db.spill.*')) != 1:
+            print("FAIL: No spill file created.")
+            raise ValueError
+
+        broker.terminate()
+        broker.wait()
+        broker = subprocess.Popen(['../../src/mosquitto', '-c', '05-queue-spill-qos1.conf'], stderr=subprocess.PIPE)
+        time.sleep(0.5)
+
+        # Now reconnect and expect all five messages in order. The in-memory
+        # messages keep their mids, spilled messages get new mids when they
+        # are read back.
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=30)
+        rc = 0
+        for (i, m) in [(0, 1), (1, 2), (2, 6), (3, 7), (4, 8)]:
+            publish_packet = mosq_test.gen_publish("qos1/spill/test", qos=1, mid=m, payload="message "+str(i))
+            if mosq_test.expect_packet(sock, "publish", publish_packet):
+                sock.send(mosq_test.gen_puback(m))
+            else:
+                rc = 1
+                break
+
+        sock.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    cleanup()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,83 @@
+#!/usr/bin/env python
+
+# Check that topic and pattern ACLs grant read access for the right topics
+# only, including wildcards and client ids that contain wildcards.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+mid = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+subscribe_packet = mosq_test.gen_subscribe(mid, "#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+sub1_connect_packet = mosq_test.gen_connect("reader-id", keepalive=keepalive, username="reader")
+sub2_connect_packet = mosq_test.gen_connect("+", keepalive=keepalive, username="reader2")
+pub_connect_packet = mosq_test.gen_connect("acl-writer", keepalive=keepalive)
+
+# (topic, received by sub1, received by sub2)
+topics = [
+    ("acl/exact", True, False),
+    ("acl/exactly", False, False),
+    ("acl/plus/x/end", True, False),
+    ("acl/plus/x/y/end", False, False),
+    ("acl/hash", True, False),
+    ("acl/hash/a/b", True, False),
+    ("acl/writeonly", False, False),
+    ("acl/client/reader-id", True, False),
+    ("acl/client/reader-id/a", True, False),
+    ("acl/client/other/a", False, False),
+    ("acl/user/reader", True, False),
+    ("acl/user/reader2", False, True),
+    ("acl/user/other", False, False),
+    ("acl/exact", True, False),
+]
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '09-acl-access.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sub1 = mosq_test.do_client_connect(sub1_connect_packet, connack_packet)
+    sub1.send(subscribe_packet)
+    if mosq_test.expect_packet(sub1, "suback", suback_packet):
+        sub2 = mosq_test.do_client_connect(sub2_connect_packet, connack_packet)
+        sub2.send(subscribe_packet)
+        if mosq_test.expect_packet(sub2, "suback", suback_packet):
+            pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet)
+            for (topic, r1, r2) in topics:
+                pub.send(mosq_test.gen_publish(topic, qos=0, payload="message"))
+
+            ok = True
+            for (topic, r1, r2) in topics:
+                if r1 and not mosq_test.expect_packet(sub1, "publish "+topic, mosq_test.gen_publish(topic, qos=0, payload="message")):
+                    ok = False
+                    break
+                if r2 and not mosq_test.expect_packet(sub2, "publish "+topic, mosq_test.gen_publish(topic, qos=0, payload="message")):
+                    ok = False
+                    break
+            if ok:
+                rc = 0
+
+            pub.close()
+        sub2.close()
+    sub1.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
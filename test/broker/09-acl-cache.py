@@ -0,0 +1,77 @@
+#!/usr/bin/env python
+
+# Check that cached ACL results give the same answers as the ACL file, with
+# entries being evicted, and that they are discarded when the ACL file is
+# reloaded.
+
+import subprocess
+import socket
+import time
+import signal
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def write_acl(topic):
+    f = open("09-acl-cache.acl", "w")
+    f.write("user writer\n")
+    f.write("topic write cache/#\n")
+    f.write("user reader\n")
+    f.write("topic read "+topic+"\n")
+    f.close()
+
+def publish(sock, topic):
+    sock.send(mosq_test.gen_publish(topic, qos=0, payload="message"))
+
+def expect(sock, topic):
+    return mosq_test.expect_packet(sock, "publish "+topic, mosq_test.gen_publish(topic, qos=0, payload="message"))
+
+rc = 1
+mid = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+subscribe_packet = mosq_test.gen_subscribe(mid, "cache/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+sub_connect_packet = mosq_test.gen_connect("acl-cache-reader", keepalive=keepalive, username="reader")
+pub_connect_packet = mosq_test.gen_connect("acl-cache-writer", keepalive=keepalive, username="writer")
+
+write_acl("cache/a")
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '09-acl-cache.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sub = mosq_test.do_client_connect(sub_connect_packet, connack_packet)
+    sub.send(subscribe_packet)
+    if mosq_test.expect_packet(sub, "suback", suback_packet):
+        pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet)
+        for topic in ["cache/a", "cache/b", "cache/c", "cache/a", "cache/a"]:
+            publish(pub, topic)
+
+        if expect(sub, "cache/a") and expect(sub, "cache/a") and expect(sub, "cache/a"):
+            write_acl("cache/b")
+            broker.send_signal(signal.SIGHUP)
+            time.sleep(0.5)
+
+            publish(pub, "cache/a")
+            publish(pub, "cache/b")
+            if expect(sub, "cache/b"):
+                rc = 0
+
+        pub.close()
+    sub.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    os.remove("09-acl-cache.acl")
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
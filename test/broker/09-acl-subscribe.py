@@ -0,0 +1,86 @@
+#!/usr/bin/env python
+
+# Check that subscriptions whose READ access is decided when they are made
+# deliver the same messages as checking each message, including topics with a
+# leading "/", and that they are decided again when the ACL file is reloaded.
+
+import subprocess
+import socket
+import time
+import signal
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def write_acl(extra):
+    f = open("09-acl-subscribe.acl", "w")
+    f.write("user writer\n")
+    f.write("topic write #\n")
+    f.write("user reader\n")
+    f.write("topic read sub/allow/#\n")
+    f.write("topic read sub/mixed/a\n")
+    f.write("pattern read sub/client/%c\n")
+    if extra:
+        f.write("topic read "+extra+"\n")
+    f.close()
+
+def subscribe(sock, mid, topic):
+    sock.send(mosq_test.gen_subscribe(mid, topic, 0))
+    return mosq_test.expect_packet(sock, "suback", mosq_test.gen_suback(mid, 0))
+
+def publish(sock, topic):
+    sock.send(mosq_test.gen_publish(topic, qos=0, payload="message"))
+
+def expect(sock, topic):
+    return mosq_test.expect_packet(sock, "publish "+topic, mosq_test.gen_publish(topic, qos=0, payload="message"))
+
+rc = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+
+sub_connect_packet = mosq_test.gen_connect("acl-sub-reader", keepalive=keepalive, username="reader")
+pub_connect_packet = mosq_test.gen_connect("acl-sub-writer", keepalive=keepalive, username="writer")
+
+write_acl(None)
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '09-acl-subscribe.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sub = mosq_test.do_client_connect(sub_connect_packet, connack_packet)
+    if subscribe(sub, 1, "sub/allow/+") and subscribe(sub, 2, "sub/deny/#") \
+            and subscribe(sub, 3, "sub/mixed/+") and subscribe(sub, 4, "sub/client/+"):
+
+        pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet)
+        for topic in ["/sub/allow/x", "sub/allow/x", "sub/deny/x", "sub/mixed/b",
+                "sub/mixed/a", "sub/client/other", "sub/client/acl-sub-reader"]:
+            publish(pub, topic)
+
+        if expect(sub, "sub/allow/x") and expect(sub, "sub/mixed/a") \
+                and expect(sub, "sub/client/acl-sub-reader"):
+
+            write_acl("sub/deny/x")
+            broker.send_signal(signal.SIGHUP)
+            time.sleep(0.5)
+
+            publish(pub, "sub/deny/y")
+            publish(pub, "sub/deny/x")
+            if expect(sub, "sub/deny/x"):
+                rc = 0
+
+        pub.close()
+    sub.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    os.remove("09-acl-subscribe.acl")
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,60 @@
+#!/usr/bin/env python
+
+# Test that a plugin's batch ACL check is used when delivering to
+# subscribers, and that the per client check is used if it fails.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+allowed_connect_packet = mosq_test.gen_connect("batch-allowed", keepalive=keepalive, username="allowed")
+denied_connect_packet = mosq_test.gen_connect("batch-denied", keepalive=keepalive, username="denied")
+pub_connect_packet = mosq_test.gen_connect("batch-pub", keepalive=keepalive, username="allowed")
+
+subscribe_packet = mosq_test.gen_subscribe(1, "#", 0)
+suback_packet = mosq_test.gen_suback(1, 0)
+publish_packet = mosq_test.gen_publish("topic", qos=0, payload="message")
+fallback_publish_packet = mosq_test.gen_publish("fallback/topic", qos=0, payload="message")
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '09-plugin-acl-batch.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    allowed = mosq_test.do_client_connect(allowed_connect_packet, connack_packet, timeout=20)
+    allowed.send(subscribe_packet)
+    denied = mosq_test.do_client_connect(denied_connect_packet, connack_packet, timeout=20)
+    denied.send(subscribe_packet)
+    if mosq_test.expect_packet(allowed, "suback", suback_packet) and mosq_test.expect_packet(denied, "suback", suback_packet):
+        pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=20)
+        pub.send(publish_packet)
+        if mosq_test.expect_packet(allowed, "publish", publish_packet):
+            # Denied by the batch check, so the ping response must come first.
+            denied.send(mosq_test.gen_pingreq())
+            if mosq_test.expect_packet(denied, "pingresp", mosq_test.gen_pingresp()):
+                pub.send(fallback_publish_packet)
+                if mosq_test.expect_packet(allowed, "publish", fallback_publish_packet):
+                    if mosq_test.expect_packet(denied, "publish", fallback_publish_packet):
+                        rc = 0
+        pub.close()
+    denied.close()
+    allowed.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,75 @@
+#!/usr/bin/env python
+
+# Test that an auth plugin with asynchronous checks holds a CONNECT or PUBLISH
+# until its check completes, while other clients carry on being served, and
+# that messages from one client stay in order.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+slow_connect_packet = mosq_test.gen_connect("async-slow", keepalive=keepalive, username="slow")
+fast_connect_packet = mosq_test.gen_connect("async-fast", keepalive=keepalive, username="fast")
+bad_connect_packet = mosq_test.gen_connect("async-bad", keepalive=keepalive, username="bad")
+bad_connack_packet = mosq_test.gen_connack(rc=4)
+
+subscribe_packet = mosq_test.gen_subscribe(1, "#", 0)
+suback_packet = mosq_test.gen_suback(1, 0)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '09-plugin-auth-async.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    slow = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    slow.settimeout(10)
+    slow.connect(("localhost", 1888))
+    slow.send(slow_connect_packet)
+    start = time.time()
+
+    # The slow client's check takes a second, and must not hold up this one.
+    fast = mosq_test.do_client_connect(fast_connect_packet, connack_packet, timeout=10)
+    if time.time() - start < 0.5 \
+            and mosq_test.expect_packet(slow, "slow connack", connack_packet):
+
+        fast.send(subscribe_packet)
+        if mosq_test.expect_packet(fast, "suback", suback_packet):
+            # The first publish is held for half a second, the next two must
+            # wait behind it. The denied one must not be delivered.
+            for (mid, topic) in [(1, "slow/1"), (2, "denied/2"), (3, "fast/3")]:
+                slow.send(mosq_test.gen_publish(topic, qos=1, mid=mid, payload="message"))
+            if mosq_test.expect_packet(slow, "puback 1", mosq_test.gen_puback(1)) \
+                    and mosq_test.expect_packet(slow, "puback 2", mosq_test.gen_puback(2)) \
+                    and mosq_test.expect_packet(slow, "puback 3", mosq_test.gen_puback(3)) \
+                    and mosq_test.expect_packet(fast, "publish 1", mosq_test.gen_publish("slow/1", qos=0, payload="message")) \
+                    and mosq_test.expect_packet(fast, "publish 3", mosq_test.gen_publish("fast/3", qos=0, payload="message")):
+
+                bad = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                bad.settimeout(10)
+                bad.connect(("localhost", 1888))
+                bad.send(bad_connect_packet)
+                if mosq_test.expect_packet(bad, "bad connack", bad_connack_packet):
+                    rc = 0
+                bad.close()
+
+    fast.close()
+    slow.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,58 @@
+#!/usr/bin/env python
+
+# Test that a plugin without asynchronous checks is run on worker threads
+# when auth_workers is set.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+fail_connect_packet = mosq_test.gen_connect("workers-fail", keepalive=keepalive, username="test-username", password="wrong")
+fail_connack_packet = mosq_test.gen_connack(rc=4)
+sub_connect_packet = mosq_test.gen_connect("workers-sub", keepalive=keepalive, username="readonly")
+pub_connect_packet = mosq_test.gen_connect("workers-pub", keepalive=keepalive, username="test-username", password="cnwTICONIURW")
+
+subscribe_packet = mosq_test.gen_subscribe(1, "#", 0)
+suback_packet = mosq_test.gen_suback(1, 0)
+publish_packet = mosq_test.gen_publish("topic", qos=1, mid=1, payload="message")
+puback_packet = mosq_test.gen_puback(1)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '09-plugin-auth-workers.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    sock = mosq_test.do_client_connect(fail_connect_packet, fail_connack_packet, timeout=20)
+    sock.close()
+
+    sub = mosq_test.do_client_connect(sub_connect_packet, connack_packet, timeout=20)
+    sub.send(subscribe_packet)
+    if mosq_test.expect_packet(sub, "suback", suback_packet):
+        pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=20)
+        pub.send(publish_packet)
+        if mosq_test.expect_packet(pub, "puback", puback_packet):
+            # The publish was denied, so the ping response must come first.
+            sub.send(mosq_test.gen_pingreq())
+            if mosq_test.expect_packet(sub, "pingresp", mosq_test.gen_pingresp()):
+                rc = 0
+        pub.close()
+    sub.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,51 @@
+#!/usr/bin/env python
+
+# Test that passwords from password_file are checked on worker threads when
+# auth_workers is set, with the CONNECT held until the check completes.
+
+import subprocess
+import socket
+import time
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+rc = 1
+keepalive = 60
+fail_connect_packet = mosq_test.gen_connect("pwfile-workers-fail", keepalive=keepalive, username="user", password="password9")
+fail_connack_packet = mosq_test.gen_connack(rc=4)
+connect_packet = mosq_test.gen_connect("pwfile-workers", keepalive=keepalive, username="open")
+connack_packet = mosq_test.gen_connack(rc=0)
+
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '09-pwfile-auth-workers.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    # A failed check must not be remembered as a success.
+    for i in range(2):
+        sock = mosq_test.do_client_connect(fail_connect_packet, fail_connack_packet, timeout=20)
+        sock.close()
+
+    ok = 0
+    for i in range(2):
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20)
+        sock.send(mosq_test.gen_pingreq())
+        if mosq_test.expect_packet(sock, "pingresp", mosq_test.gen_pingresp()):
+            ok = ok + 1
+        sock.close()
+    if ok == 2:
+        rc = 0
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+
+exit(rc)
@@ -0,0 +1,74 @@
+#!/usr/bin/env python
+
+# Check that a reloaded password file disconnects clients whose user has been
+# removed, leaves the others connected, and that a password file that can't
+# be read leaves the previous one in use.
+
+import subprocess
+import socket
+import time
+import signal
+
+import inspect, os, sys
+# From http://stackoverflow.com/questions/279237/python-import-a-module-from-a-folder
+cmd_subfolder = os.path.realpath(os.path.abspath(os.path.join(os.path.split(inspect.getfile( inspect.currentframe() ))[0],"..")))
+if cmd_subfolder not in sys.path:
+    sys.path.insert(0, cmd_subfolder)
+
+import mosq_test
+
+def write_pwfile(users):
+    f = open("09-pwfile-reload.pwfile", "w")
+    for u in users:
+        f.write(u+"\n")
+    f.close()
+
+rc = 1
+keepalive = 60
+connack_packet = mosq_test.gen_connack(rc=0)
+denied_connack_packet = mosq_test.gen_connack(rc=4)
+keep_connect_packet = mosq_test.gen_connect("pwfile-reload-keep", keepalive=keepalive, username="keep")
+remove_connect_packet = mosq_test.gen_connect("pwfile-reload-remove", keepalive=keepalive, username="remove")
+keep2_connect_packet = mosq_test.gen_connect("pwfile-reload-keep2", keepalive=keepalive, username="keep")
+
+write_pwfile(["keep", "remove"])
+broker = subprocess.Popen(['../../src/mosquitto', '-c', '09-pwfile-reload.conf'], stderr=subprocess.PIPE)
+
+try:
+    time.sleep(0.5)
+
+    keep = mosq_test.do_client_connect(keep_connect_packet, connack_packet, timeout=20)
+    remove = mosq_test.do_client_connect(remove_connect_packet, connack_packet, timeout=20)
+
+    write_pwfile(["keep"])
+    broker.send_signal(signal.SIGHUP)
+    time.sleep(0.5)
+
+    # The removed user is disconnected, the other is not.
+    if remove.recv(1) == "":
+        keep.send(mosq_test.gen_pingreq())
+        if mosq_test.expect_packet(keep, "pingresp", mosq_test.gen_pingresp()):
+            sock = mosq_test.do_client_connect(remove_connect_packet, denied_connack_packet, timeout=20)
+            sock.close()
+
+            # A missing file is an error, so "keep" is still allowed.
+            os.remove("09-pwfile-reload.pwfile")
+            broker.send_signal(signal.SIGHUP)
+            time.sleep(0.5)
+
+            sock = mosq_test.do_client_connect(keep2_connect_packet, connack_packet, timeout=20)
+            sock.close()
+            rc = 0
+
+    remove.close()
+    keep.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    if rc:
+        (stdo, stde) = broker.communicate()
+        print(stde)
+    if os.path.exists("09-pwfile-reload.pwfile"):
+        os.remove("09-pwfile-reload.pwfile")
+
+exit(rc)
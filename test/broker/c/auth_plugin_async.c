@@ -0,0 +1,110 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mosquitto.h>
+#include <mosquitto_plugin.h>
+
+/* Completes checks on a new thread after a delay, or straight away if there
+ * is no delay. */
+struct check {
+	void (*complete)(void *, int);
+	void *request;
+	int result;
+	int delay_ms;
+};
+
+static void *check_thread(void *arg)
+{
+	struct check *check = arg;
+
+	usleep(check->delay_ms*1000);
+	check->complete(check->request, check->result);
+	free(check);
+	return NULL;
+}
+
+static int check_start(void (*complete)(void *, int), void *request, int result, int delay_ms)
+{
+	struct check *check;
+	pthread_t thread;
+
+	if(delay_ms == 0){
+		complete(request, result);
+		return MOSQ_ERR_SUCCESS;
+	}
+	check = malloc(sizeof(struct check));
+	if(!check) return MOSQ_ERR_NOMEM;
+	check->complete = complete;
+	check->request = request;
+	check->result = result;
+	check->delay_ms = delay_ms;
+	if(pthread_create(&thread, NULL, check_thread, check)){
+		free(check);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	pthread_detach(thread);
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_plugin_version(void)
+{
+	return MOSQ_AUTH_PLUGIN_VERSION;
+}
+
+int mosquitto_auth_plugin_init(void **user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_plugin_cleanup(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_security_init(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count, bool reload)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_security_cleanup(void *user_data, struct mosquitto_auth_opt *auth_opts, int auth_opt_count, bool reload)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_acl_check(void *user_data, const char *clientid, const char *username, const char *topic, int access)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_unpwd_check(void *user_data, const char *username, const char *password)
+{
+	return MOSQ_ERR_AUTH;
+}
+
+int mosquitto_auth_unpwd_check_async(void *user_data, const char *username, const char *password, void (*complete)(void *request, int result), void *request)
+{
+	if(!strcmp(username, "slow")){
+		return check_start(complete, request, MOSQ_ERR_SUCCESS, 1000);
+	}else if(!strcmp(username, "fast")){
+		return check_start(complete, request, MOSQ_ERR_SUCCESS, 0);
+	}else{
+		return check_start(complete, request, MOSQ_ERR_AUTH, 200);
+	}
+}
+
+int mosquitto_auth_acl_check_async(void *user_data, const char *clientid, const char *username, const char *topic, int access, void (*complete)(void *request, int result), void *request)
+{
+	if(!strncmp(topic, "slow/", 5)){
+		return check_start(complete, request, MOSQ_ERR_SUCCESS, 500);
+	}else if(!strncmp(topic, "denied/", 7)){
+		return check_start(complete, request, MOSQ_ERR_ACL_DENIED, 200);
+	}else{
+		return check_start(complete, request, MOSQ_ERR_SUCCESS, 0);
+	}
+}
+
+int mosquitto_auth_psk_key_get(void *user_data, const char *hint, const char *identity, char *key, int max_key_len)
+{
+	return MOSQ_ERR_AUTH;
+}